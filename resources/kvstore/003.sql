@@ -0,0 +1,5 @@
+ALTER TABLE url ADD COLUMN parent TEXT;
+
+UPDATE url SET parent = rtrim(url, replace(url, '/', ''));
+
+CREATE INDEX url_parent_idx ON url(parent);
@@ -0,0 +1,6 @@
+CREATE TABLE subtitlecache (
+       url TEXT PRIMARY KEY,
+       mtime INTEGER,
+       stamp INTEGER,
+       created INTEGER,
+       data BLOB);
@@ -31,6 +31,10 @@
 #include "backend/backend.h"
 #include "notifications.h"
 #include "fileaccess/fileaccess.h"
+#include "misc/callout.h"
+#include "misc/profiler.h"
+#include "db/db_support.h"
+#include "text/text.h"
 
 #define STRINGIFY(A)  #A
 
@@ -487,6 +491,81 @@ hc_logfile(http_connection_t *hc, const char *remain, void *opaque,
 }
 
 
+/**
+ *
+ */
+static int
+hc_callouts(http_connection_t *hc, const char *remain, void *opaque,
+	    http_cmd_t method)
+{
+  htsbuf_queue_t out;
+  htsbuf_queue_init(&out, 0);
+
+  callout_dump_stats(&out);
+
+  return http_send_reply(hc, 0, "text/plain; charset=utf-8", NULL, NULL, 0, &out);
+}
+
+
+/**
+ *
+ */
+static int
+hc_db(http_connection_t *hc, const char *remain, void *opaque,
+      http_cmd_t method)
+{
+  htsbuf_queue_t out;
+  htsbuf_queue_init(&out, 0);
+
+  db_dump_stats(&out);
+
+  return http_send_reply(hc, 0, "text/plain; charset=utf-8", NULL, NULL, 0, &out);
+}
+
+
+#if ENABLE_LIBFREETYPE
+/**
+ *
+ */
+static int
+hc_freetype(http_connection_t *hc, const char *remain, void *opaque,
+	    http_cmd_t method)
+{
+  htsbuf_queue_t out;
+  htsbuf_queue_init(&out, 0);
+
+  freetype_dump_stats(&out);
+
+  return http_send_reply(hc, 0, "text/plain; charset=utf-8", NULL, NULL, 0, &out);
+}
+#endif
+
+
+/**
+ * /showtime/profile/start starts recording, /showtime/profile stops it and
+ * returns what was recorded in Chrome trace format
+ */
+static int
+hc_profile(http_connection_t *hc, const char *remain, void *opaque,
+	   http_cmd_t method)
+{
+  htsbuf_queue_t out;
+  htsbuf_queue_init(&out, 0);
+
+  if(remain != NULL && !strcmp(remain, "start")) {
+    profiler_start();
+    htsbuf_qprintf(&out, "Profiling started\n");
+    return http_send_reply(hc, 0, "text/plain", NULL, NULL, 0, &out);
+  }
+
+  profiler_stop();
+  profiler_export(&out);
+  http_set_response_hdr(hc, "Content-Disposition",
+			"attachment; filename=\"showtime-profile.json\"");
+  return http_send_reply(hc, 0, "application/json", NULL, NULL, 0, &out);
+}
+
+
 #if 0
 
 extern void my_malloc_stats(void (*fn)(const char *fmt, ...));
@@ -635,8 +714,6 @@ static const struct {
 static int
 hc_serve_file(http_connection_t *hc, const char *file, const char *contenttype)
 {
-  htsbuf_queue_t out;
-
   if(contenttype == NULL) {
     const char *pfx = strrchr(file, '.');
     if(pfx != NULL) {
@@ -651,14 +728,7 @@ hc_serve_file(http_connection_t *hc, const char *file, const char *contenttype)
     }
   }
 
-  buf_t *b = fa_load(file, NULL);
-  if(b == NULL)
-    return 404;
-
-  htsbuf_queue_init(&out, 0);
-  htsbuf_append(&out, b->b_ptr, b->b_size);
-  buf_release(b);
-  return http_send_reply(hc, 0, contenttype, NULL, NULL, 0, &out);
+  return http_send_file(hc, file, contenttype, 0);
 }
 
 
@@ -717,6 +787,12 @@ httpcontrol_init(void)
   http_path_add("/showtime/diag", NULL, hc_diagnostics, 1);
   http_path_add("/showtime/logfile", NULL, hc_logfile, 0);
   http_path_add("/showtime/replace", NULL, hc_binreplace, 1);
+  http_path_add("/showtime/callouts", NULL, hc_callouts, 1);
+  http_path_add("/showtime/db", NULL, hc_db, 1);
+#if ENABLE_LIBFREETYPE
+  http_path_add("/showtime/freetype", NULL, hc_freetype, 1);
+#endif
+  http_path_add("/showtime/profile", NULL, hc_profile, 0);
   http_add_websocket("/showtime/ws/echo",
 		     hc_echo_init, hc_echo_data, hc_echo_fini);
 
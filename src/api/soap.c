@@ -67,6 +67,72 @@ soap_encode_args(htsbuf_queue_t *xml, htsmsg_t *args)
 }
 
 
+/**
+ *
+ */
+static void
+soap_build_request(htsbuf_queue_t *post, char *action, size_t actionlen,
+		   const char *service, int version, const char *method,
+		   htsmsg_t *in)
+{
+  htsbuf_queue_init(post, 0);
+
+  htsbuf_qprintf(post,
+		 "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+		 "<s:Envelope s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\" xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\">"
+		 "<s:Body><ns0:%s xmlns:ns0=\"urn:schemas-upnp-org:service:%s:%d\">", method, service, version);
+
+  soap_encode_args(post, in);
+  htsbuf_qprintf(post, "</ns0:%s></s:Body></s:Envelope>", method);
+
+  snprintf(action, actionlen, "\"urn:schemas-upnp-org:service:%s:%d#%s\"",
+	   service, version, method);
+}
+
+
+/**
+ *
+ */
+static int
+soap_stream_data(void *opaque, const void *data, size_t size)
+{
+  htsmsg_xml_stream_t *xs = opaque;
+
+  if(size == 0)
+    return htsmsg_xml_stream_finish(xs);
+  return htsmsg_xml_stream_feed(xs, data, size);
+}
+
+
+/**
+ *
+ */
+int
+soap_exec_stream(const char *uri, const char *service, int version,
+		 const char *method, htsmsg_t *in, htsmsg_xml_stream_t *xs,
+		 char *errbuf, size_t errlen)
+{
+  int r;
+  htsbuf_queue_t post;
+  char tmp[100];
+
+  soap_build_request(&post, tmp, sizeof(tmp), service, version, method, in);
+
+  r = http_req(uri,
+               HTTP_DATA_CALLBACK(soap_stream_data, xs),
+               HTTP_ERRBUF(errbuf, errlen),
+               HTTP_POSTDATA(&post, "text/xml; charset=\"utf-8\""),
+               HTTP_REQUEST_HEADER("SOAPACTION", tmp),
+               NULL);
+
+  htsbuf_queue_flush(&post);
+
+  if(r && *htsmsg_xml_stream_error(xs))
+    snprintf(errbuf, errlen, "Malformed XML: %s", htsmsg_xml_stream_error(xs));
+  return r ? -1 : 0;
+}
+
+
 /**
  *
  */
@@ -80,18 +146,7 @@ soap_exec(const char *uri, const char *service, int version, const char *method,
   buf_t *result;
   char tmp[100];
 
-  htsbuf_queue_init(&post, 0);
-
-  htsbuf_qprintf(&post,
-		 "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
-		 "<s:Envelope s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\" xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\">"
-		 "<s:Body><ns0:%s xmlns:ns0=\"urn:schemas-upnp-org:service:%s:%d\">", method, service, version);
-
-  soap_encode_args(&post, in);
-  htsbuf_qprintf(&post, "</ns0:%s></s:Body></s:Envelope>", method);
-
-  snprintf(tmp, sizeof(tmp),"\"urn:schemas-upnp-org:service:%s:%d#%s\"",
-	   service, version, method);
+  soap_build_request(&post, tmp, sizeof(tmp), service, version, method, in);
 
   r = http_req(uri,
                HTTP_RESULT_PTR(&result),
@@ -24,6 +24,7 @@
 
 #include "htsmsg/htsbuf.h"
 #include "htsmsg/htsmsg.h"
+#include "htsmsg/htsmsg_xml.h"
 
 void soap_encode_arg(htsbuf_queue_t *xml, htsmsg_field_t *f);
 
@@ -33,4 +34,13 @@ int soap_exec(const char *uri, const char *service, int version,
 	      const char *method, htsmsg_t *in, htsmsg_t **out,
 	      char *errbuf, size_t errlen);
 
+/**
+ * Like soap_exec() but the response is fed to 'xs' as it arrives.
+ * Paths registered on 'xs' are relative to the SOAP document root,
+ * ie. "Envelope/Body/<method>Response/..."
+ */
+int soap_exec_stream(const char *uri, const char *service, int version,
+		     const char *method, htsmsg_t *in, htsmsg_xml_stream_t *xs,
+		     char *errbuf, size_t errlen);
+
 #endif // SOAP_H__
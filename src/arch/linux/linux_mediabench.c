@@ -0,0 +1,139 @@
+/*
+ *  Showtime Mediacenter
+ *  Copyright (C) 2007-2013 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+
+/**
+ * Headless entry point for the media pipeline benchmark.
+ * Built with 'make mediabench' and linked with the same objects as
+ * the regular binary except for linux_main.c, so no display server or
+ * sound card is required.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "showtime.h"
+#include "arch/arch.h"
+#include "arch/posix/posix.h"
+#include "linux.h"
+#include "prop/prop.h"
+#include "audio2/audio_ext.h"
+#include "media_bench.h"
+
+/*
+ * Provided by linux_main.c in the regular build and referenced by
+ * the GTK bits which are linked but never started here
+ */
+hts_mutex_t gdk_mutex;
+prop_courier_t *glibcourier;
+
+
+/**
+ *
+ */
+int
+arch_stop_req(void)
+{
+  return 0;
+}
+
+
+/**
+ *
+ */
+void
+arch_exit(void)
+{
+  exit(gconf.exit_code);
+}
+
+
+/**
+ *
+ */
+static void
+usage(const char *argv0)
+{
+  printf("Usage: %s [options] [showtime options] <url>\n"
+         "\n"
+         "  Options:\n"
+         "   --realtime        - Pace video and audio output as real\n"
+         "                       sinks would (default: as fast as possible)\n"
+         "   -t <seconds>      - Stop after this many seconds\n"
+         "   -o <file>         - Write JSON report to <file> [stdout]\n"
+         "\n", argv0);
+  exit(0);
+}
+
+
+/**
+ * Linux media benchmark main
+ */
+int
+main(int argc, char **argv)
+{
+  const char *output = NULL;
+  int flags = 0;
+  int duration = 0;
+  char **args = alloca(sizeof(char *) * (argc + 1));
+  int nargs = 0;
+
+  gconf.binary = argv[0];
+
+  args[nargs++] = argv[0];
+
+  for(int i = 1; i < argc; i++) {
+    if(!strcmp(argv[i], "--realtime")) {
+      flags |= MEDIA_BENCH_REALTIME;
+    } else if(!strcmp(argv[i], "-t") && i + 1 < argc) {
+      duration = atoi(argv[++i]);
+    } else if(!strcmp(argv[i], "-o") && i + 1 < argc) {
+      output = argv[++i];
+    } else if(!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+      usage(argv[0]);
+    } else {
+      args[nargs++] = argv[i];
+    }
+  }
+  args[nargs] = NULL;
+
+  posix_init();
+
+  parse_opts(nargs, args);
+
+  if(gconf.initial_url == NULL)
+    usage(argv[0]);
+
+  gconf.concurrency = get_system_concurrency();
+  gconf.disable_sd = 1;
+  gconf.disable_upnp = 1;
+  gconf.audio_null = flags & MEDIA_BENCH_REALTIME ?
+    AUDIO_NULL_REALTIME : AUDIO_NULL_UNPACED;
+
+  trap_init();
+
+  showtime_init();
+
+  gconf.exit_code =
+    media_bench_run(gconf.initial_url, flags, duration, output) ? 1 : 0;
+
+  arch_exit();
+  return 0;
+}
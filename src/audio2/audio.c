@@ -29,6 +29,7 @@
 #include "libav.h"
 #include "htsmsg/htsmsg_store.h"
 #include "settings.h"
+#include "misc/profiler.h"
 
 #include <libavutil/avutil.h>
 #include <libavcodec/avcodec.h>
@@ -39,6 +40,8 @@
 
 static audio_class_t *audio_class;
 
+static audio_class_t null_audio_class;
+
 static void *audio_decode_thread(void *aux);
 
 
@@ -126,7 +129,14 @@ audio_init(void)
                    NULL);
 
   audio_mastervol_init();
-  audio_class = audio_driver_init();
+
+  if(gconf.audio_null) {
+    TRACE(TRACE_INFO, "audio", "Using null audio output (%s)",
+          gconf.audio_null == AUDIO_NULL_REALTIME ? "realtime" : "unpaced");
+    audio_class = &null_audio_class;
+  } else {
+    audio_class = audio_driver_init();
+  }
 }
 
 
@@ -375,7 +385,9 @@ audio_process_audio(audio_decoder_t *ad, media_buf_t *mb)
 	}
       }
 
+      int64_t t = prof_begin();
       r = avcodec_decode_audio4(ctx, frame, &got_frame, &avpkt);
+      prof_end(t, "decode", "audio");
       if(r < 0)
 	return;
 
@@ -564,7 +576,9 @@ audio_decode_thread(void *aux)
       TAILQ_REMOVE(&mq->mq_q_data, data, mb_link);
       mb = data;
     } else {
+      int64_t t = prof_begin();
       hts_cond_wait(&mq->mq_avail, &mp->mp_mutex);
+      prof_end(t, "mq_wait", "audio");
       continue;
     }
 
@@ -644,97 +658,91 @@ audio_decode_thread(void *aux)
 
 
 
-#if 0
 /**
+ * Null audio output
  *
+ * Discards decoded samples but keeps the media pipe audio clock
+ * running, either at playback rate or as fast as samples are decoded.
+ * Used by headless benchmarks (see media_bench.c)
  */
-static void *
-dummy_audio_thread(void *aux)
-{
-  audio_decoder_t *ad = aux;
-  media_pipe_t *mp = ad->ad_mp;
-  media_queue_t *mq = &mp->mp_audio;
-  media_buf_t *mb;
-  int hold = 0;
-  int run = 1;
-  int64_t rt = 0;
-  int64_t base = AV_NOPTS_VALUE;
+typedef struct null_decoder {
+  audio_decoder_t ad;
+  int64_t start;    // avtime when samples == 0
+  int64_t samples;  // Samples consumed since start
+} null_decoder_t;
 
 
-  hts_mutex_lock(&mp->mp_mutex);
+/**
+ *
+ */
+static int
+null_audio_reconfig(audio_decoder_t *ad)
+{
+  null_decoder_t *nd = (null_decoder_t *)ad;
 
-  while(run) {
+  ad->ad_out_sample_format  = ad->ad_in_sample_format;
+  ad->ad_out_sample_rate    = ad->ad_in_sample_rate;
+  ad->ad_out_channel_layout = ad->ad_in_channel_layout;
+  nd->samples = 0;
+  return 0;
+}
 
-    if((mb = TAILQ_FIRST(&mq->mq_q)) == NULL) {
-      hts_cond_wait(&mq->mq_avail, &mp->mp_mutex);
-      continue;
-    }
 
-    if(mb->mb_data_type == MB_AUDIO && hold && mb->mb_skip == 0) {
-      hts_cond_wait(&mq->mq_avail, &mp->mp_mutex);
-      continue;
-    }
+/**
+ *
+ */
+static int
+null_audio_deliver(audio_decoder_t *ad, int samples, int64_t pts, int epoch)
+{
+  null_decoder_t *nd = (null_decoder_t *)ad;
+  media_pipe_t *mp = ad->ad_mp;
+  int64_t now = showtime_get_avtime();
+  int64_t ts;
 
-    TAILQ_REMOVE(&mq->mq_q, mb, mb_link);
-    mq->mq_packets_current--;
-    mp->mp_buffer_current -= mb->mb_size;
-    mq_update_stats(mp, mq);
-    hts_cond_signal(&mp->mp_backpressure);
-    hts_mutex_unlock(&mp->mp_mutex);
+  if(nd->samples == 0)
+    nd->start = now;
 
-    switch(mb->mb_data_type) {
-    case MB_CTRL_EXIT:
-      run = 0;
-      break;
+  ts = nd->start + nd->samples * 1000000LL / ad->ad_out_sample_rate;
 
-    case MB_CTRL_PAUSE:
-      hold = 1;
-      break;
+  if(gconf.audio_null == AUDIO_NULL_REALTIME) {
+    if(ts > now)
+      usleep(ts - now);
+  } else {
+    ts = now;
+  }
 
-    case MB_CTRL_PLAY:
-      hold = 0;
-      base = AV_NOPTS_VALUE;
-      break;
+  if(pts != AV_NOPTS_VALUE) {
+    hts_mutex_lock(&mp->mp_clock_mutex);
+    mp->mp_audio_clock_avtime = ts;
+    mp->mp_audio_clock = pts;
+    mp->mp_audio_clock_epoch = epoch;
+    hts_mutex_unlock(&mp->mp_clock_mutex);
+  }
 
-    case MB_FLUSH:
-      base = AV_NOPTS_VALUE;
-      break;
+  nd->samples += avresample_read(ad->ad_avr, NULL, samples);
+  return 0;
+}
 
-    case MB_AUDIO:
-      if(mb->mb_skip || mb->mb_stream != mq->mq_stream) 
-	break;
-      if(mb->mb_pts != AV_NOPTS_VALUE) {
-        audio_set_clock(mp, mb->mb_pts, 0, mb->mb_epoch);
-
-        if(base == AV_NOPTS_VALUE) {
-          base = mb->mb_pts;
-          rt = showtime_get_ts();
-        } else {
-          int64_t d = mb->mb_pts - base;
-          if(d > 0) {
-            int sleeptime = rt + d - showtime_get_ts();
-	    if(sleeptime > 0)
-	      usleep(sleeptime);
-          }
-        }
-      }
-      break;
 
-    default:
-      abort();
-    }
-    hts_mutex_lock(&mp->mp_mutex);
-    media_buf_free_locked(mp, mb);
-  }
-  hts_mutex_unlock(&mp->mp_mutex);
-  return NULL;
+/**
+ *
+ */
+static void
+null_audio_reset(audio_decoder_t *ad)
+{
+  null_decoder_t *nd = (null_decoder_t *)ad;
+  nd->samples = 0;
 }
 
+
 /**
  *
  */
-static audio_class_t dummy_audio_class = {
-  .ac_alloc_size = sizeof(audio_decoder_t),
-  .ac_thread = dummy_audio_thread,
+static audio_class_t null_audio_class = {
+  .ac_alloc_size       = sizeof(null_decoder_t),
+  .ac_reconfig         = null_audio_reconfig,
+  .ac_deliver_unlocked = null_audio_deliver,
+  .ac_pause            = null_audio_reset,
+  .ac_play             = null_audio_reset,
+  .ac_flush            = null_audio_reset,
 };
-#endif
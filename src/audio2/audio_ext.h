@@ -24,6 +24,9 @@
 struct audio_decoder;
 struct media_pipe;
 
+#define AUDIO_NULL_REALTIME 1 // Discard samples at playback rate
+#define AUDIO_NULL_UNPACED  2 // Discard samples as soon as they are decoded
+
 void audio_init(void);
 
 void audio_fini(void);
@@ -25,6 +25,8 @@
 
 #include "showtime.h"
 #include "fileaccess/fileaccess.h"
+#include "arch/atomic.h"
+#include "htsmsg/htsbuf.h"
 
 #include "db_support.h"
 
@@ -73,10 +75,13 @@ wait_for_unlock_notify(sqlite3 *db)
   return rc;
 }
 
+static void db_step_account(sqlite3 *db, int64_t us);
+
 int
 db_step(sqlite3_stmt *pStmt)
 {
   int rc;
+  int64_t ts = showtime_get_ts();
   while( SQLITE_LOCKED==(rc = sqlite3_step(pStmt)) ){
     rc = wait_for_unlock_notify(sqlite3_db_handle(pStmt));
     if( rc!=SQLITE_OK ) break;
@@ -84,6 +89,7 @@ db_step(sqlite3_stmt *pStmt)
   }
   if(rc == SQLITE_LOCKED)
     TRACE(TRACE_DEBUG, "DB", "Deadlock detected");
+  db_step_account(sqlite3_db_handle(pStmt), showtime_get_ts() - ts);
   return rc;
 }
 
@@ -343,29 +349,106 @@ db_upgrade_schema(sqlite3 *db, const char *schemadir, const char *dbname,
 }
 
 
+#define DB_STMT_CACHE_SIZE 24
+#define DB_HIST_BUCKETS 8
+
+/**
+ *
+ */
+typedef struct db_cached_stmt {
+  const char *dcs_sql;
+  sqlite3_stmt *dcs_stmt;
+  int dcs_busy;
+  unsigned int dcs_lru;
+} db_cached_stmt_t;
+
+
+/**
+ *
+ */
+typedef struct db_step_stats {
+  unsigned int dss_hist[DB_HIST_BUCKETS];
+  unsigned int dss_count;
+  int64_t dss_time;
+  int64_t dss_time_max;
+} db_step_stats_t;
+
+
+/**
+ * An open connection belonging to a pool. While handed out by
+ * db_pool_get() it's only used by one thread, so the statement cache
+ * and step stats need no locking
+ */
+typedef struct db_conn {
+  LIST_ENTRY(db_conn) dc_link;
+  sqlite3 *dc_db;
+  struct db_pool *dc_pool;
+  hts_thread_t dc_owner;   // Thread that last returned it to the pool
+  unsigned int dc_lru_clock;
+  db_step_stats_t dc_step_stats;
+  db_cached_stmt_t dc_stmts[DB_STMT_CACHE_SIZE];
+} db_conn_t;
+
+static LIST_HEAD(, db_conn) db_conns;
+static LIST_HEAD(, db_pool) db_pools;
+static hts_mutex_t db_conns_mutex;  // Protects db_conns, db_pools and stats
+static volatile int db_conns_gen;   // Bumped when a connection is closed
+static db_step_stats_t db_step_stats_closed; // From closed connections
+
+/**
+ * Connection last looked up by this thread. Only valid if no connection
+ * has been closed since, otherwise 'db' might be a reused pointer
+ */
+static __thread struct {
+  sqlite3 *db;
+  db_conn_t *dc;
+  int gen;
+} db_conn_last;
+
+
 /**
  *
  */
 struct db_pool {
+  LIST_ENTRY(db_pool) dp_link;
   int dp_size;
   int dp_closed;
   char *dp_path;
+  int dp_cache_size_kb;
+  int dp_mmap_size_kb;
   hts_mutex_t dp_mutex;
-  sqlite3 *dp_pool[0];
+
+  unsigned int dp_gets;
+  unsigned int dp_affinity_hits;
+  unsigned int dp_opens;
+  int64_t dp_get_time;
+  int64_t dp_get_time_max;
+  int dp_stmt_hits;
+  int dp_stmt_misses;
+
+  db_conn_t *dp_pool[0];
 };
 
+
 /**
  *
  */
 db_pool_t *
-db_pool_create(const char *path, int size)
+db_pool_create(const char *path, int size,
+               int cache_size_kb, int mmap_size_kb)
 {
   db_pool_t *dp;
   
-  dp = calloc(1, sizeof(db_pool_t) + sizeof(sqlite3 *) * size);
+  dp = calloc(1, sizeof(db_pool_t) + sizeof(db_conn_t *) * size);
   dp->dp_size = size;
   dp->dp_path = strdup(path);
+  dp->dp_cache_size_kb = cache_size_kb;
+  dp->dp_mmap_size_kb = mmap_size_kb;
   hts_mutex_init(&dp->dp_mutex);
+
+  hts_mutex_lock(&db_conns_mutex);
+  LIST_INSERT_HEAD(&db_pools, dp, dp_link);
+  hts_mutex_unlock(&db_conns_mutex);
   return dp;
 }
 
@@ -412,15 +495,196 @@ db_open(const char *path, int flags)
 /**
  *
  */
+static db_conn_t *
+db_conn_open(db_pool_t *dp)
+{
+  char buf[64];
+  db_conn_t *dc;
+  sqlite3 *db = db_open(dp->dp_path, DB_OPEN_CASE_SENSITIVE_LIKE);
+
+  if(db == NULL)
+    return NULL;
+
+  // Negative cache_size is in kB (older sqlite reads it as pages)
+  if(dp->dp_cache_size_kb) {
+    snprintf(buf, sizeof(buf), "PRAGMA cache_size=-%d", dp->dp_cache_size_kb);
+    db_one_statement(db, buf, dp->dp_path);
+  }
+
+  // Silently ignored by sqlite versions without mmap support
+  if(dp->dp_mmap_size_kb) {
+    snprintf(buf, sizeof(buf), "PRAGMA mmap_size=%"PRId64,
+             (int64_t)dp->dp_mmap_size_kb * 1024);
+    db_one_statement(db, buf, dp->dp_path);
+  }
+
+  dc = calloc(1, sizeof(db_conn_t));
+  dc->dc_db = db;
+  dc->dc_pool = dp;
+
+  hts_mutex_lock(&db_conns_mutex);
+  LIST_INSERT_HEAD(&db_conns, dc, dc_link);
+  dp->dp_opens++;
+  hts_mutex_unlock(&db_conns_mutex);
+  return dc;
+}
+
+
+/**
+ *
+ */
+static void
+db_conn_close(db_conn_t *dc)
+{
+  int i;
+
+  hts_mutex_lock(&db_conns_mutex);
+  LIST_REMOVE(dc, dc_link);
+  db_conns_gen++;
+
+  db_step_stats_t *dst = &db_step_stats_closed;
+  const db_step_stats_t *src = &dc->dc_step_stats;
+  for(i = 0; i < DB_HIST_BUCKETS; i++)
+    dst->dss_hist[i] += src->dss_hist[i];
+  dst->dss_count += src->dss_count;
+  dst->dss_time += src->dss_time;
+  dst->dss_time_max = MAX(dst->dss_time_max, src->dss_time_max);
+  hts_mutex_unlock(&db_conns_mutex);
+
+  for(i = 0; i < DB_STMT_CACHE_SIZE; i++)
+    if(dc->dc_stmts[i].dcs_stmt != NULL)
+      sqlite3_finalize(dc->dc_stmts[i].dcs_stmt);
+
+  sqlite3_close(dc->dc_db);
+  free(dc);
+}
+
+
+/**
+ * Callers hold 'db' so it can't be closed while we look at it
+ */
+static db_conn_t *
+db_conn_find(sqlite3 *db)
+{
+  db_conn_t *dc;
+
+  if(db_conn_last.db == db && db_conn_last.gen == db_conns_gen)
+    return db_conn_last.dc;
+
+  hts_mutex_lock(&db_conns_mutex);
+  LIST_FOREACH(dc, &db_conns, dc_link)
+    if(dc->dc_db == db)
+      break;
+  if(dc != NULL) {
+    db_conn_last.db = db;
+    db_conn_last.dc = dc;
+    db_conn_last.gen = db_conns_gen;
+  }
+  hts_mutex_unlock(&db_conns_mutex);
+  return dc;
+}
+
+
+/**
+ *
+ */
+int
+db_prepare_cachedx(sqlite3 *db, sqlite3_stmt **ppStmt, const char *zSql,
+                   const char *file, int line)
+{
+  db_conn_t *dc = db_conn_find(db);
+  db_cached_stmt_t *dcs, *victim = NULL;
+  int i, rc;
+
+  if(dc == NULL)
+    return db_preparex(db, ppStmt, zSql, file, line);
+
+  for(i = 0; i < DB_STMT_CACHE_SIZE; i++) {
+    dcs = &dc->dc_stmts[i];
+
+    if(dcs->dcs_stmt == NULL) {
+      if(victim == NULL || victim->dcs_stmt != NULL)
+        victim = dcs;
+      continue;
+    }
+
+    if(dcs->dcs_busy)
+      continue;
+
+    if(dcs->dcs_sql == zSql || !strcmp(dcs->dcs_sql, zSql)) {
+      dcs->dcs_busy = 1;
+      dcs->dcs_lru = ++dc->dc_lru_clock;
+      *ppStmt = dcs->dcs_stmt;
+      atomic_add(&dc->dc_pool->dp_stmt_hits, 1);
+      return SQLITE_OK;
+    }
+
+    if(victim == NULL ||
+       (victim->dcs_stmt != NULL && dcs->dcs_lru < victim->dcs_lru))
+      victim = dcs;
+  }
+
+  atomic_add(&dc->dc_pool->dp_stmt_misses, 1);
+
+  if((rc = db_preparex(db, ppStmt, zSql, file, line)) != SQLITE_OK)
+    return rc;
+
+  // If every slot is busy the statement is simply not cached
+  if(victim != NULL) {
+    if(victim->dcs_stmt != NULL)
+      sqlite3_finalize(victim->dcs_stmt);
+    victim->dcs_stmt = *ppStmt;
+    victim->dcs_sql = zSql;
+    victim->dcs_busy = 1;
+    victim->dcs_lru = ++dc->dc_lru_clock;
+  }
+  return SQLITE_OK;
+}
+
+
+/**
+ *
+ */
+void
+db_stmt_release(sqlite3_stmt *stmt)
+{
+  db_conn_t *dc;
+  int i;
+
+  if(stmt == NULL)
+    return;
+
+  if((dc = db_conn_find(sqlite3_db_handle(stmt))) != NULL) {
+    for(i = 0; i < DB_STMT_CACHE_SIZE; i++) {
+      if(dc->dc_stmts[i].dcs_stmt == stmt) {
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        dc->dc_stmts[i].dcs_busy = 0;
+        return;
+      }
+    }
+  }
+  sqlite3_finalize(stmt);
+}
+
+
+/**
+ * Prefer the connection last used by the calling thread, its statement
+ * cache is most likely to be warm
+ */
 sqlite3 *
 db_pool_get(db_pool_t *dp)
 {
-  int i;
-  sqlite3 *db;
+  const hts_thread_t self = hts_thread_current();
+  int64_t ts, delta;
+  db_conn_t *dc = NULL;
+  int i, slot = -1;
 
   if(dp == NULL)
     return NULL;
 
+  ts = showtime_get_ts();
+
   hts_mutex_lock(&dp->dp_mutex);
 
   if(dp->dp_closed) {
@@ -429,17 +693,36 @@ db_pool_get(db_pool_t *dp)
   }
 
   for(i = 0; i < dp->dp_size; i++) {
-    if(dp->dp_pool[i] != NULL) {
-      db = dp->dp_pool[i];
-      dp->dp_pool[i] = NULL;
-      hts_mutex_unlock(&dp->dp_mutex);
-      return db;
+    if(dp->dp_pool[i] == NULL)
+      continue;
+    if(slot == -1)
+      slot = i;
+    if(dp->dp_pool[i]->dc_owner == self) {
+      slot = i;
+      dp->dp_affinity_hits++;
+      break;
     }
   }
 
+  if(slot != -1) {
+    dc = dp->dp_pool[slot];
+    dp->dp_pool[slot] = NULL;
+  }
+
   hts_mutex_unlock(&dp->dp_mutex);
 
-  return db_open(dp->dp_path, DB_OPEN_CASE_SENSITIVE_LIKE);
+  if(dc == NULL)
+    dc = db_conn_open(dp);
+
+  delta = showtime_get_ts() - ts;
+
+  hts_mutex_lock(&dp->dp_mutex);
+  dp->dp_gets++;
+  dp->dp_get_time += delta;
+  dp->dp_get_time_max = MAX(dp->dp_get_time_max, delta);
+  hts_mutex_unlock(&dp->dp_mutex);
+
+  return dc ? dc->dc_db : NULL;
 }
 
 /**
@@ -448,29 +731,48 @@ db_pool_get(db_pool_t *dp)
 void
 db_pool_put(db_pool_t *dp, sqlite3 *db)
 {
+  db_conn_t *dc;
   int i;
   if(db == NULL)
     return;
 
+  if((dc = db_conn_find(db)) == NULL) {
+    sqlite3_close(db);
+    return;
+  }
+
   if(!sqlite3_get_autocommit(db)) {
     TRACE(TRACE_ERROR, "DB",
 	  "%s: db handle returned to pool while in transaction, closing handle",
 	  dp->dp_path);
-    sqlite3_close(db);
+    db_conn_close(dc);
     return;
   }
 
+  for(i = 0; i < DB_STMT_CACHE_SIZE; i++) {
+    if(dc->dc_stmts[i].dcs_busy) {
+      TRACE(TRACE_ERROR, "DB", "%s: Cached statement not released: %s",
+            dp->dp_path, dc->dc_stmts[i].dcs_sql);
+      sqlite3_reset(dc->dc_stmts[i].dcs_stmt);
+      dc->dc_stmts[i].dcs_busy = 0;
+    }
+  }
+
+  dc->dc_owner = hts_thread_current();
+
   hts_mutex_lock(&dp->dp_mutex);
-  for(i = 0; i < dp->dp_size; i++) {
-    if(dp->dp_pool[i] == NULL) {
-      dp->dp_pool[i] = db;
-      hts_mutex_unlock(&dp->dp_mutex);
-      return;
+  if(!dp->dp_closed) {
+    for(i = 0; i < dp->dp_size; i++) {
+      if(dp->dp_pool[i] == NULL) {
+        dp->dp_pool[i] = dc;
+        hts_mutex_unlock(&dp->dp_mutex);
+        return;
+      }
     }
   }
 
   hts_mutex_unlock(&dp->dp_mutex);
-  sqlite3_close(db);
+  db_conn_close(dc);
 }
 
 
@@ -486,13 +788,100 @@ db_pool_close(db_pool_t *dp)
 
   hts_mutex_lock(&dp->dp_mutex);
   dp->dp_closed = 1;
-  for(i = 0; i < dp->dp_size; i++)
-    if(dp->dp_pool[i] != NULL)
-      sqlite3_close(dp->dp_pool[i]);
+  for(i = 0; i < dp->dp_size; i++) {
+    if(dp->dp_pool[i] != NULL) {
+      db_conn_close(dp->dp_pool[i]);
+      dp->dp_pool[i] = NULL;
+    }
+  }
   hts_mutex_unlock(&dp->dp_mutex);
 }
 
 
+/**
+ * Only steps on pooled connections are counted
+ */
+static void
+db_step_account(sqlite3 *db, int64_t us)
+{
+  db_conn_t *dc = db_conn_find(db);
+  db_step_stats_t *dss;
+  int b = 0;
+  int64_t lim = 100;
+
+  if(dc == NULL)
+    return;
+
+  while(b < DB_HIST_BUCKETS - 1 && us >= lim) {
+    lim *= 4;
+    b++;
+  }
+
+  dss = &dc->dc_step_stats;
+  dss->dss_hist[b]++;
+  dss->dss_count++;
+  dss->dss_time += us;
+  dss->dss_time_max = MAX(dss->dss_time_max, us);
+}
+
+
+/**
+ *
+ */
+void
+db_dump_stats(struct htsbuf_queue *hq)
+{
+  db_step_stats_t dss;
+  const db_conn_t *dc;
+  db_pool_t *dp;
+  int i, idle, hits, lookups;
+
+  hts_mutex_lock(&db_conns_mutex);
+
+  // Counters of connections in use might be a bit off, that's fine
+  dss = db_step_stats_closed;
+  LIST_FOREACH(dc, &db_conns, dc_link) {
+    for(i = 0; i < DB_HIST_BUCKETS; i++)
+      dss.dss_hist[i] += dc->dc_step_stats.dss_hist[i];
+    dss.dss_count += dc->dc_step_stats.dss_count;
+    dss.dss_time += dc->dc_step_stats.dss_time;
+    dss.dss_time_max = MAX(dss.dss_time_max, dc->dc_step_stats.dss_time_max);
+  }
+
+  LIST_FOREACH(dp, &db_pools, dp_link) {
+    idle = 0;
+    for(i = 0; i < dp->dp_size; i++)
+      if(dp->dp_pool[i] != NULL)
+        idle++;
+
+    hits = dp->dp_stmt_hits;
+    lookups = hits + dp->dp_stmt_misses;
+
+    htsbuf_qprintf(hq, "%s\n", dp->dp_path);
+    htsbuf_qprintf(hq, "  %d/%d connections idle, %u opened\n",
+                   idle, dp->dp_size, dp->dp_opens);
+    htsbuf_qprintf(hq, "  %u gets, %u same thread, "
+                   "avg wait %dus, max wait %dus\n",
+                   dp->dp_gets, dp->dp_affinity_hits,
+                   dp->dp_gets ? (int)(dp->dp_get_time / dp->dp_gets) : 0,
+                   (int)dp->dp_get_time_max);
+    htsbuf_qprintf(hq, "  statement cache: %d lookups, %d%% hit rate\n\n",
+                   lookups, lookups ? hits * 100 / lookups : 0);
+  }
+
+  htsbuf_qprintf(hq, "%u steps, avg %dus, max %dus\n",
+                 dss.dss_count,
+                 dss.dss_count ? (int)(dss.dss_time / dss.dss_count) : 0,
+                 (int)dss.dss_time_max);
+  htsbuf_qprintf(hq, "    <100us  <400us  <1.6ms  <6.4ms   <25ms  <100ms  <400ms  >=400ms\n");
+  for(i = 0; i < DB_HIST_BUCKETS; i++)
+    htsbuf_qprintf(hq, " %7u", dss.dss_hist[i]);
+  htsbuf_qprintf(hq, "\n");
+
+  hts_mutex_unlock(&db_conns_mutex);
+}
+
+
 /**
  *
  */
@@ -669,6 +1058,8 @@ memlogger_fn(callout_t *co, void *aux)
 void
 db_init(void)
 {
+  hts_mutex_init(&db_conns_mutex);
+
   sqlite3_temp_directory = gconf.cache_path;
 #if ENABLE_SQLITE_LOCKING
   sqlite3_config(SQLITE_CONFIG_MUTEX, &sqlite_mutexes);
@@ -46,6 +46,19 @@ int db_preparex(sqlite3 *db, sqlite3_stmt **ppStmt, const char *zSql,
 
 #define db_prepare(db, stmt, sql) db_preparex(db, stmt, sql, __FILE__, __LINE__)
 
+int db_prepare_cachedx(sqlite3 *db, sqlite3_stmt **ppStmt, const char *zSql,
+                       const char *file, int line);
+
+/**
+ * Like db_prepare() but the statement is kept in a per-connection cache.
+ * 'sql' must be a string constant. The statement must be returned with
+ * db_stmt_release() instead of sqlite3_finalize()
+ */
+#define db_prepare_cached(db, stmt, sql) \
+  db_prepare_cachedx(db, stmt, sql, __FILE__, __LINE__)
+
+void db_stmt_release(sqlite3_stmt *stmt);
+
 #define db_begin(db)    db_begin0(db, __FUNCTION__)
 #define db_commit(db)   db_commit0(db, __FUNCTION__)
 #define db_rollback(db) db_rollback0(db, __FUNCTION__)
@@ -61,7 +74,14 @@ int db_upgrade_schema(sqlite3 *db, const char *schemadir, const char *dbname,
 
 typedef struct db_pool db_pool_t;
 
-db_pool_t *db_pool_create(const char *path, int size);
+#ifdef PS3
+#define DB_MMAP_SIZE_KB 0
+#else
+#define DB_MMAP_SIZE_KB (64 * 1024)
+#endif
+
+db_pool_t *db_pool_create(const char *path, int size,
+                          int cache_size_kb, int mmap_size_kb);
 
 sqlite3 *db_pool_get(db_pool_t *p);
 
@@ -81,4 +101,8 @@ static inline void db_bind_rstr(sqlite3_stmt *stmt, int col, rstr_t *rstr)
 
 void db_escape_path_query(char *dst, size_t dstlen, const char *src);
 
+struct htsbuf_queue;
+
+void db_dump_stats(struct htsbuf_queue *hq);
+
 void db_init(void);
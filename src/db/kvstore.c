@@ -67,6 +67,56 @@ static callout_t deferred_callout;
 static hts_mutex_t deferred_mutex;
 
 
+/**
+ * Cache of everything stored for recently accessed URLs
+ *
+ * An entry holds the values for all domains and keys of a URL so a miss
+ * on one key loads the rest of them with the same query.
+ *
+ * kv_url_prefetch() loads entries for every URL directly in a directory
+ * with a single query and remembers the directory as complete. URLs in
+ * such a directory without an entry are then known to have nothing
+ * stored.
+ *
+ * Writes mark the entry as stale which makes next access reload it.
+ *
+ * The DB is never queried with kv_cache_mutex held. Every invalidation
+ * bumps kv_cache_gen and results of queries that overlapped with one
+ * are thrown away as they might predate the write
+ */
+#define KV_CACHE_HASH     1021
+#define KV_CACHE_MAX      8192
+#define KV_CACHE_PREFIXES 8
+#define KV_PREFETCH_MAX   20000  // Max number of rows in a prefetch
+
+typedef struct kv_cache_value {
+  struct kv_cache_value *kcv_next;
+  int kcv_domain;
+  int kcv_type;  // SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_TEXT or SQLITE_NULL
+  int64_t kcv_int;
+  double kcv_float;
+  char *kcv_str;
+  char *kcv_key;
+} kv_cache_value_t;
+
+typedef struct kv_cache_entry {
+  LIST_ENTRY(kv_cache_entry) kce_hash_link;
+  TAILQ_ENTRY(kv_cache_entry) kce_lru_link;
+  char *kce_url;
+  int64_t kce_id;  // ID of row in URL table, -1 if not in DB
+  int kce_stale;
+  kv_cache_value_t *kce_values;
+} kv_cache_entry_t;
+
+static hts_mutex_t kv_cache_mutex;
+static LIST_HEAD(, kv_cache_entry) kv_cache_hash[KV_CACHE_HASH];
+static TAILQ_HEAD(kv_cache_entry_queue, kv_cache_entry) kv_cache_lru;
+static int kv_cache_entries;
+static char *kv_cache_prefixes[KV_CACHE_PREFIXES];
+static int kv_cache_prefix_ptr;
+static int kv_cache_gen;
+
+
 static const char *domain_to_name[] = {
   [KVSTORE_DOMAIN_SYS] = "sys",
   [KVSTORE_DOMAIN_PROP] = "prop",
@@ -114,6 +164,8 @@ kvstore_init(void)
   char buf[256];
 
   hts_mutex_init(&deferred_mutex);
+  hts_mutex_init(&kv_cache_mutex);
+  TAILQ_INIT(&kv_cache_lru);
 
   snprintf(buf, sizeof(buf), "%s/kvstore", gconf.persistent_path);
   mkdir(buf, 0770);
@@ -121,7 +173,7 @@ kvstore_init(void)
 
   //  unlink(buf);
 
-  kvstore_pool = db_pool_create(buf, 2);
+  kvstore_pool = db_pool_create(buf, 2, 512, DB_MMAP_SIZE_KB);
   db = kvstore_get();
   if(db == NULL)
     return;
@@ -138,6 +190,406 @@ kvstore_init(void)
 
 
 
+/**
+ *
+ */
+static void
+kv_cache_values_free(kv_cache_value_t *kcv)
+{
+  kv_cache_value_t *next;
+
+  for(; kcv != NULL; kcv = next) {
+    next = kcv->kcv_next;
+    free(kcv->kcv_str);
+    free(kcv->kcv_key);
+    free(kcv);
+  }
+}
+
+
+/**
+ * Return 1 if 'url' is directly in directory 'dir' (which ends with /)
+ */
+static int
+kv_url_in_dir(const char *url, const char *dir)
+{
+  const size_t len = strlen(dir);
+  return !strncmp(url, dir, len) && strchr(url + len, '/') == NULL;
+}
+
+
+/**
+ * Must be called with kv_cache_mutex locked
+ */
+static int
+kv_cache_covered(const char *url)
+{
+  int i;
+  for(i = 0; i < KV_CACHE_PREFIXES; i++) {
+    const char *p = kv_cache_prefixes[i];
+    if(p != NULL && kv_url_in_dir(url, p))
+      return 1;
+  }
+  return 0;
+}
+
+
+/**
+ * Must be called with kv_cache_mutex locked
+ */
+static void
+kv_cache_entry_destroy(kv_cache_entry_t *e)
+{
+  int i;
+
+  // Once gone we can no longer tell what's stored in these directories
+  for(i = 0; i < KV_CACHE_PREFIXES; i++) {
+    const char *p = kv_cache_prefixes[i];
+    if(p != NULL && kv_url_in_dir(e->kce_url, p)) {
+      free(kv_cache_prefixes[i]);
+      kv_cache_prefixes[i] = NULL;
+    }
+  }
+
+  LIST_REMOVE(e, kce_hash_link);
+  TAILQ_REMOVE(&kv_cache_lru, e, kce_lru_link);
+  kv_cache_values_free(e->kce_values);
+  free(e->kce_url);
+  free(e);
+  kv_cache_entries--;
+}
+
+
+/**
+ * Must be called with kv_cache_mutex locked
+ */
+static kv_cache_entry_t *
+kv_cache_find(const char *url, int create)
+{
+  const unsigned int hash = mystrhash(url) % KV_CACHE_HASH;
+  kv_cache_entry_t *e;
+
+  LIST_FOREACH(e, &kv_cache_hash[hash], kce_hash_link) {
+    if(!strcmp(e->kce_url, url)) {
+      TAILQ_REMOVE(&kv_cache_lru, e, kce_lru_link);
+      TAILQ_INSERT_HEAD(&kv_cache_lru, e, kce_lru_link);
+      return e;
+    }
+  }
+
+  if(!create)
+    return NULL;
+
+  while(kv_cache_entries >= KV_CACHE_MAX)
+    kv_cache_entry_destroy(TAILQ_LAST(&kv_cache_lru, kv_cache_entry_queue));
+
+  e = calloc(1, sizeof(kv_cache_entry_t));
+  e->kce_url = strdup(url);
+  e->kce_id = -1;
+  e->kce_stale = 1;
+  LIST_INSERT_HEAD(&kv_cache_hash[hash], e, kce_hash_link);
+  TAILQ_INSERT_HEAD(&kv_cache_lru, e, kce_lru_link);
+  kv_cache_entries++;
+  return e;
+}
+
+
+/**
+ * Add value from a (domain, key, value) triplet starting at column 'col'
+ */
+static void
+kv_cache_add_value(kv_cache_value_t **values, sqlite3_stmt *stmt, int col)
+{
+  kv_cache_value_t *kcv;
+
+  if(sqlite3_column_type(stmt, col + 1) != SQLITE_TEXT)
+    return; // No values for this URL (outer join)
+
+  kcv = calloc(1, sizeof(kv_cache_value_t));
+  kcv->kcv_domain = sqlite3_column_int(stmt, col);
+  kcv->kcv_key = strdup((const char *)sqlite3_column_text(stmt, col + 1));
+  kcv->kcv_type = sqlite3_column_type(stmt, col + 2);
+
+  switch(kcv->kcv_type) {
+  case SQLITE_INTEGER:
+    kcv->kcv_int = sqlite3_column_int64(stmt, col + 2);
+    break;
+  case SQLITE_FLOAT:
+    kcv->kcv_float = sqlite3_column_double(stmt, col + 2);
+    break;
+  case SQLITE_TEXT:
+    kcv->kcv_str = strdup((const char *)sqlite3_column_text(stmt, col + 2));
+    break;
+  default:
+    kcv->kcv_type = SQLITE_NULL;
+    break;
+  }
+  kcv->kcv_next = *values;
+  *values = kcv;
+}
+
+
+/**
+ * Load all values for 'url' from DB
+ *
+ * Must be called without kv_cache_mutex locked
+ */
+static int
+kv_cache_query(const char *url, int64_t *idp, kv_cache_value_t **valuesp)
+{
+  sqlite3_stmt *stmt;
+  void *db = kvstore_get();
+  int rc;
+
+  if(db == NULL)
+    return -1;
+
+  rc = db_prepare_cached(db, &stmt,
+                         "SELECT id, domain, key, value "
+                         "FROM url "
+                         "LEFT OUTER JOIN url_kv ON id = url_id "
+                         "WHERE url=?1");
+
+  if(rc != SQLITE_OK) {
+    kvstore_close(db);
+    return -1;
+  }
+
+  sqlite3_bind_text(stmt, 1, url, -1, SQLITE_STATIC);
+
+  *valuesp = NULL;
+  *idp = -1;
+
+  while(db_step(stmt) == SQLITE_ROW) {
+    *idp = sqlite3_column_int64(stmt, 0);
+    kv_cache_add_value(valuesp, stmt, 1);
+  }
+
+  db_stmt_release(stmt);
+  kvstore_close(db);
+  return 0;
+}
+
+
+/**
+ * Return up to date entry for 'url' or NULL if nothing is stored for it
+ *
+ * Must be called with kv_cache_mutex locked. The lock is released while
+ * querying the DB so the returned entry must be used before unlocking
+ */
+static kv_cache_entry_t *
+kv_cache_acquire(const char *url)
+{
+  kv_cache_value_t *values;
+  kv_cache_entry_t *e;
+  int64_t id;
+  int gen, r;
+
+  while(1) {
+    e = kv_cache_find(url, 0);
+
+    if(e == NULL && kv_cache_covered(url))
+      return NULL;
+
+    if(e != NULL && !e->kce_stale)
+      return e;
+
+    gen = kv_cache_gen;
+    hts_mutex_unlock(&kv_cache_mutex);
+    r = kv_cache_query(url, &id, &values);
+    hts_mutex_lock(&kv_cache_mutex);
+
+    if(r)
+      return NULL;
+
+    if(gen != kv_cache_gen) {
+      // Raced with a write, might have read old values
+      kv_cache_values_free(values);
+      continue;
+    }
+
+    e = kv_cache_find(url, 1);
+    kv_cache_values_free(e->kce_values);
+    e->kce_values = values;
+    e->kce_id = id;
+    e->kce_stale = 0;
+    return e;
+  }
+}
+
+
+/**
+ * Find value for 'domain' / 'key' of 'url'. Returns 1 if it is set
+ */
+static int
+kv_cache_lookup(const char *url, int domain, const char *key,
+                int64_t *ip, rstr_t **rp)
+{
+  kv_cache_entry_t *e;
+  kv_cache_value_t *kcv = NULL;
+  char tmp[64];
+
+  hts_mutex_lock(&kv_cache_mutex);
+
+  if((e = kv_cache_acquire(url)) != NULL) {
+    for(kcv = e->kce_values; kcv != NULL; kcv = kcv->kcv_next)
+      if(kcv->kcv_domain == domain && !strcmp(kcv->kcv_key, key))
+        break;
+  }
+
+  if(kcv != NULL) {
+    switch(kcv->kcv_type) {
+    case SQLITE_INTEGER:
+      *ip = kcv->kcv_int;
+      snprintf(tmp, sizeof(tmp), "%"PRId64, kcv->kcv_int);
+      break;
+    case SQLITE_FLOAT:
+      *ip = kcv->kcv_float;
+      snprintf(tmp, sizeof(tmp), "%.15g", kcv->kcv_float);
+      break;
+    case SQLITE_TEXT:
+      *ip = strtoll(kcv->kcv_str, NULL, 10);
+      break;
+    default:
+      *ip = 0;
+      break;
+    }
+
+    if(rp != NULL)
+      *rp = rstr_alloc(kcv->kcv_type == SQLITE_TEXT ? kcv->kcv_str :
+                       kcv->kcv_type == SQLITE_NULL ? NULL : tmp);
+  }
+
+  hts_mutex_unlock(&kv_cache_mutex);
+  return kcv != NULL;
+}
+
+
+/**
+ * Called after 'url' has been written to
+ */
+static void
+kv_cache_invalidate(const char *url)
+{
+  kv_cache_entry_t *e;
+
+  hts_mutex_lock(&kv_cache_mutex);
+  kv_cache_gen++;
+  e = kv_cache_find(url, 0);
+  if(e == NULL && kv_cache_covered(url))
+    e = kv_cache_find(url, 1); // Must not be assumed empty any more
+  if(e != NULL)
+    e->kce_stale = 1;
+  hts_mutex_unlock(&kv_cache_mutex);
+}
+
+
+/**
+ * Load values for all URLs directly in directory 'parent' into the cache
+ */
+void
+kv_url_prefetch(const char *parent)
+{
+  const size_t len = strlen(parent);
+  char *lo = alloca(len + 2);
+  struct kv_cache_entry_queue q;
+  kv_cache_entry_t *e = NULL;
+  sqlite3_stmt *stmt;
+  void *db;
+  int i, rc, gen, valid, rows = 0, urls = 0;
+
+  memcpy(lo, parent, len + 1);
+  if(len == 0 || parent[len - 1] != '/')
+    strcat(lo, "/");
+
+  TAILQ_INIT(&q);
+
+  hts_mutex_lock(&kv_cache_mutex);
+  gen = kv_cache_gen;
+  hts_mutex_unlock(&kv_cache_mutex);
+
+  db = kvstore_get();
+  if(db == NULL)
+    return;
+
+  // Indexed on 'parent' so only URLs directly in this directory are visited
+  rc = db_prepare_cached(db, &stmt,
+                         "SELECT id, url, domain, key, value "
+                         "FROM url "
+                         "LEFT OUTER JOIN url_kv ON id = url_id "
+                         "WHERE parent = ?1 "
+                         "ORDER BY url "
+                         "LIMIT ?2");
+
+  if(rc != SQLITE_OK) {
+    kvstore_close(db);
+    return;
+  }
+
+  sqlite3_bind_text(stmt, 1, lo, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, 2, KV_PREFETCH_MAX);
+
+  while(db_step(stmt) == SQLITE_ROW) {
+    const char *url = (const char *)sqlite3_column_text(stmt, 1);
+    rows++;
+
+    if(e == NULL || strcmp(e->kce_url, url)) {
+      e = calloc(1, sizeof(kv_cache_entry_t));
+      e->kce_url = strdup(url);
+      e->kce_id = sqlite3_column_int64(stmt, 0);
+      TAILQ_INSERT_TAIL(&q, e, kce_lru_link);
+      urls++;
+    }
+    kv_cache_add_value(&e->kce_values, stmt, 2);
+  }
+
+  db_stmt_release(stmt);
+  kvstore_close(db);
+
+  hts_mutex_lock(&kv_cache_mutex);
+
+  // Results are useless if something was written while we queried
+  valid = gen == kv_cache_gen;
+
+  while((e = TAILQ_FIRST(&q)) != NULL) {
+    TAILQ_REMOVE(&q, e, kce_lru_link);
+
+    // If truncated, last entry might not be complete
+    if(valid && (TAILQ_FIRST(&q) != NULL || rows < KV_PREFETCH_MAX)) {
+      kv_cache_entry_t *c = kv_cache_find(e->kce_url, 1);
+      kv_cache_values_free(c->kce_values);
+      c->kce_values = e->kce_values;
+      c->kce_id = e->kce_id;
+      c->kce_stale = 0;
+    } else {
+      kv_cache_values_free(e->kce_values);
+    }
+    free(e->kce_url);
+    free(e);
+  }
+
+  if(valid && rows < KV_PREFETCH_MAX && urls < KV_CACHE_MAX / 2) {
+
+    for(i = 0; i < KV_CACHE_PREFIXES; i++)
+      if(kv_cache_prefixes[i] != NULL && !strcmp(kv_cache_prefixes[i], lo))
+        break;
+
+    if(i == KV_CACHE_PREFIXES) {
+      i = kv_cache_prefix_ptr;
+      kv_cache_prefix_ptr = (kv_cache_prefix_ptr + 1) % KV_CACHE_PREFIXES;
+      free(kv_cache_prefixes[i]);
+      kv_cache_prefixes[i] = strdup(lo);
+    }
+  }
+
+  hts_mutex_unlock(&kv_cache_mutex);
+
+  if(gconf.enable_kvstore_debug)
+    TRACE(TRACE_DEBUG, "kvstore", "Prefetched %d URLs (%d rows) in %s",
+          urls, rows, parent);
+}
+
+
 typedef struct kv_prop_bind {
   uint64_t kpb_id;  // ID of row in URL table
   prop_sub_t *kpb_sub;
@@ -155,8 +607,8 @@ get_url(void *db, const char *url, uint64_t *id)
   int rc;
   sqlite3_stmt *stmt;
 
-  rc = db_prepare(db, &stmt,
-		  "SELECT id FROM url WHERE url=?1");
+  rc = db_prepare_cached(db, &stmt,
+                         "SELECT id FROM url WHERE url=?1");
 
   if(rc != SQLITE_OK)
     return rc;
@@ -165,19 +617,21 @@ get_url(void *db, const char *url, uint64_t *id)
 
   rc = sqlite3_step(stmt);
   if(rc == SQLITE_LOCKED) {
-    sqlite3_finalize(stmt);
+    db_stmt_release(stmt);
     return SQLITE_LOCKED;
   }
   if(rc == SQLITE_ROW) {
     *id = sqlite3_column_int64(stmt, 0);
-    sqlite3_finalize(stmt);
+    db_stmt_release(stmt);
     return SQLITE_OK;
 
   } else if(rc == SQLITE_DONE) {
-    sqlite3_finalize(stmt);
+    db_stmt_release(stmt);
 
-    rc = db_prepare(db, &stmt,
-		    "INSERT INTO url ('url') VALUES (?1)");
+    // 'parent' is everything up to and including the last '/'
+    rc = db_prepare_cached(db, &stmt,
+                           "INSERT INTO url ('url', 'parent') "
+                           "VALUES (?1, rtrim(?1, replace(?1, '/', '')))");
 
     if(rc != SQLITE_OK)
       return rc;
@@ -195,7 +649,7 @@ get_url(void *db, const char *url, uint64_t *id)
 
     }
   }
-  sqlite3_finalize(stmt);
+  db_stmt_release(stmt);
   return rc;
 }
 
@@ -310,6 +764,7 @@ kv_value_cb(void *opaque, prop_event_t event, ...)
     }
     db_commit(db);
     kvstore_close(db);
+    kv_cache_invalidate(kpb->kpb_url);
     break;
 
   default:
@@ -391,56 +846,50 @@ kv_cb(void *opaque, prop_event_t event, ...)
 void
 kv_prop_bind_create(prop_t *p, const char *url)
 {
-  void *db;
   int64_t id = -1;
-  sqlite3_stmt *stmt;
-  int rc;
+  kv_cache_entry_t *e;
+  kv_cache_value_t *kcv, *values = NULL;
 
-  db = kvstore_get();
-  if(db == NULL)
+  if(kvstore_pool == NULL)
     return;
 
-  rc = db_prepare(db, &stmt, 
-		  "SELECT id,key,value "
-		  "FROM url "
-		  "LEFT OUTER JOIN url_kv ON id = url_id "
-		  "WHERE url=?1 "
-		  "AND domain=?2");
+  // Copy values so we don't hold kv_cache_mutex while updating props
+  hts_mutex_lock(&kv_cache_mutex);
+  if((e = kv_cache_acquire(url)) != NULL) {
+    id = e->kce_id;
 
-
-  if(rc != SQLITE_OK) {
-    kvstore_close(db);
-    return;
+    for(kcv = e->kce_values; kcv != NULL; kcv = kcv->kcv_next) {
+      if(kcv->kcv_domain != KVSTORE_DOMAIN_PROP)
+        continue;
+      kv_cache_value_t *c = malloc(sizeof(kv_cache_value_t));
+      *c = *kcv;
+      c->kcv_key = strdup(kcv->kcv_key);
+      c->kcv_str = kcv->kcv_str ? strdup(kcv->kcv_str) : NULL;
+      c->kcv_next = values;
+      values = c;
+    }
   }
-  sqlite3_bind_text(stmt, 1, url, -1, SQLITE_STATIC);
-  sqlite3_bind_int(stmt, 2, KVSTORE_DOMAIN_PROP);
+  hts_mutex_unlock(&kv_cache_mutex);
 
-  while(db_step(stmt) == SQLITE_ROW) {
-    if(id == -1)
-      id = sqlite3_column_int64(stmt, 0);
-    if(sqlite3_column_type(stmt, 1) != SQLITE_TEXT)
-      continue;
-
-    prop_t *c = prop_create(p, (const char *)sqlite3_column_text(stmt, 1));
+  for(kcv = values; kcv != NULL; kcv = kcv->kcv_next) {
+    prop_t *c = prop_create(p, kcv->kcv_key);
 
-    switch(sqlite3_column_type(stmt, 2)) {
+    switch(kcv->kcv_type) {
     case SQLITE_TEXT:
-      prop_set_string(c, (const char *)sqlite3_column_text(stmt, 2));
+      prop_set_string(c, kcv->kcv_str);
       break;
     case SQLITE_INTEGER:
-      prop_set_int(c, sqlite3_column_int(stmt, 2));
+      prop_set_int(c, kcv->kcv_int);
       break;
     case SQLITE_FLOAT:
-      prop_set_float(c, sqlite3_column_double(stmt, 2));
+      prop_set_float(c, kcv->kcv_float);
       break;
     default:
       prop_set_void(c);
       break;
     }
   }
-
-  sqlite3_finalize(stmt);
-  kvstore_close(db);
+  kv_cache_values_free(values);
 
   kv_prop_bind_t *kpb = calloc(1, sizeof(kv_prop_bind_t));
   kpb->kpb_id = id;
@@ -456,40 +905,6 @@ kv_prop_bind_create(prop_t *p, const char *url)
 
 
 
-/**
- *
- */
-static sqlite3_stmt *
-kv_url_opt_get(void *db, const char *url, int domain, const char *key)
-{
-  sqlite3_stmt *stmt;
-  int rc;
-
-  if(db == NULL)
-    return NULL;
-
-  rc = db_prepare(db, &stmt, 
-		  "SELECT value "
-		  "FROM url, url_kv "
-		  "WHERE url=?1 "
-		  "AND key = ?2 "
-		  "AND domain = ?3 "
-		  "AND url.id = url_id"
-		  );
-
-  if(rc != SQLITE_OK) {
-    return NULL;
-  }
-  sqlite3_bind_text(stmt, 1, url, -1, SQLITE_STATIC);
-  sqlite3_bind_text(stmt, 2, key, -1, SQLITE_STATIC);
-  sqlite3_bind_int(stmt,  3, domain);
-
-  if(db_step(stmt) == SQLITE_ROW)
-    return stmt;
-  sqlite3_finalize(stmt);
-  return NULL;
-}
-
 /**
  *
  */
@@ -532,14 +947,9 @@ kv_url_opt_get_rstr(const char *url, int domain, const char *key)
     return rval;
   }
 
-  void *db = kvstore_get();
-  sqlite3_stmt *stmt = kv_url_opt_get(db, url, domain, key);
+  int64_t v;
   rstr_t *r = NULL;
-  if(stmt) {
-    r = db_rstr(stmt, 0);
-    sqlite3_finalize(stmt);
-  }
-  kvstore_close(db);
+  kv_cache_lookup(url, domain, key, &v, &r);
   return r;
 }
 
@@ -568,12 +978,10 @@ kv_url_opt_get_int(const char *url, int domain, const char *key, int def)
     return rval;
   }
 
-  void *db = kvstore_get();
-  sqlite3_stmt *stmt = kv_url_opt_get(db, url, domain, key);
+  int64_t v64;
   int v = def;
-  if(stmt) {
-    v = sqlite3_column_int(stmt, 0);
-    sqlite3_finalize(stmt);
+  if(kv_cache_lookup(url, domain, key, &v64, NULL)) {
+    v = v64;
     if(gconf.enable_kvstore_debug)
       TRACE(TRACE_DEBUG, "kvstore","GET DB url=%s key=%s domain=%d value=%d",
             url, key, domain, v);
@@ -582,7 +990,6 @@ kv_url_opt_get_int(const char *url, int domain, const char *key, int def)
       TRACE(TRACE_DEBUG, "kvstore","GET DB url=%s key=%s domain=%d value=UNSET",
             url, key, domain);
   }
-  kvstore_close(db);
   return v;
 }
 
@@ -615,12 +1022,8 @@ kv_url_opt_get_int64(const char *url, int domain, const char *key, int64_t def)
   }
 
 
-  void *db = kvstore_get();
-  sqlite3_stmt *stmt = kv_url_opt_get(db, url, domain, key);
-  int64_t v = def;
-  if(stmt) {
-    v = sqlite3_column_int64(stmt, 0);
-    sqlite3_finalize(stmt);
+  int64_t v;
+  if(kv_cache_lookup(url, domain, key, &v, NULL)) {
     if(gconf.enable_kvstore_debug)
       TRACE(TRACE_DEBUG, "kvstore",
             "GET DB url=%s key=%s domain=%d value=%"PRId64,
@@ -629,8 +1032,8 @@ kv_url_opt_get_int64(const char *url, int domain, const char *key, int64_t def)
     if(gconf.enable_kvstore_debug)
       TRACE(TRACE_DEBUG, "kvstore","GET DB url=%s key=%s domain=%d value=UNSET",
             url, key, domain);
+    v = def;
   }
-  kvstore_close(db);
   return v;
 }
 
@@ -847,6 +1250,7 @@ kv_url_opt_set(const char *url, int domain, const char *key,
   }
   db_commit(db);
   kvstore_close(db);
+  kv_cache_invalidate(url);
 }
 
 
@@ -910,9 +1314,12 @@ kvstore_deferred_flush(void)
   db_commit(db);
 
  err:
+  // Release DB first, nothing below needs it
+  kvstore_close(db);
 
   while((kw = LIST_FIRST(&deferred_writes)) != NULL) {
     LIST_REMOVE(kw, kw_link);
+    kv_cache_invalidate(kw->kw_url);
     free(kw->kw_url);
     free(kw->kw_key);
     if(kw->kw_type == KVSTORE_SET_STRING)
@@ -922,8 +1329,6 @@ kvstore_deferred_flush(void)
 
 
   hts_mutex_unlock(&deferred_mutex);
-  kvstore_close(db);
-
 }
 
 
@@ -996,6 +1401,6 @@ kv_url_opt_set_deferred(const char *url, int domain, const char *key,
 
   hts_mutex_unlock(&deferred_mutex);
 
-  callout_arm(&deferred_callout, deferred_callout_fire, NULL, 5);
+  callout_arm_worker(&deferred_callout, deferred_callout_fire, NULL, 5);
   va_end(ap);
 }
@@ -31,6 +31,8 @@ void kvstore_close(void *db);
 
 void kv_prop_bind_create(prop_t *p, const char *url);
 
+void kv_url_prefetch(const char *parent);
+
 // Direct access
 
 #define KVSTORE_DOMAIN_SYS     1
@@ -87,6 +87,8 @@ typedef struct buffered_file {
 
   buffered_zone_t bf_zones[BF_ZONES];
 
+  fa_readahead_t *bf_ra;  // NULL if prefetch is disabled
+
 } buffered_file_t;
 
 
@@ -224,6 +226,28 @@ resolve_zone(const buffered_file_t *bf, int64_t fpos, int size, int *mpos)
 }
 
 
+/**
+ *
+ */
+static void
+src_lock(buffered_file_t *bf)
+{
+  if(bf->bf_ra != NULL)
+    fa_readahead_lock(bf->bf_ra);
+}
+
+
+/**
+ *
+ */
+static void
+src_unlock(buffered_file_t *bf)
+{
+  if(bf->bf_ra != NULL)
+    fa_readahead_unlock(bf->bf_ra);
+}
+
+
 /**
  *
  */
@@ -250,7 +274,10 @@ need_to_fill(const buffered_file_t *bf, int64_t fpos, size_t rd)
 static void
 fab_destroy(buffered_file_t *bf)
 {
-  bf->bf_src->fh_proto->fap_close(bf->bf_src);
+  if(bf->bf_ra != NULL)
+    fa_readahead_destroy(bf->bf_ra); // Closes bf_src
+  else
+    bf->bf_src->fh_proto->fap_close(bf->bf_src);
 
   if(bf->bf_mem != NULL)
     hfree(bf->bf_mem, bf->bf_mem_size);
@@ -312,7 +339,9 @@ fab_seek(fa_handle_t *handle, int64_t pos, int whence)
 
   case SEEK_END:
     if(bf->bf_size == -1) {
+      src_lock(bf);
       bf->bf_size = src->fh_proto->fap_fsize(src);
+      src_unlock(bf);
       if(bf->bf_size == -1)
 	return -1;
     }
@@ -343,7 +372,9 @@ fab_fsize(fa_handle_t *handle)
     return bf->bf_size;
 
   fa_handle_t *src = bf->bf_src;
+  src_lock(bf);
   bf->bf_size = src->fh_proto->fap_fsize(src);
+  src_unlock(bf);
   return bf->bf_size;
 }
 
@@ -393,10 +424,27 @@ store_in_cache(buffered_file_t *bf, const void *buf, size_t size)
  *
  */
 static int
-fab_read(fa_handle_t *handle, void *buf, size_t size)
+fab_read_src(buffered_file_t *bf, void *buf, int64_t fpos, size_t size)
 {
-  buffered_file_t *bf = (buffered_file_t *)handle;
   fa_handle_t *src = bf->bf_src;
+  int r;
+
+  src_lock(bf);
+  if(src->fh_proto->fap_seek(src, fpos, SEEK_SET) != fpos)
+    r = -1;
+  else
+    r = src->fh_proto->fap_read(src, buf, size);
+  src_unlock(bf);
+  return r;
+}
+
+
+/**
+ *
+ */
+static int
+fab_read0(buffered_file_t *bf, void *buf, size_t size)
+{
 
   if(bf->bf_mem == NULL) {
     bf->bf_mem = halloc(bf->bf_mem_size);
@@ -421,13 +469,21 @@ fab_read(fa_handle_t *handle, void *buf, size_t size)
       continue;
     }
 
+    if(bf->bf_ra != NULL &&
+       (cs = fa_readahead_read(bf->bf_ra, buf, bf->bf_fpos, size)) > 0) {
+      // Read-ahead hit
+      store_in_cache(bf, buf, cs);
+      rval += cs;
+      buf += cs;
+      bf->bf_fpos += cs;
+      size -= cs;
+      continue;
+    }
+
     int rreq = need_to_fill(bf, bf->bf_fpos, size);
     if(rreq >= bf->bf_min_request) {
 
-      if(src->fh_proto->fap_seek(src, bf->bf_fpos, SEEK_SET) != bf->bf_fpos)
-	return -1;
-
-      int r = src->fh_proto->fap_read(src, buf, rreq);
+      int r = fab_read_src(bf, buf, bf->bf_fpos, rreq);
       if(r > 0) {
 	store_in_cache(bf, buf, r);
 	rval += r;
@@ -447,11 +503,8 @@ fab_read(fa_handle_t *handle, void *buf, size_t size)
     
     erase_zone(bf, bf->bf_mem_ptr, bf->bf_min_request);
 
-    if(src->fh_proto->fap_seek(src, bf->bf_fpos, SEEK_SET) != bf->bf_fpos)
-      return -1;
-
-    int r = src->fh_proto->fap_read(src, bf->bf_mem + bf->bf_mem_ptr,
-				    bf->bf_min_request);
+    int r = fab_read_src(bf, bf->bf_mem + bf->bf_mem_ptr, bf->bf_fpos,
+			 bf->bf_min_request);
     if(r < 1) {
       bf->bf_size = bf->bf_fpos;
       return r < 0 ? r : rval;
@@ -480,6 +533,22 @@ fab_read(fa_handle_t *handle, void *buf, size_t size)
 }
 
 
+/**
+ *
+ */
+static int
+fab_read(fa_handle_t *handle, void *buf, size_t size)
+{
+  buffered_file_t *bf = (buffered_file_t *)handle;
+  int64_t fpos = bf->bf_fpos;
+  int r = fab_read0(bf, buf, size);
+
+  if(bf->bf_ra != NULL && r > 0)
+    fa_readahead_access(bf->bf_ra, fpos, r);
+  return r;
+}
+
+
 #if BK_CHK
 static int
 fab_read(fa_handle_t *handle, void *buf, size_t size)
@@ -542,8 +611,11 @@ fab_set_read_timeout(fa_handle_t *handle, int ms)
 {
   buffered_file_t *bf = (buffered_file_t *)handle;
   fa_handle_t *fh = bf->bf_src;
-  if(fh->fh_proto->fap_set_read_timeout != NULL)
+  if(fh->fh_proto->fap_set_read_timeout != NULL) {
+    src_lock(bf);
     fh->fh_proto->fap_set_read_timeout(fh, ms);
+    src_unlock(bf);
+  }
 }
 
 
@@ -618,6 +690,8 @@ fa_buffered_open(const char *url, char *errbuf, size_t errsize, int flags,
   bf->bf_src = fh;
   bf->bf_size = -1;
   bf->h.fh_proto = &fa_protocol_buffered;
+  if(!(mflags & FA_BUFFERED_NO_PREFETCH))
+    bf->bf_ra = fa_readahead_create(fh);
 #if BF_CHK
   bf->bf_chk = fa_open_ex(url, NULL, 0, 0, NULL);
 #endif
@@ -26,11 +26,13 @@
 #include <unistd.h>
 #include <stdio.h>
 
-#include <arch/threads.h>
+#include "arch/threads.h"
+#include "htsmsg/htsbuf.h"
 #include "showtime.h"
 #include "fileaccess.h"
 #include "fa_proto.h"
 #include "misc/redblack.h"
+#include "metadata/playinfo.h"
 
 
 TAILQ_HEAD(cached_segment_queue, cached_segment);
@@ -55,6 +57,7 @@ static struct cached_file_queue cached_files;
  */
 typedef struct cached_page {
   int cp_file_offset;
+  int cp_slot;  // Slot in persistent store holding the page, -1 if in cf_fd
 } cached_page_t;
 
 
@@ -95,6 +98,9 @@ typedef struct cached_file {
   prop_t *cf_stats_cachesize;
   prop_t *cf_stats_cachemax;
 
+  uint64_t cf_key;  // Key in persistent store, 0 if not stored
+  struct fcs_file *cf_fcs_file;
+
 } cached_file_t;
 
 
@@ -154,15 +160,600 @@ get_anon_file(int fd[2])
 }
 
 
+/**
+ * Persistent page store
+ *
+ * Pages are kept in chunk files of FCS_CHUNK_PAGES pages each. The
+ * 'slots' file has one record per page slot telling which file and
+ * page is stored in it. A record is cleared before its slot is
+ * overwritten so a crash can't leave it pointing to the wrong data.
+ *
+ * Files are identified by URL, size and modification time (if the
+ * protocol knows it from when the file was opened).
+ *
+ * When a slot is needed we look at a few slots after a clock hand
+ * and evict the one not used for the longest time. Pages around the
+ * position where playback of a file was stopped age much slower as
+ * they are likely to be needed when the user resumes.
+ *
+ * The in-memory index is protected by fcs_mutex which is never held
+ * during disk I/O. A slot with I/O in progress is marked busy so it
+ * is not evicted, and a slot being filled is not linked into the hash
+ * until both its data and record are written.
+ *
+ * Pages that are in the store are read from there by the read-ahead
+ * cache rather than copied to its page file, so each page is written
+ * once. Such slots stay busy for as long as a handle refers to them.
+ */
+
+#define FCS_CHUNK_PAGES   128
+#define FCS_HASH_SIZE     4096
+#define FCS_SCAN          32
+#define FCS_RESUME_BEFORE (16 * 1024 * 1024)
+#define FCS_RESUME_AFTER  (256 * 1024 * 1024)
+#define FCS_RA_FRACTION   4  // Read-ahead may use this part of the store
+
+typedef struct fcs_slot {
+  uint64_t fs_key;
+  int32_t fs_vpage;
+  int32_t fs_size;     // 0 if slot is free
+  uint32_t fs_atime;
+  uint32_t fs_pad;
+} fcs_slot_t;
+
+typedef struct fcs_file {
+  LIST_ENTRY(fcs_file) ff_link;
+  uint64_t ff_key;
+  int64_t ff_resume;   // Where we stopped reading, -1 if not resumable
+  int ff_slots;        // Number of slots holding pages of this file
+  int ff_refcount;     // Number of open handles
+  char *ff_url;
+} fcs_file_t;
+
+static hts_mutex_t fcs_mutex;
+static hts_mutex_t fcs_file_mutex;  // Serializes init and 'files' writes
+static int fcs_initialized;
+static int fcs_num_slots;     // 0 if persistent store is disabled
+static fcs_slot_t *fcs_slots;
+static uint16_t *fcs_busy;
+static int *fcs_hash;
+static int *fcs_next;
+static int fcs_hand;
+static int fcs_slots_fd = -1;
+static int *fcs_chunk_fds;
+static LIST_HEAD(, fcs_file) fcs_files;
+
+
+/**
+ *
+ */
+static uint64_t
+fcs_make_key(const char *url, int64_t size, time_t mtime)
+{
+  char tmp[64];
+  uint64_t h = 14695981039346656037ULL;
+  const char *s;
+
+  for(s = url; *s; s++)
+    h = (h ^ *s) * 1099511628211ULL;
+
+  snprintf(tmp, sizeof(tmp), "|%"PRId64"|%"PRId64, size, (int64_t)mtime);
+  for(s = tmp; *s; s++)
+    h = (h ^ *s) * 1099511628211ULL;
+
+  return h ?: 1;
+}
+
+
+/**
+ *
+ */
+static int
+fcs_bucket(uint64_t key, int vpage)
+{
+  return (key ^ (key >> 32) ^ (vpage * 0x9e3779b1)) & (FCS_HASH_SIZE - 1);
+}
+
+
+/**
+ *
+ */
+static int
+fcs_find(uint64_t key, int vpage)
+{
+  int s;
+  for(s = fcs_hash[fcs_bucket(key, vpage)]; s != -1; s = fcs_next[s])
+    if(fcs_slots[s].fs_key == key && fcs_slots[s].fs_vpage == vpage)
+      return s;
+  return -1;
+}
+
+
+/**
+ *
+ */
+static fcs_file_t *
+fcs_file_find(uint64_t key)
+{
+  fcs_file_t *ff;
+  LIST_FOREACH(ff, &fcs_files, ff_link)
+    if(ff->ff_key == key)
+      return ff;
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static fcs_file_t *
+fcs_file_get(uint64_t key, const char *url)
+{
+  fcs_file_t *ff = fcs_file_find(key);
+  if(ff == NULL) {
+    ff = calloc(1, sizeof(fcs_file_t));
+    ff->ff_key = key;
+    ff->ff_resume = -1;
+    ff->ff_url = strdup(url);
+    LIST_INSERT_HEAD(&fcs_files, ff, ff_link);
+  }
+  return ff;
+}
+
+
+/**
+ *
+ */
+static void
+fcs_link(int s)
+{
+  int b = fcs_bucket(fcs_slots[s].fs_key, fcs_slots[s].fs_vpage);
+  fcs_file_t *ff = fcs_file_find(fcs_slots[s].fs_key);
+
+  fcs_next[s] = fcs_hash[b];
+  fcs_hash[b] = s;
+  if(ff != NULL)
+    ff->ff_slots++;
+}
+
+
+/**
+ *
+ */
+static void
+fcs_unlink(int s)
+{
+  int *p = &fcs_hash[fcs_bucket(fcs_slots[s].fs_key, fcs_slots[s].fs_vpage)];
+  fcs_file_t *ff = fcs_file_find(fcs_slots[s].fs_key);
+
+  if(ff != NULL)
+    ff->ff_slots--;
+
+  for(; *p != -1; p = &fcs_next[*p]) {
+    if(*p == s) {
+      *p = fcs_next[s];
+      return;
+    }
+  }
+}
+
+
+/**
+ *
+ */
+static int
+fcs_slot_write(int s, const fcs_slot_t *fs)
+{
+  off_t o = (off_t)s * sizeof(fcs_slot_t);
+  return pwrite(fcs_slots_fd, fs, sizeof(fcs_slot_t), o) !=
+    sizeof(fcs_slot_t);
+}
+
+
+/**
+ *
+ */
+static off_t
+fcs_slot_offset(int s)
+{
+  return (off_t)(s % FCS_CHUNK_PAGES) << PAGE_SHIFT;
+}
+
+
+/**
+ * Return fd of chunk file holding slot 's', or -1
+ */
+static int
+fcs_chunk_fd(int s)
+{
+  int c = s / FCS_CHUNK_PAGES;
+  char path[URL_MAX];
+  int fd, dup = -1;
+
+  hts_mutex_lock(&fcs_mutex);
+  fd = fcs_chunk_fds[c];
+  hts_mutex_unlock(&fcs_mutex);
+
+  if(fd != -1)
+    return fd;
+
+  snprintf(path, sizeof(path), "%s/facache/chunk%d", gconf.cache_path, c);
+  if((fd = open(path, O_CREAT | O_RDWR, 0666)) == -1)
+    return -1;
+
+  hts_mutex_lock(&fcs_mutex);
+  if(fcs_chunk_fds[c] == -1) {
+    fcs_chunk_fds[c] = fd;
+  } else {
+    dup = fd;
+    fd = fcs_chunk_fds[c];
+  }
+  hts_mutex_unlock(&fcs_mutex);
+
+  if(dup != -1)
+    close(dup);
+  return fd;
+}
+
+
+/**
+ * Write list of files that still have pages in store
+ */
+static void
+fcs_files_save(void)
+{
+  char path[URL_MAX], tmp[URL_MAX];
+  fcs_file_t *ff, *next;
+  htsbuf_queue_t hq;
+  FILE *fp;
+  char *s;
+
+  htsbuf_queue_init(&hq, 0);
+
+  hts_mutex_lock(&fcs_file_mutex);
+
+  hts_mutex_lock(&fcs_mutex);
+  for(ff = LIST_FIRST(&fcs_files); ff != NULL; ff = next) {
+    next = LIST_NEXT(ff, ff_link);
+    if(ff->ff_slots == 0 && ff->ff_refcount == 0) {
+      LIST_REMOVE(ff, ff_link);
+      free(ff->ff_url);
+      free(ff);
+      continue;
+    }
+    htsbuf_qprintf(&hq, "%016"PRIx64" %"PRId64" %s\n",
+		   ff->ff_key, ff->ff_resume, ff->ff_url);
+  }
+  hts_mutex_unlock(&fcs_mutex);
+
+  s = htsbuf_to_string(&hq);
+
+  snprintf(path, sizeof(path), "%s/facache/files", gconf.cache_path);
+  snprintf(tmp, sizeof(tmp), "%s/facache/files.tmp", gconf.cache_path);
+  if((fp = fopen(tmp, "w")) != NULL) {
+    fputs(s, fp);
+    if(!fclose(fp))
+      rename(tmp, path);
+  }
+  hts_mutex_unlock(&fcs_file_mutex);
+  free(s);
+}
+
+
+/**
+ *
+ */
+static void
+fcs_files_load(void)
+{
+  char path[URL_MAX], line[URL_MAX + 64];
+  uint64_t key;
+  int64_t resume;
+  int n;
+  FILE *fp;
+
+  snprintf(path, sizeof(path), "%s/facache/files", gconf.cache_path);
+  if((fp = fopen(path, "r")) == NULL)
+    return;
+
+  while(fgets(line, sizeof(line), fp) != NULL) {
+    char *nl = strchr(line, '\n');
+    if(nl != NULL)
+      *nl = 0;
+    if(sscanf(line, "%"SCNx64" %"SCNd64" %n", &key, &resume, &n) != 2)
+      continue;
+    fcs_file_t *ff = fcs_file_get(key, line + n);
+    // Only keep resume position if user has not finished watching it
+    ff->ff_resume = playinfo_get_restartpos(ff->ff_url) > 0 ? resume : -1;
+  }
+  fclose(fp);
+}
+
+
+/**
+ * Open store, done when first needed since settings are not loaded
+ * when fa_cache_init() runs. Changes to cache size take effect on
+ * next start.
+ *
+ * Nothing else touches the index until fcs_initialized is set so it's
+ * built without holding fcs_mutex
+ */
+static void
+fcs_init(void)
+{
+  char path[URL_MAX];
+  int s, c;
+
+  hts_mutex_lock(&fcs_file_mutex);
+
+  if(fcs_initialized)
+    goto out;
+  fcs_initialized = 1;
+
+  if(gconf.fa_cache_size <= 0 || gconf.cache_path == NULL)
+    goto out;
+
+  snprintf(path, sizeof(path), "%s/facache/slots", gconf.cache_path);
+  if((fcs_slots_fd = open(path, O_CREAT | O_RDWR, 0666)) == -1) {
+    TRACE(TRACE_ERROR, "RA", "Unable to open %s -- %s", path, strerror(errno));
+    goto out;
+  }
+
+  int num_slots = ((int64_t)gconf.fa_cache_size << 20) >> PAGE_SHIFT;
+  num_slots = (num_slots + FCS_CHUNK_PAGES - 1) & ~(FCS_CHUNK_PAGES - 1);
+  c = num_slots / FCS_CHUNK_PAGES;
+
+  fcs_slots = calloc(num_slots, sizeof(fcs_slot_t));
+  fcs_busy = calloc(num_slots, sizeof(uint16_t));
+  fcs_next = malloc(sizeof(int) * num_slots);
+  fcs_hash = malloc(sizeof(int) * FCS_HASH_SIZE);
+  memset(fcs_hash, 0xff, sizeof(int) * FCS_HASH_SIZE);
+  fcs_chunk_fds = malloc(sizeof(int) * c);
+  memset(fcs_chunk_fds, 0xff, sizeof(int) * c);
+
+  if(read(fcs_slots_fd, fcs_slots, sizeof(fcs_slot_t) * num_slots) < 0)
+    memset(fcs_slots, 0, sizeof(fcs_slot_t) * num_slots);
+
+  fcs_files_load();
+
+  for(s = 0; s < num_slots; s++) {
+    if(fcs_slots[s].fs_size > PAGE_SIZE || fcs_slots[s].fs_size < 0)
+      fcs_slots[s].fs_size = 0;
+    if(fcs_slots[s].fs_size)
+      fcs_link(s);
+  }
+
+  fcs_num_slots = num_slots;
+
+  TRACE(TRACE_DEBUG, "RA", "Persistent cache with %d MB budget",
+	gconf.fa_cache_size);
+ out:
+  hts_mutex_unlock(&fcs_file_mutex);
+}
+
+
+/**
+ * How long since slot was used. Pages close to where the user will
+ * resume playback age slower
+ */
+static int64_t
+fcs_age(const fcs_slot_t *fs, uint32_t now)
+{
+  int64_t age = now - fs->fs_atime;
+  const fcs_file_t *ff = fcs_file_find(fs->fs_key);
+
+  if(ff != NULL && ff->ff_resume >= 0) {
+    int64_t pos = (int64_t)fs->fs_vpage << PAGE_SHIFT;
+    if(pos > ff->ff_resume - FCS_RESUME_BEFORE &&
+       pos < ff->ff_resume + FCS_RESUME_AFTER)
+      age /= 16;
+  }
+  return age;
+}
+
+
+/**
+ * Returns -1 if all scanned slots are busy
+ */
+static int
+fcs_victim(void)
+{
+  uint32_t now = time(NULL);
+  int64_t best_age = -1;
+  int i, best = -1;
+
+  for(i = 0; i < FCS_SCAN; i++) {
+    int s = fcs_hand;
+    fcs_hand = (fcs_hand + 1) % fcs_num_slots;
+
+    if(fcs_busy[s])
+      continue;
+
+    if(fcs_slots[s].fs_size == 0)
+      return s;
+
+    int64_t age = fcs_age(&fcs_slots[s], now);
+    if(age > best_age) {
+      best_age = age;
+      best = s;
+    }
+  }
+  return best;
+}
+
+
+/**
+ * Find page in persistent store. Returns the slot, kept busy until
+ * fcs_unpin(), or -1 if not there
+ */
+static int
+fcs_pin(cached_file_t *cf, int vpage)
+{
+  fcs_slot_t fs;
+  int s;
+
+  if(cf->cf_key == 0)
+    return -1;
+
+  hts_mutex_lock(&fcs_mutex);
+  if((s = fcs_find(cf->cf_key, vpage)) != -1) {
+    fcs_busy[s]++;
+    fcs_slots[s].fs_atime = time(NULL);
+    fs = fcs_slots[s];
+  }
+  hts_mutex_unlock(&fcs_mutex);
+
+  if(s != -1)
+    fcs_slot_write(s, &fs);
+  return s;
+}
+
+
+/**
+ *
+ */
+static void
+fcs_unpin(int s)
+{
+  hts_mutex_lock(&fcs_mutex);
+  fcs_busy[s]--;
+  hts_mutex_unlock(&fcs_mutex);
+}
+
+
+/**
+ * Store page, returns the slot pinned as by fcs_pin() or -1 if it
+ * could not be stored
+ */
+static int
+fcs_store(cached_file_t *cf, int vpage, const void *buf, int size)
+{
+  fcs_slot_t fs;
+  int s, fd, ok = 0;
+
+  if(cf->cf_key == 0)
+    return -1;
+
+  hts_mutex_lock(&fcs_mutex);
+  if(fcs_find(cf->cf_key, vpage) != -1 || (s = fcs_victim()) == -1) {
+    hts_mutex_unlock(&fcs_mutex);
+    return -1;
+  }
+
+  if(fcs_slots[s].fs_size) {
+    fcs_unlink(s);
+    fcs_slots[s].fs_size = 0;
+  }
+  fcs_busy[s]++;
+  hts_mutex_unlock(&fcs_mutex);
+
+  memset(&fs, 0, sizeof(fs));
+
+  if(!fcs_slot_write(s, &fs)) {
+    fs.fs_key = cf->cf_key;
+    fs.fs_vpage = vpage;
+    fs.fs_size = size;
+    fs.fs_atime = time(NULL);
+
+    ok = (fd = fcs_chunk_fd(s)) != -1 &&
+      pwrite(fd, buf, size, fcs_slot_offset(s)) == size &&
+      !fcs_slot_write(s, &fs);
+  }
+
+  hts_mutex_lock(&fcs_mutex);
+  // Another handle to the same file may have stored the page meanwhile
+  if(ok && fcs_find(cf->cf_key, vpage) == -1) {
+    fcs_slots[s] = fs;
+    fcs_link(s);
+  } else {
+    fcs_busy[s]--;
+    s = -1;
+  }
+  hts_mutex_unlock(&fcs_mutex);
+  return s;
+}
+
+
+/**
+ * Files are validated with what the protocol learned when opening
+ * them. A separate stat would cost another round trip per open
+ */
+static void
+fcs_open(cached_file_t *cf, const char *url)
+{
+  struct fa_stat fs;
+  fcs_file_t *ff;
+
+  fcs_init();
+
+  if(fcs_num_slots == 0 || cf->cf_size == 0 || cf->cf_size == (uint64_t)-1)
+    return;
+
+  if(fa_fstat(cf->cf_src, &fs))
+    fs.fs_mtime = 0;
+
+  int64_t restartpos = playinfo_get_restartpos(url);
+
+  hts_mutex_lock(&fcs_mutex);
+  cf->cf_key = fcs_make_key(url, cf->cf_size, fs.fs_mtime);
+  ff = fcs_file_get(cf->cf_key, url);
+  ff->ff_refcount++;
+  if(restartpos <= 0)
+    ff->ff_resume = -1;
+  cf->cf_fcs_file = ff;
+  hts_mutex_unlock(&fcs_mutex);
+}
+
+
+/**
+ * Remember where we stopped so pages around it are kept longer
+ */
+static void
+fcs_close(cached_file_t *cf)
+{
+  fcs_file_t *ff = cf->cf_fcs_file;
+
+  if(ff == NULL)
+    return;
+
+  hts_mutex_lock(&fcs_mutex);
+  ff->ff_resume = cf->cf_pos;
+  ff->ff_refcount--;
+  hts_mutex_unlock(&fcs_mutex);
+
+  cf->cf_fcs_file = NULL;
+  fcs_files_save();
+}
+
+
+/**
+ * Forget what is cached in the page
+ */
+static void
+cached_page_drop(cached_page_t *cp)
+{
+  if(cp->cp_slot != -1)
+    fcs_unpin(cp->cp_slot);
+  cp->cp_slot = -1;
+  cp->cp_file_offset = -1;
+}
+
+
 /**
  *
  */
 static void
 cf_release(cached_file_t *cf)
 {
+  int i;
+
   if(atomic_add(&cf->cf_ref_count, -1) > 1)
     return;
-  
+
+  for(i = 0; i < cf->cf_num_pages; i++)
+    cached_page_drop(cf->cf_pages + i);
+  free(cf->cf_pages);
+
   close(cf->cf_fd[0]);
   close(cf->cf_fd[1]);
   fa_close(cf->cf_src);
@@ -182,6 +773,8 @@ fac_close(fa_handle_t *handle)
 {
   cached_file_t *cf = (cached_file_t *)handle;
 
+  fcs_close(cf);
+
   hts_mutex_lock(&cf->cf_mutex);
   cf->cf_thread_running = 0;
   hts_cond_signal(&cf->cf_cond_req);
@@ -261,20 +854,34 @@ cache_page(cached_file_t *cf, int vpage, void *buf)
   if(srcoffset >= cf->cf_size)
     return 0;
 
-  cp->cp_file_offset = -1;
+  cached_page_drop(cp);
   hts_mutex_unlock(&cf->cf_mutex);
 
-  int r;
+  int r, slot = fcs_pin(cf, vpage);
 
-  if(fa_seek(cf->cf_src, srcoffset, SEEK_SET) == srcoffset) {
-    r = fa_read(cf->cf_src, buf, PAGE_SIZE);
-  } else {
-    r = -1;
+  if(slot == -1) {
+    if(fa_seek(cf->cf_src, srcoffset, SEEK_SET) == srcoffset) {
+      r = fa_read(cf->cf_src, buf, PAGE_SIZE);
+    } else {
+      r = -1;
+    }
+
+    if(r <= 0) {
+      hts_mutex_lock(&cf->cf_mutex);
+      return -1;
+    }
+
+    // Only store complete pages (or the last one)
+    if(r == PAGE_SIZE || srcoffset + r == cf->cf_size)
+      slot = fcs_store(cf, vpage, buf, r);
   }
 
-  if(r <= 0) {
+  if(slot != -1) {
+    // Read from the store, no need for a second copy
     hts_mutex_lock(&cf->cf_mutex);
-    return -1;
+    cp->cp_slot = slot;
+    cp->cp_file_offset = vpage;
+    return 1;
   }
 
   int64_t voff = dpage << PAGE_SHIFT;
@@ -300,8 +907,13 @@ cache_pages(cached_file_t *cf, void *buf)
   int i;
   int basepage = cf->cf_pos >> PAGE_SHIFT;
   int ra = 0;
+  int max = cf->cf_num_pages - 10;
+
+  // Don't let one file's read-ahead cycle through the whole store
+  if(fcs_num_slots)
+    max = MIN(max, fcs_num_slots / FCS_RA_FRACTION);
 
-  for(i = 0; i < cf->cf_num_pages - 10; i++) {
+  for(i = 0; i < max; i++) {
     if(cf->cf_pending == 1 || cf->cf_thread_running == 0)
       break;
     int r = cache_page(cf, basepage + i, buf);
@@ -374,12 +986,16 @@ fac_load(cached_file_t *cf, void *buf, int64_t offset, int size)
 
   int count = MIN(size, PAGE_SIZE - poffset);
   int64_t voff = (dpage << PAGE_SHIFT) + poffset;
+  int slot = cp->cp_slot;
 
   hts_mutex_unlock(&cf->cf_mutex);
 
-  int r;
+  int r, fd;
 
-  if(lseek(cf->cf_fd[1], voff, SEEK_SET) != voff) {
+  if(slot != -1) {
+    r = (fd = fcs_chunk_fd(slot)) == -1 ||
+      pread(fd, buf, count, fcs_slot_offset(slot) + poffset) != count;
+  } else if(lseek(cf->cf_fd[1], voff, SEEK_SET) != voff) {
     r = 1;
   } else {
     r = read(cf->cf_fd[1], buf, count) != count;
@@ -460,10 +1076,10 @@ static fa_protocol_t fa_protocol_cache = {
  */
 fa_handle_t *
 fa_cache_open(const char *url, char *errbuf, size_t errsize, int flags,
-	      struct prop *stats)
+	      struct fa_open_extra *foe)
 {
-  fa_handle_t *fh = fa_open_ex(url, errbuf, errsize, flags | FA_HUGE_BUFFER,
-			       stats);
+  prop_t *stats = foe ? foe->foe_stats : NULL;
+  fa_handle_t *fh = fa_open_ex(url, errbuf, errsize, flags, foe);
   if(fh == NULL)
     return NULL;
 
@@ -497,11 +1113,14 @@ fa_cache_open(const char *url, char *errbuf, size_t errsize, int flags,
 
   cf->cf_src = fh;
   cf->cf_size = fa_fsize(fh);
+
+  fcs_open(cf, url);
+
   // Boot thread
 
   cf->cf_ref_count = 2;
   cf->cf_thread_running = 1;
-  hts_thread_create_detached("facache", fac_thread, cf, THREAD_PRIO_NORMAL);
+  hts_thread_create_detached("facache", fac_thread, cf, THREAD_PRIO_FILESYSTEM);
 
   cf->h.fh_proto = &fa_protocol_cache;
   return &cf->h;
@@ -516,12 +1135,14 @@ fa_cache_init(void)
 {
   char path[200];
 
-  snprintf(path, sizeof(path), "%s/facache", showtime_cache_path);
+  snprintf(path, sizeof(path), "%s/facache", gconf.cache_path);
   mkdir(path, 0777);
-  snprintf(path, sizeof(path), "%s/facache/tmp", showtime_cache_path);
+  snprintf(path, sizeof(path), "%s/facache/tmp", gconf.cache_path);
 
   cachefile = strdup(path);
   
   hts_mutex_init(&cache_mutex);
+  hts_mutex_init(&fcs_mutex);
+  hts_mutex_init(&fcs_file_mutex);
   TAILQ_INIT(&cached_files);
 }
@@ -634,7 +634,7 @@ http_cookie_set(char *cookie, http_file_t *hf)
   }
 
   if(expire != -1)
-    callout_arm(&cookie_persist_timer, cookie_persist, NULL, 5);
+    callout_arm_worker(&cookie_persist_timer, cookie_persist, NULL, 5);
 
   mystrset(&hc->hc_value, value);
   hc->hc_expire = expire;
@@ -1403,6 +1403,9 @@ http_read_response(http_file_t *hf, struct http_header_list *headers)
 	hf->hf_filesize = i64;
     }
     
+    if(!strcasecmp(argv[0], "Last-Modified"))
+      http_ctime(&hf->hf_mtime, argv[1]);
+
     if(!strcasecmp(argv[0], "Content-Type")) {
       free(hf->hf_content_type);
       hf->hf_content_type = strdup(argv[1]);
@@ -2406,6 +2409,22 @@ http_fsize(fa_handle_t *handle)
 }
 
 
+/**
+ * Stat from what we got when the file was opened
+ */
+static int
+http_fstat(fa_handle_t *handle, struct fa_stat *fs)
+{
+  http_file_t *hf = (http_file_t *)handle;
+
+  memset(fs, 0, sizeof(struct fa_stat));
+  fs->fs_type = CONTENT_FILE;
+  fs->fs_size = hf->hf_filesize;
+  fs->fs_mtime = hf->hf_mtime;
+  return 0;
+}
+
+
 /**
  * Standard unix stat
  */
@@ -2617,6 +2636,7 @@ static fa_protocol_t fa_protocol_http = {
   .fap_read  = http_read,
   .fap_seek  = http_seek,
   .fap_fsize = http_fsize,
+  .fap_fstat = http_fstat,
   .fap_stat  = http_stat,
   .fap_load = http_load,
   .fap_get_last_component = http_get_last_component,
@@ -2639,6 +2659,7 @@ static fa_protocol_t fa_protocol_https = {
   .fap_read  = http_read,
   .fap_seek  = http_seek,
   .fap_fsize = http_fsize,
+  .fap_fstat = http_fstat,
   .fap_stat  = http_stat,
   .fap_load = http_load,
   .fap_get_last_component = http_get_last_component,
@@ -2980,6 +3001,7 @@ static fa_protocol_t fa_protocol_webdav = {
   .fap_read  = http_read,
   .fap_seek  = http_seek,
   .fap_fsize = http_fsize,
+  .fap_fstat = http_fstat,
   .fap_stat  = dav_stat,
   .fap_load = http_load,
   .fap_get_last_component = http_get_last_component,
@@ -3000,6 +3022,7 @@ static fa_protocol_t fa_protocol_webdavs = {
   .fap_read  = http_read,
   .fap_seek  = http_seek,
   .fap_fsize = http_fsize,
+  .fap_fstat = http_fstat,
   .fap_stat  = dav_stat,
   .fap_load = http_load,
   .fap_get_last_component = http_get_last_component,
@@ -3031,6 +3054,8 @@ typedef struct http_read_aux {
 
   void (*decoded_cleanup)(struct http_read_aux *hra);
 
+  http_data_cb_t *data_cb;
+
 } http_read_aux_t;
 
 /**
@@ -3089,6 +3114,21 @@ cleanup_buf(struct http_read_aux *hra)
 }
 
 
+/**
+ *
+ */
+static int
+deliver_callback(http_file_t *hf, struct http_read_aux *hra,
+                 const void *data, int size)
+{
+  if(hra->data_cb(hra->decoded_opaque, data, size)) {
+    snprintf(hra->errbuf, hra->errlen, "Aborted by receiver");
+    return -1;
+  }
+  return 0;
+}
+
+
 /**
  *
  */
@@ -3318,6 +3358,14 @@ http_req(const char *url, ...)
       want_result = 1;
       break;
 
+    case HTTP_TAG_DATA_CALLBACK:
+      assert(want_result == 0);
+      hra.data_cb = va_arg(ap, http_data_cb_t *);
+      hra.decoded_opaque = va_arg(ap, void *);
+      hra.decoded_data = deliver_callback;
+      want_result = 1;
+      break;
+
     case HTTP_TAG_ERRBUF:
       errbuf = va_arg(ap, char *);
       errlen = va_arg(ap, size_t);
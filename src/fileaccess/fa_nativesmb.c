@@ -41,6 +41,8 @@
 #include "networking/net.h"
 #include "misc/str.h"
 #include "misc/callout.h"
+#include "misc/md5.h"
+#include "htsmsg/htsbuf.h"
 
 #define SAMBA_NEED_AUTH ((void *)-1)
 
@@ -54,8 +56,15 @@
 LIST_HEAD(cifs_connection_list, cifs_connection);
 LIST_HEAD(nbt_req_list, nbt_req);
 LIST_HEAD(cifs_tree_list, cifs_tree);
+TAILQ_HEAD(smb_read_seg_queue, smb_read_seg);
 
 static struct cifs_connection_list cifs_connections;
+
+/**
+ * Protects the connection list, tree lists, refcounts and status
+ * fields. It's never held while doing network I/O, that is
+ * serialized per connection by cc_mutex
+ */
 static hts_mutex_t smb_global_mutex;
 
 #define NBT_TIMEOUT 30000
@@ -65,14 +74,11 @@ static hts_mutex_t smb_global_mutex;
  */
 typedef struct nbt_req {
   LIST_ENTRY(nbt_req) nr_link;
-  uint16_t nr_mid;
+  uint64_t nr_mid;
   void *nr_response;
   int nr_response_len;
   int nr_result;
-  LIST_ENTRY(nbt_req) nr_multi_link;
-  int nr_offset;
-  int nr_cnt;
-  int nr_last;
+  int nr_orphan;  // Nobody waits for reply, dispatcher will free it
   int nr_is_trans2;
   int nr_data_count;
 } nbt_req_t;
@@ -93,6 +99,20 @@ typedef struct cifs_connection {
 
   uint16_t cc_mid_generator;
 
+  hts_mutex_t cc_mutex;       // Protects requests, credits and socket writes
+  hts_cond_t cc_reply_cond;   // Signalled (with cc_mutex) on replies
+
+  uint8_t cc_smb2;            // Connection talks SMB2 or later
+  uint8_t cc_large_mtu;       // Multi credit requests supported
+  uint8_t cc_disconnected;    // Dispatch thread has exited
+  uint16_t cc_dialect;
+  uint64_t cc_message_id;
+  uint64_t cc_session_id;
+  uint64_t cc_echo_mid;
+  int cc_credits;
+  int cc_max_read_size;
+  int cc_max_transact_size;
+
   enum {
     CC_CONNECTING,
     CC_RUNNING,
@@ -102,7 +122,7 @@ typedef struct cifs_connection {
   
   hts_thread_t cc_thread;
 
-  hts_cond_t cc_cond;
+  hts_cond_t cc_cond;  // Signalled (with smb_global_mutex) on status change
 
   struct nbt_req_list cc_pending_nbt_requests;
 
@@ -140,7 +160,7 @@ typedef struct cifs_connection {
 typedef struct cifs_tree {
   cifs_connection_t *ct_cc;  // We hold a ref in the connection too
   LIST_ENTRY(cifs_tree) ct_link;
-  int ct_tid;
+  uint32_t ct_tid;
 
   char *ct_share;
   int ct_refcount;
@@ -660,6 +680,392 @@ typedef struct {
 #define TRANS2_SET_PATH_INFORMATION   6
 
 
+
+/**
+ * SMB2 Header (64 bytes)
+ *
+ * SMB2 requests are built as a body only (the structs below that does
+ * not start with a header). The headers (and NBT framing) are added by
+ * smb2_build() so several commands can be compounded in one message
+ */
+typedef struct {
+  uint32_t proto;
+  uint16_t header_length;
+  uint16_t credit_charge;
+  uint32_t status;
+  uint16_t cmd;
+  uint16_t credits;
+  uint32_t flags;
+  uint32_t next_command;
+  uint64_t message_id;
+  uint32_t process_id;
+  uint32_t tree_id;
+  uint64_t session_id;
+  uint8_t signature[16];
+} __attribute__((packed)) SMB2_t;
+
+#define SMB2_FLAGS_SERVER_TO_REDIR    0x00000001
+#define SMB2_FLAGS_ASYNC_COMMAND      0x00000002
+#define SMB2_FLAGS_RELATED_OPERATIONS 0x00000004
+
+
+typedef struct {
+  uint16_t structure_size;
+  uint16_t dialect_count;
+  uint16_t security_mode;
+  uint16_t reserved;
+  uint32_t capabilities;
+  uint8_t client_guid[16];
+  uint64_t client_start_time;
+  uint16_t dialects[0];
+} __attribute__((packed)) SMB2_NEGOTIATE_req_t;
+
+typedef struct {
+  SMB2_t hdr;
+  uint16_t structure_size;
+  uint16_t security_mode;
+  uint16_t dialect;
+  uint16_t negotiate_context_count;
+  uint8_t server_guid[16];
+  uint32_t capabilities;
+  uint32_t max_transact_size;
+  uint32_t max_read_size;
+  uint32_t max_write_size;
+  uint64_t system_time;
+  uint64_t server_start_time;
+  uint16_t security_buffer_offset;
+  uint16_t security_buffer_length;
+  uint32_t negotiate_context_offset;
+} __attribute__((packed)) SMB2_NEGOTIATE_resp_t;
+
+#define SMB2_NEGOTIATE_SIGNING_ENABLED  0x0001
+#define SMB2_NEGOTIATE_SIGNING_REQUIRED 0x0002
+
+#define SMB2_GLOBAL_CAP_LARGE_MTU       0x00000004
+
+
+typedef struct {
+  uint16_t structure_size;
+  uint8_t flags;
+  uint8_t security_mode;
+  uint32_t capabilities;
+  uint32_t channel;
+  uint16_t security_buffer_offset;
+  uint16_t security_buffer_length;
+  uint64_t previous_session_id;
+  uint8_t buffer[0];
+} __attribute__((packed)) SMB2_SESSION_SETUP_req_t;
+
+typedef struct {
+  SMB2_t hdr;
+  uint16_t structure_size;
+  uint16_t session_flags;
+  uint16_t security_buffer_offset;
+  uint16_t security_buffer_length;
+} __attribute__((packed)) SMB2_SESSION_SETUP_resp_t;
+
+#define SMB2_SESSION_FLAG_IS_GUEST 0x0001
+
+
+typedef struct {
+  uint16_t structure_size;
+  uint16_t reserved;
+  uint16_t path_offset;
+  uint16_t path_length;
+  uint8_t buffer[0];
+} __attribute__((packed)) SMB2_TREE_CONNECT_req_t;
+
+
+typedef struct {
+  uint16_t structure_size;
+  uint8_t security_flags;
+  uint8_t requested_oplock_level;
+  uint32_t impersonation_level;
+  uint64_t smb_create_flags;
+  uint64_t reserved;
+  uint32_t desired_access;
+  uint32_t file_attributes;
+  uint32_t share_access;
+  uint32_t create_disposition;
+  uint32_t create_options;
+  uint16_t name_offset;
+  uint16_t name_length;
+  uint32_t create_contexts_offset;
+  uint32_t create_contexts_length;
+  uint8_t buffer[0];
+} __attribute__((packed)) SMB2_CREATE_req_t;
+
+typedef struct {
+  SMB2_t hdr;
+  uint16_t structure_size;
+  uint8_t oplock_level;
+  uint8_t flags;
+  uint32_t create_action;
+  int64_t created;
+  int64_t last_access;
+  int64_t last_write;
+  int64_t change;
+  uint64_t allocation_size;
+  uint64_t file_size;
+  uint32_t file_attributes;
+  uint32_t reserved;
+  uint8_t file_id[16];
+  uint32_t create_contexts_offset;
+  uint32_t create_contexts_length;
+} __attribute__((packed)) SMB2_CREATE_resp_t;
+
+#define FILE_READ_DATA         0x00000001
+#define FILE_WRITE_DATA        0x00000002
+#define FILE_LIST_DIRECTORY    0x00000001
+#define FILE_READ_EA           0x00000008
+#define FILE_WRITE_EA          0x00000010
+#define FILE_READ_ATTRIBUTES   0x00000080
+#define DELETE                 0x00010000
+#define READ_CONTROL           0x00020000
+#define SYNCHRONIZE            0x00100000
+
+#define FILE_SHARE_READ        0x00000001
+#define FILE_SHARE_WRITE       0x00000002
+#define FILE_SHARE_DELETE      0x00000004
+
+#define FILE_OPEN              0x00000001
+
+#define FILE_DIRECTORY_FILE     0x00000001
+#define FILE_NON_DIRECTORY_FILE 0x00000040
+#define FILE_DELETE_ON_CLOSE    0x00001000
+
+
+typedef struct {
+  uint16_t structure_size;
+  uint16_t flags;
+  uint32_t reserved;
+  uint8_t file_id[16];
+} __attribute__((packed)) SMB2_CLOSE_req_t;
+
+
+typedef struct {
+  uint16_t structure_size;
+  uint8_t padding;
+  uint8_t flags;
+  uint32_t length;
+  uint64_t offset;
+  uint8_t file_id[16];
+  uint32_t minimum_count;
+  uint32_t channel;
+  uint32_t remaining_bytes;
+  uint16_t read_channel_info_offset;
+  uint16_t read_channel_info_length;
+  uint8_t buffer[1];
+} __attribute__((packed)) SMB2_READ_req_t;
+
+typedef struct {
+  SMB2_t hdr;
+  uint16_t structure_size;
+  uint8_t data_offset;
+  uint8_t reserved;
+  uint32_t data_length;
+  uint32_t data_remaining;
+  uint32_t reserved2;
+} __attribute__((packed)) SMB2_READ_resp_t;
+
+
+typedef struct {
+  uint16_t structure_size;
+  uint8_t file_info_class;
+  uint8_t flags;
+  uint32_t file_index;
+  uint8_t file_id[16];
+  uint16_t file_name_offset;
+  uint16_t file_name_length;
+  uint32_t output_buffer_length;
+  uint8_t buffer[0];
+} __attribute__((packed)) SMB2_QUERY_DIRECTORY_req_t;
+
+/**
+ * Response for both QUERY_DIRECTORY and QUERY_INFO
+ */
+typedef struct {
+  SMB2_t hdr;
+  uint16_t structure_size;
+  uint16_t output_buffer_offset;
+  uint32_t output_buffer_length;
+} __attribute__((packed)) SMB2_QUERY_resp_t;
+
+#define FILE_DIRECTORY_INFORMATION 1
+#define FILE_FULL_EA_INFORMATION   15
+
+typedef struct {
+  uint32_t next_entry_offset;
+  uint32_t file_index;
+  int64_t created;
+  int64_t last_access;
+  int64_t last_write;
+  int64_t change;
+  uint64_t file_size;
+  uint64_t allocation_size;
+  uint32_t file_attributes;
+  uint32_t file_name_len;
+  uint8_t filename[0];
+} __attribute__((packed)) SMB2_DIRECTORY_INFO_t;
+
+
+typedef struct {
+  uint16_t structure_size;
+  uint8_t info_type;
+  uint8_t file_info_class;
+  uint32_t output_buffer_length;
+  uint16_t input_buffer_offset;
+  uint16_t reserved;
+  uint32_t input_buffer_length;
+  uint32_t additional_information;
+  uint32_t flags;
+  uint8_t file_id[16];
+  uint8_t buffer[0];
+} __attribute__((packed)) SMB2_QUERY_INFO_req_t;
+
+typedef struct {
+  uint16_t structure_size;
+  uint8_t info_type;
+  uint8_t file_info_class;
+  uint32_t buffer_length;
+  uint16_t buffer_offset;
+  uint16_t reserved;
+  uint32_t additional_information;
+  uint8_t file_id[16];
+  uint8_t buffer[0];
+} __attribute__((packed)) SMB2_SET_INFO_req_t;
+
+#define SMB2_0_INFO_FILE 1
+
+
+typedef struct {
+  uint16_t structure_size;
+  uint16_t reserved;
+  uint32_t ctl_code;
+  uint8_t file_id[16];
+  uint32_t input_offset;
+  uint32_t input_count;
+  uint32_t max_input_response;
+  uint32_t output_offset;
+  uint32_t output_count;
+  uint32_t max_output_response;
+  uint32_t flags;
+  uint32_t reserved2;
+  uint8_t buffer[0];
+} __attribute__((packed)) SMB2_IOCTL_req_t;
+
+typedef struct {
+  SMB2_t hdr;
+  uint16_t structure_size;
+  uint16_t reserved;
+  uint32_t ctl_code;
+  uint8_t file_id[16];
+  uint32_t input_offset;
+  uint32_t input_count;
+  uint32_t output_offset;
+  uint32_t output_count;
+  uint32_t flags;
+  uint32_t reserved2;
+} __attribute__((packed)) SMB2_IOCTL_resp_t;
+
+#define FSCTL_PIPE_TRANSCEIVE  0x0011c017
+#define SMB2_0_IOCTL_IS_FSCTL  0x00000001
+
+
+typedef struct {
+  uint16_t structure_size;
+  uint16_t reserved;
+} __attribute__((packed)) SMB2_ECHO_req_t;
+
+
+#define SMB2_PROTO 0x424d53fe
+
+#define SMB2_NEGOTIATE       0x0000
+#define SMB2_SESSION_SETUP   0x0001
+#define SMB2_TREE_CONNECT    0x0003
+#define SMB2_CREATE          0x0005
+#define SMB2_CLOSE           0x0006
+#define SMB2_READ            0x0008
+#define SMB2_IOCTL           0x000b
+#define SMB2_ECHO            0x000d
+#define SMB2_QUERY_DIRECTORY 0x000e
+#define SMB2_QUERY_INFO      0x0010
+#define SMB2_SET_INFO        0x0011
+
+#define STATUS_PENDING                  0x00000103
+#define STATUS_BUFFER_OVERFLOW          0x80000005
+#define STATUS_NO_MORE_FILES            0x80000006
+#define STATUS_END_OF_FILE              0xc0000011
+#define STATUS_MORE_PROCESSING_REQUIRED 0xc0000016
+
+#define SMB2_MAX_IO_SIZE     (1024 * 1024)
+#define SMB2_OPEN_READ_SIZE  65536
+#define SMB2_CREDITS_WANTED  128
+
+
+/**
+ * NTLMSSP, used for SMB2 session setup
+ */
+typedef struct {
+  uint16_t len;
+  uint16_t maxlen;
+  uint32_t offset;
+} __attribute__((packed)) NTLMSSP_field_t;
+
+typedef struct {
+  uint8_t signature[8];
+  uint32_t type;
+  uint32_t flags;
+  NTLMSSP_field_t domain;
+  NTLMSSP_field_t workstation;
+} __attribute__((packed)) NTLMSSP_NEGOTIATE_t;
+
+typedef struct {
+  uint8_t signature[8];
+  uint32_t type;
+  NTLMSSP_field_t target_name;
+  uint32_t flags;
+  uint8_t challenge[8];
+  uint8_t reserved[8];
+  NTLMSSP_field_t target_info;
+} __attribute__((packed)) NTLMSSP_CHALLENGE_t;
+
+typedef struct {
+  uint8_t signature[8];
+  uint32_t type;
+  NTLMSSP_field_t lm_response;
+  NTLMSSP_field_t nt_response;
+  NTLMSSP_field_t domain;
+  NTLMSSP_field_t username;
+  NTLMSSP_field_t workstation;
+  NTLMSSP_field_t session_key;
+  uint32_t flags;
+  uint8_t data[0];
+} __attribute__((packed)) NTLMSSP_AUTHENTICATE_t;
+
+#define NTLMSSP_NEGOTIATE_UNICODE                  0x00000001
+#define NTLMSSP_REQUEST_TARGET                     0x00000004
+#define NTLMSSP_NEGOTIATE_NTLM                     0x00000200
+#define NTLMSSP_NEGOTIATE_ALWAYS_SIGN              0x00008000
+#define NTLMSSP_NEGOTIATE_EXTENDED_SESSIONSECURITY 0x00080000
+#define NTLMSSP_NEGOTIATE_TARGET_INFO              0x00800000
+#define NTLMSSP_NEGOTIATE_128                      0x20000000
+#define NTLMSSP_NEGOTIATE_56                       0x80000000
+
+#define NTLMSSP_CLIENT_FLAGS (NTLMSSP_NEGOTIATE_UNICODE | \
+                              NTLMSSP_REQUEST_TARGET | \
+                              NTLMSSP_NEGOTIATE_NTLM | \
+                              NTLMSSP_NEGOTIATE_ALWAYS_SIGN | \
+                              NTLMSSP_NEGOTIATE_EXTENDED_SESSIONSECURITY | \
+                              NTLMSSP_NEGOTIATE_TARGET_INFO | \
+                              NTLMSSP_NEGOTIATE_128 | \
+                              NTLMSSP_NEGOTIATE_56)
+
+#define NTLMSSP_AV_EOL               0
+#define NTLMSSP_AV_NB_DOMAIN_NAME    2
+#define NTLMSSP_AV_TIMESTAMP         7
+
+
 #if defined(__BIG_ENDIAN__)
 
 #define htole_64(v) __builtin_bswap64(v)
@@ -930,7 +1336,7 @@ nbt_write(cifs_connection_t *cc, void *buf, int len)
   NBT_t *nbt = buf;
 
   nbt->msg = NBT_SESSION_MSG;
-  nbt->flags = 0;
+  nbt->flags = (len - 4) >> 16; // Length extension, SMB2 can exceed 64k
   nbt->length = htons(len - 4);
   tcp_write_data(cc->cc_tc, buf, len);
   return 0;
@@ -982,6 +1388,8 @@ cifs_maybe_destroy(cifs_connection_t *cc)
   callout_disarm(&cc->cc_timer);
 
   hts_cond_destroy(&cc->cc_cond);
+  hts_cond_destroy(&cc->cc_reply_cond);
+  hts_mutex_destroy(&cc->cc_mutex);
   free(cc->cc_hostname);
   free(cc);
 }
@@ -1002,78 +1410,243 @@ cifs_release_connection(cifs_connection_t *cc)
 /**
  *
  */
+static void
+backslashify(char *str)
+{
+  while(*str) {
+    if(*str == '/')
+      *str = '\\';
+    str++;
+  }
+}
+
+
+/**
+ * One command in a SMB2 message
+ */
+typedef struct smb2_cmd {
+  int sc_cmd;
+  const void *sc_body;
+  int sc_len;
+  int sc_payload;  // Bytes transfered by command, determines credit charge
+} smb2_cmd_t;
+
+
+/**
+ * Number of credits consumed by a request transfering 'payload' bytes
+ */
 static int
-smb_neg_proto(cifs_connection_t *cc, char *errbuf, size_t errlen)
+smb2_credit_charge(const cifs_connection_t *cc, int payload)
 {
-  const char *dialect = "NT LM 0.12";
-  SMB_NEG_PROTOCOL_req_t *req;
-  SMB_NEG_PROTOCOL_reply_t *reply;
-  void *rbuf;
+  if(!cc->cc_large_mtu)
+    return 1;
+  return MAX(1, (payload + 65535) / 65536);
+}
 
-  int len = strlen(dialect) + 1;
-  int tlen = sizeof(SMB_NEG_PROTOCOL_req_t) + 1 + len;
 
-  req = alloca(tlen);
-  memset(req, 0, tlen);
+/**
+ *
+ */
+static void
+smb2_init_header(cifs_connection_t *cc, SMB2_t *h, int cmd, int charge,
+                 uint32_t tree_id)
+{
+  int credits = charge;
+
+  // Ask for more credits until we have a comfortable amount
+  if(cc->cc_credits < SMB2_CREDITS_WANTED)
+    credits += 16;
+
+  h->proto = htole_32(SMB2_PROTO);
+  h->header_length = htole_16(sizeof(SMB2_t));
+  h->credit_charge = htole_16(cc->cc_large_mtu ? charge : 0);
+  h->cmd = htole_16(cmd);
+  h->credits = htole_16(credits);
+  h->message_id = htole_64(cc->cc_message_id);
+  h->process_id = htole_32(0xfeff);
+  h->tree_id = htole_32(tree_id);
+  h->session_id = htole_64(cc->cc_session_id);
+
+  cc->cc_message_id += charge;
+}
 
-  smb_init_header(cc, &req->hdr, SMB_NEG_PROTOCOL,
-		  SMB_FLAGS_CASELESS_PATHNAMES, SMB_FLAGS2_32BIT_STATUS,
-		  0, 1);
 
-  req->wordcount = 0;
-  req->bytecount = htole_16(len + 1);
-  req->protos[0] = 2;
-  memcpy(req->protos + 1, dialect, len);
+/**
+ * Build a NBT message with one or more SMB2 commands
+ *
+ * All commands but the first are flagged as related operations, ie.
+ * they can refer to the file created by the first command using
+ * an all ones file id.
+ *
+ * The message IDs assigned are returned in 'mids'
+ */
+static void *
+smb2_build(cifs_connection_t *cc, uint32_t tree_id,
+           const smb2_cmd_t *cmds, int num, uint64_t *mids, int *lenp)
+{
+  int i, len, total = sizeof(NBT_t);
+  uint8_t *buf;
 
-  nbt_write(cc, req, tlen);
+  for(i = 0; i < num; i++) {
+    len = sizeof(SMB2_t) + cmds[i].sc_len;
+    total += i == num - 1 ? len : (len + 7) & ~7;
+  }
 
-  if(nbt_read(cc, &rbuf, &len)) {
-    snprintf(errbuf, errlen, "Socket read error during negotiation");
-    return -1;
+  buf = calloc(1, total);
+  total = sizeof(NBT_t);
+
+  for(i = 0; i < num; i++) {
+    SMB2_t *h = (SMB2_t *)(buf + total);
+
+    mids[i] = cc->cc_message_id;
+    smb2_init_header(cc, h, cmds[i].sc_cmd,
+                     smb2_credit_charge(cc, cmds[i].sc_payload), tree_id);
+
+    if(i > 0)
+      h->flags = htole_32(SMB2_FLAGS_RELATED_OPERATIONS);
+
+    memcpy(h + 1, cmds[i].sc_body, cmds[i].sc_len);
+
+    len = sizeof(SMB2_t) + cmds[i].sc_len;
+    if(i != num - 1) {
+      len = (len + 7) & ~7;
+      h->next_command = htole_32(len);
+    }
+    total += len;
   }
-  reply = rbuf;
+  *lenp = total;
+  return buf;
+}
 
-  if(len < sizeof(SMB_NEG_PROTOCOL_reply_t) || reply->wordcount != 17) {
+
+/**
+ * Synchronous request and reply. Only used during connection setup
+ * before the dispatch thread is running
+ */
+static int
+smb2_sync_req(cifs_connection_t *cc, int cmd, const void *body, int len,
+              void **rbufp, int *rlenp)
+{
+  const smb2_cmd_t sc = {cmd, body, len, 0};
+  uint64_t mid;
+  int tlen;
+  void *buf;
+  const SMB2_t *h;
+
+  cc->cc_credits--;
+  buf = smb2_build(cc, 0, &sc, 1, &mid, &tlen);
+  nbt_write(cc, buf, tlen);
+  free(buf);
+
+  while(1) {
+    if(nbt_read(cc, rbufp, rlenp))
+      return -1;
+
+    h = *rbufp;
+    if(*rlenp < sizeof(SMB2_t) || h->proto != htole_32(SMB2_PROTO)) {
+      free(*rbufp);
+      return -1;
+    }
+
+    cc->cc_credits += letoh_16(h->credits);
+
+    if(letoh_64(h->message_id) == mid &&
+       !(h->status == htole_32(STATUS_PENDING) &&
+         h->flags & htole_32(SMB2_FLAGS_ASYNC_COMMAND)))
+      return 0;
+
+    free(*rbufp);
+  }
+}
+
+
+/**
+ * Server replied to our SMB1 negotiate with SMB2
+ */
+static int
+smb2_negotiate(cifs_connection_t *cc, void *rbuf, int len,
+               char *errbuf, size_t errlen)
+{
+  const SMB2_NEGOTIATE_resp_t *reply = rbuf;
+  // No SMB3 dialects, they are of no use without signing
+  static const uint16_t dialects[] = {0x0202, 0x0210};
+  const int ndialects = sizeof(dialects) / sizeof(dialects[0]);
+  int i;
+
+  cc->cc_smb2 = 1;
+  cc->cc_message_id = 1; // The SMB1 negotiate counts as message 0
+  cc->cc_credits = letoh_16(reply->hdr.credits);
+
+  if(len >= sizeof(SMB2_NEGOTIATE_resp_t) &&
+     letoh_16(reply->dialect) == 0x02ff) {
+    // Wildcard dialect, server wants a real SMB2 negotiate for 2.1+
+    int tlen = sizeof(SMB2_NEGOTIATE_req_t) + sizeof(dialects);
+    SMB2_NEGOTIATE_req_t *req = alloca(tlen);
+
+    free(rbuf);
+
+    memset(req, 0, tlen);
+    req->structure_size = htole_16(36);
+    req->dialect_count = htole_16(ndialects);
+    req->security_mode = htole_16(SMB2_NEGOTIATE_SIGNING_ENABLED);
+    for(i = 0; i < 16; i++)
+      req->client_guid[i] = rand();
+    for(i = 0; i < ndialects; i++)
+      req->dialects[i] = htole_16(dialects[i]);
+
+    if(smb2_sync_req(cc, SMB2_NEGOTIATE, req, tlen, &rbuf, &len)) {
+      snprintf(errbuf, errlen, "Socket read error during negotiation");
+      return -1;
+    }
+    reply = rbuf;
+  }
+
+  if(len < sizeof(SMB2_NEGOTIATE_resp_t)) {
     snprintf(errbuf, errlen, "Malformed response %d bytes during negotiation",
 	     len);
     free(rbuf);
     return -1;
   }
 
-  if(reply->hdr.errorcode) {
+  if(reply->hdr.status) {
     snprintf(errbuf, errlen, "Negotiation error 0x%08x",
-	     (int)letoh_32(reply->hdr.errorcode));
+	     (int)letoh_32(reply->hdr.status));
     free(rbuf);
     return -1;
   }
 
-  if(letoh_32(reply->capabilities) & SERVER_CAP_UNICODE)
-    cc->cc_unicode = 1;
-  else
-    cc->cc_unicode = 0;
-
-  cc->cc_bpc = cc->cc_unicode + 1;
+  cc->cc_dialect = letoh_16(reply->dialect);
 
-  if(letoh_32(reply->capabilities) & SERVER_CAP_NT_SMBS)
-    cc->cc_ntsmb = 1;
-  else {
-    snprintf(errbuf, errlen, "Server does not support NTSMB");
+  if(cc->cc_dialect < 0x0202 || cc->cc_dialect == 0x02ff) {
+    snprintf(errbuf, errlen, "Unsupported SMB2 dialect 0x%04x",
+             cc->cc_dialect);
     free(rbuf);
     return -1;
   }
 
-  cc->cc_session_key = reply->session_key;
-  cc->cc_security_mode = reply->security_mode;
+  if(letoh_16(reply->security_mode) & SMB2_NEGOTIATE_SIGNING_REQUIRED) {
+    snprintf(errbuf, errlen, "Server requires SMB signing");
+    free(rbuf);
+    return -1;
+  }
 
-  cc->cc_max_buffer_size = MIN(65000, letoh_32(reply->max_buffer_size));
-  cc->cc_max_mpx_count   = letoh_16(reply->max_mpx_count);
+  cc->cc_large_mtu = cc->cc_dialect >= 0x0210 &&
+    letoh_32(reply->capabilities) & SMB2_GLOBAL_CAP_LARGE_MTU;
 
-  len -= sizeof(SMB_NEG_PROTOCOL_reply_t);
+  cc->cc_max_read_size = MIN(letoh_32(reply->max_read_size),
+                             cc->cc_large_mtu ? SMB2_MAX_IO_SIZE : 65536);
+  cc->cc_max_transact_size = MIN(letoh_32(reply->max_transact_size), 65536);
 
-  memcpy(cc->cc_challenge_key, reply->data, 8);
-  len -= 8;
+  // SMB2 is always unicode and user level security
+  cc->cc_unicode = 1;
+  cc->cc_bpc = 2;
+  cc->cc_ntsmb = 1;
+  cc->cc_security_mode = SECURITY_USER_LEVEL;
 
-  ucs2_to_utf8(cc->cc_domain, sizeof(cc->cc_domain), reply->data + 8, len, 1);
+  SMBTRACE("%s:%d SMB dialect %x.%02x, max read %d bytes",
+           cc->cc_hostname, cc->cc_port,
+           cc->cc_dialect >> 8, cc->cc_dialect & 0xff,
+           cc->cc_max_read_size);
   free(rbuf);
   return 0;
 }
@@ -1083,58 +1656,330 @@ smb_neg_proto(cifs_connection_t *cc, char *errbuf, size_t errlen)
  *
  */
 static int
-smb_setup_andX(cifs_connection_t *cc, char *errbuf, size_t errlen,
-	       int non_interactive, int as_guest)
+smb_neg_proto(cifs_connection_t *cc, char *errbuf, size_t errlen,
+              int smb1_only)
 {
-  SMB_SETUP_ANDX_req_t *req;
-  SMB_SETUP_ANDX_reply_t *reply;
-
-  char *username = NULL;
-  const char *os = "Unix";
-  const char *lanmgr = "Showtime";
+  // Offering the SMB2 dialects makes SMB2 capable servers reply with SMB2
+  static const char smb2_dialects[] =
+    "\002NT LM 0.12\000\002SMB 2.002\000\002SMB 2.???";
+  static const char smb1_dialects[] =
+    "\002NT LM 0.12";
+  const char *dialects = smb1_only ? smb1_dialects : smb2_dialects;
+  const int dlen = smb1_only ? sizeof(smb1_dialects) : sizeof(smb2_dialects);
+  SMB_NEG_PROTOCOL_req_t *req;
+  SMB_NEG_PROTOCOL_reply_t *reply;
+  void *rbuf;
 
-  char *domain = NULL;
+  int len;
+  int tlen = sizeof(SMB_NEG_PROTOCOL_req_t) + dlen;
 
+  req = alloca(tlen);
+  memset(req, 0, tlen);
 
-  size_t ulen = 0;
-  size_t olen = utf8_to_smb(cc, NULL, os);
-  size_t llen = utf8_to_smb(cc, NULL, lanmgr);
+  smb_init_header(cc, &req->hdr, SMB_NEG_PROTOCOL,
+		  SMB_FLAGS_CASELESS_PATHNAMES, SMB_FLAGS2_32BIT_STATUS,
+		  0, 1);
 
-  void *rbuf;
-  int rlen;
+  req->wordcount = 0;
+  req->bytecount = htole_16(dlen);
+  memcpy(req->protos, dialects, dlen);
 
-  const char *retry_reason = NULL;
-  char reason[256];
+  nbt_write(cc, req, tlen);
 
-  uint8_t password[24];
-  int password_len;
+  if(nbt_read(cc, &rbuf, &len)) {
+    snprintf(errbuf, errlen, "Socket read error during negotiation");
+    return -1;
+  }
+
+  if(len >= sizeof(SMB2_t) &&
+     ((const SMB2_t *)rbuf)->proto == htole_32(SMB2_PROTO))
+    return smb2_negotiate(cc, rbuf, len, errbuf, errlen);
+
+  reply = rbuf;
+
+  if(len < sizeof(SMB_NEG_PROTOCOL_reply_t) || reply->wordcount != 17) {
+    snprintf(errbuf, errlen, "Malformed response %d bytes during negotiation",
+	     len);
+    free(rbuf);
+    return -1;
+  }
+
+  if(reply->hdr.errorcode) {
+    snprintf(errbuf, errlen, "Negotiation error 0x%08x",
+	     (int)letoh_32(reply->hdr.errorcode));
+    free(rbuf);
+    return -1;
+  }
+
+  if(letoh_32(reply->capabilities) & SERVER_CAP_UNICODE)
+    cc->cc_unicode = 1;
+  else
+    cc->cc_unicode = 0;
+
+  cc->cc_bpc = cc->cc_unicode + 1;
+
+  if(letoh_32(reply->capabilities) & SERVER_CAP_NT_SMBS)
+    cc->cc_ntsmb = 1;
+  else {
+    snprintf(errbuf, errlen, "Server does not support NTSMB");
+    free(rbuf);
+    return -1;
+  }
+
+  cc->cc_session_key = reply->session_key;
+  cc->cc_security_mode = reply->security_mode;
+
+  cc->cc_max_buffer_size = MIN(65000, letoh_32(reply->max_buffer_size));
+  cc->cc_max_mpx_count   = letoh_16(reply->max_mpx_count);
+
+  len -= sizeof(SMB_NEG_PROTOCOL_reply_t);
+
+  memcpy(cc->cc_challenge_key, reply->data, 8);
+  len -= 8;
+
+  ucs2_to_utf8(cc->cc_domain, sizeof(cc->cc_domain), reply->data + 8, len, 1);
+  free(rbuf);
+  return 0;
+}
+
+
+/**
+ * HMAC-MD5 of d1 followed by d2 (which may be NULL)
+ */
+static void
+hmac_md5(const uint8_t *key, int keylen, const void *d1, int l1,
+         const void *d2, int l2, uint8_t *digest)
+{
+  uint8_t pad[64];
+  uint8_t inner[16];
+  int i;
+
+  assert(keylen <= sizeof(pad));
+  memset(pad, 0, sizeof(pad));
+  memcpy(pad, key, keylen);
+  for(i = 0; i < sizeof(pad); i++)
+    pad[i] ^= 0x36;
+
+  md5_decl(ctx);
+  md5_init(ctx);
+  md5_update(ctx, pad, sizeof(pad));
+  md5_update(ctx, d1, l1);
+  if(d2 != NULL)
+    md5_update(ctx, d2, l2);
+  md5_final(ctx, inner);
+
+  for(i = 0; i < sizeof(pad); i++)
+    pad[i] ^= 0x36 ^ 0x5c;
+
+  md5_init(ctx);
+  md5_update(ctx, pad, sizeof(pad));
+  md5_update(ctx, inner, sizeof(inner));
+  md5_final(ctx, digest);
+}
+
+
+/**
+ * Locate NTLMSSP challenge in security blob. It might be wrapped in
+ * SPNEGO, but we don't need to parse that just to find it
+ */
+static const NTLMSSP_CHALLENGE_t *
+ntlmssp_find_challenge(const uint8_t *buf, int len, int *lenp)
+{
+  int i;
+  for(i = 0; i + (int)sizeof(NTLMSSP_CHALLENGE_t) <= len; i++) {
+    if(!memcmp(buf + i, "NTLMSSP\0\2\0\0\0", 12)) {
+      *lenp = len - i;
+      return (const void *)(buf + i);
+    }
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static const uint8_t *
+ntlmssp_target_info(const NTLMSSP_CHALLENGE_t *ch, int len, int *tilenp)
+{
+  int off = letoh_32(ch->target_info.offset);
+  int tilen = letoh_16(ch->target_info.len);
+
+  if(off < sizeof(NTLMSSP_CHALLENGE_t) || off + tilen > len)
+    return NULL;
+  *tilenp = tilen;
+  return (const uint8_t *)ch + off;
+}
+
+
+/**
+ * Find attribute/value pair in target info
+ */
+static const uint8_t *
+ntlmssp_av_find(const uint8_t *ti, int len, int id, int *lenp)
+{
+  while(len >= 4) {
+    int avid  = ti[0] | ti[1] << 8;
+    int avlen = ti[2] | ti[3] << 8;
+
+    if(avid == NTLMSSP_AV_EOL || avlen > len - 4)
+      break;
+
+    if(avid == id) {
+      *lenp = avlen;
+      return ti + 4;
+    }
+    ti  += 4 + avlen;
+    len -= 4 + avlen;
+  }
+  return NULL;
+}
+
+
+/**
+ * Append 'data' to NTLMSSP message and fill in field descriptor
+ */
+static void
+ntlmssp_put(void *msg, NTLMSSP_field_t *f, int *offp, const void *data,
+            int len)
+{
+  memcpy(msg + *offp, data, len);
+  f->len = f->maxlen = htole_16(len);
+  f->offset = htole_32(*offp);
+  *offp += len;
+}
+
+
+/**
+ * Build NTLMSSP AUTHENTICATE message with NTLMv2 responses
+ */
+static void *
+ntlmssp_authenticate(const NTLMSSP_CHALLENGE_t *ch, int chlen,
+                     const char *username, const char *domain,
+                     const char *password, int *lenp)
+{
+  const uint8_t *ti, *ts;
+  int tilen, tslen, i;
+  uint8_t nthash[16], ntowf[16], lm[24];
+  uint64_t timestamp;
+
+  if((ti = ntlmssp_target_info(ch, chlen, &tilen)) == NULL)
+    return NULL;
+
+  ts = ntlmssp_av_find(ti, tilen, NTLMSSP_AV_TIMESTAMP, &tslen);
+  if(ts != NULL && tslen == 8) {
+    memcpy(&timestamp, ts, 8);
+  } else {
+    ts = NULL;
+    timestamp = htole_64((time(NULL) + 11644473600LL) * 10000000LL);
+  }
+
+  // NTOWFv2 is keyed on upper case username (only ASCII folded) + domain
+  char *ud = alloca(strlen(username) + strlen(domain) + 1);
+  for(i = 0; username[i]; i++)
+    ud[i] = username[i] >= 'a' && username[i] <= 'z' ?
+      username[i] - 32 : username[i];
+  strcpy(ud + i, domain);
+
+  int udlen = utf8_to_ucs2(NULL, ud, 1);
+  uint8_t *ud16 = alloca(udlen);
+  utf8_to_ucs2(ud16, ud, 1);
+
+  NTLM_hash(password, nthash);
+  hmac_md5(nthash, 16, ud16, udlen - 2, NULL, 0, ntowf);
+
+  // NTLMv2 response is HMAC of server challenge + blob, followed by blob
+  int bloblen = 28 + tilen + 4;
+  uint8_t *nt = alloca(16 + bloblen);
+  uint8_t *blob = nt + 16;
+
+  memset(blob, 0, bloblen);
+  blob[0] = 1;
+  blob[1] = 1;
+  memcpy(blob + 8, &timestamp, 8);
+  for(i = 0; i < 8; i++)
+    blob[16 + i] = rand();
+  memcpy(blob + 28, ti, tilen);
+
+  hmac_md5(ntowf, 16, ch->challenge, 8, blob, bloblen, nt);
+
+  if(ts != NULL) {
+    // Server sent timestamp, LMv2 should not be sent
+    memset(lm, 0, sizeof(lm));
+  } else {
+    hmac_md5(ntowf, 16, ch->challenge, 8, blob + 16, 8, lm);
+    memcpy(lm + 16, blob + 16, 8);
+  }
+
+  int dlen = utf8_to_ucs2(NULL, domain, 1);
+  uint8_t *d16 = alloca(dlen);
+  utf8_to_ucs2(d16, domain, 1);
+
+  int ulen = utf8_to_ucs2(NULL, username, 1);
+  uint8_t *u16 = alloca(ulen);
+  utf8_to_ucs2(u16, username, 1);
+
+  int off = sizeof(NTLMSSP_AUTHENTICATE_t);
+  int tlen = off + dlen - 2 + ulen - 2 + sizeof(lm) + 16 + bloblen;
+  NTLMSSP_AUTHENTICATE_t *a = calloc(1, tlen);
+
+  memcpy(a->signature, "NTLMSSP", 8);
+  a->type = htole_32(3);
+  a->flags = htole_32(NTLMSSP_CLIENT_FLAGS & letoh_32(ch->flags));
+
+  ntlmssp_put(a, &a->domain,      &off, d16, dlen - 2);
+  ntlmssp_put(a, &a->username,    &off, u16, ulen - 2);
+  ntlmssp_put(a, &a->workstation, &off, NULL, 0);
+  ntlmssp_put(a, &a->lm_response, &off, lm, sizeof(lm));
+  ntlmssp_put(a, &a->nt_response, &off, nt, 16 + bloblen);
+  ntlmssp_put(a, &a->session_key, &off, NULL, 0);
+  assert(off == tlen);
+
+  *lenp = tlen;
+  return a;
+}
+
+
+/**
+ * Get credentials for session setup
+ *
+ * Returns 0 if ok, -1 if user rejected and -2 if we need to ask user
+ * but are not allowed to
+ */
+static int
+cifs_credentials(cifs_connection_t *cc, const char *retry_reason,
+                 int non_interactive, int as_guest,
+                 char **usernamep, char **passwordp, char **domainp,
+                 char *errbuf, size_t errlen)
+{
+  char *domain;
 
  again:
-  password[0] = 0;
-  password_len = 1;
-  free(domain);
   domain = strdup(cc->cc_domain[0] ? (char *)cc->cc_domain : "WORKGROUP");
-  char *password_cleartext;
 
   if(cc->cc_security_mode & SECURITY_USER_LEVEL && !as_guest) {
     char id[256];
     char name[256];
 
-    if(retry_reason && non_interactive)
+    if(retry_reason && non_interactive) {
+      free(domain);
       return -2;
+    }
 
     snprintf(id, sizeof(id), "smb:connection:%s:%d",
 	     cc->cc_hostname, cc->cc_port);
 
     snprintf(name, sizeof(name), "Samba server '%s'", cc->cc_hostname);
 
-    int r = keyring_lookup(id, &username, &password_cleartext, &domain, NULL,
+    *usernamep = NULL;
+    int r = keyring_lookup(id, usernamep, passwordp, &domain, NULL,
 			   name, retry_reason,
 			   (retry_reason ? KEYRING_QUERY_USER : 0) |
 			   KEYRING_SHOW_REMEMBER_ME | KEYRING_REMEMBER_ME_SET);
 
     if(r == 1) {
       retry_reason = "Login required";
+      free(domain);
       goto again;
     }
 
@@ -1152,9 +1997,54 @@ smb_setup_andX(cifs_connection_t *cc, char *errbuf, size_t errlen,
     assert(r == 0);
 
   } else {
-    username = strdup("guest");
-    password_cleartext = strdup("");
+    *usernamep = strdup("guest");
+    *passwordp = strdup("");
   }
+  *domainp = domain;
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int
+smb_setup_andX(cifs_connection_t *cc, char *errbuf, size_t errlen,
+	       int non_interactive, int as_guest)
+{
+  SMB_SETUP_ANDX_req_t *req;
+  SMB_SETUP_ANDX_reply_t *reply;
+
+  char *username = NULL;
+  const char *os = "Unix";
+  const char *lanmgr = "Showtime";
+
+  char *domain = NULL;
+
+
+  size_t ulen = 0;
+  size_t olen = utf8_to_smb(cc, NULL, os);
+  size_t llen = utf8_to_smb(cc, NULL, lanmgr);
+
+  void *rbuf;
+  int rlen;
+
+  const char *retry_reason = NULL;
+  char reason[256];
+
+  uint8_t password[24];
+  int password_len;
+  char *password_cleartext;
+
+ again:
+  password[0] = 0;
+  password_len = 1;
+
+  int r = cifs_credentials(cc, retry_reason, non_interactive, as_guest,
+                           &username, &password_cleartext, &domain,
+                           errbuf, errlen);
+  if(r)
+    return r;
 
   uint8_t pwdigest[16];
   NTLM_hash(password_cleartext, pwdigest);
@@ -1162,8 +2052,8 @@ smb_setup_andX(cifs_connection_t *cc, char *errbuf, size_t errlen,
   password_len = 24;
 
   SMBTRACE("SETUP %s:%s:%s", username ?: "<unset>",
-	   *password_cleartext ? "<hidden>" : "<unset>", domain); 
-  
+	   *password_cleartext ? "<hidden>" : "<unset>", domain);
+
   free(password_cleartext);
 
   ulen = utf8_to_smb(cc, NULL, username);
@@ -1227,7 +2117,7 @@ smb_setup_andX(cifs_connection_t *cc, char *errbuf, size_t errlen,
   SMBTRACE("SETUP errorcode=0x%08x", errcode);
 
   if(reply->hdr.errorcode) {
-    
+
     smberr_write(reason, sizeof(reason), errcode);
     retry_reason = reason;
     free(rbuf);
@@ -1263,171 +2153,460 @@ smb_setup_andX(cifs_connection_t *cc, char *errbuf, size_t errlen,
 /**
  *
  */
-static void
-dump_request_list(cifs_connection_t *cc)
+static int
+smb2_session_setup_req(cifs_connection_t *cc, const void *token, int len,
+                       void **rbufp, int *rlenp)
 {
-  nbt_req_t *nr;
-  SMBTRACE("List of pending reuqests");
-  LIST_FOREACH(nr, &cc->cc_pending_nbt_requests, nr_link) {
-    SMBTRACE("  Pending request %d", nr->nr_mid);
-  }
+  int tlen = sizeof(SMB2_SESSION_SETUP_req_t) + len;
+  SMB2_SESSION_SETUP_req_t *req = alloca(tlen);
+
+  memset(req, 0, tlen);
+  req->structure_size = htole_16(25);
+  req->security_mode = SMB2_NEGOTIATE_SIGNING_ENABLED;
+  req->security_buffer_offset =
+    htole_16(sizeof(SMB2_t) + sizeof(SMB2_SESSION_SETUP_req_t));
+  req->security_buffer_length = htole_16(len);
+  memcpy(req->buffer, token, len);
+
+  return smb2_sync_req(cc, SMB2_SESSION_SETUP, req, tlen, rbufp, rlenp);
 }
 
 
 /**
- *
+ * SMB2 session setup using raw NTLMSSP (no SPNEGO wrapping)
  */
-static void *
-smb_dispatch(void *aux)
+static int
+smb2_session_setup(cifs_connection_t *cc, char *errbuf, size_t errlen,
+                   int non_interactive, int as_guest)
 {
-  cifs_connection_t *cc = aux;
-  void *buf;
-  int len;
-  uint16_t mid;
-  SMB_t *h;
-  nbt_req_t *nr;
+  const SMB2_SESSION_SETUP_resp_t *reply;
+  const NTLMSSP_CHALLENGE_t *ch;
+  NTLMSSP_NEGOTIATE_t neg;
+  char *username, *password, *domain;
+  const char *retry_reason = NULL;
+  char reason[256];
+  void *rbuf, *auth;
+  int rlen, chlen, alen, r;
+  uint32_t status;
 
-  SMBTRACE("%s:%d Read thread running %lx",
-	   cc->cc_hostname, cc->cc_port, hts_thread_current());
+ again:
+  memset(&neg, 0, sizeof(neg));
+  memcpy(neg.signature, "NTLMSSP", 8);
+  neg.type = htole_32(1);
+  neg.flags = htole_32(NTLMSSP_CLIENT_FLAGS);
 
-  while(1) {
-    if(nbt_read(cc, &buf, &len))
-      break;
-    
-    if(len < sizeof(SMB_t)) {
-      TRACE(TRACE_ERROR, "SMB", "%s:%d malformed packet smbhdrlen %d",
-	    cc->cc_hostname, cc->cc_port, len);
-      free(buf);
-      break;
-    }
+  cc->cc_session_id = 0;
 
-    h = buf;
-    mid = letoh_16(h->mid);
+  if(smb2_session_setup_req(cc, &neg, sizeof(neg), &rbuf, &rlen)) {
+    snprintf(errbuf, errlen, "Socket read error during setup");
+    return -1;
+  }
 
-    if(h->pid == htole_16(3)) {
-      SMBTRACE("%s:%d got echo reply", cc->cc_hostname, cc->cc_port);
-      // SMB_ECHO is always transfered on PID 3
-      cc->cc_wait_for_ping = 0;
-    }
+  reply = rbuf;
+  status = letoh_32(reply->hdr.status);
 
-    // We run all requests on PID 2, so if it's not 2, free data
-    if(h->pid != htole_16(2)) {
-      free(buf);
-      continue;
-    }
+  if(status != STATUS_MORE_PROCESSING_REQUIRED ||
+     rlen < sizeof(SMB2_SESSION_SETUP_resp_t)) {
+    snprintf(errbuf, errlen, "Session setup failed, NTStatus: 0x%08x",
+             status);
+    free(rbuf);
+    return -1;
+  }
 
-    hts_mutex_lock(&smb_global_mutex);
+  cc->cc_session_id = letoh_64(reply->hdr.session_id);
 
-    LIST_FOREACH(nr, &cc->cc_pending_nbt_requests, nr_link)
-      if(nr->nr_mid == mid)
-	break;
+  int sboff = letoh_16(reply->security_buffer_offset);
+  int sblen = letoh_16(reply->security_buffer_length);
 
-    if(nr != NULL) {
-      SMBTRACE("%s:%d Got response for mid=%d (err:0x%08x len:%d%s)",
-               cc->cc_hostname, cc->cc_port, mid,
-               letoh_32(h->errorcode), len, 
-               nr->nr_is_trans2 ? ", TRANS2" : "");
+  if(sboff + sblen > rlen ||
+     (ch = ntlmssp_find_challenge(rbuf + sboff, sblen, &chlen)) == NULL) {
+    snprintf(errbuf, errlen, "Malformed NTLMSSP challenge");
+    free(rbuf);
+    return -1;
+  }
 
-      if(nr->nr_is_trans2 && h->errorcode == 0 &&
-         len >= sizeof(TRANS2_reply_t)) {
+  if(!cc->cc_domain[0]) {
+    const uint8_t *ti, *dom;
+    int tilen, domlen;
 
-        // We do reassembly of TRANS2 here
-        const TRANS2_reply_t *tr = (const TRANS2_reply_t *)buf;
+    ti = ntlmssp_target_info(ch, chlen, &tilen);
+    if(ti != NULL &&
+       (dom = ntlmssp_av_find(ti, tilen, NTLMSSP_AV_NB_DOMAIN_NAME,
+                              &domlen)) != NULL)
+      ucs2_to_utf8(cc->cc_domain, sizeof(cc->cc_domain), dom, domlen, 1);
+  }
 
-        int total_count = letoh_16(tr->total_data_count);
-        int seg_count = letoh_16(tr->param_count) + letoh_16(tr->data_count);
-        SMBTRACE("trans2 segment: "
-                 "total=%d param_count=%d data_count=%d poff=%d", 
-                 total_count,
-                 letoh_16(tr->param_count),
-                 letoh_16(tr->data_count),
-                 letoh_16(tr->param_offset));
+  r = cifs_credentials(cc, retry_reason, non_interactive, as_guest,
+                       &username, &password, &domain, errbuf, errlen);
+  if(r) {
+    free(rbuf);
+    return r;
+  }
 
-        if(seg_count > len - sizeof(TRANS2_reply_t)) {
-          TRACE(TRACE_ERROR, "SMB",
-                "%s:%d malformed trans2, %d > %d",
-                cc->cc_hostname, cc->cc_port,
-                seg_count, len - sizeof(TRANS2_reply_t));
-          goto bad_trans2;
-        }
+  SMBTRACE("SETUP %s:%s:%s", username ?: "<unset>",
+	   *password ? "<hidden>" : "<unset>", domain);
 
-        nr->nr_data_count += letoh_16(tr->data_count);
-
-        if(nr->nr_response == NULL) {
-
-          // We can't deal with any parameters that's not sent in
-          // first packet
-          if(tr->total_param_count != tr->param_count) {
-            TRACE(TRACE_ERROR, "SMB",
-                  "%s:%d Unable to reassemble trans2, param count err:%d,%d",
-                  cc->cc_hostname, cc->cc_port,
-                  letoh_16(tr->total_param_count),
-                  letoh_16(tr->param_count));
-
-          bad_trans2:
-            nr->nr_result = 1;
-            free(buf);
-            free(nr->nr_response);
-            nr->nr_response = NULL;
-            nr->nr_response_len = 0;
-            hts_cond_broadcast(&cc->cc_cond);
-            hts_mutex_unlock(&smb_global_mutex);
-            continue;
-          }
-
-
-          nr->nr_response = buf;
-          nr->nr_response_len = len;
-        } else {
-          void *payload = buf + letoh_16(tr->param_offset);
-          if(seg_count < 0) {
-            TRACE(TRACE_ERROR, "SMB",
-                  "%s:%d Unable to reassemble trans2, seg_count=%d",
-                  cc->cc_hostname, cc->cc_port, seg_count);
-            goto bad_trans2;
-          }
-
-          nr->nr_response = realloc(nr->nr_response,
-                                    nr->nr_response_len + seg_count);
-
-          memcpy(nr->nr_response + nr->nr_response_len,
-                 payload, seg_count);
-          nr->nr_response_len += seg_count;
+  auth = ntlmssp_authenticate(ch, chlen, username ?: "", domain, password,
+                              &alen);
+  free(rbuf);
+  free(username);
+  free(password);
+  free(domain);
+
+  if(auth == NULL) {
+    snprintf(errbuf, errlen, "Malformed NTLMSSP challenge");
+    return -1;
+  }
+
+  r = smb2_session_setup_req(cc, auth, alen, &rbuf, &rlen);
+  free(auth);
+
+  if(r) {
+    snprintf(errbuf, errlen, "Socket read error during setup");
+    return -1;
+  }
+
+  reply = rbuf;
+  status = letoh_32(reply->hdr.status);
+
+  SMBTRACE("SETUP errorcode=0x%08x", status);
+
+  if(status) {
+    smberr_write(reason, sizeof(reason), status);
+    retry_reason = reason;
+    free(rbuf);
+    if(as_guest) {
+      snprintf(errbuf, errlen, "Guest login failed");
+      return -1;
+    }
+    goto again;
+  }
+
+  if(rlen < sizeof(SMB2_SESSION_SETUP_resp_t)) {
+    snprintf(errbuf, errlen, "Malformed response %d bytes during setup",
+	     rlen);
+    free(rbuf);
+    return -1;
+  }
+
+  int guest = letoh_16(reply->session_flags) & SMB2_SESSION_FLAG_IS_GUEST;
+  free(rbuf);
+
+  SMBTRACE("Logged in as session:0x%"PRIx64" guest=%s",
+           cc->cc_session_id, guest ? "yes" : "no");
+
+  if(guest && !as_guest) {
+    retry_reason = "Login attempt failed";
+    goto again;
+  }
+
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+dump_request_list(cifs_connection_t *cc)
+{
+  nbt_req_t *nr;
+  SMBTRACE("List of pending reuqests");
+  LIST_FOREACH(nr, &cc->cc_pending_nbt_requests, nr_link) {
+    SMBTRACE("  Pending request %"PRIu64"%s", nr->nr_mid,
+             nr->nr_orphan ? " (orphaned)" : "");
+  }
+}
+
+
+/**
+ * Hand over reply to whoever is waiting for it
+ *
+ * Must be called with cc_mutex held
+ */
+static void
+nbt_complete(cifs_connection_t *cc, nbt_req_t *nr, void *buf, int len)
+{
+  if(nr->nr_orphan) {
+    LIST_REMOVE(nr, nr_link);
+    free(nr);
+    free(buf);
+    return;
+  }
+  nr->nr_response = buf;
+  nr->nr_response_len = len;
+  nr->nr_result = 0;
+}
+
+
+/**
+ *
+ */
+static int
+smb1_dispatch(cifs_connection_t *cc, void *buf, int len)
+{
+  uint16_t mid;
+  SMB_t *h;
+  nbt_req_t *nr;
+
+  if(len < sizeof(SMB_t)) {
+    TRACE(TRACE_ERROR, "SMB", "%s:%d malformed packet smbhdrlen %d",
+          cc->cc_hostname, cc->cc_port, len);
+    free(buf);
+    return -1;
+  }
+
+  h = buf;
+  mid = letoh_16(h->mid);
+
+  if(h->pid == htole_16(3)) {
+    SMBTRACE("%s:%d got echo reply", cc->cc_hostname, cc->cc_port);
+    // SMB_ECHO is always transfered on PID 3
+    cc->cc_wait_for_ping = 0;
+  }
+
+  // We run all requests on PID 2, so if it's not 2, free data
+  if(h->pid != htole_16(2)) {
+    free(buf);
+    return 0;
+  }
+
+  hts_mutex_lock(&cc->cc_mutex);
+
+  LIST_FOREACH(nr, &cc->cc_pending_nbt_requests, nr_link)
+    if(nr->nr_mid == mid)
+      break;
+
+  if(nr != NULL) {
+    SMBTRACE("%s:%d Got response for mid=%d (err:0x%08x len:%d%s)",
+             cc->cc_hostname, cc->cc_port, mid,
+             letoh_32(h->errorcode), len,
+             nr->nr_is_trans2 ? ", TRANS2" : "");
+
+    if(nr->nr_is_trans2 && h->errorcode == 0 &&
+       len >= sizeof(TRANS2_reply_t)) {
+
+      // We do reassembly of TRANS2 here
+      const TRANS2_reply_t *tr = (const TRANS2_reply_t *)buf;
+
+      int total_count = letoh_16(tr->total_data_count);
+      int seg_count = letoh_16(tr->param_count) + letoh_16(tr->data_count);
+      SMBTRACE("trans2 segment: "
+               "total=%d param_count=%d data_count=%d poff=%d",
+               total_count,
+               letoh_16(tr->param_count),
+               letoh_16(tr->data_count),
+               letoh_16(tr->param_offset));
+
+      if(seg_count > len - sizeof(TRANS2_reply_t)) {
+        TRACE(TRACE_ERROR, "SMB",
+              "%s:%d malformed trans2, %d > %d",
+              cc->cc_hostname, cc->cc_port,
+              seg_count, len - sizeof(TRANS2_reply_t));
+        goto bad_trans2;
+      }
+
+      nr->nr_data_count += letoh_16(tr->data_count);
+
+      if(nr->nr_response == NULL) {
+
+        // We can't deal with any parameters that's not sent in
+        // first packet
+        if(tr->total_param_count != tr->param_count) {
+          TRACE(TRACE_ERROR, "SMB",
+                "%s:%d Unable to reassemble trans2, param count err:%d,%d",
+                cc->cc_hostname, cc->cc_port,
+                letoh_16(tr->total_param_count),
+                letoh_16(tr->param_count));
+
+        bad_trans2:
+          nr->nr_result = 1;
           free(buf);
+          free(nr->nr_response);
+          nr->nr_response = NULL;
+          nr->nr_response_len = 0;
+          hts_cond_broadcast(&cc->cc_reply_cond);
+          hts_mutex_unlock(&cc->cc_mutex);
+          return 0;
         }
 
-        if(nr->nr_data_count < total_count) {
-          hts_mutex_unlock(&smb_global_mutex);
-          continue; // Not complete yet
-        }
 
-      } else {
         nr->nr_response = buf;
         nr->nr_response_len = len;
+      } else {
+        void *payload = buf + letoh_16(tr->param_offset);
+        if(seg_count < 0) {
+          TRACE(TRACE_ERROR, "SMB",
+                "%s:%d Unable to reassemble trans2, seg_count=%d",
+                cc->cc_hostname, cc->cc_port, seg_count);
+          goto bad_trans2;
+        }
+
+        nr->nr_response = realloc(nr->nr_response,
+                                  nr->nr_response_len + seg_count);
+
+        memcpy(nr->nr_response + nr->nr_response_len,
+               payload, seg_count);
+        nr->nr_response_len += seg_count;
+        free(buf);
+      }
+
+      if(nr->nr_data_count < total_count) {
+        hts_mutex_unlock(&cc->cc_mutex);
+        return 0; // Not complete yet
       }
 
       nr->nr_result = 0;
-      hts_cond_broadcast(&cc->cc_cond);
 
     } else {
-      SMBTRACE("%s:%d unexpected response pid=%d mid=%d on %p",
-	       cc->cc_hostname, cc->cc_port, letoh_16(h->pid), mid, cc);
-      dump_request_list(cc);
+      nbt_complete(cc, nr, buf, len);
+    }
+
+    hts_cond_broadcast(&cc->cc_reply_cond);
+
+  } else {
+    SMBTRACE("%s:%d unexpected response pid=%d mid=%d on %p",
+             cc->cc_hostname, cc->cc_port, letoh_16(h->pid), mid, cc);
+    dump_request_list(cc);
+
+    free(buf);
+  }
+  hts_mutex_unlock(&cc->cc_mutex);
+  return 0;
+}
+
+
+/**
+ * Dispatch SMB2 message, can contain several compounded replies
+ */
+static int
+smb2_dispatch(cifs_connection_t *cc, void *buf, int len)
+{
+  int off = 0;
+  nbt_req_t *nr;
+
+  hts_mutex_lock(&cc->cc_mutex);
 
+  while(1) {
+    const SMB2_t *h = buf + off;
+    int next, mlen;
+
+    if(len - off < sizeof(SMB2_t) || h->proto != htole_32(SMB2_PROTO)) {
+      TRACE(TRACE_ERROR, "SMB", "%s:%d malformed SMB2 packet",
+            cc->cc_hostname, cc->cc_port);
+      hts_mutex_unlock(&cc->cc_mutex);
       free(buf);
+      return -1;
     }
-    hts_mutex_unlock(&smb_global_mutex);
+
+    next = letoh_32(h->next_command);
+    if(next && (next < sizeof(SMB2_t) || next > len - off)) {
+      TRACE(TRACE_ERROR, "SMB", "%s:%d malformed SMB2 compound",
+            cc->cc_hostname, cc->cc_port);
+      hts_mutex_unlock(&cc->cc_mutex);
+      free(buf);
+      return -1;
+    }
+    mlen = next ?: len - off;
+
+    uint64_t mid = letoh_64(h->message_id);
+    uint32_t status = letoh_32(h->status);
+
+    cc->cc_credits += letoh_16(h->credits);
+
+    if(mid == cc->cc_echo_mid) {
+      SMBTRACE("%s:%d got echo reply", cc->cc_hostname, cc->cc_port);
+      cc->cc_wait_for_ping = 0;
+    }
+
+    if(status == STATUS_PENDING &&
+       h->flags & htole_32(SMB2_FLAGS_ASYNC_COMMAND)) {
+      // Interim reply, the real one will arrive later
+
+    } else {
+
+      LIST_FOREACH(nr, &cc->cc_pending_nbt_requests, nr_link)
+        if(nr->nr_mid == mid)
+          break;
+
+      if(nr != NULL) {
+        void *reply;
+        SMBTRACE("%s:%d Got response for mid=%"PRIu64" (err:0x%08x len:%d)",
+                 cc->cc_hostname, cc->cc_port, mid, status, mlen);
+
+        if(off == 0 && next == 0) {
+          reply = buf;
+          buf = NULL;
+        } else {
+          reply = malloc(mlen);
+          memcpy(reply, h, mlen);
+        }
+        nbt_complete(cc, nr, reply, mlen);
+
+      } else if(mid != cc->cc_echo_mid) {
+        SMBTRACE("%s:%d unexpected response mid=%"PRIu64" on %p",
+                 cc->cc_hostname, cc->cc_port, mid, cc);
+      }
+    }
+
+    if(next == 0)
+      break;
+    off += next;
   }
 
-  hts_mutex_lock(&smb_global_mutex);
+  // Wakeup everyone, replies may also have granted more credits
+  hts_cond_broadcast(&cc->cc_reply_cond);
+  hts_mutex_unlock(&cc->cc_mutex);
+  free(buf);
+  return 0;
+}
 
-  LIST_FOREACH(nr, &cc->cc_pending_nbt_requests, nr_link) {
-    nr->nr_result = 1;
-    free(nr->nr_response);
+
+/**
+ *
+ */
+static void *
+smb_dispatch(void *aux)
+{
+  cifs_connection_t *cc = aux;
+  void *buf;
+  int len;
+  nbt_req_t *nr, *next;
+
+  SMBTRACE("%s:%d Read thread running %lx",
+	   cc->cc_hostname, cc->cc_port, hts_thread_current());
+
+  while(1) {
+    if(nbt_read(cc, &buf, &len))
+      break;
+
+    if(cc->cc_smb2 ? smb2_dispatch(cc, buf, len) : smb1_dispatch(cc, buf, len))
+      break;
   }
 
-  hts_cond_broadcast(&cc->cc_cond);
-  hts_mutex_unlock(&smb_global_mutex);
+  hts_mutex_lock(&cc->cc_mutex);
+
+  cc->cc_disconnected = 1;
+  cc->cc_broken = 1;
+
+  for(nr = LIST_FIRST(&cc->cc_pending_nbt_requests); nr != NULL; nr = next) {
+    next = LIST_NEXT(nr, nr_link);
+
+    if(nr->nr_orphan) {
+      LIST_REMOVE(nr, nr_link);
+      free(nr);
+      continue;
+    }
+
+    if(nr->nr_result == -1) {
+      nr->nr_result = 1;
+      free(nr->nr_response);
+      nr->nr_response = NULL;
+    }
+  }
+
+  hts_cond_broadcast(&cc->cc_reply_cond);
+  hts_mutex_unlock(&cc->cc_mutex);
   return NULL;
 }
 
@@ -1450,26 +2629,70 @@ get_tree_no_create(const char *hostname, int port, const char *share)
     if(!strcmp(cc->cc_hostname, hostname) && cc->cc_port == port &&
        !cc->cc_broken && cc->cc_status < CC_ERROR)
       break;
-  
+
   if(cc == NULL) {
     hts_mutex_unlock(&smb_global_mutex);
     return NULL;
   }
 
   LIST_FOREACH(ct, &cc->cc_trees, ct_link)
-    if(!strcmp(ct->ct_share, share))
+    if(!strcmp(ct->ct_share, share) && ct->ct_status == CT_RUNNING)
       break;
-  
-  if(ct != NULL)
+
+  if(ct != NULL) {
     ct->ct_refcount++;
-  else
-    hts_mutex_unlock(&smb_global_mutex);
+    cc->cc_auto_close = 0;
+  }
+  hts_mutex_unlock(&smb_global_mutex);
   return ct;
 }
 
 
 /**
- *
+ * Connect and negotiate. If SMB2 negotiation fails (unsupported dialect,
+ * signing required, etc) reconnect and offer SMB1 only
+ */
+static int
+smb_connect(cifs_connection_t *cc)
+{
+  int smb1_only;
+
+  for(smb1_only = 0; smb1_only < 2; smb1_only++) {
+    cc->cc_tc = tcp_connect(cc->cc_hostname, cc->cc_port,
+                            cc->cc_errbuf, sizeof(cc->cc_errbuf), 3000, 0,
+                            NULL);
+
+    if(cc->cc_tc == NULL) {
+      SMBTRACE("Unable to connect to %s:%d - %s",
+               cc->cc_hostname, cc->cc_port, cc->cc_errbuf);
+      return -1;
+    }
+
+    SMBTRACE("Connected to %s:%d", cc->cc_hostname, cc->cc_port);
+
+    if(!smb_neg_proto(cc, cc->cc_errbuf, sizeof(cc->cc_errbuf), smb1_only))
+      return 0;
+
+    if(!cc->cc_smb2)
+      return -1;
+
+    SMBTRACE("%s:%d SMB2 negotiation failed (%s), retrying with SMB1",
+             cc->cc_hostname, cc->cc_port, cc->cc_errbuf);
+
+    tcp_close(cc->cc_tc);
+    cc->cc_tc = NULL;
+    cc->cc_smb2 = 0;
+    cc->cc_message_id = 0;
+    cc->cc_credits = 0;
+    cc->cc_dialect = 0;
+    cc->cc_large_mtu = 0;
+  }
+  return -1;
+}
+
+
+/**
+ * Returns a referenced connection
  */
 static cifs_connection_t *
 cifs_get_connection(const char *hostname, int port, char *errbuf, size_t errlen,
@@ -1482,7 +2705,7 @@ cifs_get_connection(const char *hostname, int port, char *errbuf, size_t errlen,
   if(!non_interactive) {
     LIST_FOREACH(cc, &cifs_connections, cc_link)
       if(!strcmp(cc->cc_hostname, hostname) && cc->cc_port == port &&
-	 cc->cc_as_guest == as_guest && 
+	 cc->cc_as_guest == as_guest &&
 	 !cc->cc_broken && cc->cc_status < CC_ERROR)
 	break;
   } else {
@@ -1490,6 +2713,9 @@ cifs_get_connection(const char *hostname, int port, char *errbuf, size_t errlen,
   }
 
   if(cc == NULL) {
+    int status = CC_ERROR;
+    int need_auth = 0;
+
     cc = calloc(1, sizeof(cifs_connection_t));
     cc->cc_uid = 1;
     cc->cc_refcount = 1;
@@ -1499,51 +2725,46 @@ cifs_get_connection(const char *hostname, int port, char *errbuf, size_t errlen,
     cc->cc_as_guest = as_guest;
 
     hts_cond_init(&cc->cc_cond, &smb_global_mutex);
+    hts_mutex_init(&cc->cc_mutex);
+    hts_cond_init(&cc->cc_reply_cond, &cc->cc_mutex);
 
     LIST_INSERT_HEAD(&cifs_connections, cc, cc_link);
-    hts_mutex_unlock(&smb_global_mutex);
-
-    cc->cc_tc = tcp_connect(hostname, port,
-			    cc->cc_errbuf, sizeof(cc->cc_errbuf), 3000, 0,
-                            NULL);
 
-    hts_mutex_lock(&smb_global_mutex);
+    // Noone else touches the connection until it's CC_RUNNING so
+    // we can do all the setup without locks
+    hts_mutex_unlock(&smb_global_mutex);
 
-    if(cc->cc_tc == NULL) {
-      SMBTRACE("Unable to connect to %s:%d - %s",
-	    hostname, port, cc->cc_errbuf);
-      cc->cc_status = CC_ERROR;
-    } else {
-      SMBTRACE("Connected to %s:%d", hostname, port);
+    if(!smb_connect(cc)) {
+      SMBTRACE("%s:%d Protocol negotiated", hostname, port);
 
-      if(smb_neg_proto(cc, cc->cc_errbuf, sizeof(cc->cc_errbuf))) {
-	cc->cc_status = CC_ERROR;
+      int r;
+      if(cc->cc_smb2)
+        r = smb2_session_setup(cc, cc->cc_errbuf, sizeof(cc->cc_errbuf),
+                               non_interactive, as_guest);
+      else
+        r = smb_setup_andX(cc, cc->cc_errbuf, sizeof(cc->cc_errbuf),
+                           non_interactive, as_guest);
+
+      if(r) {
+        need_auth = r == -2;
       } else {
-	SMBTRACE("%s:%d Protocol negotiated", hostname, port);
-
-	int r;
-	r = smb_setup_andX(cc, cc->cc_errbuf, sizeof(cc->cc_errbuf),
-			   non_interactive, as_guest);
-
-	if(r) {
-	  if(r == -2) {
-	    cifs_release_connection(cc);
-	    return SAMBA_NEED_AUTH;
-	  }
-	  cc->cc_status = CC_ERROR;
-	} else {
-	  SMBTRACE("%s:%d Session setup", hostname, port);
-	  cc->cc_status = CC_RUNNING;
-	  hts_thread_create_joinable("SMB", &cc->cc_thread, smb_dispatch,
-				     cc, THREAD_PRIO_FILESYSTEM);
-
-	  callout_arm(&cc->cc_timer, cifs_periodic, cc, SMB_ECHO_INTERVAL);
-	}
+	SMBTRACE("%s:%d Session setup", hostname, port);
+	status = CC_RUNNING;
+	hts_thread_create_joinable("SMB", &cc->cc_thread, smb_dispatch,
+				   cc, THREAD_PRIO_FILESYSTEM);
+
+	callout_arm(&cc->cc_timer, cifs_periodic, cc, SMB_ECHO_INTERVAL);
       }
     }
 
+    hts_mutex_lock(&smb_global_mutex);
+    cc->cc_status = status;
     hts_cond_broadcast(&cc->cc_cond);
 
+    if(need_auth) {
+      cifs_release_connection(cc);
+      return SAMBA_NEED_AUTH;
+    }
 
   } else {
 
@@ -1560,12 +2781,13 @@ cifs_get_connection(const char *hostname, int port, char *errbuf, size_t errlen,
     return NULL;
   }
   cc->cc_auto_close = 0;
+  hts_mutex_unlock(&smb_global_mutex);
   return cc;
 }
 
 
 /**
- *
+ * Send SMB1 request. Must be called with cc_mutex held
  */
 static nbt_req_t *
 nbt_async_req(cifs_connection_t *cc, void *request, int request_len,
@@ -1579,7 +2801,11 @@ nbt_async_req(cifs_connection_t *cc, void *request, int request_len,
   nr->nr_is_trans2 = is_trans2;
   h->pid = htole_16(2);
   h->mid = htole_16(nr->nr_mid);
-  nbt_write(cc, request, request_len);
+
+  if(cc->cc_disconnected)
+    nr->nr_result = 1;
+  else
+    nbt_write(cc, request, request_len);
 
   LIST_INSERT_HEAD(&cc->cc_pending_nbt_requests, nr, nr_link);
   return nr;
@@ -1587,46 +2813,264 @@ nbt_async_req(cifs_connection_t *cc, void *request, int request_len,
 
 
 /**
- *
+ * Wait for reply. Must be called with cc_mutex held
  */
 static int
-nbt_async_req_reply(cifs_connection_t *cc,
-		    void *request, int request_len,
-		    void **responsep, int *response_lenp,
-                    int is_trans2)
+nbt_wait(cifs_connection_t *cc, nbt_req_t *nr)
 {
-  nbt_req_t *nr = nbt_async_req(cc, request, request_len, is_trans2);
-
   while(nr->nr_result == -1) {
-    if(hts_cond_wait_timeout(&cc->cc_cond, &smb_global_mutex, NBT_TIMEOUT)) {
-      TRACE(TRACE_ERROR, "SMB", "%s:%d request timeout (%d) on %p",
+    if(hts_cond_wait_timeout(&cc->cc_reply_cond, &cc->cc_mutex,
+                             NBT_TIMEOUT)) {
+      TRACE(TRACE_ERROR, "SMB", "%s:%d request timeout (%"PRIu64") on %p",
 	    cc->cc_hostname, cc->cc_port, nr->nr_mid, cc);
 
-
       dump_request_list(cc);
 
       cc->cc_broken = 1;
-      break;
+      return -1;
     }
   }
-  LIST_REMOVE(nr, nr_link);
+  return nr->nr_result;
+}
 
-  int r = nr->nr_result;
-  *responsep = nr->nr_response;
-  *response_lenp = nr->nr_response_len;
+
+/**
+ *
+ */
+static int
+nbt_async_req_reply(cifs_connection_t *cc,
+		    void *request, int request_len,
+		    void **responsep, int *response_lenp,
+                    int is_trans2)
+{
+  hts_mutex_lock(&cc->cc_mutex);
+
+  nbt_req_t *nr = nbt_async_req(cc, request, request_len, is_trans2);
+
+  int r = nbt_wait(cc, nr);
+  LIST_REMOVE(nr, nr_link);
+
+  hts_mutex_unlock(&cc->cc_mutex);
+
+  if(r) {
+    free(nr->nr_response);
+    nr->nr_response = NULL;
+  }
+
+  *responsep = nr->nr_response;
+  *response_lenp = nr->nr_response_len;
 
   free(nr);
   return r;
 }
 
 
+/**
+ * Send one or more (compounded) SMB2 commands
+ *
+ * Must be called with cc_mutex held. If there are not enough credits
+ * we wait for them to be returned unless 'nowait' is set in which
+ * case we fail right away.
+ *
+ * If 'nrs' is NULL nobody will wait for the replies
+ */
+static int
+smb2_send(cifs_connection_t *cc, uint32_t tree_id,
+          const smb2_cmd_t *cmds, int num, nbt_req_t **nrs, int nowait)
+{
+  uint64_t mids[num];
+  int i, len, charge = 0;
+  void *buf;
+
+  for(i = 0; i < num; i++)
+    charge += smb2_credit_charge(cc, cmds[i].sc_payload);
+
+  while(cc->cc_credits < charge) {
+    if(cc->cc_disconnected || nowait)
+      return -1;
+
+    if(hts_cond_wait_timeout(&cc->cc_reply_cond, &cc->cc_mutex,
+                             NBT_TIMEOUT)) {
+      TRACE(TRACE_ERROR, "SMB", "%s:%d timeout waiting for credits on %p",
+	    cc->cc_hostname, cc->cc_port, cc);
+      cc->cc_broken = 1;
+      return -1;
+    }
+  }
+
+  if(cc->cc_disconnected)
+    return -1;
+
+  cc->cc_credits -= charge;
+
+  buf = smb2_build(cc, tree_id, cmds, num, mids, &len);
+  nbt_write(cc, buf, len);
+  free(buf);
+
+  for(i = 0; i < num; i++) {
+    nbt_req_t *nr = calloc(1, sizeof(nbt_req_t));
+    nr->nr_result = -1;
+    nr->nr_mid = mids[i];
+    LIST_INSERT_HEAD(&cc->cc_pending_nbt_requests, nr, nr_link);
+    if(nrs != NULL)
+      nrs[i] = nr;
+    else
+      nr->nr_orphan = 1;
+  }
+  return 0;
+}
+
+
+/**
+ * Send SMB2 commands and wait for all replies
+ *
+ * Replies are returned in 'rbufs' (NULL if missing) and must always
+ * be freed by caller. Returns -1 if the connection failed
+ */
+static int
+smb2_transact(cifs_connection_t *cc, uint32_t tree_id,
+              const smb2_cmd_t *cmds, int num, void **rbufs, int *rlens)
+{
+  nbt_req_t *nrs[num];
+  int i, r = 0;
+
+  hts_mutex_lock(&cc->cc_mutex);
+
+  if(smb2_send(cc, tree_id, cmds, num, nrs, 0)) {
+    hts_mutex_unlock(&cc->cc_mutex);
+    for(i = 0; i < num; i++) {
+      rbufs[i] = NULL;
+      rlens[i] = 0;
+    }
+    return -1;
+  }
+
+  for(i = 0; i < num && r == 0; i++)
+    if(nbt_wait(cc, nrs[i]))
+      r = -1;
+
+  for(i = 0; i < num; i++) {
+    nbt_req_t *nr = nrs[i];
+    rbufs[i] = nr->nr_response;
+    rlens[i] = nr->nr_response_len;
+    LIST_REMOVE(nr, nr_link);
+    free(nr);
+  }
+
+  hts_mutex_unlock(&cc->cc_mutex);
+  return r;
+}
 
 
 /**
  *
  */
 static void
-cifs_release_tree(cifs_tree_t *ct, int full)
+smb2_free_replies(void **rbufs, int num)
+{
+  int i;
+  for(i = 0; i < num; i++)
+    free(rbufs[i]);
+}
+
+
+/**
+ * Check status and size of SMB2 reply
+ */
+static int
+smb2_check_reply(const void *rbuf, int rlen, int runt_lim,
+                 char *errbuf, size_t errlen)
+{
+  const SMB2_t *h = rbuf;
+  uint32_t status;
+
+  if(rbuf == NULL) {
+    snprintf(errbuf, errlen, "I/O error");
+    return -1;
+  }
+
+  status = letoh_32(h->status);
+  if(status) {
+    smberr_write(errbuf, errlen, status);
+    SMBTRACE("Error: 0x%08x", status);
+    return -1;
+  }
+
+  if(rlen < runt_lim) {
+    snprintf(errbuf, errlen, "Short packet");
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+smb2_close_req(SMB2_CLOSE_req_t *req, const uint8_t *file_id)
+{
+  memset(req, 0, sizeof(SMB2_CLOSE_req_t));
+  req->structure_size = htole_16(24);
+  if(file_id != NULL)
+    memcpy(req->file_id, file_id, 16);
+  else
+    memset(req->file_id, 0xff, 16);
+}
+
+
+/**
+ * Close file without waiting for the reply
+ */
+static void
+smb2_close_handle(cifs_connection_t *cc, uint32_t tree_id,
+                  const uint8_t *file_id)
+{
+  SMB2_CLOSE_req_t req;
+  smb2_close_req(&req, file_id);
+  const smb2_cmd_t cmd = {SMB2_CLOSE, &req, sizeof(req), 0};
+
+  hts_mutex_lock(&cc->cc_mutex);
+  smb2_send(cc, tree_id, &cmd, 1, NULL, 0);
+  hts_mutex_unlock(&cc->cc_mutex);
+}
+
+
+/**
+ * Setup CREATE request for 'path' (relative to share root)
+ */
+static SMB2_CREATE_req_t *
+smb2_create_req(const char *path, uint32_t access, uint32_t options,
+                int *lenp)
+{
+  char *fname = mystrdupa(path);
+  backslashify(fname);
+
+  int nlen = utf8_to_ucs2(NULL, fname, 1);
+  int tlen = sizeof(SMB2_CREATE_req_t) + nlen;
+  SMB2_CREATE_req_t *req = calloc(1, tlen);
+
+  req->structure_size = htole_16(57);
+  req->impersonation_level = htole_32(2);
+  req->desired_access = htole_32(access);
+  req->share_access =
+    htole_32(FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE);
+  req->create_disposition = htole_32(FILE_OPEN);
+  req->create_options = htole_32(options);
+  req->name_offset = htole_16(sizeof(SMB2_t) + sizeof(SMB2_CREATE_req_t));
+  req->name_length = htole_16(nlen - 2);
+  utf8_to_ucs2(req->buffer, fname, 1);
+
+  *lenp = tlen;
+  return req;
+}
+
+
+/**
+ * Must be called with smb_global_mutex held, will return unlocked
+ */
+static void
+cifs_release_tree0(cifs_tree_t *ct, int full)
 {
   ct->ct_cc->cc_auto_close = 0;
   assert(ct->ct_refcount > 0);
@@ -1637,14 +3081,27 @@ cifs_release_tree(cifs_tree_t *ct, int full)
   }
   LIST_REMOVE(ct, ct_link);
   cifs_release_connection(ct->ct_cc);
+  hts_cond_destroy(&ct->ct_cond);
   free(ct->ct_share);
   free(ct);
 }
 
+
 /**
  *
  */
 static void
+cifs_release_tree(cifs_tree_t *ct, int full)
+{
+  hts_mutex_lock(&smb_global_mutex);
+  cifs_release_tree0(ct, full);
+}
+
+
+/**
+ * Must be called with smb_global_mutex held, will return unlocked
+ */
+static void
 cifs_disconnect(cifs_connection_t *cc)
 {
   cifs_tree_t *ct;
@@ -1663,14 +3120,15 @@ cifs_disconnect(cifs_connection_t *cc)
   cifs_maybe_destroy(cc);
 }
 
-		    
+
 
 /**
- *
+ * Returns 0 if connected, -1 on error (see ct_errbuf) and -2 if
+ * authentication is required but we are not allowed to ask for it
  */
-static cifs_tree_t *
-smb_tree_connect_andX(cifs_connection_t *cc, const char *share,
-		      char *errbuf, size_t errlen, int non_interactive)
+static int
+smb_tree_connect_andX(cifs_connection_t *cc, cifs_tree_t *ct,
+		      int non_interactive)
 {
   SMB_TREE_CONNECT_ANDX_req_t *req;
   SMB_TREE_CONNECT_ANDX_reply_t *reply;
@@ -1679,103 +3137,186 @@ smb_tree_connect_andX(cifs_connection_t *cc, const char *share,
   uint8_t password[24];
   void *rbuf;
   int rlen;
-  cifs_tree_t *ct;
+  int password_len;
 
   const char *retry_reason = NULL;
 
-  cc->cc_auto_close = 0;
+  snprintf(resource, sizeof(resource), "\\\\%s\\%s", "127.0.0.1",
+           ct->ct_share);
 
-  if(!non_interactive) {
-    LIST_FOREACH(ct, &cc->cc_trees, ct_link) {
-      if(!strcmp(ct->ct_share, share)) {
-	ct->ct_refcount++;
-	cc->cc_refcount--;
-	break;
-      }
+ again:
+  password[0] = 0;
+  password_len = 1;
+
+  if(!(cc->cc_security_mode & SECURITY_USER_LEVEL)) {
+    char id[256];
+    char name[256];
+    int r;
+    char *password_cleartext = NULL;
+    snprintf(id, sizeof(id), "smb:share:%s:%d:share",
+             cc->cc_hostname, cc->cc_port);
+    snprintf(name, sizeof(name), "Samba share '\\%s' on '%s'",
+             ct->ct_share, cc->cc_hostname);
+
+    if(non_interactive && retry_reason)
+      return -2;
+
+    r = keyring_lookup(id, NULL, &password_cleartext, NULL, NULL,
+                       name, retry_reason,
+                       (retry_reason ? KEYRING_QUERY_USER : 0) |
+                       KEYRING_SHOW_REMEMBER_ME | KEYRING_REMEMBER_ME_SET);
+
+    if(r == -1) {
+      /* Rejected */
+      snprintf(ct->ct_errbuf, sizeof(ct->ct_errbuf),
+               "Authentication rejected by user");
+      return -1;
+    }
+
+
+    if(r == 0) {
+      uint8_t pwdigest[16];
+      NTLM_hash(password_cleartext, pwdigest);
+      lmresponse(password, pwdigest, cc->cc_challenge_key);
+      password_len = 24;
+      free(password_cleartext);
     }
-  } else {
-    ct = NULL;
   }
-  if(ct == NULL) {
 
-    int password_len;
+  int password_pad = cc->cc_unicode && (password_len & 1) == 0;
 
-    snprintf(resource, sizeof(resource), "\\\\%s\\%s", "127.0.0.1", share);
-    
-  again:
-    password[0] = 0;
-    password_len = 1;
+  int resource_len =  utf8_to_smb(cc, NULL, resource);
+  int service_len = strlen(service) + 1;
+  int bytecount = password_len + password_pad + resource_len + service_len;
 
-    if(!(cc->cc_security_mode & SECURITY_USER_LEVEL)) {
-      char id[256];
-      char name[256];
-      int r;
-      char *password_cleartext = NULL;
-      snprintf(id, sizeof(id), "smb:share:%s:%d:share",
-	       cc->cc_hostname, cc->cc_port);
-      snprintf(name, sizeof(name), "Samba share '\\%s' on '%s'",
-	       share, cc->cc_hostname);
-
-      if(non_interactive && retry_reason) {
-	cifs_release_tree(ct, 1);
-	return SAMBA_NEED_AUTH;
-      }
+  int tlen = sizeof(SMB_TREE_CONNECT_ANDX_req_t) + bytecount;
 
-      r = keyring_lookup(id, NULL, &password_cleartext, NULL, NULL,
-			 name, retry_reason,
-			 (retry_reason ? KEYRING_QUERY_USER : 0) |
-			 KEYRING_SHOW_REMEMBER_ME | KEYRING_REMEMBER_ME_SET);
-
-      if(r == -1) {
-	/* Rejected */
-	snprintf(ct->ct_errbuf, sizeof(ct->ct_errbuf),
-		 "Authentication rejected by user");
-	ct->ct_status = CT_ERROR;
-	hts_cond_broadcast(&ct->ct_cond);
-	goto out;
-      }
-      
-
-      if(r == 0) {
-	uint8_t pwdigest[16];
-	NTLM_hash(password_cleartext, pwdigest);
-	lmresponse(password, pwdigest, cc->cc_challenge_key);
-	password_len = 24;
-	free(password_cleartext);
-      }
+  req = alloca(tlen);
+  memset(req, 0, tlen);
+
+  smb_init_header(cc, &req->hdr, SMB_TREEC_ANDX,
+                  SMB_FLAGS_CASELESS_PATHNAMES, SMB_FLAGS2_32BIT_STATUS,
+                  0, 1);
+
+  req->wordcount = 4;
+  req->andx_command = 0xff;
+  req->password_length = htole_16(password_len);
+
+  req->bytecount = htole_16(bytecount);
+
+  void *ptr = req->data;
+  memcpy(ptr, password, password_len);
+  ptr += password_len + password_pad;
+
+  ptr += utf8_to_smb(cc, ptr, resource);
+  memcpy(ptr, service, service_len);
+  ptr += service_len;
+
+  assert((ptr - (void *)req) == tlen);
+
+  if(nbt_async_req_reply(cc, req, tlen, &rbuf, &rlen, 0)) {
+    snprintf(ct->ct_errbuf, sizeof(ct->ct_errbuf), "Connection lost");
+    return -1;
+  }
+
+  reply = rbuf;
+
+  uint32_t err = letoh_32(reply->hdr.errorcode);
+  SMBTRACE("Tree connect errorcode:0x%08x (%s)", err, ct->ct_share);
+  if(err != 0) {
+    free(rbuf);
+
+    if(!(cc->cc_security_mode & SECURITY_USER_LEVEL) &&
+       retry_reason == NULL) {
+      retry_reason = "Authentication failed";
+      goto again;
     }
 
-    int password_pad = cc->cc_unicode && (password_len & 1) == 0;
+    smberr_write(ct->ct_errbuf, sizeof(ct->ct_errbuf), err);
+    return -1;
+  }
 
-    int resource_len =  utf8_to_smb(cc, NULL, resource);
-    int service_len = strlen(service) + 1;
-    int bytecount = password_len + password_pad + resource_len + service_len;
+  ct->ct_tid = letoh_16(reply->hdr.tid);
+  free(rbuf);
+  return 0;
+}
 
-    int tlen = sizeof(SMB_TREE_CONNECT_ANDX_req_t) + bytecount;
 
-    req = alloca(tlen);
-    memset(req, 0, tlen);
+/**
+ *
+ */
+static int
+smb2_tree_connect(cifs_connection_t *cc, cifs_tree_t *ct)
+{
+  char unc[512];
+  void *rbuf;
+  int rlen;
 
-    smb_init_header(cc, &req->hdr, SMB_TREEC_ANDX,
-		    SMB_FLAGS_CASELESS_PATHNAMES, SMB_FLAGS2_32BIT_STATUS,
-		    0, 1);
+  snprintf(unc, sizeof(unc), "\\\\%s\\%s", cc->cc_hostname, ct->ct_share);
 
-    req->wordcount = 4;
-    req->andx_command = 0xff;
-    req->password_length = htole_16(password_len);
-  
-    req->bytecount = htole_16(bytecount);
+  int plen = utf8_to_ucs2(NULL, unc, 1);
+  int tlen = sizeof(SMB2_TREE_CONNECT_req_t) + plen;
+  SMB2_TREE_CONNECT_req_t *req = alloca(tlen);
+
+  memset(req, 0, tlen);
+  req->structure_size = htole_16(9);
+  req->path_offset =
+    htole_16(sizeof(SMB2_t) + sizeof(SMB2_TREE_CONNECT_req_t));
+  req->path_length = htole_16(plen - 2);
+  utf8_to_ucs2(req->buffer, unc, 1);
+
+  const smb2_cmd_t cmd = {SMB2_TREE_CONNECT, req, tlen - 2, 0};
+
+  if(smb2_transact(cc, 0, &cmd, 1, &rbuf, &rlen)) {
+    free(rbuf);
+    snprintf(ct->ct_errbuf, sizeof(ct->ct_errbuf), "Connection lost");
+    return -1;
+  }
+
+  const SMB2_t *h = rbuf;
+  uint32_t err = letoh_32(h->status);
+  SMBTRACE("Tree connect errorcode:0x%08x (%s)", err, ct->ct_share);
+
+  if(err) {
+    smberr_write(ct->ct_errbuf, sizeof(ct->ct_errbuf), err);
+    free(rbuf);
+    return -1;
+  }
+
+  ct->ct_tid = letoh_32(h->tree_id);
+  free(rbuf);
+  return 0;
+}
+
+
+/**
+ * Get a tree connection for 'share'
+ *
+ * The reference on 'cc' held by caller is transfered to the tree
+ * (or released on error)
+ */
+static cifs_tree_t *
+cifs_tree_connect(cifs_connection_t *cc, const char *share,
+                  char *errbuf, size_t errlen, int non_interactive)
+{
+  cifs_tree_t *ct = NULL;
+  int r;
 
-    void *ptr = req->data;
-    memcpy(ptr, password, password_len);
-    ptr += password_len + password_pad;
+  hts_mutex_lock(&smb_global_mutex);
 
-    ptr += utf8_to_smb(cc, ptr, resource);
-    memcpy(ptr, service, service_len);
-    ptr += service_len;
+  cc->cc_auto_close = 0;
 
-    assert((ptr - (void *)req) == tlen);
+  if(!non_interactive) {
+    LIST_FOREACH(ct, &cc->cc_trees, ct_link) {
+      if(!strcmp(ct->ct_share, share) && ct->ct_status != CT_ERROR) {
+	ct->ct_refcount++;
+	cc->cc_refcount--;
+	break;
+      }
+    }
+  }
 
+  if(ct == NULL) {
 
     ct = calloc(1, sizeof(cifs_tree_t));
     ct->ct_cc = cc;
@@ -1785,43 +3326,35 @@ smb_tree_connect_andX(cifs_connection_t *cc, const char *share,
     hts_cond_init(&ct->ct_cond, &smb_global_mutex);
     ct->ct_status = CT_CONNECTING;
 
-    if(nbt_async_req_reply(cc, req, tlen, &rbuf, &rlen, 0)) {
-      ct->ct_status = CT_ERROR;
-      snprintf(ct->ct_errbuf, sizeof(ct->ct_errbuf), "Connection lost");
-    } else {
-      reply = rbuf;
-
-      uint32_t err = letoh_32(reply->hdr.errorcode);
-      SMBTRACE("Tree connect errorcode:0x%08x (%s)", err, share);
-      if(err != 0) {
-
-	if(!(cc->cc_security_mode & SECURITY_USER_LEVEL) &&
-	   retry_reason == NULL) {
-	  free(rbuf);
-	  retry_reason = "Authentication failed";
-	  goto again;
-	}
-	
-	ct->ct_status = CT_ERROR;
-	smberr_write(ct->ct_errbuf, sizeof(ct->ct_errbuf), err);
+    hts_mutex_unlock(&smb_global_mutex);
 
-      } else {
-	ct->ct_tid = htole_16(reply->hdr.tid);
-	ct->ct_status = CT_RUNNING;
-      }
-    }
-    free(rbuf);
+    if(cc->cc_smb2)
+      r = smb2_tree_connect(cc, ct);
+    else
+      r = smb_tree_connect_andX(cc, ct, non_interactive);
+
+    hts_mutex_lock(&smb_global_mutex);
+
+    ct->ct_status = r ? CT_ERROR : CT_RUNNING;
     hts_cond_broadcast(&ct->ct_cond);
+
+    if(r == -2) {
+      cifs_release_tree0(ct, 1);
+      return SAMBA_NEED_AUTH;
+    }
+
+  } else {
+
+    while(ct->ct_status == CT_CONNECTING)
+      hts_cond_wait(&ct->ct_cond, &smb_global_mutex);
   }
 
-  while(ct->ct_status == CT_CONNECTING)
-    hts_cond_wait(&ct->ct_cond, &smb_global_mutex);
- out:
   if(ct->ct_status == CT_ERROR) {
     snprintf(errbuf, errlen, "%s", ct->ct_errbuf);
-    cifs_release_tree(ct, 1);
+    cifs_release_tree0(ct, 1);
     return NULL;
   }
+  hts_mutex_unlock(&smb_global_mutex);
   return ct;
 }
 
@@ -1832,7 +3365,8 @@ smb_tree_connect_andX(cifs_connection_t *cc, const char *share,
 #define CIFS_RESOLVE_CONNECTION 2
 
 /**
- *
+ * Resolve URL into a referenced tree (or connection if URL only
+ * contains a hostname)
  */
 static int
 cifs_resolve(const char *url, char *filename, size_t filenamesize,
@@ -1857,13 +3391,13 @@ cifs_resolve(const char *url, char *filename, size_t filenamesize,
     fn = strchr(p, '/');
     if(fn != NULL)
       *fn++ = 0;
-    
+
   }
   if(port < 0)
     port = 445;
 
   if(*p == 0) {
-    
+
     if(p_cc == NULL) {
       // Resolved into a host but caller won't deal with it, error out
       snprintf(errbuf, errlen, "Invalid URL for operation");
@@ -1904,11 +3438,20 @@ cifs_resolve(const char *url, char *filename, size_t filenamesize,
     assert(cc != SAMBA_NEED_AUTH); /* Should not happen if we just try to
 				      login as guest */
 
-    ct = smb_tree_connect_andX(cc, p, errbuf, errlen, non_interactive);
-    if(!(cc->cc_security_mode & SECURITY_USER_LEVEL) || ct != NULL) {
+    // Tree connect will drop our reference on error so check this first
+    const int user_level = cc->cc_security_mode & SECURITY_USER_LEVEL;
+
+    ct = cifs_tree_connect(cc, p, errbuf, errlen, non_interactive);
+    if(ct == SAMBA_NEED_AUTH)
+      return CIFS_RESOLVE_NEED_AUTH;
+
+    if(ct != NULL) {
       *p_ct = ct;
       return CIFS_RESOLVE_TREE;
     }
+
+    if(!user_level)
+      return CIFS_RESOLVE_ERROR;
   }
 
   if((cc = cifs_get_connection(hostname, port, errbuf, errlen,
@@ -1919,17 +3462,18 @@ cifs_resolve(const char *url, char *filename, size_t filenamesize,
   if(cc == SAMBA_NEED_AUTH)
     return CIFS_RESOLVE_NEED_AUTH;
 
-  ct = smb_tree_connect_andX(cc, p, errbuf, errlen, non_interactive);
+  ct = cifs_tree_connect(cc, p, errbuf, errlen, non_interactive);
+  if(ct == SAMBA_NEED_AUTH)
+    return CIFS_RESOLVE_NEED_AUTH;
+
   if(ct == NULL)
     return CIFS_RESOLVE_ERROR;
-  
+
   *p_ct = ct;
   return CIFS_RESOLVE_TREE;
 }
 
 
-
-
 /**
  *
  */
@@ -1982,24 +3526,404 @@ check_smb_error(cifs_tree_t *ct, void *rbuf, size_t rlen, size_t runt_lim,
 
 
 /**
+ * SMB2 version of check_smb_error() for compounded replies
  *
+ * On error all replies are freed and the tree is released
+ */
+static int
+check_smb2_error(cifs_tree_t *ct, void **rbufs, const int *rlens, int num,
+                 int idx, size_t runt_lim, char *errbuf, size_t errlen)
+{
+  if(!smb2_check_reply(rbufs[idx], rlens[idx], runt_lim, errbuf, errlen))
+    return 0;
+
+  int broken = rbufs[idx] == NULL || rlens[idx] < runt_lim;
+  smb2_free_replies(rbufs, num);
+  cifs_release_tree(ct, broken);
+  return -1;
+}
+
+
+/**
+ * Minimal NDR reader for decoding DCE/RPC replies
+ */
+typedef struct ndr_reader {
+  const uint8_t *nd_buf;
+  int nd_len;
+  int nd_off;
+  int nd_err;
+} ndr_reader_t;
+
+
+/**
+ *
+ */
+static uint32_t
+ndr_u32(ndr_reader_t *nd)
+{
+  nd->nd_off = (nd->nd_off + 3) & ~3;
+  if(nd->nd_off + 4 > nd->nd_len) {
+    nd->nd_err = 1;
+    return 0;
+  }
+  const uint8_t *p = nd->nd_buf + nd->nd_off;
+  nd->nd_off += 4;
+  return p[0] | p[1] << 8 | p[2] << 16 | p[3] << 24;
+}
+
+
+/**
+ * Conformant varying UCS2 string
  */
 static void
-backslashify(char *str)
+ndr_string(ndr_reader_t *nd, char *out, size_t outlen)
 {
-  while(*str) {
-    if(*str == '/')
-      *str = '\\';
-    str++;
+  ndr_u32(nd); // max count
+  ndr_u32(nd); // offset
+  int len = ndr_u32(nd) * 2;
+
+  if(nd->nd_err || len > nd->nd_len - nd->nd_off) {
+    nd->nd_err = 1;
+    *out = 0;
+    return;
   }
+  ucs2_to_utf8((uint8_t *)out, outlen, nd->nd_buf + nd->nd_off, len, 1);
+  nd->nd_off += len;
+}
+
+
+/**
+ * Build DCE/RPC request for srvsvc NetrShareEnum (opnum 15) level 1
+ */
+static void *
+srvsvc_share_enum_req(const char *hostname, int *lenp)
+{
+  char server[256];
+  snprintf(server, sizeof(server), "\\\\%s", hostname);
+
+  int slen = utf8_to_ucs2(NULL, server, 1);
+  int spad = (4 - (slen & 3)) & 3;
+  int tlen = 24 + 16 + slen + spad + 28;
+  uint8_t *b = calloc(1, tlen);
+  uint32_t *w;
+
+  // Common header + request header
+  b[0] = 5;     // Version
+  b[2] = 0;     // Request
+  b[3] = 3;     // First + Last fragment
+  b[4] = 0x10;  // Little endian
+  b[8] = tlen;
+  b[9] = tlen >> 8;
+  b[12] = 2;    // Call ID
+  b[16] = tlen - 24;
+  b[17] = (tlen - 24) >> 8;
+  b[22] = 15;   // NetrShareEnum
+
+  w = (uint32_t *)(b + 24);
+  w[0] = htole_32(0x20000);  // ServerName referent
+  w[1] = htole_32(slen / 2); // Max count
+  w[2] = 0;                  // Offset
+  w[3] = htole_32(slen / 2); // Actual count
+  utf8_to_ucs2(b + 40, server, 1);
+
+  w = (uint32_t *)(b + 40 + slen + spad);
+  w[0] = htole_32(1);        // Level
+  w[1] = htole_32(1);        // Union switch
+  w[2] = htole_32(0x20004);  // SHARE_INFO_1_CONTAINER referent
+  w[3] = 0;                  // Entries read
+  w[4] = 0;                  // Buffer (NULL)
+  w[5] = htole_32(0xffffffff); // Prefered max length
+  w[6] = 0;                  // Resume handle (NULL)
+
+  *lenp = tlen;
+  return b;
 }
 
 
+/**
+ * DCE/RPC bind to srvsvc v3.0 using NDR transfer syntax
+ */
+static const uint8_t srvsvc_bind_req[72] = {
+  5, 0, 11, 3, 0x10, 0, 0, 0, 72, 0, 0, 0, 1, 0, 0, 0,
+  0xb8, 0x10, 0xb8, 0x10, 0, 0, 0, 0,
+  1, 0, 0, 0,
+  0, 0, 1, 0,
+  0xc8, 0x4f, 0x32, 0x4b, 0x70, 0x16, 0xd3, 0x01,
+  0x12, 0x78, 0x5a, 0x47, 0xbf, 0x6e, 0xe1, 0x88, 3, 0, 0, 0,
+  0x04, 0x5d, 0x88, 0x8a, 0xeb, 0x1c, 0xc9, 0x11,
+  0x9f, 0xe8, 0x08, 0x00, 0x2b, 0x10, 0x48, 0x60, 2, 0, 0, 0,
+};
+
+
 /**
  *
  */
+static void
+smb2_ioctl_req(SMB2_IOCTL_req_t *req, const uint8_t *file_id,
+               const void *data, int len, int max_output)
+{
+  memset(req, 0, sizeof(SMB2_IOCTL_req_t));
+  req->structure_size = htole_16(57);
+  req->ctl_code = htole_32(FSCTL_PIPE_TRANSCEIVE);
+  if(file_id != NULL)
+    memcpy(req->file_id, file_id, 16);
+  else
+    memset(req->file_id, 0xff, 16);
+  req->input_offset = htole_32(sizeof(SMB2_t) + sizeof(SMB2_IOCTL_req_t));
+  req->input_count = htole_32(len);
+  req->max_output_response = htole_32(max_output);
+  req->flags = htole_32(SMB2_0_IOCTL_IS_FSCTL);
+  memcpy(req->buffer, data, len);
+}
+
+
+/**
+ * Extract output from IOCTL reply and append to 'out'
+ */
+static int
+smb2_ioctl_output(const void *rbuf, int rlen, htsbuf_queue_t *out)
+{
+  const SMB2_IOCTL_resp_t *resp = rbuf;
+  int off = letoh_32(resp->output_offset);
+  int cnt = letoh_32(resp->output_count);
+
+  if(rlen < sizeof(SMB2_IOCTL_resp_t) || off > rlen || cnt > rlen - off)
+    return -1;
+  htsbuf_append(out, rbuf + off, cnt);
+  return 0;
+}
+
+
+/**
+ * Reassemble DCE/RPC fragments into a stub. Returns 1 if more data
+ * is needed
+ */
+static int
+dcerpc_reassemble(const uint8_t *buf, int len, htsbuf_queue_t *stub)
+{
+  while(len >= 24) {
+    int flen = buf[8]  | buf[9] << 8;
+    int alen = buf[10] | buf[11] << 8;
+
+    if(flen < 24 + alen)
+      return -1;
+    if(flen > len)
+      return 1;
+
+    if(buf[2] != 2) // Response
+      return -1;
+
+    htsbuf_append(stub, buf + 24, flen - 24 - alen);
+
+    if(buf[3] & 2) // Last fragment
+      return 0;
+    buf += flen;
+    len -= flen;
+  }
+  return 1;
+}
+
+
+/**
+ * Enumerate shares using srvsvc over SMB2 (There is no RAP on SMB2)
+ */
 static int
-cifs_enum_shares(cifs_connection_t *cc, fa_dir_t *fd, 
+smb2_enum_shares(cifs_connection_t *cc, fa_dir_t *fd,
+                 char *errbuf, size_t errlen)
+{
+  cifs_tree_t *ct;
+  void *rbufs[2];
+  int rlens[2];
+  uint8_t file_id[16];
+  htsbuf_queue_t pipe, stubq;
+  char url[512];
+  char name[256];
+  int r, len;
+
+  ct = cifs_tree_connect(cc, "IPC$", errbuf, errlen, 0);
+  if(ct == NULL || ct == SAMBA_NEED_AUTH)
+    return -1;
+
+  // Open pipe and bind in one round trip
+  SMB2_CREATE_req_t *create =
+    smb2_create_req("srvsvc", FILE_READ_DATA | FILE_WRITE_DATA |
+                    FILE_READ_EA | FILE_WRITE_EA | FILE_READ_ATTRIBUTES |
+                    READ_CONTROL | SYNCHRONIZE, 0, &len);
+
+  SMB2_IOCTL_req_t *bind =
+    alloca(sizeof(SMB2_IOCTL_req_t) + sizeof(srvsvc_bind_req));
+  smb2_ioctl_req(bind, NULL, srvsvc_bind_req, sizeof(srvsvc_bind_req),
+                 cc->cc_max_transact_size);
+
+  const smb2_cmd_t cmds[2] = {
+    {SMB2_CREATE, create, len, 0},
+    {SMB2_IOCTL, bind,
+     sizeof(SMB2_IOCTL_req_t) + sizeof(srvsvc_bind_req),
+     cc->cc_max_transact_size},
+  };
+
+  r = smb2_transact(cc, ct->ct_tid, cmds, 2, rbufs, rlens);
+  free(create);
+
+  if(r) {
+    smb2_free_replies(rbufs, 2);
+    return release_tree_io_error(ct, errbuf, errlen);
+  }
+
+  if(check_smb2_error(ct, rbufs, rlens, 2, 0, sizeof(SMB2_CREATE_resp_t),
+                      errbuf, errlen))
+    return -1;
+
+  memcpy(file_id, ((const SMB2_CREATE_resp_t *)rbufs[0])->file_id, 16);
+
+  htsbuf_queue_init(&pipe, 0);
+  htsbuf_queue_init(&stubq, 0);
+
+  if(smb2_check_reply(rbufs[1], rlens[1], sizeof(SMB2_IOCTL_resp_t),
+                      errbuf, errlen) ||
+     smb2_ioctl_output(rbufs[1], rlens[1], &pipe) ||
+     pipe.hq_size < 24 || htsbuf_peek(&pipe, name, 24) != 24 ||
+     name[2] != 12) { // Bind ack
+    snprintf(errbuf, errlen, "Unable to bind to srvsvc");
+    smb2_free_replies(rbufs, 2);
+    goto fail;
+  }
+  smb2_free_replies(rbufs, 2);
+  htsbuf_queue_flush(&pipe);
+
+  void *rpc = srvsvc_share_enum_req(cc->cc_hostname, &len);
+  SMB2_IOCTL_req_t *ioctl = alloca(sizeof(SMB2_IOCTL_req_t) + len);
+  smb2_ioctl_req(ioctl, file_id, rpc, len, cc->cc_max_transact_size);
+  free(rpc);
+
+  const smb2_cmd_t cmd = {SMB2_IOCTL, ioctl, sizeof(SMB2_IOCTL_req_t) + len,
+                          cc->cc_max_transact_size};
+
+  r = smb2_transact(cc, ct->ct_tid, &cmd, 1, rbufs, rlens);
+  const SMB2_t *h = rbufs[0];
+
+  if(r || h == NULL ||
+     (h->status && h->status != htole_32(STATUS_BUFFER_OVERFLOW)) ||
+     smb2_ioctl_output(rbufs[0], rlens[0], &pipe)) {
+    snprintf(errbuf, errlen, "NetShareEnum failed");
+    free(rbufs[0]);
+    goto fail;
+  }
+  free(rbufs[0]);
+
+  // Read rest of reply from pipe
+  while(1) {
+    uint8_t *raw = malloc(pipe.hq_size);
+    htsbuf_peek(&pipe, raw, pipe.hq_size);
+    r = dcerpc_reassemble(raw, pipe.hq_size, &stubq);
+    free(raw);
+
+    if(r <= 0)
+      break;
+
+    htsbuf_queue_flush(&stubq);
+
+    SMB2_READ_req_t rd;
+    memset(&rd, 0, sizeof(rd));
+    rd.structure_size = htole_16(49);
+    rd.length = htole_32(cc->cc_max_transact_size);
+    memcpy(rd.file_id, file_id, 16);
+
+    const smb2_cmd_t rcmd = {SMB2_READ, &rd, sizeof(rd),
+                             cc->cc_max_transact_size};
+
+    r = smb2_transact(cc, ct->ct_tid, &rcmd, 1, rbufs, rlens);
+    const SMB2_READ_resp_t *resp = rbufs[0];
+    if(r || resp == NULL ||
+       (resp->hdr.status &&
+        resp->hdr.status != htole_32(STATUS_BUFFER_OVERFLOW)) ||
+       rlens[0] < sizeof(SMB2_READ_resp_t) ||
+       resp->data_offset + letoh_32(resp->data_length) > rlens[0]) {
+      free(rbufs[0]);
+      r = -1;
+      break;
+    }
+    htsbuf_append(&pipe, rbufs[0] + resp->data_offset,
+                  letoh_32(resp->data_length));
+    free(rbufs[0]);
+  }
+
+  if(r) {
+    snprintf(errbuf, errlen, "Malformed NetShareEnum reply");
+    goto fail;
+  }
+
+  ndr_reader_t nd = {0};
+  nd.nd_len = stubq.hq_size;
+  uint8_t *stub = malloc(nd.nd_len);
+  htsbuf_read(&stubq, stub, nd.nd_len);
+  nd.nd_buf = stub;
+
+  ndr_u32(&nd); // Level
+  ndr_u32(&nd); // Union switch
+  ndr_u32(&nd); // Container referent
+  int entries = ndr_u32(&nd);
+  ndr_u32(&nd); // Buffer referent
+  ndr_u32(&nd); // Max count
+
+  if(nd.nd_err || entries < 0 || entries > (nd.nd_len - nd.nd_off) / 12) {
+    free(stub);
+    snprintf(errbuf, errlen, "Malformed NetShareEnum reply");
+    goto fail;
+  }
+
+  int i, base = nd.nd_off;
+
+  snprintf(url, sizeof(url), "smb://%s", cc->cc_hostname);
+  if(cc->cc_port != 445)
+    snprintf(url + strlen(url), sizeof(url) - strlen(url), ":%d",
+	     cc->cc_port);
+  int ul = strlen(url);
+
+  // Strings are deferred after the array of fixed size parts
+  nd.nd_off = base + entries * 12;
+  for(i = 0; i < entries && !nd.nd_err; i++) {
+    const uint32_t *e = (const uint32_t *)(stub + base + i * 12);
+    uint32_t type = letoh_32(e[1]);
+
+    name[0] = 0;
+    if(e[0])
+      ndr_string(&nd, name, sizeof(name));
+    if(e[2]) {
+      char remark[256];
+      ndr_string(&nd, remark, sizeof(remark));
+    }
+
+    if(type == 0 && name[0] && !nd.nd_err) {
+      fa_dir_entry_t *fde;
+      snprintf(url + ul, sizeof(url) - ul, "/%s", name);
+      fde = fa_dir_add(fd, url, name, CONTENT_DIR);
+      if(fde != NULL)
+	fde->fde_statdone = 1;
+    }
+  }
+  free(stub);
+
+  htsbuf_queue_flush(&pipe);
+  htsbuf_queue_flush(&stubq);
+  smb2_close_handle(cc, ct->ct_tid, file_id);
+  cifs_release_tree(ct, 0);
+  return 0;
+
+ fail:
+  htsbuf_queue_flush(&pipe);
+  htsbuf_queue_flush(&stubq);
+  smb2_close_handle(cc, ct->ct_tid, file_id);
+  cifs_release_tree(ct, 0);
+  return -1;
+}
+
+
+/**
+ *
+ */
+static int
+cifs_enum_shares(cifs_connection_t *cc, fa_dir_t *fd,
 		 char *errbuf, size_t errlen)
 {
   fa_dir_entry_t *fde;
@@ -2011,12 +3935,15 @@ cifs_enum_shares(cifs_connection_t *cc, fa_dir_t *fd,
   char url[512];
   int tlen = sizeof(TRANS_req_t) + 32;
 
+  if(cc->cc_smb2)
+    return smb2_enum_shares(cc, fd, errbuf, errlen);
+
   req = alloca(tlen);
 
   memset(req, 0, tlen);
 
-  ct = smb_tree_connect_andX(cc, "IPC$", errbuf, errlen, 0);
-  if(ct == NULL)
+  ct = cifs_tree_connect(cc, "IPC$", errbuf, errlen, 0);
+  if(ct == NULL || ct == SAMBA_NEED_AUTH)
     return -1;
 
   smb_init_header(ct->ct_cc, &req->hdr, SMB_TRANSACTION,
@@ -2035,15 +3962,15 @@ cifs_enum_shares(cifs_connection_t *cc, fa_dir_t *fd,
 
   if(nbt_async_req_reply(ct->ct_cc, req, tlen, &rbuf, &rlen, 0))
     return release_tree_io_error(ct, errbuf, errlen);
-  
+
   if(check_smb_error(ct, rbuf, rlen, sizeof(TRANS_reply_t), errbuf, errlen))
     return -1;
 
   resp = rbuf;
-  
+
   int poff = letoh_16(resp->param_offset);
   int doff = letoh_16(resp->data_offset);
-  
+
   if(poff + 8 > rlen) {
     free(rbuf);
     return release_tree_protocol_error(ct, errbuf, errlen);
@@ -2057,7 +3984,7 @@ cifs_enum_shares(cifs_connection_t *cc, fa_dir_t *fd,
     snprintf(errbuf, errlen, "RPC status %d", letoh_16(params[0]));
     return -1;
   }
-  
+
   snprintf(url, sizeof(url), "smb://%s", ct->ct_cc->cc_hostname);
   if(ct->ct_cc->cc_port != 445)
     snprintf(url + strlen(url), sizeof(url) - strlen(url), ":%d",
@@ -2080,8 +4007,53 @@ cifs_enum_shares(cifs_connection_t *cc, fa_dir_t *fd,
   cifs_release_tree(ct, 0);
 
   free(rbuf);
-  return 0;  
+  return 0;
+
+}
+
+
+/**
+ * Delete using a delete-on-close open followed by close
+ */
+static int
+smb2_delete(cifs_tree_t *ct, const char *filename, char *errbuf,
+            size_t errlen, int dir)
+{
+  cifs_connection_t *cc = ct->ct_cc;
+  SMB2_CREATE_req_t *create;
+  SMB2_CLOSE_req_t close;
+  void *rbufs[2];
+  int rlens[2];
+  int len, r;
+
+  create = smb2_create_req(filename, DELETE | FILE_READ_ATTRIBUTES,
+                           FILE_DELETE_ON_CLOSE |
+                           (dir ? FILE_DIRECTORY_FILE :
+                            FILE_NON_DIRECTORY_FILE), &len);
+  smb2_close_req(&close, NULL);
+
+  const smb2_cmd_t cmds[2] = {
+    {SMB2_CREATE, create, len, 0},
+    {SMB2_CLOSE, &close, sizeof(close), 0},
+  };
+
+  r = smb2_transact(cc, ct->ct_tid, cmds, 2, rbufs, rlens);
+  free(create);
+
+  if(r) {
+    smb2_free_replies(rbufs, 2);
+    return release_tree_io_error(ct, errbuf, errlen);
+  }
 
+  if(check_smb2_error(ct, rbufs, rlens, 2, 0, sizeof(SMB2_CREATE_resp_t),
+                      errbuf, errlen) ||
+     check_smb2_error(ct, rbufs, rlens, 2, 1, sizeof(SMB2_t),
+                      errbuf, errlen))
+    return -1;
+
+  smb2_free_replies(rbufs, 2);
+  cifs_release_tree(ct, 0);
+  return 0;
 }
 
 
@@ -2097,14 +4069,18 @@ cifs_delete(const char *url, char *errbuf, size_t errlen, int dir)
   cifs_connection_t *cc;
 
   r = cifs_resolve(url, filename, sizeof(filename), errbuf, errlen,
-		   0, &ct, &cc);
+		   0, &ct, NULL);
 
   if(r != CIFS_RESOLVE_TREE)
     return -1;
 
-  backslashify(filename);
   cc = ct->ct_cc;
 
+  if(cc->cc_smb2)
+    return smb2_delete(ct, filename, errbuf, errlen, dir);
+
+  backslashify(filename);
+
   int plen = utf8_to_smb(cc, NULL, filename);
   int tlen;
   void *reqbuf;
@@ -2117,7 +4093,7 @@ cifs_delete(const char *url, char *errbuf, size_t errlen, int dir)
 		    SMB_FLAGS_CANONICAL_PATHNAMES, 0, ct->ct_tid, 1);
     utf8_to_smb(cc, req->data, filename);
     req->byte_count = htole_16(plen);
-    
+
   } else {
 
     tlen = sizeof(SMB_DELETE_FILE_req_t) + plen;
@@ -2133,7 +4109,7 @@ cifs_delete(const char *url, char *errbuf, size_t errlen, int dir)
 
   void *rbuf;
   int rlen;
-  
+
   if(nbt_async_req_reply(ct->ct_cc, reqbuf, tlen, &rbuf, &rlen, 0)) {
     snprintf(errbuf, errlen, "I/O error");
     cifs_release_tree(ct, 1);
@@ -2149,6 +4125,56 @@ cifs_delete(const char *url, char *errbuf, size_t errlen, int dir)
 }
 
 
+/**
+ * Stat using open + close in one compound, attributes are in the
+ * CREATE reply
+ */
+static int
+smb2_stat(cifs_tree_t *ct, const char *filename, fa_stat_t *fs,
+          char *errbuf, size_t errlen)
+{
+  SMB2_CREATE_req_t *create;
+  SMB2_CLOSE_req_t close;
+  void *rbufs[2];
+  int rlens[2];
+  int len, r;
+
+  create = smb2_create_req(filename, FILE_READ_ATTRIBUTES, 0, &len);
+  smb2_close_req(&close, NULL);
+
+  const smb2_cmd_t cmds[2] = {
+    {SMB2_CREATE, create, len, 0},
+    {SMB2_CLOSE, &close, sizeof(close), 0},
+  };
+
+  r = smb2_transact(ct->ct_cc, ct->ct_tid, cmds, 2, rbufs, rlens);
+  free(create);
+
+  if(r) {
+    smb2_free_replies(rbufs, 2);
+    return release_tree_io_error(ct, errbuf, errlen);
+  }
+
+  if(check_smb2_error(ct, rbufs, rlens, 2, 0, sizeof(SMB2_CREATE_resp_t),
+                      errbuf, errlen))
+    return -1;
+
+  const SMB2_CREATE_resp_t *resp = rbufs[0];
+
+  fs->fs_mtime = parsetime(resp->change);
+  if(letoh_32(resp->file_attributes) & 0x10) {
+    fs->fs_type = CONTENT_DIR;
+    fs->fs_size = 0;
+  } else {
+    fs->fs_type = CONTENT_FILE;
+    fs->fs_size = letoh_64(resp->file_size);
+  }
+
+  smb2_free_replies(rbufs, 2);
+  return 0;
+}
+
+
 /**
  *
  */
@@ -2156,6 +4182,9 @@ static int
 cifs_stat(cifs_tree_t *ct, const char *filename, fa_stat_t *fs,
 	  char *errbuf, size_t errlen)
 {
+  if(ct->ct_cc->cc_smb2)
+    return smb2_stat(ct, filename, fs, errbuf, errlen);
+
   char *fname = mystrdupa(filename);
   backslashify(fname);
   int plen = utf8_to_smb(ct->ct_cc, NULL, fname);
@@ -2170,7 +4199,7 @@ cifs_stat(cifs_tree_t *ct, const char *filename, fa_stat_t *fs,
     memset(req, 0, tlen);
     smb_init_t2_header(ct->ct_cc, &req->t2, TRANS2_QUERY_PATH_INFORMATION,
 		       6 + plen, 0, ct->ct_tid);
-  
+
     req->level_of_interest = htole_16(0x101+i);
     utf8_to_smb(ct->ct_cc, req->data, fname);
 
@@ -2185,7 +4214,7 @@ cifs_stat(cifs_tree_t *ct, const char *filename, fa_stat_t *fs,
     if(i == 0) {
       const BasicFileInfo_t *bfi = rbuf + letoh_16(t2resp->data_offset);
       uint32_t fa = letoh_32(bfi->file_attributes);
-      
+
       fs->fs_mtime = parsetime(bfi->change);
       if(fa & 0x10) {
 	fs->fs_type = CONTENT_DIR;
@@ -2205,6 +4234,165 @@ cifs_stat(cifs_tree_t *ct, const char *filename, fa_stat_t *fs,
 }
 
 
+/**
+ *
+ */
+static SMB2_QUERY_DIRECTORY_req_t *
+smb2_query_directory_req(const uint8_t *file_id, int outlen, int *lenp)
+{
+  int tlen = sizeof(SMB2_QUERY_DIRECTORY_req_t) + 2;
+  SMB2_QUERY_DIRECTORY_req_t *req = calloc(1, tlen);
+
+  req->structure_size = htole_16(33);
+  req->file_info_class = FILE_DIRECTORY_INFORMATION;
+  if(file_id != NULL)
+    memcpy(req->file_id, file_id, 16);
+  else
+    memset(req->file_id, 0xff, 16);
+  req->file_name_offset =
+    htole_16(sizeof(SMB2_t) + sizeof(SMB2_QUERY_DIRECTORY_req_t));
+  req->file_name_length = htole_16(2);
+  req->output_buffer_length = htole_32(outlen);
+  req->buffer[0] = '*';
+  *lenp = tlen;
+  return req;
+}
+
+
+/**
+ * Open directory and query first batch of entries in one round trip
+ */
+static int
+smb2_scandir(cifs_tree_t *ct, const char *path, fa_dir_t *fd,
+             char *errbuf, size_t errlen)
+{
+  cifs_connection_t *cc = ct->ct_cc;
+  SMB2_CREATE_req_t *create;
+  SMB2_QUERY_DIRECTORY_req_t *query;
+  void *rbufs[2];
+  int rlens[2];
+  uint8_t file_id[16];
+  uint8_t fname[512];
+  char url[1024];
+  char *urlbase;
+  size_t urlspace;
+  int len, qlen, r;
+  const int outlen = cc->cc_max_transact_size;
+
+  snprintf(url, sizeof(url), "smb://%s", cc->cc_hostname);
+  if(cc->cc_port != 445)
+    snprintf(url + strlen(url), sizeof(url) - strlen(url), ":%d",
+	     cc->cc_port);
+  snprintf(url + strlen(url), sizeof(url) - strlen(url),
+	   "/%s/%s%s", ct->ct_share, path, *path ? "/" : "");
+  urlbase = url + strlen(url);
+  urlspace = sizeof(url) - strlen(url);
+
+  create = smb2_create_req(path, FILE_LIST_DIRECTORY | FILE_READ_ATTRIBUTES |
+                           SYNCHRONIZE, FILE_DIRECTORY_FILE, &len);
+  query = smb2_query_directory_req(NULL, outlen, &qlen);
+
+  const smb2_cmd_t cmds[2] = {
+    {SMB2_CREATE, create, len, 0},
+    {SMB2_QUERY_DIRECTORY, query, qlen, outlen},
+  };
+
+  r = smb2_transact(cc, ct->ct_tid, cmds, 2, rbufs, rlens);
+  free(create);
+
+  if(r) {
+    free(query);
+    smb2_free_replies(rbufs, 2);
+    return release_tree_io_error(ct, errbuf, errlen);
+  }
+
+  if(check_smb2_error(ct, rbufs, rlens, 2, 0, sizeof(SMB2_CREATE_resp_t),
+                      errbuf, errlen)) {
+    free(query);
+    return -1;
+  }
+
+  memcpy(file_id, ((const SMB2_CREATE_resp_t *)rbufs[0])->file_id, 16);
+  memcpy(query->file_id, file_id, 16);
+  free(rbufs[0]);
+
+  void *rbuf = rbufs[1];
+  int rlen = rlens[1];
+
+  while(1) {
+    const SMB2_QUERY_resp_t *resp = rbuf;
+
+    if(rbuf == NULL) {
+      r = -1;
+      snprintf(errbuf, errlen, "I/O error");
+      break;
+    }
+
+    if(resp->hdr.status == htole_32(STATUS_NO_MORE_FILES))
+      break;
+
+    if(smb2_check_reply(rbuf, rlen, sizeof(SMB2_QUERY_resp_t),
+                        errbuf, errlen)) {
+      r = -1;
+      break;
+    }
+
+    unsigned int off = letoh_16(resp->output_buffer_offset);
+    unsigned int end = off + letoh_32(resp->output_buffer_length);
+    if(end > rlen) {
+      r = -1;
+      snprintf(errbuf, errlen, "Short packet");
+      break;
+    }
+
+    while(off + sizeof(SMB2_DIRECTORY_INFO_t) <= end) {
+      const SMB2_DIRECTORY_INFO_t *data = rbuf + off;
+      unsigned int nlen = letoh_32(data->file_name_len);
+
+      if(off + sizeof(SMB2_DIRECTORY_INFO_t) + nlen > end)
+        break;
+
+      ucs2_to_utf8(fname, sizeof(fname), data->filename, nlen, 1);
+
+      snprintf(urlbase, urlspace, "%s", fname);
+
+      int isdir = letoh_32(data->file_attributes) & 0x10;
+
+      fa_dir_entry_t *fde = fa_dir_add(fd, url, (char *)fname,
+                                       isdir ? CONTENT_DIR : CONTENT_FILE);
+      if(fde != NULL) {
+	fde->fde_stat.fs_size = letoh_64(data->file_size);
+	fde->fde_stat.fs_mtime = parsetime(data->change);
+	fde->fde_statdone = 1;
+      }
+
+      int neo = letoh_32(data->next_entry_offset);
+      if(neo == 0)
+	break;
+      off += neo;
+    }
+
+    free(rbuf);
+
+    const smb2_cmd_t cmd = {SMB2_QUERY_DIRECTORY, query, qlen, outlen};
+    if(smb2_transact(cc, ct->ct_tid, &cmd, 1, &rbuf, &rlen)) {
+      free(rbuf);
+      rbuf = NULL;
+    }
+  }
+
+  free(rbuf);
+  free(query);
+  smb2_close_handle(cc, ct->ct_tid, file_id);
+
+  if(r) {
+    cifs_release_tree(ct, 0);
+    return -1;
+  }
+  return 0;
+}
+
+
 /**
  *
  */
@@ -2227,6 +4415,9 @@ cifs_scandir(cifs_tree_t *ct, const char *path, fa_dir_t *fd,
   char *urlbase;
   size_t urlspace;
 
+  if(ct->ct_cc->cc_smb2)
+    return smb2_scandir(ct, path, fd, errbuf, errlen);
+
   snprintf((char *)fname, sizeof(fname), "%s/*", path);
 
   backslashify((char *)fname);
@@ -2253,7 +4444,7 @@ cifs_scandir(cifs_tree_t *ct, const char *path, fa_dir_t *fd,
 
       smb_init_t2_header(ct->ct_cc, &req->t2, TRANS2_FIND_FIRST2,
 			 12 + plen, 0, ct->ct_tid);
-  
+
       req->first.search_attribs    = htole_16(ATTR_READONLY |
 					      ATTR_DIRECTORY |
 					      ATTR_ARCHIVE);
@@ -2266,109 +4457,434 @@ cifs_scandir(cifs_tree_t *ct, const char *path, fa_dir_t *fd,
 
       smb_init_t2_header(ct->ct_cc, &req->t2, TRANS2_FIND_NEXT2,
 			 12 + 1, 0, ct->ct_tid);
-    
+
       req->next.search_id = search_id;
 
-      req->next.search_count      = htole_16(search_count);
-      req->next.flags             = htole_16(0xe);
-      req->next.level_of_interest = htole_16(260);
-      
-      req->data[0] = 0;
-      tlen = sizeof(SMB_TRANS2_FIND_req_t) + 1;
-    }
+      req->next.search_count      = htole_16(search_count);
+      req->next.flags             = htole_16(0xe);
+      req->next.level_of_interest = htole_16(260);
+
+      req->data[0] = 0;
+      tlen = sizeof(SMB_TRANS2_FIND_req_t) + 1;
+    }
+
+    if(nbt_async_req_reply(ct->ct_cc, req, tlen, &rbuf, &rlen, 1))
+      return release_tree_io_error(ct, errbuf, errlen);
+
+    if(check_smb_error(ct, rbuf, rlen, sizeof(TRANS2_reply_t), errbuf, errlen))
+      return -1;
+
+    t2resp = (const TRANS2_reply_t *)rbuf;
+    int poff = letoh_16(t2resp->param_offset);
+    if(search_id == -1) {
+      respparam = rbuf + poff;
+      search_id = respparam->search_id;
+    } else {
+      if(poff < 2) {
+	free(rbuf);
+	return release_tree_protocol_error(ct, errbuf, errlen);
+      }
+      respparam = rbuf + poff-2;
+    }
+
+    int eos = respparam->end_of_search;
+    unsigned int off = letoh_16(t2resp->data_offset);
+
+    for(off = letoh_16(t2resp->data_offset) ;
+	off + sizeof(SMB_FIND_DATA_t) < rlen ;) {
+      data = rbuf + off;
+
+      ucs2_to_utf8(fname, sizeof(fname),
+		   data->filename, htole_32(data->file_name_len), 1);
+
+      snprintf(urlbase, urlspace, "%s", fname);
+
+      int isdir = letoh_32(data->file_attributes) & 0x10;
+
+      fde = fa_dir_add(fd, url, (char *)fname,
+		       isdir ? CONTENT_DIR : CONTENT_FILE);
+      if(fde != NULL) {
+	fde->fde_stat.fs_size = letoh_64(data->file_size);
+	fde->fde_stat.fs_mtime = parsetime(data->change);
+	fde->fde_statdone = 1;
+      }
+
+      int neo = letoh_32(data->next_entry_offset);
+      if(neo == 0)
+	break;
+      off += neo;
+    }
+
+    free(rbuf);
+    if(eos)
+      break;
+  }
+  return 0;
+}
+
+
+static int
+smb_scandir(fa_protocol_t *fap, fa_dir_t *fa, const char *url,
+            char *errbuf, size_t errlen)
+{
+  char filename[512];
+  cifs_tree_t *ct;
+  cifs_connection_t *cc;
+  int r;
+  r = cifs_resolve(url, filename, sizeof(filename), errbuf, errlen, 0,
+		   &ct, &cc);
+  switch(r) {
+  default:
+    return -1;
+
+  case CIFS_RESOLVE_TREE:
+    if(cifs_scandir(ct, filename, fa, errbuf, errlen))
+      return -1;
+
+    cifs_release_tree(ct, 0);
+    return 0;
+
+  case CIFS_RESOLVE_CONNECTION:
+    return cifs_enum_shares(cc, fa, errbuf, errlen);
+  }
+}
+
+
+/**
+ * A read request, possibly still in flight
+ */
+typedef struct smb_read_seg {
+  TAILQ_ENTRY(smb_read_seg) srs_link;
+  nbt_req_t *srs_nr;      // Pending request, NULL once reply is parsed
+  uint64_t srs_offset;
+  int srs_size;           // Requested bytes
+  int srs_len;            // Received bytes, less than size at EOF
+  void *srs_buf;          // Reply buffer
+  const uint8_t *srs_data;
+} smb_read_seg_t;
+
+
+/**
+ *
+ */
+typedef struct smb_file {
+  fa_handle_t h;
+  cifs_tree_t *sf_ct;
+  uint16_t sf_fid;
+  uint8_t sf_file_id[16];
+  uint64_t sf_pos;
+  uint64_t sf_file_size;
+
+  uint64_t sf_read_end;   // End of last issued read segment
+  uint64_t sf_prev_end;   // Where previous smb_read() call ended
+  struct smb_read_seg_queue sf_segs;
+} smb_file_t;
+
+#define SMB_READAHEAD_CHUNKS 4
+
+
+/**
+ * Issue read for a segment. Must be called with cc_mutex held
+ *
+ * If 'nowait' is set we will not wait for SMB2 credits (used for
+ * read-ahead)
+ */
+static smb_read_seg_t *
+smb_read_seg_issue(smb_file_t *sf, uint64_t offset, int size, int nowait)
+{
+  cifs_tree_t *ct = sf->sf_ct;
+  cifs_connection_t *cc = ct->ct_cc;
+  smb_read_seg_t *seg;
+  nbt_req_t *nr;
+
+  if(cc->cc_smb2) {
+    SMB2_READ_req_t req;
+    memset(&req, 0, sizeof(req));
+    req.structure_size = htole_16(49);
+    req.length = htole_32(size);
+    req.offset = htole_64(offset);
+    memcpy(req.file_id, sf->sf_file_id, 16);
+
+    const smb2_cmd_t cmd = {SMB2_READ, &req, sizeof(req), size};
+
+    if(smb2_send(cc, ct->ct_tid, &cmd, 1, &nr, nowait))
+      return NULL;
+
+  } else {
+    SMB_READ_ANDX_req_t *req = alloca(sizeof(SMB_READ_ANDX_req_t));
+    memset(req, 0, sizeof(SMB_READ_ANDX_req_t));
+
+    smb_init_header(cc, &req->hdr, SMB_READ_ANDX,
+		    SMB_FLAGS_CANONICAL_PATHNAMES, 0, ct->ct_tid, 1);
+
+    req->fid = sf->sf_fid;
+    req->offset_low = htole_32((uint32_t)offset);
+    req->offset_high = htole_32((uint32_t)(offset >> 32));
+    req->max_count_low = htole_16(size & 0xffff);
+    req->max_count_high = htole_32(size >> 16);
+    req->wordcount = 12;
+    req->andx_command = 0xff;
+
+    nr = nbt_async_req(cc, req, sizeof(SMB_READ_ANDX_req_t), 0);
+  }
+
+  seg = calloc(1, sizeof(smb_read_seg_t));
+  seg->srs_nr = nr;
+  seg->srs_offset = offset;
+  seg->srs_size = size;
+  TAILQ_INSERT_TAIL(&sf->sf_segs, seg, srs_link);
+  sf->sf_read_end = offset + size;
+  return seg;
+}
+
+
+/**
+ * Parse reply for a read segment
+ */
+static int
+smb_read_seg_parse(cifs_connection_t *cc, smb_read_seg_t *seg,
+                   void *buf, int len)
+{
+  unsigned int off, cnt;
+
+  seg->srs_buf = buf;
+
+  if(cc->cc_smb2) {
+    const SMB2_READ_resp_t *resp = buf;
+
+    if(len < sizeof(SMB2_t))
+      return -1;
+
+    if(resp->hdr.status == htole_32(STATUS_END_OF_FILE)) {
+      seg->srs_len = 0;
+      return 0;
+    }
+
+    if(resp->hdr.status || len < sizeof(SMB2_READ_resp_t))
+      return -1;
+
+    off = resp->data_offset;
+    cnt = letoh_32(resp->data_length);
+
+  } else {
+    const SMB_READ_ANDX_resp_t *resp = buf;
+
+    if(len < sizeof(SMB_READ_ANDX_resp_t) || resp->hdr.errorcode)
+      return -1;
+
+    off = letoh_16(resp->data_offset);
+    cnt = letoh_16(resp->data_length_low);
+    cnt += letoh_32(resp->data_length_high) << 16;
+  }
+
+  if(off > len || cnt > len - off || cnt > seg->srs_size)
+    return -1;
+
+  seg->srs_data = buf + off;
+  seg->srs_len = cnt;
+  return 0;
+}
+
+
+/**
+ * Wait for segment to complete. Must be called with cc_mutex held
+ */
+static int
+smb_read_seg_wait(cifs_connection_t *cc, smb_read_seg_t *seg)
+{
+  nbt_req_t *nr = seg->srs_nr;
+  int r;
+
+  if(nr == NULL)
+    return seg->srs_buf == NULL ? -1 : 0;
+
+  r = nbt_wait(cc, nr);
+  LIST_REMOVE(nr, nr_link);
+  seg->srs_nr = NULL;
+
+  if(!r && smb_read_seg_parse(cc, seg, nr->nr_response,
+                              nr->nr_response_len)) {
+    r = -1;
+  } else if(r) {
+    free(nr->nr_response);
+  }
+
+  if(r) {
+    free(seg->srs_buf);
+    seg->srs_buf = NULL;
+  }
+  free(nr);
+  return r ? -1 : 0;
+}
 
-    if(nbt_async_req_reply(ct->ct_cc, req, tlen, &rbuf, &rlen, 1))
-      return release_tree_io_error(ct, errbuf, errlen);
 
-    if(check_smb_error(ct, rbuf, rlen, sizeof(TRANS2_reply_t), errbuf, errlen))
-      return -1;
+/**
+ * Must be called with cc_mutex held
+ */
+static void
+smb_read_seg_destroy(smb_file_t *sf, smb_read_seg_t *seg)
+{
+  nbt_req_t *nr = seg->srs_nr;
 
-    t2resp = (const TRANS2_reply_t *)rbuf;
-    int poff = letoh_16(t2resp->param_offset);
-    if(search_id == -1) {
-      respparam = rbuf + poff;
-      search_id = respparam->search_id;
+  if(nr != NULL) {
+    if(nr->nr_result == -1) {
+      // Still in flight, let dispatcher free it when reply arrives
+      nr->nr_orphan = 1;
     } else {
-      if(poff < 2) {
-	free(rbuf);
-	return -1;
-      }
-      respparam = rbuf + poff-2;
+      LIST_REMOVE(nr, nr_link);
+      free(nr->nr_response);
+      free(nr);
     }
+  }
+  TAILQ_REMOVE(&sf->sf_segs, seg, srs_link);
+  free(seg->srs_buf);
+  free(seg);
+}
 
-    int eos = respparam->end_of_search;
-    unsigned int off = letoh_16(t2resp->data_offset);
-
-    for(off = letoh_16(t2resp->data_offset) ;
-	off + sizeof(SMB_FIND_DATA_t) < rlen ;) {
-      data = rbuf + off;
-
-      ucs2_to_utf8(fname, sizeof(fname),
-		   data->filename, htole_32(data->file_name_len), 1);
 
-      snprintf(urlbase, urlspace, "%s", fname);
+/**
+ *
+ */
+static void
+smb_read_flush(smb_file_t *sf)
+{
+  smb_read_seg_t *seg;
+  while((seg = TAILQ_FIRST(&sf->sf_segs)) != NULL)
+    smb_read_seg_destroy(sf, seg);
+}
 
-      int isdir = letoh_32(data->file_attributes) & 0x10;
 
-      fde = fa_dir_add(fd, url, (char *)fname,
-		       isdir ? CONTENT_DIR : CONTENT_FILE);
-      if(fde != NULL) {
-	fde->fde_stat.fs_size = letoh_64(data->file_size);
-	fde->fde_stat.fs_mtime = parsetime(data->change);
-	fde->fde_statdone = 1;
-      }
+/**
+ * Size of each read request
+ */
+static int
+smb_read_chunk_size(const cifs_connection_t *cc)
+{
+  if(!cc->cc_smb2)
+    return 57344; // 14 * 4096 is max according to spec
 
-      int neo = letoh_32(data->next_entry_offset);
-      if(neo == 0)
-	break;
-      off += neo;
-    }
+  if(!cc->cc_large_mtu)
+    return cc->cc_max_read_size;
 
-    free(rbuf);
-    if(eos)
-      break;
-  }
-  return 0;
+  // Don't ask for more than we have credits for
+  return MIN(cc->cc_max_read_size, MAX(1, cc->cc_credits) * 65536);
 }
 
 
+/**
+ * Make sure reads for [sf_pos, end) are issued and issue read-ahead
+ * beyond that if access is sequential
+ */
 static int
-smb_scandir(fa_protocol_t *fap, fa_dir_t *fa, const char *url,
-            char *errbuf, size_t errlen)
+smb_read_fill(smb_file_t *sf, uint64_t end, int sequential)
 {
-  char filename[512];
-  cifs_tree_t *ct;
-  cifs_connection_t *cc;
-  int r;
-  r = cifs_resolve(url, filename, sizeof(filename), errbuf, errlen, 0, 
-		   &ct, &cc);
-  switch(r) {
-  default:
-    return -1;
+  cifs_connection_t *cc = sf->sf_ct->ct_cc;
+  int chunk, i;
 
-  case CIFS_RESOLVE_TREE:
-    if(cifs_scandir(ct, filename, fa, errbuf, errlen))
+  while(sf->sf_read_end < end) {
+    chunk = MIN(smb_read_chunk_size(cc), sf->sf_file_size - sf->sf_read_end);
+    if(smb_read_seg_issue(sf, sf->sf_read_end, chunk, 0) == NULL)
       return -1;
+  }
 
-    cifs_release_tree(ct, 0);
+  if(!sequential)
     return 0;
 
-  case CIFS_RESOLVE_CONNECTION:
-    return cifs_enum_shares(cc, fa, errbuf, errlen);
+  for(i = 0; i < SMB_READAHEAD_CHUNKS; i++) {
+    if(sf->sf_read_end >= sf->sf_file_size)
+      break;
+
+    chunk = MIN(smb_read_chunk_size(cc), sf->sf_file_size - sf->sf_read_end);
+    if(sf->sf_read_end >= end + (uint64_t)chunk * SMB_READAHEAD_CHUNKS)
+      break;
+
+    if(smb_read_seg_issue(sf, sf->sf_read_end, chunk, 1) == NULL)
+      break;
   }
+  return 0;
 }
 
+
+
 /**
  *
  */
-typedef struct smb_file {
-  fa_handle_t h;
-  cifs_tree_t *sf_ct;
-  uint16_t sf_fid;
-  uint64_t sf_pos;
-  uint64_t sf_file_size;
-} smb_file_t;
+static fa_handle_t *
+smb2_open(fa_protocol_t *fap, cifs_tree_t *ct, const char *filename,
+          char *errbuf, size_t errlen)
+{
+  cifs_connection_t *cc = ct->ct_cc;
+  SMB2_CREATE_req_t *create;
+  SMB2_READ_req_t read;
+  nbt_req_t *nrs[2];
+  smb_file_t *sf;
+  int len, r;
+  const int rsize = MIN(SMB2_OPEN_READ_SIZE, cc->cc_max_read_size);
+
+  create = smb2_create_req(filename, 0x20089, FILE_NON_DIRECTORY_FILE, &len);
+
+  // Read the start of the file along with the open, most users
+  // (probing, etc) will want it right away
+  memset(&read, 0, sizeof(read));
+  read.structure_size = htole_16(49);
+  read.length = htole_32(rsize);
+  memset(read.file_id, 0xff, 16);
+
+  const smb2_cmd_t cmds[2] = {
+    {SMB2_CREATE, create, len, 0},
+    {SMB2_READ, &read, sizeof(read), rsize},
+  };
+
+  hts_mutex_lock(&cc->cc_mutex);
+
+  r = smb2_send(cc, ct->ct_tid, cmds, 2, nrs, 0);
+  free(create);
 
+  if(r) {
+    hts_mutex_unlock(&cc->cc_mutex);
+    snprintf(errbuf, errlen, "I/O error");
+    cifs_release_tree(ct, 1);
+    return NULL;
+  }
+
+  sf = calloc(1, sizeof(smb_file_t));
+  sf->sf_ct = ct;
+  TAILQ_INIT(&sf->sf_segs);
+
+  smb_read_seg_t *seg = calloc(1, sizeof(smb_read_seg_t));
+  seg->srs_nr = nrs[1];
+  seg->srs_size = rsize;
+  TAILQ_INSERT_TAIL(&sf->sf_segs, seg, srs_link);
+
+  r = nbt_wait(cc, nrs[0]);
+  LIST_REMOVE(nrs[0], nr_link);
+
+  void *rbuf = nrs[0]->nr_response;
+  int rlen = nrs[0]->nr_response_len;
+  free(nrs[0]);
+
+  if(r || smb2_check_reply(rbuf, rlen, sizeof(SMB2_CREATE_resp_t),
+                           errbuf, errlen)) {
+    if(r)
+      snprintf(errbuf, errlen, "I/O error");
+    smb_read_flush(sf);
+    hts_mutex_unlock(&cc->cc_mutex);
+    free(rbuf);
+    free(sf);
+    cifs_release_tree(ct, r != 0);
+    return NULL;
+  }
+
+  hts_mutex_unlock(&cc->cc_mutex);
+
+  const SMB2_CREATE_resp_t *resp = rbuf;
+  memcpy(sf->sf_file_id, resp->file_id, 16);
+  sf->sf_file_size = letoh_64(resp->file_size);
+  sf->sf_read_end = rsize;
+  sf->h.fh_proto = fap;
+  free(rbuf);
+  return &sf->h;
+}
 
 
 /**
@@ -2391,6 +4907,9 @@ smb_open(fa_protocol_t *fap, const char *url, char *errbuf, size_t errlen,
 
   cifs_connection_t *cc = ct->ct_cc;
 
+  if(cc->cc_smb2)
+    return smb2_open(fap, ct, filename, errbuf, errlen);
+
   backslashify(filename);
 
   int plen = utf8_to_smb(cc, NULL, filename);
@@ -2398,13 +4917,13 @@ smb_open(fa_protocol_t *fap, const char *url, char *errbuf, size_t errlen,
 
   void *rbuf;
   int rlen;
-  
+
   req = alloca(tlen);
   memset(req, 0, tlen);
 
   smb_init_header(cc, &req->hdr, SMB_NT_CREATE_ANDX,
 		  SMB_FLAGS_CANONICAL_PATHNAMES, 0, ct->ct_tid, 1);
-  
+
   req->wordcount=24;
   req->andx_command = 0xff;
   req->access_mask = htole_32(0x20089);
@@ -2417,7 +4936,7 @@ smb_open(fa_protocol_t *fap, const char *url, char *errbuf, size_t errlen,
   utf8_to_smb(cc, req->data + cc->cc_unicode, filename);
   req->name_len = htole_16(plen - cc->cc_unicode - 1);
   req->byte_count = htole_16(plen + cc->cc_unicode);
-  
+
   if(nbt_async_req_reply(ct->ct_cc, req, tlen, &rbuf, &rlen, 0)) {
     snprintf(errbuf, errlen, "I/O error");
     cifs_release_tree(ct, 1);
@@ -2428,10 +4947,9 @@ smb_open(fa_protocol_t *fap, const char *url, char *errbuf, size_t errlen,
 		     errbuf, errlen))
     return NULL;
 
-  hts_mutex_unlock(&smb_global_mutex);
-
   sf = calloc(1, sizeof(smb_file_t));
   sf->sf_ct = ct;  // transfer reference of 'sf' to smb_file_t
+  TAILQ_INIT(&sf->sf_segs);
 
   resp = rbuf;
   sf->sf_fid = resp->fid;
@@ -2451,37 +4969,51 @@ smb_close(fa_handle_t *fh)
   smb_file_t *sf = (smb_file_t *)fh;
   SMB_CLOSE_req_t *req;
   cifs_tree_t *ct = sf->sf_ct;
+  cifs_connection_t *cc = ct->ct_cc;
 
-  hts_mutex_lock(&smb_global_mutex);
+  hts_mutex_lock(&cc->cc_mutex);
 
-  req = alloca(sizeof(SMB_CLOSE_req_t));
-  memset(req, 0, sizeof(SMB_CLOSE_req_t));
+  smb_read_flush(sf);
+
+  if(cc->cc_smb2) {
+    SMB2_CLOSE_req_t close;
+    smb2_close_req(&close, sf->sf_file_id);
+    const smb2_cmd_t cmd = {SMB2_CLOSE, &close, sizeof(close), 0};
+    smb2_send(cc, ct->ct_tid, &cmd, 1, NULL, 0);
+
+  } else if(!cc->cc_disconnected) {
+
+    req = alloca(sizeof(SMB_CLOSE_req_t));
+    memset(req, 0, sizeof(SMB_CLOSE_req_t));
+
+    smb_init_header(cc, &req->hdr, SMB_CLOSE,
+                    SMB_FLAGS_CANONICAL_PATHNAMES, 0, ct->ct_tid, 1);
+
+    req->fid = sf->sf_fid;
+    req->wordcount = 3;
+    nbt_write(cc, req, sizeof(SMB_CLOSE_req_t));
+  }
+
+  hts_mutex_unlock(&cc->cc_mutex);
 
-  smb_init_header(ct->ct_cc, &req->hdr, SMB_CLOSE,
-		  SMB_FLAGS_CANONICAL_PATHNAMES, 0, ct->ct_tid, 1);
-  
-  req->fid = sf->sf_fid;
-  req->wordcount = 3;
-  nbt_write(ct->ct_cc, req, sizeof(SMB_CLOSE_req_t));
   cifs_release_tree(sf->sf_ct, 0);
   free(sf);
 }
 
 
 /**
- *
+ * Reads are split into segments that are all sent before we wait for
+ * any of them. If the file is read sequentially we also keep a few
+ * segments in flight beyond the requested range so the next read
+ * (hopefully) finds its data already received
  */
 static int
 smb_read(fa_handle_t *fh, void *buf, size_t size)
 {
   smb_file_t *sf = (smb_file_t *)fh;
-  SMB_READ_ANDX_req_t *req;
-  const SMB_READ_ANDX_resp_t *resp;
-  size_t cnt, rcnt;
+  cifs_connection_t *cc = sf->sf_ct->ct_cc;
+  smb_read_seg_t *seg;
   size_t total = 0;
-  cifs_tree_t *ct = sf->sf_ct;
-  nbt_req_t *nr = NULL;
-  struct nbt_req_list reqs;
 
   if(sf->sf_pos >= sf->sf_file_size)
     return 0;
@@ -2492,95 +5024,58 @@ smb_read(fa_handle_t *fh, void *buf, size_t size)
   if(size == 0)
     return 0;
 
-  LIST_INIT(&reqs);
-
-  req = alloca(sizeof(SMB_READ_ANDX_req_t));
-  memset(req, 0, sizeof(SMB_READ_ANDX_req_t));
+  const int sequential = sf->sf_pos == sf->sf_prev_end;
 
-  hts_mutex_lock(&smb_global_mutex);
-
-  while(size > 0) {
-    cnt = MIN(size, 57344); // 14 * 4096 is max according to spec
-    smb_init_header(ct->ct_cc, &req->hdr, SMB_READ_ANDX,
-		    SMB_FLAGS_CANONICAL_PATHNAMES, 0, ct->ct_tid, 1);
-    
-    req->fid = sf->sf_fid;
-    int64_t pos = sf->sf_pos + total;
-    req->offset_low = htole_32((uint32_t)pos);
-    req->offset_high = htole_32((uint32_t)(pos >> 32));
-    req->max_count_low = htole_16(cnt & 0xffff);
-    req->max_count_high = htole_32(cnt >> 16);
-    req->wordcount = 12;
-    req->andx_command = 0xff;
+  hts_mutex_lock(&cc->cc_mutex);
 
-    nr = nbt_async_req(ct->ct_cc, req, sizeof(SMB_READ_ANDX_req_t), 0);
-    LIST_INSERT_HEAD(&reqs, nr, nr_multi_link);
+  // Drop segments that do not cover current position (after seek)
+  while((seg = TAILQ_FIRST(&sf->sf_segs)) != NULL &&
+        (seg->srs_offset > sf->sf_pos ||
+         seg->srs_offset + seg->srs_size <= sf->sf_pos))
+    smb_read_seg_destroy(sf, seg);
 
-    nr->nr_offset = total;
-    nr->nr_cnt = cnt;
-    total += cnt;
-    size -= cnt;
-    nr->nr_last = 0;
-  }
-  nr->nr_last = 1;
+  if(seg == NULL)
+    sf->sf_read_end = sf->sf_pos;
 
-  while(1) {
-    LIST_FOREACH(nr, &reqs, nr_multi_link)
-      if(nr->nr_result == -1)
-	break;
+  if(smb_read_fill(sf, sf->sf_pos + size, sequential))
+    goto fail;
 
-    if(nr != NULL) {
-      if(hts_cond_wait_timeout(&ct->ct_cc->cc_cond, &smb_global_mutex,
-                               NBT_TIMEOUT)) {
-	break;
-      }
-    } else {
-      break;
-    }
-  }
-  
-  total = 0;
-  while((nr = LIST_FIRST(&reqs)) != NULL) {
-    if(nr->nr_result)
-      goto fail;
+  while(size > 0 && (seg = TAILQ_FIRST(&sf->sf_segs)) != NULL) {
 
-    resp = nr->nr_response;
-    uint32_t errcode = letoh_32(resp->hdr.errorcode);
-    if(errcode)
+    if(smb_read_seg_wait(cc, seg))
       goto fail;
 
-    LIST_REMOVE(nr, nr_link);
-    LIST_REMOVE(nr, nr_multi_link);
+    int skip = sf->sf_pos - seg->srs_offset;
+    int avail = seg->srs_len - skip;
 
-    rcnt = letoh_16(resp->data_length_low);
-    rcnt += letoh_32(resp->data_length_high) << 16;
-    memcpy(buf + nr->nr_offset, 
-	   nr->nr_response + letoh_16(resp->data_offset), rcnt);
-    free(nr->nr_response);
+    if(avail > 0) {
+      int cnt = MIN(avail, size);
+      memcpy(buf + total, seg->srs_data + skip, cnt);
+      total += cnt;
+      size -= cnt;
+      sf->sf_pos += cnt;
+      avail -= cnt;
+    }
 
-    sf->sf_pos += rcnt;
-    total += rcnt;
+    if(avail > 0)
+      break; // Request satisfied
 
-    if(nr->nr_last && rcnt < nr->nr_cnt) {
-      free(nr);
+    if(seg->srs_len < seg->srs_size) {
+      // Short read, we're at EOF (file shrunk?)
+      smb_read_flush(sf);
       break;
     }
-    free(nr);
+    smb_read_seg_destroy(sf, seg);
   }
-  hts_mutex_unlock(&smb_global_mutex);
+
+  hts_mutex_unlock(&cc->cc_mutex);
+  sf->sf_prev_end = sf->sf_pos;
   return total;
 
  fail:
-
-  while((nr = LIST_FIRST(&reqs)) != NULL) {
-    LIST_REMOVE(nr, nr_link);
-    LIST_REMOVE(nr, nr_multi_link);
-    free(nr->nr_response);
-    free(nr);
-  }
-  hts_mutex_unlock(&smb_global_mutex);
+  smb_read_flush(sf);
+  hts_mutex_unlock(&cc->cc_mutex);
   return -1;
-
 }
 
 
@@ -2637,7 +5132,7 @@ smb_stat(fa_protocol_t *fap, const char *url, struct fa_stat *fs,
   cifs_connection_t *cc;
   r = cifs_resolve(url, filename, sizeof(filename), errbuf, errlen,
 		   non_interactive, &ct, &cc);
-  
+
   switch(r) {
   default:
     return FAP_ERROR;
@@ -2656,6 +5151,7 @@ smb_stat(fa_protocol_t *fap, const char *url, struct fa_stat *fs,
     fs->fs_size = 0;
     fs->fs_mtime = 0;
     fs->fs_type = CONTENT_DIR;
+    hts_mutex_lock(&smb_global_mutex);
     cc->cc_refcount--;
     hts_mutex_unlock(&smb_global_mutex);
     return FAP_OK;
@@ -2685,6 +5181,9 @@ smb_rmdir(const fa_protocol_t *fap, const char *url,
 
 /**
  * Simple helper for setting one one EA
+ *
+ * Same layout as SMB2 FILE_FULL_EA_INFORMATION (list_len is
+ * next_entry_offset there)
  */
 typedef struct eahdr {
   uint32_t list_len;
@@ -2695,6 +5194,132 @@ typedef struct eahdr {
 
 } __attribute__((packed)) eahdr_t;
 
+
+/**
+ * Simple helper for getting one one EA
+ *
+ * Same layout as SMB2 FILE_GET_EA_INFORMATION
+ */
+typedef struct get_eahdr {
+  uint32_t list_len;
+  uint8_t name_len;
+  char data[0];
+} __attribute__((packed)) get_eahdr_t;
+
+
+/**
+ * Open, set or query EA and close in one compound
+ */
+static fa_err_code_t
+smb2_xattr(cifs_tree_t *ct, const char *filename, const char *name,
+           const void *data, size_t data_len, void **datap, size_t *lenp)
+{
+  cifs_connection_t *cc = ct->ct_cc;
+  const int name_len = strlen(name);
+  SMB2_CREATE_req_t *create;
+  SMB2_CLOSE_req_t close;
+  void *req, *rbufs[3];
+  int rlens[3];
+  int len, tlen, r, retcode;
+
+  if(datap == NULL) {
+    int dlen = sizeof(eahdr_t) + name_len + 1 + data_len;
+    tlen = sizeof(SMB2_SET_INFO_req_t) + dlen;
+    SMB2_SET_INFO_req_t *si = req = alloca(tlen);
+    memset(si, 0, tlen);
+    si->structure_size = htole_16(33);
+    si->info_type = SMB2_0_INFO_FILE;
+    si->file_info_class = FILE_FULL_EA_INFORMATION;
+    si->buffer_length = htole_32(dlen);
+    si->buffer_offset = htole_16(sizeof(SMB2_t) + sizeof(SMB2_SET_INFO_req_t));
+    memset(si->file_id, 0xff, 16);
+
+    eahdr_t *ea = (void *)si->buffer;
+    ea->name_len = name_len;
+    ea->data_len = htole_16(data_len);
+    memcpy(ea->data, name, name_len + 1);
+    if(data != NULL)
+      memcpy(ea->data + name_len + 1, data, data_len);
+
+    create = smb2_create_req(filename, FILE_WRITE_EA, 0, &len);
+
+  } else {
+    int dlen = sizeof(get_eahdr_t) + name_len + 1;
+    tlen = sizeof(SMB2_QUERY_INFO_req_t) + dlen;
+    SMB2_QUERY_INFO_req_t *qi = req = alloca(tlen);
+    memset(qi, 0, tlen);
+    qi->structure_size = htole_16(41);
+    qi->info_type = SMB2_0_INFO_FILE;
+    qi->file_info_class = FILE_FULL_EA_INFORMATION;
+    qi->output_buffer_length = htole_32(cc->cc_max_transact_size);
+    qi->input_buffer_offset =
+      htole_16(sizeof(SMB2_t) + sizeof(SMB2_QUERY_INFO_req_t));
+    qi->input_buffer_length = htole_32(dlen);
+    memset(qi->file_id, 0xff, 16);
+
+    get_eahdr_t *ea = (void *)qi->buffer;
+    ea->name_len = name_len;
+    memcpy(ea->data, name, name_len + 1);
+
+    create = smb2_create_req(filename, FILE_READ_EA, 0, &len);
+  }
+
+  smb2_close_req(&close, NULL);
+
+  const smb2_cmd_t cmds[3] = {
+    {SMB2_CREATE, create, len, 0},
+    {datap ? SMB2_QUERY_INFO : SMB2_SET_INFO, req, tlen,
+     datap ? cc->cc_max_transact_size : 0},
+    {SMB2_CLOSE, &close, sizeof(close), 0},
+  };
+
+  r = smb2_transact(cc, ct->ct_tid, cmds, 3, rbufs, rlens);
+  free(create);
+
+  if(r) {
+    smb2_free_replies(rbufs, 3);
+    cifs_release_tree(ct, 1);
+    return FAP_ERROR;
+  }
+
+  const SMB2_QUERY_resp_t *resp = rbufs[1];
+
+  if(resp == NULL || resp->hdr.status) {
+    retcode = datap ? FAP_ERROR : FAP_NOT_SUPPORTED;
+  } else if(datap == NULL) {
+    retcode = FAP_OK;
+  } else {
+    int offset = letoh_16(resp->output_buffer_offset);
+    int olen   = letoh_32(resp->output_buffer_length);
+
+    if(rlens[1] < sizeof(SMB2_QUERY_resp_t) || olen < sizeof(eahdr_t) ||
+       offset + olen > rlens[1]) {
+      retcode = FAP_ERROR;
+    } else {
+      const eahdr_t *ea = rbufs[1] + offset;
+      const int dlen = letoh_16(ea->data_len);
+      if(sizeof(eahdr_t) + ea->name_len + 1 + dlen > olen) {
+        retcode = FAP_ERROR;
+      } else {
+        retcode = FAP_OK;
+        if(dlen > 0) {
+          *datap = malloc(dlen);
+          memcpy(*datap, ea->data + ea->name_len + 1, dlen);
+          *lenp = dlen;
+        } else {
+          *datap = NULL;
+          *lenp = 0;
+        }
+      }
+    }
+  }
+
+  smb2_free_replies(rbufs, 3);
+  cifs_release_tree(ct, 0);
+  return retcode;
+}
+
+
 /**
  * Set extended attribute
  */
@@ -2706,17 +5331,19 @@ smb_set_xattr(struct fa_protocol *fap, const char *url,
   char filename[512];
   int r;
   cifs_tree_t *ct;
-  cifs_connection_t *cc;
   const int name_len = strlen(name);
 
   if(data == NULL)
     data_len = 0;
 
-  r = cifs_resolve(url, filename, sizeof(filename), NULL, 0, 0, &ct, &cc);
+  r = cifs_resolve(url, filename, sizeof(filename), NULL, 0, 0, &ct, NULL);
 
   if(r != CIFS_RESOLVE_TREE)
     return -1;
 
+  if(ct->ct_cc->cc_smb2)
+    return smb2_xattr(ct, filename, name, data, data_len, NULL, NULL);
+
   backslashify(filename);
 
   int plen = utf8_to_smb(ct->ct_cc, NULL, filename);
@@ -2754,14 +5381,6 @@ smb_set_xattr(struct fa_protocol *fap, const char *url,
   return FAP_OK;
 }
 
-/**
- * Simple helper for getting one one EA
- */
-typedef struct get_eahdr {
-  uint32_t list_len;
-  uint8_t name_len;
-  char data[0];
-} __attribute__((packed)) get_eahdr_t;
 
 /**
  * Get extended attribute
@@ -2774,16 +5393,17 @@ smb_get_xattr(struct fa_protocol *fap, const char *url,
   char filename[512];
   int r;
   cifs_tree_t *ct;
-  cifs_connection_t *cc;
   const int name_len = strlen(name);
 
-  r = cifs_resolve(url, filename, sizeof(filename), NULL, 0, 0, &ct, &cc);
+  r = cifs_resolve(url, filename, sizeof(filename), NULL, 0, 0, &ct, NULL);
 
   if(r != CIFS_RESOLVE_TREE)
     return -1;
 
+  if(ct->ct_cc->cc_smb2)
+    return smb2_xattr(ct, filename, name, NULL, 0, datap, lenp);
+
   backslashify(filename);
-  cc = ct->ct_cc;
   int plen = utf8_to_smb(ct->ct_cc, NULL, filename);
   int dlen = sizeof(get_eahdr_t) + name_len + 1;
   int tlen = sizeof(SMB_TRANS2_PATH_QUERY_req_t) + plen + dlen;
@@ -2849,28 +5469,47 @@ static void
 cifs_periodic(struct callout *c, void *opaque)
 {
   cifs_connection_t *cc = opaque;
+  int sent = 1;
 
-  EchoRequest_t *req = alloca(sizeof(EchoRequest_t) + 2);
-  memset(req, 0, sizeof(EchoRequest_t) + 2);
+  hts_mutex_lock(&cc->cc_mutex);
 
-  hts_mutex_lock(&smb_global_mutex);
+  if(cc->cc_smb2) {
+    const SMB2_ECHO_req_t req = {htole_16(4)};
+    const smb2_cmd_t cmd = {SMB2_ECHO, &req, sizeof(req), 0};
+    uint64_t mid = cc->cc_message_id;
+
+    // If we're out of credits the connection is busy anyway
+    sent = !smb2_send(cc, 0, &cmd, 1, NULL, 1);
+    if(sent)
+      cc->cc_echo_mid = mid;
+
+  } else if(!cc->cc_disconnected) {
+
+    EchoRequest_t *req = alloca(sizeof(EchoRequest_t) + 2);
+    memset(req, 0, sizeof(EchoRequest_t) + 2);
 
-  smb_init_header(cc, &req->hdr, SMB_ECHO, 0, 0, 0, 1);
-  req->wordcount = 1;
-  req->echo_count = htole_16(1);
-  req->byte_count = htole_16(2);
-  req->data[0] = 0x13;
-  req->data[1] = 0x37;
+    smb_init_header(cc, &req->hdr, SMB_ECHO, 0, 0, 0, 1);
+    req->wordcount = 1;
+    req->echo_count = htole_16(1);
+    req->byte_count = htole_16(2);
+    req->data[0] = 0x13;
+    req->data[1] = 0x37;
 
-  req->hdr.pid = htole_16(3); // PING
-  nbt_write(cc, req, sizeof(EchoRequest_t) + 2);
+    req->hdr.pid = htole_16(3); // PING
+    nbt_write(cc, req, sizeof(EchoRequest_t) + 2);
+  }
 
   if(cc->cc_wait_for_ping) {
     cc->cc_broken = 1;
     SMBTRACE("%s:%d no ping response", cc->cc_hostname, cc->cc_port);
   }
 
-  cc->cc_wait_for_ping = 1;
+  if(sent)
+    cc->cc_wait_for_ping = 1;
+
+  hts_mutex_unlock(&cc->cc_mutex);
+
+  hts_mutex_lock(&smb_global_mutex);
 
   callout_arm(&cc->cc_timer, cifs_periodic, cc, SMB_ECHO_INTERVAL);
   cc->cc_auto_close++;
@@ -88,6 +88,12 @@ typedef struct fa_protocol {
    */
   int64_t (*fap_fsize)(fa_handle_t *fh);
 
+  /**
+   * stat(2) an open file, avoids a round trip to the server if the
+   * protocol already knows the answer from when the file was opened
+   */
+  int (*fap_fstat)(fa_handle_t *fh, struct fa_stat *buf);
+
   /**
    * stat(2) file
    *
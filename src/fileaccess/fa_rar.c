@@ -132,6 +132,8 @@ typedef struct rar_volume {
  */
 typedef struct rar_file {
   struct rar_segment_queue rf_segments;
+  struct rar_segment **rf_segvec;  // Same as rf_segments, sorted on offset
+  int rf_nsegs;
   struct rar_file_list rf_files;
 
   char *rf_name;
@@ -228,6 +230,7 @@ rar_archive_destroy_file(rar_file_t *rf)
     TAILQ_REMOVE(&rf->rf_segments, rs, rs_link);
     free(rs);
   }
+  free(rf->rf_segvec);
 
   while((c = LIST_FIRST(&rf->rf_files)) != NULL)
     rar_archive_destroy_file(c);
@@ -411,6 +414,11 @@ rar_archive_load(rar_archive_t *ra)
 	rs->rs_size = packsize;
 	rf->rf_size += packsize;
 	TAILQ_INSERT_TAIL(&rf->rf_segments, rs, rs_link);
+
+	if((rf->rf_nsegs & (rf->rf_nsegs - 1)) == 0)
+	  rf->rf_segvec = realloc(rf->rf_segvec, sizeof(rar_segment_t *) *
+				  MAX(rf->rf_nsegs * 2, 1));
+	rf->rf_segvec[rf->rf_nsegs++] = rs;
       }
 
       free(fname);
@@ -651,15 +659,45 @@ rar_unreference(fa_handle_t *fh)
 }
 
 
+#define RAR_VOLUME_POOL_SIZE  3
+#define RAR_PREFETCH_SIZE     (256 * 1024)
+#define RAR_PREFETCH_DISTANCE (4 * 1024 * 1024)
+
+
+/**
+ * Open handle to a volume
+ */
+typedef struct rar_volfh {
+  rar_volume_t *rvh_volume;
+  void *rvh_fh;
+  int rvh_lru;
+} rar_volfh_t;
+
+
 /**
  *
  */
 typedef struct rar_fd {
   fa_handle_t h;
   rar_file_t *rfd_file;
-  rar_segment_t *rfd_segment;
-  void *rfd_fh;
+  int rfd_segidx;       // Index of current segment, -1 if none
   int64_t rfd_fpos;
+
+  rar_volfh_t rfd_pool[RAR_VOLUME_POOL_SIZE];
+  int rfd_lru;
+
+  /**
+   * Prefetch of the start of the next segment. Only touched by the
+   * prefetch thread while rfd_pf_running is set, the reader joins
+   * the thread before looking at the result
+   */
+  hts_thread_t rfd_pf_thread;
+  int rfd_pf_running;
+  int rfd_pf_segidx;    // -1 if none
+  void *rfd_pf_fh;
+  uint8_t *rfd_pf_buf;
+  int rfd_pf_len;
+
 } rar_fd_t;
 
 
@@ -693,12 +731,35 @@ rar_open(fa_protocol_t *fap, const char *url, char *errbuf, size_t errlen,
 
   rfd = calloc(1, sizeof(rar_fd_t));
   rfd->rfd_file = rf;
+  rfd->rfd_segidx = -1;
+  rfd->rfd_pf_segidx = -1;
 
   rfd->h.fh_proto = fap;
   return &rfd->h;
 }
 
 
+/**
+ * Wait for prefetch to finish and drop whatever it produced
+ */
+static void
+rar_prefetch_reset(rar_fd_t *rfd)
+{
+  if(rfd->rfd_pf_running) {
+    hts_thread_join(&rfd->rfd_pf_thread);
+    rfd->rfd_pf_running = 0;
+  }
+  if(rfd->rfd_pf_fh != NULL) {
+    fa_close(rfd->rfd_pf_fh);
+    rfd->rfd_pf_fh = NULL;
+  }
+  free(rfd->rfd_pf_buf);
+  rfd->rfd_pf_buf = NULL;
+  rfd->rfd_pf_len = 0;
+  rfd->rfd_pf_segidx = -1;
+}
+
+
 /**
  *
  */
@@ -706,15 +767,182 @@ static void
 rar_close(fa_handle_t *handle)
 {
   rar_fd_t *rfd = (rar_fd_t *)handle;
+  int i;
 
-  if(rfd->rfd_fh != NULL)
-    fa_close(rfd->rfd_fh);
+  rar_prefetch_reset(rfd);
+
+  for(i = 0; i < RAR_VOLUME_POOL_SIZE; i++)
+    if(rfd->rfd_pool[i].rvh_fh != NULL)
+      fa_close(rfd->rfd_pool[i].rvh_fh);
 
   rar_file_unref(rfd->rfd_file);
   free(rfd);
 }
 
 
+/**
+ * Find index of segment containing 'pos'
+ */
+static int
+rar_segment_find(const rar_file_t *rf, int64_t pos)
+{
+  int lo = 0, hi = rf->rf_nsegs;
+
+  while(lo < hi) {
+    int mid = (lo + hi) / 2;
+    const rar_segment_t *rs = rf->rf_segvec[mid];
+    if(pos >= rs->rs_offset + rs->rs_size)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < rf->rf_nsegs ? lo : -1;
+}
+
+
+/**
+ * Insert an open volume handle in the pool, evicting the least
+ * recently used one if full
+ */
+static rar_volfh_t *
+rar_pool_insert(rar_fd_t *rfd, rar_volume_t *rv, void *fh)
+{
+  rar_volfh_t *rvh = &rfd->rfd_pool[0];
+  int i;
+
+  for(i = 0; i < RAR_VOLUME_POOL_SIZE; i++) {
+    if(rfd->rfd_pool[i].rvh_fh == NULL) {
+      rvh = &rfd->rfd_pool[i];
+      break;
+    }
+    if(rfd->rfd_pool[i].rvh_lru < rvh->rvh_lru)
+      rvh = &rfd->rfd_pool[i];
+  }
+
+  if(rvh->rvh_fh != NULL)
+    fa_close(rvh->rvh_fh);
+
+  rvh->rvh_volume = rv;
+  rvh->rvh_fh = fh;
+  rvh->rvh_lru = ++rfd->rfd_lru;
+  return rvh;
+}
+
+
+/**
+ *
+ */
+static rar_volfh_t *
+rar_pool_find(rar_fd_t *rfd, const rar_volume_t *rv)
+{
+  int i;
+  for(i = 0; i < RAR_VOLUME_POOL_SIZE; i++)
+    if(rfd->rfd_pool[i].rvh_fh != NULL && rfd->rfd_pool[i].rvh_volume == rv)
+      return &rfd->rfd_pool[i];
+  return NULL;
+}
+
+
+/**
+ * Get an open handle for a volume
+ */
+static void *
+rar_volume_get(rar_fd_t *rfd, rar_volume_t *rv)
+{
+  rar_volfh_t *rvh = rar_pool_find(rfd, rv);
+  void *fh;
+
+  if(rvh != NULL) {
+    rvh->rvh_lru = ++rfd->rfd_lru;
+    return rvh->rvh_fh;
+  }
+
+  if((fh = fa_open(rv->rv_url, NULL, 0)) == NULL)
+    return NULL;
+
+  return rar_pool_insert(rfd, rv, fh)->rvh_fh;
+}
+
+
+/**
+ * Open volume of rfd_pf_segidx and read the first part of the segment
+ */
+static void *
+rar_prefetch_thread(void *aux)
+{
+  rar_fd_t *rfd = aux;
+  const rar_segment_t *rs = rfd->rfd_file->rf_segvec[rfd->rfd_pf_segidx];
+  int len = MIN(rs->rs_size, RAR_PREFETCH_SIZE);
+
+  rfd->rfd_pf_fh = fa_open(rs->rs_volume->rv_url, NULL, 0);
+  if(rfd->rfd_pf_fh == NULL)
+    return NULL;
+
+  if(fa_seek(rfd->rfd_pf_fh, rs->rs_voffset, SEEK_SET) != rs->rs_voffset)
+    return NULL;
+
+  rfd->rfd_pf_buf = malloc(len);
+  if(fa_read(rfd->rfd_pf_fh, rfd->rfd_pf_buf, len) == len)
+    rfd->rfd_pf_len = len;
+  return NULL;
+}
+
+
+/**
+ * Start prefetching next segment if we are getting close to the end
+ * of the current one and it lives in a volume we don't have open
+ */
+static void
+rar_prefetch_check(rar_fd_t *rfd)
+{
+  const rar_file_t *rf = rfd->rfd_file;
+  const int next = rfd->rfd_segidx + 1;
+  const rar_segment_t *rs;
+
+  if(rfd->rfd_segidx < 0 || next >= rf->rf_nsegs ||
+     rfd->rfd_pf_segidx == next)
+    return;
+
+  rs = rf->rf_segvec[rfd->rfd_segidx];
+  if(rs->rs_offset + rs->rs_size - rfd->rfd_fpos > RAR_PREFETCH_DISTANCE)
+    return;
+
+  if(rar_pool_find(rfd, rf->rf_segvec[next]->rs_volume) != NULL)
+    return;
+
+  rar_prefetch_reset(rfd);
+  rfd->rfd_pf_segidx = next;
+  rfd->rfd_pf_running = 1;
+  hts_thread_create_joinable("rar prefetch", &rfd->rfd_pf_thread,
+			     rar_prefetch_thread, rfd, THREAD_PRIO_FILESYSTEM);
+}
+
+
+/**
+ * Switch to segment 'idx'. If it has been prefetched its volume handle
+ * is moved to the pool
+ */
+static void
+rar_segment_enter(rar_fd_t *rfd, int idx)
+{
+  rfd->rfd_segidx = idx;
+
+  if(rfd->rfd_pf_segidx != idx)
+    return;
+
+  if(rfd->rfd_pf_running) {
+    hts_thread_join(&rfd->rfd_pf_thread);
+    rfd->rfd_pf_running = 0;
+  }
+
+  if(rfd->rfd_pf_fh != NULL) {
+    rar_pool_insert(rfd, rfd->rfd_file->rf_segvec[idx]->rs_volume,
+		    rfd->rfd_pf_fh);
+    rfd->rfd_pf_fh = NULL;
+  }
+}
+
+
 /**
  * Read from file
  */
@@ -726,27 +954,23 @@ rar_read(fa_handle_t *handle, void *buf, size_t size)
   rar_segment_t *rs;
   size_t c = 0, r, w;
   int64_t o;
+  void *fh;
   int x;
 
   if(rfd->rfd_fpos + size > rf->rf_size)
     size = rf->rf_size - rfd->rfd_fpos;
 
   while(c < size) {
-    if((rs = rfd->rfd_segment) == NULL || 
+    rs = rfd->rfd_segidx >= 0 ? rf->rf_segvec[rfd->rfd_segidx] : NULL;
+
+    if(rs == NULL ||
        rfd->rfd_fpos < rs->rs_offset ||
        rfd->rfd_fpos >= rs->rs_offset + rs->rs_size) {
       
-      if(rfd->rfd_fh != NULL) {
-	fa_close(rfd->rfd_fh);
-	rfd->rfd_fh = NULL;
-      }
-
-      TAILQ_FOREACH(rs, &rf->rf_segments, rs_link) {
-	if(rfd->rfd_fpos < rs->rs_offset + rs->rs_size)
-	  break;
-      }
-      if(rs == NULL)
+      if((x = rar_segment_find(rf, rfd->rfd_fpos)) == -1)
 	return -1;
+      rar_segment_enter(rfd, x);
+      rs = rf->rf_segvec[x];
     }
 
     w = size - c;
@@ -754,26 +978,36 @@ rar_read(fa_handle_t *handle, void *buf, size_t size)
 
     if(w < r)
       r = w;
-    
-    if(rfd->rfd_fh == NULL) {
-      rfd->rfd_fh = fa_open(rs->rs_volume->rv_url, NULL, 0);
-      if(rfd->rfd_fh == NULL)
+
+    o = rfd->rfd_fpos - rs->rs_offset;
+
+    if(rfd->rfd_pf_segidx == rfd->rfd_segidx && !rfd->rfd_pf_running &&
+       o < rfd->rfd_pf_len) {
+      // Served from prefetched data
+      x = MIN(r, rfd->rfd_pf_len - o);
+      memcpy(buf + c, rfd->rfd_pf_buf + o, x);
+
+    } else {
+
+      if((fh = rar_volume_get(rfd, rs->rs_volume)) == NULL)
 	return -2;
-    }
 
-    o = rfd->rfd_fpos - rs->rs_offset + rs->rs_voffset;
+      o += rs->rs_voffset;
 
-    if(fa_seek(rfd->rfd_fh, o, SEEK_SET) < 0) {
-      return -1;
-    }
-    x = fa_read(rfd->rfd_fh, buf + c, r);
+      if(fa_seek(fh, o, SEEK_SET) < 0) {
+	return -1;
+      }
+      x = fa_read(fh, buf + c, r);
     
-    if(x != r)
-      return -1;
+      if(x != r)
+	return -1;
+    }
 
     rfd->rfd_fpos += x;
     c += x;
   }
+
+  rar_prefetch_check(rfd);
   return c;
 }
 
@@ -0,0 +1,540 @@
+/*
+ *  Showtime Mediacenter
+ *  Copyright (C) 2007-2013 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+
+/**
+ * Shared asynchronous read-ahead
+ *
+ * Sequential access on a handle is detected by looking at where reads
+ * start and end. Once a handle reads sequentially, pages ahead of the
+ * read position are queued. A few worker threads load them into a page
+ * pool shared by all handles. The pool has a fixed global budget and
+ * old pages are evicted in LRU order.
+ *
+ * The window (number of pages ahead) starts small. It is doubled every
+ * time the reader catches up with a page that is still loading. It is
+ * also capped to what the source can deliver in RA_MAX_LAG seconds,
+ * so slow sources don't queue up data that takes ages to arrive.
+ *
+ * Each handle has at most one page loading at a time and workers skip
+ * pages of handles whose source is busy, so a stalled source only ties
+ * up a single worker and never blocks read-ahead for other handles.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+
+#include "showtime.h"
+#include "fileaccess.h"
+#include "fa_proto.h"
+#include "prop/prop.h"
+
+#define RA_PAGE_SHIFT  16
+#define RA_PAGE_SIZE   (1 << RA_PAGE_SHIFT)
+
+#define RA_POOL_SIZE   (16 * 1024 * 1024)
+#define RA_POOL_PAGES  (RA_POOL_SIZE / RA_PAGE_SIZE)
+
+#define RA_MIN_WINDOW  2
+#define RA_MAX_WINDOW  64
+#define RA_MAX_LAG     2     // Seconds
+#define RA_SEQ_THRES   2     // Sequential reads before we start
+#define RA_WORKERS     2
+
+LIST_HEAD(ra_page_list, ra_page);
+TAILQ_HEAD(ra_page_queue, ra_page);
+LIST_HEAD(ra_stats_list, ra_stats);
+
+typedef enum {
+  RP_QUEUED,
+  RP_LOADING,
+  RP_DONE,
+  RP_FAILED,
+} ra_page_state_t;
+
+
+/**
+ *
+ */
+typedef struct ra_page {
+  TAILQ_ENTRY(ra_page) rp_link;  // In ra_lru if done, ra_workq if queued
+  LIST_ENTRY(ra_page) rp_file_link;
+  struct fa_readahead *rp_ra;
+  int64_t rp_fpos;
+  int rp_size;
+  ra_page_state_t rp_state;
+  uint8_t *rp_data;
+} ra_page_t;
+
+
+/**
+ * Counters per protocol
+ */
+typedef struct ra_stats {
+  LIST_ENTRY(ra_stats) rs_link;
+  const char *rs_name;
+  int rs_hits;
+  int rs_stalls;      // Hits on pages still loading
+  int rs_misses;
+  prop_t *rs_prop_hits;
+  prop_t *rs_prop_misses;
+  prop_t *rs_prop_hitrate;
+} ra_stats_t;
+
+
+/**
+ *
+ */
+struct fa_readahead {
+  fa_handle_t *ra_src;
+  int ra_src_busy;            // ra_src in use by a worker or the owner
+  int ra_destroyed;           // Owner is gone, worker closes ra_src
+  ra_stats_t *ra_stats;
+
+  struct ra_page_list ra_pages;
+  int ra_loading;
+
+  int64_t ra_next;            // Where next read is expected to start
+  int ra_seq;                 // Number of sequential reads
+  int ra_window;              // In pages
+  int64_t ra_eof;             // -1 if not known yet
+  int ra_bps;                 // Measured source throughput (bytes/s)
+};
+
+
+static hts_mutex_t ra_mutex;
+static hts_cond_t ra_work_cond;
+static hts_cond_t ra_done_cond;
+static struct ra_page_queue ra_lru;
+static struct ra_page_queue ra_workq;
+static struct ra_stats_list ra_stats;
+static int ra_num_pages;
+static int ra_workers_running;
+static prop_t *ra_prop_root;
+
+
+/**
+ *
+ */
+static void
+ra_page_destroy(ra_page_t *rp)
+{
+  if(rp->rp_state == RP_QUEUED)
+    TAILQ_REMOVE(&ra_workq, rp, rp_link);
+  else
+    TAILQ_REMOVE(&ra_lru, rp, rp_link);
+
+  LIST_REMOVE(rp, rp_file_link);
+  free(rp->rp_data);
+  free(rp);
+  ra_num_pages--;
+}
+
+
+/**
+ * Allocate a page, evicting the least recently used one if the
+ * pool is full
+ */
+static ra_page_t *
+ra_page_alloc(fa_readahead_t *ra, int64_t fpos)
+{
+  ra_page_t *rp;
+
+  if(ra_num_pages >= RA_POOL_PAGES) {
+    TAILQ_FOREACH(rp, &ra_lru, rp_link)
+      if(rp->rp_state != RP_LOADING)
+        break;
+    if(rp == NULL)
+      return NULL;
+    ra_page_destroy(rp);
+  }
+
+  rp = calloc(1, sizeof(ra_page_t));
+  rp->rp_data = malloc(RA_PAGE_SIZE);
+  rp->rp_ra = ra;
+  rp->rp_fpos = fpos;
+  rp->rp_state = RP_QUEUED;
+  LIST_INSERT_HEAD(&ra->ra_pages, rp, rp_file_link);
+  TAILQ_INSERT_TAIL(&ra_workq, rp, rp_link);
+  ra_num_pages++;
+  return rp;
+}
+
+
+/**
+ *
+ */
+static ra_page_t *
+ra_page_find(fa_readahead_t *ra, int64_t fpos)
+{
+  ra_page_t *rp;
+  LIST_FOREACH(rp, &ra->ra_pages, rp_file_link)
+    if(fpos >= rp->rp_fpos && fpos < rp->rp_fpos + RA_PAGE_SIZE)
+      return rp;
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static void
+ra_free(fa_readahead_t *ra)
+{
+  ra->ra_src->fh_proto->fap_close(ra->ra_src);
+  free(ra);
+}
+
+
+/**
+ *
+ */
+static void *
+ra_worker(void *aux)
+{
+  ra_page_t *rp;
+  fa_readahead_t *ra;
+  int r;
+
+  hts_mutex_lock(&ra_mutex);
+
+  while(1) {
+    // Skip pages for handles already busy with their source
+    TAILQ_FOREACH(rp, &ra_workq, rp_link)
+      if(!rp->rp_ra->ra_src_busy)
+        break;
+
+    if(rp == NULL) {
+      hts_cond_wait(&ra_work_cond, &ra_mutex);
+      continue;
+    }
+
+    ra = rp->rp_ra;
+    TAILQ_REMOVE(&ra_workq, rp, rp_link);
+    rp->rp_state = RP_LOADING;
+    TAILQ_INSERT_TAIL(&ra_lru, rp, rp_link);
+    ra->ra_loading++;
+    ra->ra_src_busy = 1;
+    hts_mutex_unlock(&ra_mutex);
+
+    fa_handle_t *src = ra->ra_src;
+    int64_t ts = showtime_get_ts();
+    if(src->fh_proto->fap_seek(src, rp->rp_fpos, SEEK_SET) == rp->rp_fpos)
+      r = src->fh_proto->fap_read(src, rp->rp_data, RA_PAGE_SIZE);
+    else
+      r = -1;
+    ts = showtime_get_ts() - ts;
+
+    hts_mutex_lock(&ra_mutex);
+    ra->ra_src_busy = 0;
+    ra->ra_loading--;
+
+    // Other workers may have skipped pages while we were busy
+    if(TAILQ_FIRST(&ra_workq) != NULL)
+      hts_cond_broadcast(&ra_work_cond);
+
+    if(ra->ra_destroyed) {
+      ra_page_destroy(rp);
+      hts_mutex_unlock(&ra_mutex);
+      ra_free(ra);
+      hts_mutex_lock(&ra_mutex);
+      continue;
+    }
+
+    if(r < 0) {
+      rp->rp_state = RP_FAILED;
+    } else {
+      rp->rp_state = RP_DONE;
+      rp->rp_size = r;
+      if(r < RA_PAGE_SIZE)
+        ra->ra_eof = rp->rp_fpos + r;
+
+      if(r > 0 && ts > 0) {
+        int bps = (int64_t)r * 1000000 / ts;
+        ra->ra_bps = ra->ra_bps ? (ra->ra_bps * 7 + bps) / 8 : bps;
+      }
+    }
+    hts_cond_broadcast(&ra_done_cond);
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static ra_stats_t *
+ra_stats_get(const char *name)
+{
+  ra_stats_t *rs;
+
+  LIST_FOREACH(rs, &ra_stats, rs_link)
+    if(!strcmp(rs->rs_name, name))
+      return rs;
+
+  rs = calloc(1, sizeof(ra_stats_t));
+  rs->rs_name = name;
+  LIST_INSERT_HEAD(&ra_stats, rs, rs_link);
+
+  prop_t *p = prop_create(ra_prop_root, name);
+  rs->rs_prop_hits    = prop_create_r(p, "hits");
+  rs->rs_prop_misses  = prop_create_r(p, "misses");
+  rs->rs_prop_hitrate = prop_create_r(p, "hitrate");
+  return rs;
+}
+
+
+/**
+ *
+ */
+static void
+ra_stats_update(ra_stats_t *rs)
+{
+  int total = rs->rs_hits + rs->rs_misses;
+
+  if(total & 31)
+    return;
+  prop_set_int(rs->rs_prop_hits, rs->rs_hits);
+  prop_set_int(rs->rs_prop_misses, rs->rs_misses);
+  prop_set_int(rs->rs_prop_hitrate, total ? rs->rs_hits * 100 / total : 0);
+}
+
+
+/**
+ *
+ */
+fa_readahead_t *
+fa_readahead_create(fa_handle_t *src)
+{
+  fa_readahead_t *ra = calloc(1, sizeof(fa_readahead_t));
+  int i;
+
+  ra->ra_src = src;
+  ra->ra_eof = -1;
+  ra->ra_window = RA_MIN_WINDOW;
+
+  hts_mutex_lock(&ra_mutex);
+  ra->ra_stats = ra_stats_get(src->fh_proto->fap_name);
+
+  if(!ra_workers_running) {
+    ra_workers_running = 1;
+    for(i = 0; i < RA_WORKERS; i++)
+      hts_thread_create_detached("readahead", ra_worker, NULL,
+                                 THREAD_PRIO_FILESYSTEM);
+  }
+  hts_mutex_unlock(&ra_mutex);
+  return ra;
+}
+
+
+/**
+ * Drop all pages and close the source handle. If a page is being
+ * loaded we don't wait for it, the worker closes the source once
+ * it's done
+ */
+void
+fa_readahead_destroy(fa_readahead_t *ra)
+{
+  ra_page_t *rp, *next;
+
+  hts_mutex_lock(&ra_mutex);
+
+  for(rp = LIST_FIRST(&ra->ra_pages); rp != NULL; rp = next) {
+    next = LIST_NEXT(rp, rp_file_link);
+    if(rp->rp_state != RP_LOADING)
+      ra_page_destroy(rp);
+  }
+
+  if(ra->ra_loading) {
+    ra->ra_destroyed = 1;
+    ra = NULL;
+  }
+  hts_mutex_unlock(&ra_mutex);
+
+  if(ra != NULL)
+    ra_free(ra);
+}
+
+
+/**
+ * Must be held while using the source handle outside of the engine.
+ * Waits for at most one page load since only one is in flight per handle
+ */
+void
+fa_readahead_lock(fa_readahead_t *ra)
+{
+  hts_mutex_lock(&ra_mutex);
+  while(ra->ra_src_busy)
+    hts_cond_wait(&ra_done_cond, &ra_mutex);
+  ra->ra_src_busy = 1;
+  hts_mutex_unlock(&ra_mutex);
+}
+
+
+/**
+ *
+ */
+void
+fa_readahead_unlock(fa_readahead_t *ra)
+{
+  hts_mutex_lock(&ra_mutex);
+  ra->ra_src_busy = 0;
+  if(TAILQ_FIRST(&ra_workq) != NULL)
+    hts_cond_broadcast(&ra_work_cond);
+  hts_mutex_unlock(&ra_mutex);
+}
+
+
+/**
+ * Copy data at 'fpos' from pool. Returns number of bytes copied,
+ * 0 if not available
+ */
+int
+fa_readahead_read(fa_readahead_t *ra, void *buf, int64_t fpos, size_t size)
+{
+  ra_stats_t *rs = ra->ra_stats;
+  ra_page_t *rp;
+  int r = 0;
+
+  hts_mutex_lock(&ra_mutex);
+
+  rp = ra_page_find(ra, fpos);
+
+  if(rp != NULL && rp->rp_state == RP_QUEUED) {
+    // Not started yet, caller is better off reading it directly
+    ra_page_destroy(rp);
+    rp = NULL;
+  }
+
+  if(rp != NULL && rp->rp_state == RP_LOADING) {
+    rs->rs_stalls++;
+    ra->ra_window = MIN(ra->ra_window * 2, RA_MAX_WINDOW);
+    // Page may be evicted once done so look it up again after waking
+    while((rp = ra_page_find(ra, fpos)) != NULL && rp->rp_state == RP_LOADING)
+      hts_cond_wait(&ra_done_cond, &ra_mutex);
+  }
+
+  if(rp != NULL && rp->rp_state == RP_DONE &&
+     fpos - rp->rp_fpos < rp->rp_size) {
+    int off = fpos - rp->rp_fpos;
+    r = MIN(size, rp->rp_size - off);
+    memcpy(buf, rp->rp_data + off, r);
+
+    TAILQ_REMOVE(&ra_lru, rp, rp_link);
+    TAILQ_INSERT_TAIL(&ra_lru, rp, rp_link);
+    rs->rs_hits++;
+  } else {
+    if(rp != NULL && rp->rp_state == RP_FAILED)
+      ra_page_destroy(rp);
+    rs->rs_misses++;
+  }
+
+  ra_stats_update(rs);
+  hts_mutex_unlock(&ra_mutex);
+  return r;
+}
+
+
+/**
+ * Tell the engine that 'size' bytes was read at 'fpos'. Queues pages
+ * ahead of the read position if access is sequential
+ */
+void
+fa_readahead_access(fa_readahead_t *ra, int64_t fpos, size_t size)
+{
+  ra_page_t *rp, *next;
+  int64_t pos, end;
+  int window, queued = 0;
+
+  hts_mutex_lock(&ra_mutex);
+
+  if(fpos == ra->ra_next) {
+    ra->ra_seq++;
+  } else {
+    // Random access, drop everything not yet started
+    ra->ra_seq = 0;
+    ra->ra_window = RA_MIN_WINDOW;
+    for(rp = LIST_FIRST(&ra->ra_pages); rp != NULL; rp = next) {
+      next = LIST_NEXT(rp, rp_file_link);
+      if(rp->rp_state == RP_QUEUED)
+        ra_page_destroy(rp);
+    }
+  }
+
+  ra->ra_next = fpos + size;
+
+  // Pages we've passed are not likely to be needed again
+  for(rp = LIST_FIRST(&ra->ra_pages); rp != NULL; rp = next) {
+    next = LIST_NEXT(rp, rp_file_link);
+    if(rp->rp_state != RP_LOADING && rp->rp_fpos + RA_PAGE_SIZE <= fpos)
+      ra_page_destroy(rp);
+  }
+
+  if(ra->ra_seq >= RA_SEQ_THRES) {
+
+    window = ra->ra_window;
+    if(ra->ra_bps)
+      window = MIN(window, MAX(RA_MIN_WINDOW,
+                               ra->ra_bps * RA_MAX_LAG / RA_PAGE_SIZE));
+
+    pos = ra->ra_next & ~(int64_t)(RA_PAGE_SIZE - 1);
+    end = pos + (int64_t)window * RA_PAGE_SIZE;
+    if(ra->ra_eof != -1)
+      end = MIN(end, ra->ra_eof);
+
+    for(; pos < end; pos += RA_PAGE_SIZE) {
+      if(ra_page_find(ra, pos) != NULL)
+        continue;
+      if(ra_page_alloc(ra, pos) == NULL)
+        break;
+      queued = 1;
+    }
+    if(queued)
+      hts_cond_broadcast(&ra_work_cond);
+  }
+  hts_mutex_unlock(&ra_mutex);
+}
+
+
+/**
+ *
+ */
+static void __attribute__((constructor))
+fa_readahead_init(void)
+{
+  hts_mutex_init(&ra_mutex);
+  hts_cond_init(&ra_work_cond, &ra_mutex);
+  hts_cond_init(&ra_done_cond, &ra_mutex);
+  TAILQ_INIT(&ra_lru);
+  TAILQ_INIT(&ra_workq);
+}
+
+
+/**
+ *
+ */
+static void
+fa_readahead_init_stats(void)
+{
+  ra_prop_root = prop_create(prop_create(prop_get_global(), "system"),
+                             "readahead");
+}
+
+INITME(INIT_GROUP_API, fa_readahead_init_stats);
@@ -35,6 +35,7 @@
 #include "playqueue.h"
 #include "misc/strtab.h"
 #include "prop/prop_nodefilter.h"
+#include "prop/prop_colstore.h"
 #include "plugins.h"
 #include "text/text.h"
 #include "db/kvstore.h"
@@ -50,6 +51,25 @@
 
 extern int media_buffer_hungry;
 
+/**
+ * Directories with this many entries are listed via a column store.
+ * Only rows the UI actually shows get a prop tree
+ */
+#define SCANNER_COLSTORE_THRESHOLD 1000
+
+/**
+ * Columns in the column store
+ */
+enum {
+  SCOL_URL,
+  SCOL_FILENAME,
+  SCOL_TYPE,
+  SCOL_TITLE,
+  SCOL_TIMESTAMP,
+  SCOL_NOTDIR,    // 0 for directories, for 'Sort folders first'
+  SCOL_HIDDEN,    // Unsupported while 'Show only supported files' is on
+};
+
 typedef enum {
   BROWSER_STOP,
   BROWSER_DIR,
@@ -88,6 +108,24 @@ typedef struct scanner {
 
   prop_courier_t *s_pc;
 
+  /**
+   * Column store used for large directories. s_cs_pc delivers its
+   * callbacks with s_mutex held. s_mutex must also be held when
+   * calling into s_cs and when changing s_rows or fields of entries
+   * read by scanner_cs_bind()
+   */
+  hts_mutex_t s_mutex;
+  prop_colstore_t *s_cs;
+  prop_courier_t *s_cs_pc;
+  fa_dir_entry_t **s_rows;
+  int s_nrows;
+  int s_rows_capacity;
+
+  int s_sortcol;
+  int s_sortdesc;
+  int s_dirsfirst;
+  int s_onlysupported;
+
 } scanner_t;
 
 
@@ -145,6 +183,242 @@ set_type(prop_t *proproot, unsigned int type)
 }
 
 
+/**
+ *
+ */
+static void
+fde_metadata_to_prop(fa_dir_entry_t *fde, prop_t *p, prop_t *meta)
+{
+  switch(fde->fde_type) {
+
+  case CONTENT_PLUGIN:
+    plugin_props_from_file(p, rstr_get(fde->fde_url));
+    break;
+
+  case CONTENT_FONT:
+    fontstash_props_from_title(p, rstr_get(fde->fde_url),
+                               rstr_get(fde->fde_filename));
+    break;
+
+  default:
+    metadata_to_proptree(fde->fde_md, meta, 1);
+    break;
+  }
+}
+
+
+/**
+ *
+ */
+static void
+fde_set_md(scanner_t *s, fa_dir_entry_t *fde, metadata_t *md)
+{
+  hts_mutex_lock(&s->s_mutex);
+  if(fde->fde_md != NULL)
+    metadata_destroy(fde->fde_md);
+  fde->fde_md = md;
+  if(md != NULL)
+    fde->fde_type = md->md_contenttype;
+  hts_mutex_unlock(&s->s_mutex);
+}
+
+
+/**
+ * Add what's been probed to a row of the column store
+ */
+static void
+scanner_cs_decorate(fa_dir_entry_t *fde, prop_t *p, int bind_playinfo)
+{
+  if(fde->fde_md == NULL || fde->fde_type == CONTENT_UNKNOWN)
+    return;
+
+  prop_t *meta = prop_create_r(p, "metadata");
+  fde_metadata_to_prop(fde, p, meta);
+  prop_ref_dec(meta);
+
+  if(bind_playinfo)
+    playinfo_bind_url_to_prop(rstr_get(fde->fde_url), p);
+}
+
+
+/**
+ * Called by the column store when a row gets a prop. s_mutex is held
+ */
+static void
+scanner_cs_bind(void *opaque, int row, prop_t *p)
+{
+  scanner_t *s = opaque;
+  fa_dir_entry_t *fde = s->s_rows[row];
+
+  if(fde == NULL)
+    return;
+
+  prop_set(p, "canDelete", PROP_SET_INT, gconf.fa_allow_delete);
+  scanner_cs_decorate(fde, p, 1);
+}
+
+
+/**
+ * Same as the 'Show only supported files' predicates on s_pnf
+ */
+static int
+scanner_cs_hidden(const scanner_t *s, const fa_dir_entry_t *fde)
+{
+  return s->s_onlysupported &&
+    (fde->fde_type == CONTENT_UNKNOWN || fde->fde_type == CONTENT_FILE);
+}
+
+
+/**
+ * Update columns derived from the entry. s_mutex is held
+ */
+static void
+scanner_cs_update(scanner_t *s, fa_dir_entry_t *fde)
+{
+  prop_colstore_t *cs = s->s_cs;
+  int row = fde->fde_csrow;
+
+  prop_colstore_set_str(cs, row, SCOL_TYPE, content2type(fde->fde_type));
+  prop_colstore_set_int(cs, row, SCOL_NOTDIR, fde->fde_type != CONTENT_DIR);
+  prop_colstore_set_int(cs, row, SCOL_HIDDEN, scanner_cs_hidden(s, fde));
+
+  if(fde->fde_statdone)
+    prop_colstore_set_int(cs, row, SCOL_TIMESTAMP, fde->fde_stat.fs_mtime);
+
+  if(fde->fde_md != NULL && fde->fde_md->md_title != NULL)
+    prop_colstore_set_rstr(cs, row, SCOL_TITLE, fde->fde_md->md_title);
+}
+
+
+/**
+ * Add a row for the entry. s_mutex is held
+ */
+static void
+scanner_cs_add(scanner_t *s, fa_dir_entry_t *fde)
+{
+  prop_colstore_t *cs = s->s_cs;
+  int row = prop_colstore_append(cs);
+  rstr_t *title;
+
+  if(row >= s->s_rows_capacity) {
+    s->s_rows_capacity = MAX(s->s_rows_capacity * 2, 1024);
+    s->s_rows = realloc(s->s_rows,
+                        s->s_rows_capacity * sizeof(fa_dir_entry_t *));
+  }
+  s->s_rows[row] = fde;
+  s->s_nrows = row + 1;
+  fde->fde_csrow = row;
+
+  if(fde->fde_type == CONTENT_DIR)
+    title = rstr_dup(fde->fde_filename);
+  else
+    title = metadata_remove_postfix_rstr(fde->fde_filename);
+
+  prop_colstore_set_rstr(cs, row, SCOL_URL, fde->fde_url);
+  prop_colstore_set_rstr(cs, row, SCOL_FILENAME, fde->fde_filename);
+  prop_colstore_set_rstr(cs, row, SCOL_TITLE, title);
+  rstr_release(title);
+  scanner_cs_update(s, fde);
+}
+
+
+/**
+ * List entries via a column store instead of a prop per entry
+ */
+static void
+scanner_cs_create(scanner_t *s)
+{
+  fa_dir_entry_t *fde;
+  prop_colstore_t *cs;
+
+  hts_mutex_lock(&s->s_mutex);
+
+  s->s_cs_pc = prop_courier_create_thread(&s->s_mutex, "fascanner", 0);
+  cs = s->s_cs = prop_colstore_create(s->s_nodes,
+                                      prop_create(s->s_model, "filter"),
+                                      0, 0, s->s_cs_pc, scanner_cs_bind, s);
+
+  prop_colstore_add_column(cs, "url", PROP_COLSTORE_STR, 0);
+  prop_colstore_add_column(cs, "filename", PROP_COLSTORE_STR,
+                           PROP_COLSTORE_SEARCHABLE);
+  prop_colstore_add_column(cs, "type", PROP_COLSTORE_STR, 0);
+  prop_colstore_add_column(cs, "metadata.title", PROP_COLSTORE_STR,
+                           PROP_COLSTORE_SEARCHABLE);
+  prop_colstore_add_column(cs, "metadata.timestamp", PROP_COLSTORE_INT, 0);
+  prop_colstore_add_column(cs, NULL, PROP_COLSTORE_INT, 0);
+  prop_colstore_add_column(cs, NULL, PROP_COLSTORE_INT,
+                           PROP_COLSTORE_EXCLUDE);
+
+  RB_FOREACH(fde, &s->s_fd->fd_entries, fde_link)
+    scanner_cs_add(s, fde);
+
+  prop_colstore_group(cs, s->s_dirsfirst ? SCOL_NOTDIR : -1);
+  prop_colstore_sort(cs, s->s_sortcol, s->s_sortdesc);
+  prop_colstore_flush(cs);
+
+  hts_mutex_unlock(&s->s_mutex);
+
+  SCAN_TRACE("%s: Listing %d items via column store",
+             s->s_url, s->s_fd->fd_count);
+}
+
+
+/**
+ *
+ */
+static void
+scanner_cs_destroy(scanner_t *s)
+{
+  if(s->s_cs == NULL)
+    return;
+
+  hts_mutex_lock(&s->s_mutex);
+  prop_colstore_destroy(s->s_cs);
+  s->s_cs = NULL;
+  hts_mutex_unlock(&s->s_mutex);
+
+  prop_courier_destroy(s->s_cs_pc);
+  s->s_cs_pc = NULL;
+
+  free(s->s_rows);
+  s->s_rows = NULL;
+  s->s_nrows = 0;
+  s->s_rows_capacity = 0;
+}
+
+
+/**
+ *
+ */
+static void
+scanner_cs_flush(scanner_t *s)
+{
+  hts_mutex_lock(&s->s_mutex);
+  if(s->s_cs != NULL)
+    prop_colstore_flush(s->s_cs);
+  hts_mutex_unlock(&s->s_mutex);
+}
+
+
+/**
+ * Entries with a premade metadata tree (from archive backends) are
+ * few and need their props, so only plain large directories qualify
+ */
+static int
+scanner_use_cs(scanner_t *s)
+{
+  fa_dir_entry_t *fde;
+
+  if(s->s_fd->fd_count < SCANNER_COLSTORE_THRESHOLD)
+    return 0;
+
+  RB_FOREACH(fde, &s->s_fd->fd_entries, fde_link)
+    if(fde->fde_metadata != NULL)
+      return 0;
+  return 1;
+}
+
+
 /**
  *
  */
@@ -267,6 +541,8 @@ type_from_filename(const char *filename)
 static void
 deep_probe(fa_dir_entry_t *fde, scanner_t *s)
 {
+  const int had_md = fde->fde_md != NULL && fde->fde_type != CONTENT_UNKNOWN;
+
   fde->fde_probestatus = FDE_PROBED_CONTENTS;
 
   SCAN_TRACE("Deep probing %s. Content_type:%s",
@@ -279,11 +555,8 @@ deep_probe(fa_dir_entry_t *fde, scanner_t *s)
     if(!fde->fde_ignore_cache && !fa_dir_entry_stat(fde) &&
        (fde->fde_md == NULL || !fde->fde_md->md_cache_status)) {
 
-      if(fde->fde_md != NULL)
-	metadata_destroy(fde->fde_md);
-
-      fde->fde_md = metadb_metadata_get(getdb(s), rstr_get(fde->fde_url),
-					fde->fde_stat.fs_mtime);
+      fde_set_md(s, fde, metadb_metadata_get(getdb(s), rstr_get(fde->fde_url),
+                                             fde->fde_stat.fs_mtime));
       SCAN_TRACE("%s: Metadata %sfound", rstr_get(fde->fde_url),
                  fde->fde_md ? "" : "not ");
     }
@@ -296,35 +569,19 @@ deep_probe(fa_dir_entry_t *fde, scanner_t *s)
     if(fde->fde_md == NULL) {
 
       if(fde->fde_type == CONTENT_DIR)
-        fde->fde_md = fa_probe_dir(rstr_get(fde->fde_url));
+        fde_set_md(s, fde, fa_probe_dir(rstr_get(fde->fde_url)));
       else {
-	fde->fde_md = fa_probe_metadata(rstr_get(fde->fde_url), NULL, 0,
-					rstr_get(fde->fde_filename));
+	fde_set_md(s, fde, fa_probe_metadata(rstr_get(fde->fde_url), NULL, 0,
+                                             rstr_get(fde->fde_filename)));
         is = INDEX_STATUS_FILE_ANALYZED;
       }
     }
     
     if(fde->fde_md != NULL) {
-      fde->fde_type = fde->fde_md->md_contenttype;
       fde->fde_ignore_cache = 0;
 
-      if(meta != NULL) {
-        switch(fde->fde_type) {
-
-        case CONTENT_PLUGIN:
-          plugin_props_from_file(fde->fde_prop, rstr_get(fde->fde_url));
-          break;
-	  
-        case CONTENT_FONT:
-          fontstash_props_from_title(fde->fde_prop, rstr_get(fde->fde_url),
-                                     rstr_get(fde->fde_filename));
-          break;
-          
-        default:
-          metadata_to_proptree(fde->fde_md, meta, 1);
-          break;
-        }
-      }
+      if(meta != NULL)
+        fde_metadata_to_prop(fde, fde->fde_prop, meta);
       SCAN_TRACE("%s: Cache status: %d",
                  rstr_get(fde->fde_url), fde->fde_md->md_cache_status);
 
@@ -357,6 +614,19 @@ deep_probe(fa_dir_entry_t *fde, scanner_t *s)
 
   if(fde->fde_prop != NULL)
     set_type(fde->fde_prop, fde->fde_type);
+
+  if(s->s_cs != NULL) {
+    hts_mutex_lock(&s->s_mutex);
+    scanner_cs_update(s, fde);
+
+    // Decorate the row if it is displayed, otherwise it's done on bind
+    prop_t *p = prop_colstore_get_prop(s->s_cs, fde->fde_csrow);
+    if(p != NULL) {
+      scanner_cs_decorate(fde, p, !had_md);
+      prop_ref_dec(p);
+    }
+    hts_mutex_unlock(&s->s_mutex);
+  }
 }
 
 
@@ -371,7 +641,23 @@ tryplay(scanner_t *s)
 
   fa_dir_entry_t *fde = fa_dir_find(s->s_fd, s->s_playme);
   if(fde != NULL) {
-    playqueue_load_with_source(fde->fde_prop, s->s_model, 0);
+    prop_t *p = prop_ref_inc(fde->fde_prop);
+
+    if(p == NULL && s->s_cs != NULL) {
+      hts_mutex_lock(&s->s_mutex);
+      p = prop_colstore_get_prop(s->s_cs, fde->fde_csrow);
+      hts_mutex_unlock(&s->s_mutex);
+    }
+
+    if(p != NULL) {
+      playqueue_load_with_source(p, s->s_model, 0);
+      prop_ref_dec(p);
+    } else {
+      // Not among the rows displayed, play it on its own
+      prop_t *meta = prop_create_root("metadata");
+      prop_set_rstring(prop_create(meta, "title"), fde->fde_filename);
+      playqueue_play(rstr_get(fde->fde_url), meta, 0);
+    }
     rstr_release(s->s_playme);
     s->s_playme = NULL;
   }
@@ -385,6 +671,7 @@ static void
 analyzer(scanner_t *s, int probe)
 {
   fa_dir_entry_t *fde;
+  int n = 0;
 
   /* Empty */
   if(s->s_fd->fd_count == 0)
@@ -403,15 +690,23 @@ analyzer(scanner_t *s, int probe)
       break;
 
     if(fde->fde_probestatus == FDE_PROBED_NONE) {
-      if(fde->fde_type == CONTENT_FILE)
+      if(fde->fde_type == CONTENT_FILE) {
+        hts_mutex_lock(&s->s_mutex);
 	fde->fde_type = type_from_filename(rstr_get(fde->fde_filename));
-
+        hts_mutex_unlock(&s->s_mutex);
+      }
       fde->fde_probestatus = FDE_PROBED_FILENAME;
     }
 
-    if(fde->fde_probestatus == FDE_PROBED_FILENAME && probe)
+    if(fde->fde_probestatus == FDE_PROBED_FILENAME && probe) {
       deep_probe(fde, s);
+
+      // Reposition probed rows in batches, each flush is O(rows)
+      if(s->s_cs != NULL && ++n % 256 == 0)
+        scanner_cs_flush(s);
+    }
   }
+  scanner_cs_flush(s);
 }
 
 
@@ -427,6 +722,8 @@ scanner_create(const char *url, time_t mtime)
   s->s_url = strdup(url);
   s->s_mode = BROWSER_DIR;
   s->s_mtime = mtime;
+  s->s_sortcol = SCOL_TITLE;
+  hts_mutex_init(&s->s_mutex);
   return s;
 }
 
@@ -440,6 +737,7 @@ scanner_destroy(scanner_t *s)
   closedb(s);
   free(s->s_url);
   prop_courier_destroy(s->s_pc);
+  hts_mutex_destroy(&s->s_mutex);
   free(s);
 }
 
@@ -474,6 +772,13 @@ scanner_entry_setup(scanner_t *s, fa_dir_entry_t *fde, const char *src)
   if(s->s_nodes == NULL)
     return 0;
 
+  if(s->s_cs != NULL) {
+    hts_mutex_lock(&s->s_mutex);
+    scanner_cs_add(s, fde);
+    hts_mutex_unlock(&s->s_mutex);
+    return 1;
+  }
+
   make_prop(fde);
 
   if(!prop_set_parent(fde->fde_prop, s->s_nodes))
@@ -496,6 +801,13 @@ scanner_entry_destroy(scanner_t *s, fa_dir_entry_t *fde, const char *src)
   metadb_unparent_item(getdb(s), rstr_get(fde->fde_url));
   if(fde->fde_prop != NULL)
     prop_destroy(fde->fde_prop);
+
+  if(s->s_cs != NULL) {
+    hts_mutex_lock(&s->s_mutex);
+    prop_colstore_remove(s->s_cs, fde->fde_csrow);
+    s->s_rows[fde->fde_csrow] = NULL;
+    hts_mutex_unlock(&s->s_mutex);
+  }
   fa_dir_entry_free(s->s_fd, fde);
 }
 
@@ -566,7 +878,9 @@ rescan(scanner_t *s)
       if(!fa_dir_entry_stat(b) && 
 	 a->fde_stat.fs_mtime != b->fde_stat.fs_mtime) {
 	// Modification time has changed,  trig deep probe
+        hts_mutex_lock(&s->s_mutex);
 	a->fde_type = b->fde_type;
+        hts_mutex_unlock(&s->s_mutex);
 	a->fde_probestatus = FDE_PROBED_NONE;
 	a->fde_stat = b->fde_stat;
 	a->fde_ignore_cache = 1;
@@ -592,6 +906,7 @@ rescan(scanner_t *s)
   if(changed)
     analyzer(s, 1);
 
+  scanner_cs_flush(s);
   fa_dir_free(fd);
   return 0;
 }
@@ -635,9 +950,16 @@ doscan(scanner_t *s, int with_notify)
 
   if(s->s_fd != NULL) {
 
+    // Load playinfo etc for all entries with one query instead of one per row
+    kv_url_prefetch(s->s_url);
+
     analyzer(s, 0);
 
-    if(s->s_nodes != NULL) {
+    if(s->s_nodes != NULL && scanner_use_cs(s)) {
+
+      scanner_cs_create(s);
+
+    } else if(s->s_nodes != NULL) {
 
       prop_vec_t *pv = prop_vec_create(s->s_fd->fd_count);
     
@@ -674,6 +996,7 @@ doscan(scanner_t *s, int with_notify)
   if(n != NULL)
     fa_notify_stop(n);
 #endif
+  scanner_cs_destroy(s);
   fa_dir_free(s->s_fd);
   return err;
 }
@@ -776,10 +1099,19 @@ delete_items(scanner_t *s, prop_vec_t *pv)
 {
   char errbuf[256];
   for(int i = 0, c = prop_vec_len(pv); i < c; i++) {
-    fa_dir_entry_t *fde;
-    RB_FOREACH(fde, &s->s_fd->fd_entries, fde_link) {
-      if(fde->fde_prop == prop_vec_get(pv, i))
-        break;
+    fa_dir_entry_t *fde = NULL;
+
+    if(s->s_cs != NULL) {
+      hts_mutex_lock(&s->s_mutex);
+      int row = prop_colstore_find(s->s_cs, prop_vec_get(pv, i));
+      if(row != -1)
+        fde = s->s_rows[row];
+      hts_mutex_unlock(&s->s_mutex);
+    } else {
+      RB_FOREACH(fde, &s->s_fd->fd_entries, fde_link) {
+        if(fde->fde_prop == prop_vec_get(pv, i))
+          break;
+      }
     }
     if(fde == NULL)
       continue;
@@ -796,6 +1128,7 @@ delete_items(scanner_t *s, prop_vec_t *pv)
       scanner_entry_destroy(s, fde, "user");
     }
   }
+  scanner_cs_flush(s);
 }
 
 /**
@@ -924,6 +1257,56 @@ add_indexed_option(scanner_t *s, prop_t *model)
 }
 
 
+/**
+ * Options below apply to s_pnf and are mirrored into the column store
+ */
+static void
+scanner_cs_sort(scanner_t *s, int col, int desc)
+{
+  hts_mutex_lock(&s->s_mutex);
+  s->s_sortcol = col;
+  s->s_sortdesc = desc;
+  if(s->s_cs != NULL)
+    prop_colstore_sort(s->s_cs, col, desc);
+  hts_mutex_unlock(&s->s_mutex);
+}
+
+
+/**
+ *
+ */
+static void
+scanner_cs_dirsfirst(scanner_t *s, int on)
+{
+  hts_mutex_lock(&s->s_mutex);
+  s->s_dirsfirst = on;
+  if(s->s_cs != NULL)
+    prop_colstore_group(s->s_cs, on ? SCOL_NOTDIR : -1);
+  hts_mutex_unlock(&s->s_mutex);
+}
+
+
+/**
+ *
+ */
+static void
+scanner_cs_onlysupported(scanner_t *s, int on)
+{
+  int i;
+
+  hts_mutex_lock(&s->s_mutex);
+  s->s_onlysupported = on;
+  if(s->s_cs != NULL) {
+    for(i = 0; i < s->s_nrows; i++)
+      if(s->s_rows[i] != NULL)
+        prop_colstore_set_int(s->s_cs, i, SCOL_HIDDEN,
+                              scanner_cs_hidden(s, s->s_rows[i]));
+    prop_colstore_flush(s->s_cs);
+  }
+  hts_mutex_unlock(&s->s_mutex);
+}
+
+
 /**
  *
  */
@@ -947,12 +1330,16 @@ set_sort_order(void *opaque, prop_event_t event, ...)
     rstr_t *r = prop_get_name(p);
     const char *val = rstr_get(r);
     if(val != NULL) {
-      if(!strcmp(val, "title"))
+      if(!strcmp(val, "title")) {
 	prop_nf_sort(s->s_pnf, "node.metadata.title", 0, 3, NULL, 1);
-      else if(!strcmp(val, "date"))
+        scanner_cs_sort(s, SCOL_TITLE, 0);
+      } else if(!strcmp(val, "date")) {
 	prop_nf_sort(s->s_pnf, "node.metadata.timestamp", 1, 3, NULL, 0);
-      else if(!strcmp(val, "dateold"))
+        scanner_cs_sort(s, SCOL_TIMESTAMP, 1);
+      } else if(!strcmp(val, "dateold")) {
 	prop_nf_sort(s->s_pnf, "node.metadata.timestamp", 0, 3, NULL, 0);
+        scanner_cs_sort(s, SCOL_TIMESTAMP, 0);
+      }
     }
     kv_url_opt_set(s->s_url, KVSTORE_DOMAIN_SYS, "sortorder", 
 		   KVSTORE_SET_STRING, val);
@@ -1002,12 +1389,15 @@ add_sort_option_type(scanner_t *s, prop_t *model)
   if(cur != NULL && !strcmp(rstr_get(cur), "date")) {
     prop_select(on_date);
     prop_nf_sort(s->s_pnf, "node.metadata.timestamp", 1, 3, NULL, 0);
+    scanner_cs_sort(s, SCOL_TIMESTAMP, 1);
   } else if(cur != NULL && !strcmp(rstr_get(cur), "dateold")) {
     prop_select(on_date);
     prop_nf_sort(s->s_pnf, "node.metadata.timestamp", 0, 3, NULL, 0);
+    scanner_cs_sort(s, SCOL_TIMESTAMP, 0);
   } else {
     prop_select(on_title);
     prop_nf_sort(s->s_pnf, "node.metadata.title", 0, 3, NULL, 1);
+    scanner_cs_sort(s, SCOL_TITLE, 0);
   }
   rstr_release(cur);
   s->s_refcount++;
@@ -1051,6 +1441,7 @@ set_sort_dirs(void *opaque, prop_event_t event, ...)
   case PROP_SET_INT:
     val = va_arg(ap, int);
     prop_nf_sort(s->s_pnf, val ? "node.type" : NULL, 0, 0, typemap, 1);
+    scanner_cs_dirsfirst(s, val);
     kv_url_opt_set(s->s_url, KVSTORE_DOMAIN_SYS, "dirsfirst",
 		   KVSTORE_SET_INT, val);
      break;
@@ -1080,6 +1471,7 @@ add_sort_option_dirfirst(scanner_t *s, prop_t *model)
   prop_link(_p("Sort folders first"), prop_create(m, "title"));
 
   prop_nf_sort(s->s_pnf, v ? "node.type" : NULL, 0, 0, typemap, 1);
+  scanner_cs_dirsfirst(s, v);
 
   s->s_refcount++;
   prop_subscribe(PROP_SUB_NO_INITIAL_UPDATE | PROP_SUB_TRACK_DESTROY,
@@ -1112,6 +1504,7 @@ set_only_supported_files(void *opaque, prop_event_t event, ...)
     
   case PROP_SET_INT:
     val = va_arg(ap, int);
+    scanner_cs_onlysupported(s, val);
     kv_url_opt_set(s->s_url, KVSTORE_DOMAIN_SYS, "supportedfiles",
 		   KVSTORE_SET_INT, val);
     break;
@@ -1139,6 +1532,7 @@ add_only_supported_files(scanner_t *s, prop_t *model,
   prop_set_string(prop_create(n, "type"), "bool");
   prop_set_int(prop_create(n, "enabled"), 1);
   prop_set_int(value, v);
+  s->s_onlysupported = v;
 
   prop_link(_p("Show only supported files"), prop_create(m, "title"));
 
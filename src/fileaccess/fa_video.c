@@ -606,7 +606,7 @@ be_file_playvideo(const char *url, media_pipe_t *mp,
     .foe_stats = mp->mp_prop_io
   };
 
-  fh = fa_open_ex(url, errbuf, errlen, FA_BUFFERED_BIG, &foe);
+  fh = fa_open_ex(url, errbuf, errlen, FA_BUFFERED_BIG | FA_CACHE, &foe);
   if(fh == NULL)
     return NULL;
 
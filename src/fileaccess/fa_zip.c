@@ -148,6 +148,8 @@ typedef struct zip_file {
   off_t zf_compressed_size;
   off_t zf_lhpos;
 
+  fa_inflate_index_t *zf_inflate_index; // Seek checkpoints, built on demand
+
   LIST_ENTRY(zip_file) zf_link;
 } zip_file_t;
 
@@ -211,6 +213,9 @@ zip_archive_destroy_file(zip_file_t *zf)
   while((c = LIST_FIRST(&zf->zf_files)) != NULL)
     zip_archive_destroy_file(c);
   
+  if(zf->zf_inflate_index != NULL)
+    fa_inflate_index_release(zf->zf_inflate_index);
+
   if(zf->zf_name != NULL) {
     free(zf->zf_name);
     free(zf->zf_fullname);
@@ -775,8 +780,14 @@ zip_open(fa_protocol_t *fap, const char *url, char *errbuf, size_t errlen,
 
   case 8:
     /* Inflate (zlib) */
+    hts_mutex_lock(&za->za_mutex);
+    if(zf->zf_inflate_index == NULL)
+      zf->zf_inflate_index = fa_inflate_index_create();
+    hts_mutex_unlock(&za->za_mutex);
+
     zfh->zfh_reader_handle = fa_inflate_init(&zip_file_protocol, &zfh->h,
-					     zf->zf_uncompressed_size);
+					     zf->zf_uncompressed_size,
+					     zf->zf_inflate_index);
     if(zfh->zfh_reader_handle == NULL) {
       snprintf(errbuf, errlen, "Unable to initialize inflator");
       goto bad;
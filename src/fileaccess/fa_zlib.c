@@ -27,13 +27,44 @@
 #include "fileaccess.h"
 #include "fa_zlib.h"
 #include "showtime.h"
+#include "arch/atomic.h"
+
+#define DECODESIZE 32768
+#define WINDOWSIZE 32768
+
+/**
+ * Inflate checkpoint, enough state to restart decompression at
+ * fip_out without decoding anything before it
+ */
+typedef struct fa_inflate_point {
+  int64_t fip_out;      // Position in uncompressed stream
+  int64_t fip_in;       // Position of first full byte in compressed stream
+  int fip_bits;         // Number of bits used from the byte before fip_in
+  int fip_winsize;
+  uint8_t *fip_window;  // Last (up to) 32k of uncompressed data
+} fa_inflate_point_t;
+
+
+/**
+ * Checkpoints for one compressed stream. Built lazily while reading
+ * and shared between all handles opened on the same stream
+ */
+struct fa_inflate_index {
+  hts_mutex_t fii_mutex;
+  int fii_refcount;
+  int fii_num;
+  int fii_capacity;
+  fa_inflate_point_t *fii_points;  // Sorted on fip_out
+};
+
+#define FA_INFLATE_INDEX_SPAN (1024 * 1024)
 
 
 typedef struct fa_inflator {
   fa_handle_t h;
 
   z_stream fi_zstream;
-  
+
   fa_handle_t *fi_src_handle;
   const fa_protocol_t *fi_src_fap;
 
@@ -44,13 +75,206 @@ typedef struct fa_inflator {
   size_t fi_bufsize;
   uint8_t *fi_buf;
 
+  uint8_t *fi_prev;     // Previous contents of fi_buf, part of the window
+  size_t fi_prevsize;
+
   uint8_t *fi_load_buf;
 
   int fi_load_size;
 
+  int64_t fi_src_pos;   // Position in compressed stream after fi_load_buf
+
+  fa_inflate_index_t *fi_index;
+
 } fa_inflator_t;
 
-#define DECODESIZE 32768
+
+/**
+ *
+ */
+fa_inflate_index_t *
+fa_inflate_index_create(void)
+{
+  fa_inflate_index_t *fii = calloc(1, sizeof(fa_inflate_index_t));
+  hts_mutex_init(&fii->fii_mutex);
+  fii->fii_refcount = 1;
+  return fii;
+}
+
+
+/**
+ *
+ */
+void
+fa_inflate_index_release(fa_inflate_index_t *fii)
+{
+  int i;
+
+  if(atomic_add(&fii->fii_refcount, -1) > 1)
+    return;
+
+  for(i = 0; i < fii->fii_num; i++)
+    free(fii->fii_points[i].fip_window);
+  free(fii->fii_points);
+  hts_mutex_destroy(&fii->fii_mutex);
+  free(fii);
+}
+
+
+/**
+ * Find last checkpoint at or before 'pos'
+ *
+ * Must be called with fii_mutex locked
+ */
+static fa_inflate_point_t *
+inflate_index_find(fa_inflate_index_t *fii, int64_t pos)
+{
+  int lo = 0, hi = fii->fii_num;
+
+  while(lo < hi) {
+    int mid = (lo + hi) / 2;
+    if(fii->fii_points[mid].fip_out <= pos)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo > 0 ? &fii->fii_points[lo - 1] : NULL;
+}
+
+
+/**
+ * Called at a deflate block boundary. Add a checkpoint if we are
+ * far enough past the last one
+ */
+static void
+inflate_index_add(fa_inflator_t *fi)
+{
+  fa_inflate_index_t *fii = fi->fi_index;
+  z_stream *z = &fi->fi_zstream;
+  const size_t have = DECODESIZE - z->avail_out;
+  const int64_t out = fi->fi_bufstart + have;
+  fa_inflate_point_t *fip;
+
+  hts_mutex_lock(&fii->fii_mutex);
+
+  if((fii->fii_num ? fii->fii_points[fii->fii_num - 1].fip_out : 0) +
+     FA_INFLATE_INDEX_SPAN > out) {
+    hts_mutex_unlock(&fii->fii_mutex);
+    return;
+  }
+
+  if(fii->fii_num == fii->fii_capacity) {
+    fii->fii_capacity = MAX(16, fii->fii_capacity * 2);
+    fii->fii_points = realloc(fii->fii_points,
+                              fii->fii_capacity * sizeof(fa_inflate_point_t));
+  }
+
+  fip = &fii->fii_points[fii->fii_num++];
+  fip->fip_out = out;
+  fip->fip_in = fi->fi_src_pos - z->avail_in;
+  fip->fip_bits = z->data_type & 7;
+
+  // Window is the tail of the previous buffer followed by what has been
+  // decoded into the current buffer so far
+  size_t from_prev = MIN(WINDOWSIZE - have, fi->fi_prevsize);
+  fip->fip_winsize = from_prev + have;
+  fip->fip_window = malloc(fip->fip_winsize);
+  memcpy(fip->fip_window, fi->fi_prev + fi->fi_prevsize - from_prev,
+         from_prev);
+  memcpy(fip->fip_window + from_prev, fi->fi_buf, have);
+
+  hts_mutex_unlock(&fii->fii_mutex);
+}
+
+
+/**
+ * Restart decompression at 'fip' (or at start of stream if NULL)
+ */
+static int
+inflate_restart(fa_inflator_t *fi, const fa_inflate_point_t *fip)
+{
+  z_stream *z = &fi->fi_zstream;
+  int64_t seekpos;
+  uint8_t byte;
+
+  inflateEnd(z);
+  memset(z, 0, sizeof(z_stream));
+  if(inflateInit2(z, -MAX_WBITS) != Z_OK)
+    return -1;
+
+  fi->fi_bufsize = 0;
+
+  if(fip == NULL) {
+    fi->fi_bufstart = 0;
+    fi->fi_prevsize = 0;
+    fi->fi_src_pos = 0;
+    fi->fi_src_fap->fap_seek(fi->fi_src_handle, 0, SEEK_SET);
+    return 0;
+  }
+
+  fi->fi_bufstart = fip->fip_out;
+  fi->fi_src_pos = fip->fip_in;
+
+  seekpos = fip->fip_in - (fip->fip_bits ? 1 : 0);
+  if(fi->fi_src_fap->fap_seek(fi->fi_src_handle, seekpos, SEEK_SET) != seekpos)
+    return -1;
+
+  if(fip->fip_bits) {
+    if(fi->fi_src_fap->fap_read(fi->fi_src_handle, &byte, 1) != 1)
+      return -1;
+    inflatePrime(z, fip->fip_bits, byte >> (8 - fip->fip_bits));
+  }
+
+  inflateSetDictionary(z, fip->fip_window, fip->fip_winsize);
+
+  // The window is also what precedes the next buffer we decode
+  memcpy(fi->fi_prev, fip->fip_window, fip->fip_winsize);
+  fi->fi_prevsize = fip->fip_winsize;
+  return 0;
+}
+
+
+/**
+ * Reposition decoder for reading at fi_pos
+ *
+ * When seeking backwards we restart at nearest checkpoint before fi_pos.
+ * When seeking forward we skip to a checkpoint if there is one between
+ * current position and fi_pos
+ */
+static int
+inflate_reposition(fa_inflator_t *fi)
+{
+  fa_inflate_index_t *fii = fi->fi_index;
+  const fa_inflate_point_t *fip;
+  fa_inflate_point_t point;
+
+  if(fii == NULL) {
+    if(fi->fi_pos >= fi->fi_bufstart)
+      return 0;
+    return inflate_restart(fi, NULL);
+  }
+
+  hts_mutex_lock(&fii->fii_mutex);
+  fip = inflate_index_find(fii, fi->fi_pos);
+
+  if(fi->fi_pos >= fi->fi_bufstart &&
+     (fip == NULL || fip->fip_out <= fi->fi_bufstart + fi->fi_bufsize)) {
+    // Just continue decoding from where we are
+    hts_mutex_unlock(&fii->fii_mutex);
+    return 0;
+  }
+
+  /*
+   * The points array may be reallocated by other inflators once we
+   * unlock, so restart (which does I/O) from a copy. Windows are never
+   * freed before the index is
+   */
+  if(fip != NULL)
+    point = *fip;
+  hts_mutex_unlock(&fii->fii_mutex);
+
+  return inflate_restart(fi, fip != NULL ? &point : NULL);
+}
 
 
 /**
@@ -58,7 +282,7 @@ typedef struct fa_inflator {
  */
 fa_handle_t *
 fa_inflate_init(const fa_protocol_t *src_fap, fa_handle_t *handle,
-		int64_t unc_size)
+		int64_t unc_size, fa_inflate_index_t *fii)
 {
   fa_inflator_t *fi = calloc(1, sizeof(fa_inflator_t));
 
@@ -70,9 +294,16 @@ fa_inflate_init(const fa_protocol_t *src_fap, fa_handle_t *handle,
     free(fi);
     return NULL;
   }
-  
+
+  // Not worth the window copies unless a checkpoint can skip a span
+  if(fii != NULL && unc_size > 2 * FA_INFLATE_INDEX_SPAN) {
+    atomic_add(&fii->fii_refcount, 1);
+    fi->fi_index = fii;
+  }
+
   fi->fi_load_size = 32768;
   fi->fi_buf       = malloc(DECODESIZE);
+  fi->fi_prev      = malloc(DECODESIZE);
   return &fi->h;
 }
 
@@ -87,7 +318,10 @@ inflate_close(fa_handle_t *handle)
   fi->fi_src_fap->fap_close(fi->fi_src_handle);
   inflateEnd(&fi->fi_zstream);
   free(fi->fi_buf);
+  free(fi->fi_prev);
   free(fi->fi_load_buf);
+  if(fi->fi_index != NULL)
+    fa_inflate_index_release(fi->fi_index);
   free(fi);
 }
 
@@ -105,19 +339,10 @@ inflate_read(fa_handle_t *handle, void *buf, size_t size)
 
   while(size > 0) {
 
-    if(fi->fi_pos < fi->fi_bufstart) {
-      /* Rewind stream from start */
-
-      inflateEnd(&fi->fi_zstream);
-
-      fi->fi_bufstart = 0;
-      fi->fi_bufsize  = 0;
-
-      memset(&fi->fi_zstream, 0, sizeof(z_stream));
-
-      inflateInit2(&fi->fi_zstream, -MAX_WBITS);
-
-      fi->fi_src_fap->fap_seek(fi->fi_src_handle, 0, SEEK_SET);
+    if(fi->fi_pos < fi->fi_bufstart ||
+       fi->fi_pos >= fi->fi_bufstart + fi->fi_bufsize) {
+      if(inflate_reposition(fi))
+        return -1;
     }
 
     n = fi->fi_pos - fi->fi_bufstart;  // Offset in decompressed buffer
@@ -133,14 +358,22 @@ inflate_read(fa_handle_t *handle, void *buf, size_t size)
       fi->fi_pos += c;
       continue;
     }
-    
+
     if(stream_end)
       break;
 
+    if(fi->fi_bufsize > 0) {
+      // Keep previous output, it's needed for the checkpoint window
+      uint8_t *tmp = fi->fi_prev;
+      fi->fi_prev = fi->fi_buf;
+      fi->fi_buf = tmp;
+      fi->fi_prevsize = fi->fi_bufsize;
+    }
+
     fi->fi_bufstart += fi->fi_bufsize;
     fi->fi_zstream.next_out  = fi->fi_buf;
     fi->fi_zstream.avail_out = DECODESIZE;
-    
+
     while(fi->fi_zstream.avail_out > 0) {
 
       if(fi->fi_zstream.avail_in == 0) {
@@ -150,15 +383,17 @@ inflate_read(fa_handle_t *handle, void *buf, size_t size)
 
 	fi->fi_load_buf = realloc(fi->fi_load_buf, fi->fi_load_size);
 
-	r = fi->fi_src_fap->fap_read(fi->fi_src_handle, 
+	r = fi->fi_src_fap->fap_read(fi->fi_src_handle,
 				     fi->fi_load_buf, fi->fi_load_size);
 	if(r < 0)
 	  r = 0;
+	fi->fi_src_pos += r;
 	fi->fi_zstream.avail_in = r;
 	fi->fi_zstream.next_in  = fi->fi_load_buf;
       }
 
-      r = inflate(&fi->fi_zstream, 0);
+      // Stop at each block boundary when indexing
+      r = inflate(&fi->fi_zstream, fi->fi_index ? Z_BLOCK : 0);
 
       if(r == Z_STREAM_END) {
 	stream_end = 1;
@@ -167,6 +402,11 @@ inflate_read(fa_handle_t *handle, void *buf, size_t size)
 
       if(r != Z_OK)
 	return -1;
+
+      // At end of a block header, but not of the last block
+      if(fi->fi_index != NULL && fi->fi_zstream.data_type & 128 &&
+         !(fi->fi_zstream.data_type & 64))
+        inflate_index_add(fi);
     }
     fi->fi_bufsize = DECODESIZE - fi->fi_zstream.avail_out;
   }
@@ -24,8 +24,14 @@
 
 #include "fa_proto.h"
 
+typedef struct fa_inflate_index fa_inflate_index_t;
+
+fa_inflate_index_t *fa_inflate_index_create(void);
+
+void fa_inflate_index_release(fa_inflate_index_t *fii);
+
 fa_handle_t *fa_inflate_init(const fa_protocol_t *src_fap, fa_handle_t *handle,
-			     int64_t unc_size);
+			     int64_t unc_size, fa_inflate_index_t *fii);
 extern fa_protocol_t fa_protocol_inflate;
 
 #endif /* FA_ZLIB_H__ */
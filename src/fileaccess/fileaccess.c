@@ -51,6 +51,7 @@
 #include "fa_indexer.h"
 #include "settings.h"
 #include "notifications.h"
+#include "misc/profiler.h"
 
 static struct fa_protocol_list fileaccess_all_protocols;
 static HTS_MUTEX_DECL(fap_mutex);
@@ -214,6 +215,31 @@ fa_normalize(const char *url, char *dst, size_t dstlen)
 }
 
 
+#if ENABLE_READAHEAD_CACHE
+/**
+ * The cache does its own read-ahead so it's only worth it for
+ * protocols that allow it and when the persistent store is enabled
+ */
+static int
+fa_cache_wanted(const char *url)
+{
+  fa_protocol_t *fap;
+  char *filename;
+  int r;
+
+  if(gconf.fa_cache_size <= 0)
+    return 0;
+
+  if((filename = fa_resolve_proto(url, &fap, NULL, NULL, 0)) == NULL)
+    return 0;
+  r = !!(fap->fap_flags & FAP_ALLOW_CACHE);
+  fap_release(fap);
+  free(filename);
+  return r;
+}
+#endif
+
+
 /**
  *
  */
@@ -228,8 +254,10 @@ fa_open_ex(const char *url, char *errbuf, size_t errsize, int flags,
   if(!(flags & FA_WRITE)) {
     // Only do caching if we are in read only mode
 #if ENABLE_READAHEAD_CACHE
-    if(flags & FA_CACHE)
-      return fa_cache_open(url, errbuf, errsize, flags & ~FA_CACHE, foe);
+    if(flags & FA_CACHE && fa_cache_wanted(url))
+      return fa_cache_open(url, errbuf, errsize,
+			   flags & ~(FA_CACHE | FA_BUFFERED_SMALL |
+				     FA_BUFFERED_BIG), foe);
 #endif
     if(flags & (FA_BUFFERED_SMALL | FA_BUFFERED_BIG))
       return fa_buffered_open(url, errbuf, errsize, flags, foe);
@@ -242,7 +270,9 @@ fa_open_ex(const char *url, char *errbuf, size_t errsize, int flags,
     snprintf(errbuf, errsize, "FS does not support writing");
     fh = NULL;
   } else {
+    int64_t t = prof_begin();
     fh = fap->fap_open(fap, filename, errbuf, errsize, flags, foe);
+    prof_end_dyn(t, "fa_open", fap->fap_name);
   }
   fap_release(fap);
   free(filename);
@@ -256,6 +286,29 @@ fa_open_ex(const char *url, char *errbuf, size_t errsize, int flags,
 }
 
 
+/**
+ * Return path in native filesystem if 'url' resolves to a local file,
+ * otherwise NULL. Must be free'd by caller
+ */
+char *
+fa_get_native_path(const char *url)
+{
+  extern fa_protocol_t fa_protocol_fs;
+  fa_protocol_t *fap;
+  char *filename;
+
+  if((filename = fa_resolve_proto(url, &fap, NULL, NULL, 0)) == NULL)
+    return NULL;
+
+  if(fap != &fa_protocol_fs) {
+    free(filename);
+    filename = NULL;
+  }
+  fap_release(fap);
+  return filename;
+}
+
+
 /**
  *
  */
@@ -299,6 +352,18 @@ fa_close(void *fh_)
 }
 
 
+/**
+ * Returns -1 if protocol can't stat open files
+ */
+int
+fa_fstat(void *fh_, struct fa_stat *buf)
+{
+  fa_handle_t *fh = fh_;
+  if(fh->fh_proto->fap_fstat == NULL)
+    return -1;
+  return fh->fh_proto->fap_fstat(fh, buf);
+}
+
 /**
  *
  */
@@ -320,7 +385,9 @@ fa_read(void *fh_, void *buf, size_t size)
   fa_handle_t *fh = fh_;
   if(size == 0)
     return 0;
+  int64_t t = prof_begin();
   int r = fh->fh_proto->fap_read(fh, buf, size);
+  prof_end_dyn(t, "fa_read", fh->fh_proto->fap_name);
 #ifdef FA_DUMP
   if(fh->fh_dump_fd != -1) {
     printf("---------------- Dumpfile write %zd bytes at %ld\n",
@@ -1343,6 +1410,18 @@ fileaccess_init(void)
                  SETTING_HTSMSG("filenameextensions", store, "faconf"),
                  NULL);
 
+#if ENABLE_READAHEAD_CACHE
+  setting_create(SETTING_INT, gconf.settings_general, SETTINGS_INITIAL_UPDATE,
+                 SETTING_TITLE(_p("Persistent cache for network files")),
+                 SETTING_WRITE_INT(&gconf.fa_cache_size),
+                 SETTING_RANGE(0, 8192),
+                 SETTING_STEP(256),
+                 SETTING_UNIT_CSTR("MB"),
+                 SETTING_ZERO_TEXT(_p("Off")),
+                 SETTING_HTSMSG("cachesize", store, "faconf"),
+                 NULL);
+#endif
+
   return 0;
 }
 
@@ -73,6 +73,7 @@ typedef struct fa_dir_entry {
   int   fde_type; /* CONTENT_ .. types from showtime.h */
   struct prop *fde_prop;
   struct prop *fde_metadata;
+  int fde_csrow; /* Row in fa_scanner's column store, if it uses one */
 
   enum {
     FDE_PROBED_NONE,
@@ -204,6 +205,7 @@ int fa_write(void *fh, const void *buf, size_t size);
 int64_t fa_seek(void *fh, int64_t pos, int whence);
 int64_t fa_fsize(void *fh);
 int fa_seek_is_fast(void *fh);
+int fa_fstat(void *fh, struct fa_stat *buf);
 int fa_stat(const char *url, struct fa_stat *buf, char *errbuf, size_t errsize);
 int fa_findfile(const char *path, const char *file, 
 		char *fullpath, size_t fullpathlen);
@@ -315,6 +317,8 @@ rstr_t *fa_absolute_path(rstr_t *filename, rstr_t *at);
 
 int fa_check_url(const char *url, char *errbuf, size_t errlen);
 
+char *fa_get_native_path(const char *url);
+
 int fa_read_to_htsbuf(struct htsbuf_queue *hq, fa_handle_t *fh, int maxbytes);
 
 void fa_pathjoin(char *dst, size_t dstlen, const char *p1, const char *p2);
@@ -326,13 +330,31 @@ void fa_url_get_last_component(char *dst, size_t dstlen, const char *url);
 void fa_cache_init(void);
 
 fa_handle_t *fa_cache_open(const char *url, char *errbuf,
-			   size_t errsize, int flags, struct prop *stats);
+			   size_t errsize, int flags,
+			   struct fa_open_extra *foe);
 
 // Buffered I/O
 
 fa_handle_t *fa_buffered_open(const char *url, char *errbuf, size_t errsize,
 			      int flags, struct fa_open_extra *foe);
 
+// Shared read-ahead (used by buffered I/O)
+
+typedef struct fa_readahead fa_readahead_t;
+
+fa_readahead_t *fa_readahead_create(fa_handle_t *src);
+
+void fa_readahead_destroy(fa_readahead_t *ra); // Also closes 'src'
+
+void fa_readahead_lock(fa_readahead_t *ra);
+
+void fa_readahead_unlock(fa_readahead_t *ra);
+
+int fa_readahead_read(fa_readahead_t *ra, void *buf, int64_t fpos,
+		      size_t size);
+
+void fa_readahead_access(fa_readahead_t *ra, int64_t fpos, size_t size);
+
 // Memory backed files
 
 int memfile_register(const void *data, size_t len);
@@ -380,8 +402,15 @@ enum {
   HTTP_TAG_CANCELLABLE,
   HTTP_TAG_CONNECT_TIMEOUT,
   HTTP_TAG_READ_TIMEOUT,
+  HTTP_TAG_DATA_CALLBACK,
 };
 
+/**
+ * Receives (decompressed) response body as it arrives from the network.
+ * Called with size == 0 at end of data. Return non-zero to abort
+ */
+typedef int (http_data_cb_t)(void *opaque, const void *data, size_t size);
+
 
 #define HTTP_ARG(a, b)                     HTTP_TAG_ARG, a, b
 #define HTTP_ARGINT(a, b)                  HTTP_TAG_ARGINT, a, b
@@ -398,6 +427,7 @@ enum {
 #define HTTP_CANCELLABLE(a)                HTTP_TAG_CANCELLABLE, a
 #define HTTP_CONNECT_TIMEOUT(a)            HTTP_TAG_CONNECT_TIMEOUT, a
 #define HTTP_READ_TIMEOUT(a)               HTTP_TAG_READ_TIMEOUT, a
+#define HTTP_DATA_CALLBACK(a, b)           HTTP_TAG_DATA_CALLBACK, a, b
 
 int http_req(const char *url, ...)  __attribute__((__sentinel__(0)));
 
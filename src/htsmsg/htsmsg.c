@@ -27,15 +27,403 @@
 #include <stdarg.h>
 #include <string.h>
 #include "htsmsg.h"
+#include "arch/atomic.h"
 
 static void htsmsg_clear(htsmsg_t *msg);
 
+static void htsmsg_copy_i(htsmsg_t *src, htsmsg_t *dst);
+
+/**
+ * Maps with more fields than this get a hash index on first lookup
+ * that needs to walk past this many fields
+ */
+#define HTSMSG_INDEX_THRESHOLD 16
+
+#define HTSMSG_ARENA_CHUNK_SIZE 16384
+
+
+/**
+ *
+ */
+typedef struct htsmsg_arena_chunk {
+  struct htsmsg_arena_chunk *hac_next;
+  char hac_data[0];
+} htsmsg_arena_chunk_t;
+
+
+/**
+ *
+ */
+struct htsmsg_arena {
+  int ha_refcount;
+
+  htsmsg_arena_chunk_t *ha_chunks;
+  char *ha_ptr;
+  size_t ha_avail;
+
+  const char **ha_names;   // Interned field names, open addressing
+  unsigned int ha_names_size;
+  unsigned int ha_names_count;
+};
+
+
+/**
+ *
+ */
+typedef struct htsmsg_index_slot {
+  uint32_t his_hash;
+  htsmsg_field_t *his_field;
+} htsmsg_index_slot_t;
+
+
+/**
+ *
+ */
+typedef struct htsmsg_index {
+  unsigned int hi_size;    // Always a power of 2
+  unsigned int hi_count;
+  unsigned int hi_shadowed; // Fields hidden by an earlier one with same name
+  htsmsg_index_slot_t hi_slots[0];
+} htsmsg_index_t;
+
+
+/**
+ * FNV-1a
+ */
+static uint32_t
+htsmsg_name_hash(const char *name)
+{
+  uint32_t h = 2166136261U;
+  while(*name) {
+    h ^= (uint8_t)*name++;
+    h *= 16777619;
+  }
+  return h;
+}
+
+
+/**
+ *
+ */
+htsmsg_arena_t *
+htsmsg_arena_create(void)
+{
+  htsmsg_arena_t *ha = calloc(1, sizeof(htsmsg_arena_t));
+  ha->ha_refcount = 1;
+  return ha;
+}
+
+
+/**
+ *
+ */
+static htsmsg_arena_t *
+htsmsg_arena_retain(htsmsg_arena_t *ha)
+{
+  atomic_add(&ha->ha_refcount, 1);
+  return ha;
+}
+
+
+/**
+ *
+ */
+void
+htsmsg_arena_release(htsmsg_arena_t *ha)
+{
+  htsmsg_arena_chunk_t *hac;
+
+  if(ha == NULL || atomic_add(&ha->ha_refcount, -1) > 1)
+    return;
+
+  while((hac = ha->ha_chunks) != NULL) {
+    ha->ha_chunks = hac->hac_next;
+    free(hac);
+  }
+  free(ha->ha_names);
+  free(ha);
+}
+
+
+/**
+ *
+ */
+static void *
+htsmsg_arena_alloc(htsmsg_arena_t *ha, size_t size)
+{
+  htsmsg_arena_chunk_t *hac;
+  void *r;
+
+  size = (size + 7) & ~7;
+
+  if(size > HTSMSG_ARENA_CHUNK_SIZE / 4) {
+    // Large allocations get a chunk of their own
+    hac = malloc(sizeof(htsmsg_arena_chunk_t) + size);
+    if(ha->ha_chunks != NULL) {
+      hac->hac_next = ha->ha_chunks->hac_next;
+      ha->ha_chunks->hac_next = hac;
+    } else {
+      hac->hac_next = NULL;
+      ha->ha_chunks = hac;
+    }
+    return hac->hac_data;
+  }
+
+  if(size > ha->ha_avail) {
+    hac = malloc(sizeof(htsmsg_arena_chunk_t) + HTSMSG_ARENA_CHUNK_SIZE);
+    hac->hac_next = ha->ha_chunks;
+    ha->ha_chunks = hac;
+    ha->ha_ptr = hac->hac_data;
+    ha->ha_avail = HTSMSG_ARENA_CHUNK_SIZE;
+  }
+
+  r = ha->ha_ptr;
+  ha->ha_ptr += size;
+  ha->ha_avail -= size;
+  return r;
+}
+
+
+/**
+ *
+ */
+static char *
+htsmsg_arena_strdup(htsmsg_arena_t *ha, const char *str, size_t len)
+{
+  char *r = htsmsg_arena_alloc(ha, len + 1);
+  memcpy(r, str, len);
+  r[len] = 0;
+  return r;
+}
+
+
+/**
+ * Return an interned copy of 'name'
+ */
+static const char *
+htsmsg_arena_intern(htsmsg_arena_t *ha, const char *name)
+{
+  unsigned int i, mask;
+  const char *n;
+
+  if(ha->ha_names_count * 2 >= ha->ha_names_size) {
+    const char **old = ha->ha_names;
+    unsigned int oldsize = ha->ha_names_size;
+
+    ha->ha_names_size = oldsize ? oldsize * 2 : 64;
+    ha->ha_names = calloc(ha->ha_names_size, sizeof(const char *));
+    mask = ha->ha_names_size - 1;
+
+    for(i = 0; i < oldsize; i++) {
+      unsigned int j;
+      if((n = old[i]) == NULL)
+	continue;
+      for(j = htsmsg_name_hash(n) & mask; ha->ha_names[j]; j = (j + 1) & mask)
+	{}
+      ha->ha_names[j] = n;
+    }
+    free(old);
+  }
+
+  mask = ha->ha_names_size - 1;
+  for(i = htsmsg_name_hash(name) & mask; (n = ha->ha_names[i]) != NULL;
+      i = (i + 1) & mask)
+    if(!strcmp(n, name))
+      return n;
+
+  n = htsmsg_arena_strdup(ha, name, strlen(name));
+  ha->ha_names[i] = n;
+  ha->ha_names_count++;
+  return n;
+}
+
+
+/**
+ *
+ */
+static void
+htsmsg_index_insert(htsmsg_index_t *hi, htsmsg_field_t *f, uint32_t hash)
+{
+  unsigned int mask = hi->hi_size - 1;
+  unsigned int i;
+  htsmsg_index_slot_t *his;
+
+  for(i = hash & mask; (his = &hi->hi_slots[i])->his_field != NULL;
+      i = (i + 1) & mask) {
+    // Only the first field with a given name is reachable by name
+    if(his->his_hash == hash && !strcmp(his->his_field->hmf_name,
+					f->hmf_name)) {
+      hi->hi_shadowed++;
+      return;
+    }
+  }
+  his->his_hash = hash;
+  his->his_field = f;
+  hi->hi_count++;
+}
+
+
+/**
+ *
+ */
+static htsmsg_index_t *
+htsmsg_index_build(htsmsg_t *msg, unsigned int count)
+{
+  htsmsg_field_t *f;
+  unsigned int size = 16;
+  htsmsg_index_t *hi;
+
+  while(size < count * 2)
+    size *= 2;
+
+  hi = calloc(1, sizeof(htsmsg_index_t) + size * sizeof(htsmsg_index_slot_t));
+  hi->hi_size = size;
+
+  HTSMSG_FOREACH(f, msg)
+    if(f->hmf_name != NULL)
+      htsmsg_index_insert(hi, f, htsmsg_name_hash(f->hmf_name));
+  return hi;
+}
+
+
+/**
+ * Called when 'f' has been linked into 'msg'. The index is built here
+ * (rather than when looking up fields) so lookups never modify the
+ * message and can run concurrently
+ */
+static void
+htsmsg_index_add(htsmsg_t *msg, htsmsg_field_t *f)
+{
+  htsmsg_index_t *hi = msg->hm_index;
+
+  if(f->hmf_name == NULL)
+    return;
+
+  if(hi == NULL) {
+    if(++msg->hm_unindexed > HTSMSG_INDEX_THRESHOLD)
+      msg->hm_index = htsmsg_index_build(msg, msg->hm_unindexed);
+    return;
+  }
+
+  if(hi->hi_count * 2 >= hi->hi_size) {
+    unsigned int count = hi->hi_count + 1;
+    free(hi);
+    msg->hm_index = htsmsg_index_build(msg, count);
+    return;
+  }
+  htsmsg_index_insert(hi, f, htsmsg_name_hash(f->hmf_name));
+}
+
+
+/**
+ * Called when 'f' is about to be unlinked from 'msg'
+ */
+static void
+htsmsg_index_remove(htsmsg_t *msg, htsmsg_field_t *f)
+{
+  htsmsg_index_t *hi = msg->hm_index;
+  unsigned int mask, i, j, k;
+  htsmsg_field_t *n;
+  uint32_t hash;
+
+  if(f->hmf_name == NULL)
+    return;
+
+  if(hi == NULL) {
+    if(msg->hm_unindexed > 0)
+      msg->hm_unindexed--;
+    return;
+  }
+
+  mask = hi->hi_size - 1;
+  hash = htsmsg_name_hash(f->hmf_name);
+
+  for(i = hash & mask; hi->hi_slots[i].his_field != f; i = (i + 1) & mask) {
+    if(hi->hi_slots[i].his_field == NULL) {
+      // Not indexed, an earlier field with the same name is
+      hi->hi_shadowed--;
+      return;
+    }
+  }
+
+  // Backward shift deletion, keeps the probe sequences of others intact
+  for(j = (i + 1) & mask; hi->hi_slots[j].his_field != NULL;
+      j = (j + 1) & mask) {
+    k = hi->hi_slots[j].his_hash & mask;
+    if(i <= j ? (i < k && k <= j) : (i < k || k <= j))
+      continue; // Home slot is between the hole and j, must stay
+    hi->hi_slots[i] = hi->hi_slots[j];
+    i = j;
+  }
+  hi->hi_slots[i].his_field = NULL;
+  hi->hi_count--;
+
+  if(hi->hi_shadowed == 0)
+    return;
+
+  // The next field with the same name becomes reachable
+  for(n = TAILQ_NEXT(f, hmf_link); n != NULL; n = TAILQ_NEXT(n, hmf_link)) {
+    if(n->hmf_name != NULL && !strcmp(n->hmf_name, f->hmf_name)) {
+      hi->hi_shadowed--;
+      htsmsg_index_insert(hi, n, hash);
+      return;
+    }
+  }
+}
+
+
+/**
+ *
+ */
+static htsmsg_field_t *
+htsmsg_index_find(const htsmsg_index_t *hi, const char *name)
+{
+  unsigned int mask = hi->hi_size - 1;
+  uint32_t hash = htsmsg_name_hash(name);
+  unsigned int i;
+  const htsmsg_index_slot_t *his;
+
+  for(i = hash & mask; (his = &hi->hi_slots[i])->his_field != NULL;
+      i = (i + 1) & mask)
+    if(his->his_hash == hash && !strcmp(his->his_field->hmf_name, name))
+      return his->his_field;
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static void
+htsmsg_drop_index(htsmsg_t *msg)
+{
+  free(msg->hm_index);
+  msg->hm_index = NULL;
+  msg->hm_unindexed = 0;
+}
+
+
+/**
+ * Move fields (and index) from 'src' to 'dst'
+ */
+static void
+htsmsg_move_fields(htsmsg_t *dst, htsmsg_t *src)
+{
+  TAILQ_MOVE(&dst->hm_fields, &src->hm_fields, hmf_link);
+  dst->hm_islist = src->hm_islist;
+  dst->hm_index = src->hm_index;
+  dst->hm_unindexed = src->hm_unindexed;
+  src->hm_index = NULL;
+  src->hm_unindexed = 0;
+}
+
 /**
  *
  */
 void
 htsmsg_field_destroy(htsmsg_t *msg, htsmsg_field_t *f)
 {
+  htsmsg_index_remove(msg, f);
   TAILQ_REMOVE(&msg->hm_fields, f, hmf_link);
 
   switch(f->hmf_type) {
@@ -58,7 +446,8 @@ htsmsg_field_destroy(htsmsg_t *msg, htsmsg_field_t *f)
   }
   if(f->hmf_flags & HMF_NAME_ALLOCED)
     free((void *)f->hmf_name);
-  free(f);
+  if(!(f->hmf_flags & HMF_IN_ARENA))
+    free(f);
 }
 
 /*
@@ -69,6 +458,8 @@ htsmsg_clear(htsmsg_t *msg)
 {
   htsmsg_field_t *f;
 
+  htsmsg_drop_index(msg);
+
   while((f = TAILQ_FIRST(&msg->hm_fields)) != NULL)
     htsmsg_field_destroy(msg, f);
 }
@@ -81,8 +472,19 @@ htsmsg_clear(htsmsg_t *msg)
 htsmsg_field_t *
 htsmsg_field_add(htsmsg_t *msg, const char *name, int type, int flags)
 {
-  htsmsg_field_t *f = malloc(sizeof(htsmsg_field_t));
-  
+  htsmsg_field_t *f;
+
+  if(msg->hm_arena != NULL) {
+    f = htsmsg_arena_alloc(msg->hm_arena, sizeof(htsmsg_field_t));
+    if(flags & HMF_NAME_ALLOCED && name != NULL)
+      name = htsmsg_arena_intern(msg->hm_arena, name);
+    flags = (flags & ~HMF_NAME_ALLOCED) | HMF_IN_ARENA;
+  } else {
+    f = malloc(sizeof(htsmsg_field_t));
+    if(flags & HMF_NAME_ALLOCED && name != NULL)
+      name = strdup(name);
+  }
+
   TAILQ_INSERT_TAIL(&msg->hm_fields, f, hmf_link);
 
   if(msg->hm_islist) {
@@ -91,17 +493,26 @@ htsmsg_field_add(htsmsg_t *msg, const char *name, int type, int flags)
     assert(name != NULL);
   }
 
-  if(flags & HMF_NAME_ALLOCED)
-    f->hmf_name = name ? strdup(name) : NULL;
-  else
-    f->hmf_name = name;
-
+  f->hmf_name = name;
   f->hmf_type = type;
   f->hmf_flags = flags;
+
+  htsmsg_index_add(msg, f);
   return f;
 }
 
 
+/**
+ *
+ */
+void
+htsmsg_field_link(htsmsg_t *msg, htsmsg_field_t *f)
+{
+  TAILQ_INSERT_TAIL(&msg->hm_fields, f, hmf_link);
+  htsmsg_index_add(msg, f);
+}
+
+
 /*
  *
  */
@@ -119,11 +530,13 @@ htsmsg_field_find(htsmsg_t *msg, const char *name)
     return NULL;
   }
 
-  TAILQ_FOREACH(f, &msg->hm_fields, hmf_link) {
+  if(msg->hm_index != NULL)
+    return htsmsg_index_find(msg->hm_index, name);
+
+  TAILQ_FOREACH(f, &msg->hm_fields, hmf_link)
     if(f->hmf_name != NULL && !strcmp(f->hmf_name, name))
-      return f;
-  }
-  return NULL;
+      break;
+  return f;
 }
 
 
@@ -155,6 +568,9 @@ htsmsg_create_map(void)
   TAILQ_INIT(&msg->hm_fields);
   msg->hm_free_opaque = NULL;
   msg->hm_islist = 0;
+  msg->hm_arena = NULL;
+  msg->hm_index = NULL;
+  msg->hm_unindexed = 0;
   return msg;
 }
 
@@ -170,6 +586,33 @@ htsmsg_create_list(void)
   TAILQ_INIT(&msg->hm_fields);
   msg->hm_free_opaque = NULL;
   msg->hm_islist = 1;
+  msg->hm_arena = NULL;
+  msg->hm_index = NULL;
+  msg->hm_unindexed = 0;
+  return msg;
+}
+
+
+/**
+ *
+ */
+htsmsg_t *
+htsmsg_create_map_arena(htsmsg_arena_t *ha)
+{
+  htsmsg_t *msg = htsmsg_create_map();
+  msg->hm_arena = htsmsg_arena_retain(ha);
+  return msg;
+}
+
+
+/**
+ *
+ */
+htsmsg_t *
+htsmsg_create_list_arena(htsmsg_arena_t *ha)
+{
+  htsmsg_t *msg = htsmsg_create_list();
+  msg->hm_arena = htsmsg_arena_retain(ha);
   return msg;
 }
 
@@ -186,6 +629,7 @@ htsmsg_destroy(htsmsg_t *msg)
   htsmsg_clear(msg);
   if(msg->hm_free_opaque != NULL)
     msg->hm_free_opaque(msg->hm_opaque);
+  htsmsg_arena_release(msg->hm_arena);
   free(msg);
 }
 
@@ -238,9 +682,15 @@ htsmsg_add_dbl(htsmsg_t *msg, const char *name, double dbl)
 void
 htsmsg_add_str(htsmsg_t *msg, const char *name, const char *str)
 {
-  htsmsg_field_t *f = htsmsg_field_add(msg, name, HMF_STR, 
-				        HMF_ALLOCED | HMF_NAME_ALLOCED);
-  f->hmf_str = strdup(str);
+  htsmsg_field_t *f;
+
+  if(msg->hm_arena != NULL) {
+    f = htsmsg_field_add(msg, name, HMF_STR, HMF_NAME_ALLOCED);
+    f->hmf_str = htsmsg_arena_strdup(msg->hm_arena, str, strlen(str));
+  } else {
+    f = htsmsg_field_add(msg, name, HMF_STR, HMF_ALLOCED | HMF_NAME_ALLOCED);
+    f->hmf_str = strdup(str);
+  }
 }
 
 /*
@@ -249,10 +699,17 @@ htsmsg_add_str(htsmsg_t *msg, const char *name, const char *str)
 void
 htsmsg_add_bin(htsmsg_t *msg, const char *name, const void *bin, size_t len)
 {
-  htsmsg_field_t *f = htsmsg_field_add(msg, name, HMF_BIN, 
-				       HMF_ALLOCED | HMF_NAME_ALLOCED);
+  htsmsg_field_t *f;
   void *v;
-  f->hmf_bin = v = malloc(len);
+
+  if(msg->hm_arena != NULL) {
+    f = htsmsg_field_add(msg, name, HMF_BIN, HMF_NAME_ALLOCED);
+    v = htsmsg_arena_alloc(msg->hm_arena, len);
+  } else {
+    f = htsmsg_field_add(msg, name, HMF_BIN, HMF_ALLOCED | HMF_NAME_ALLOCED);
+    v = malloc(len);
+  }
+  f->hmf_bin = v;
   f->hmf_binsize = len;
   memcpy(v, bin, len);
 }
@@ -269,38 +726,55 @@ htsmsg_add_binptr(htsmsg_t *msg, const char *name, const void *bin, size_t len)
 }
 
 
-/*
- *
+/**
+ * Fields can be moved between messages sharing the same arena and from
+ * a message without arena (each field tells how it is to be freed).
+ * Only arena fields going to a message outside that arena are copied
  */
-void
-htsmsg_add_msg(htsmsg_t *msg, const char *name, htsmsg_t *sub)
+static void
+htsmsg_add_msg0(htsmsg_t *msg, const char *name, htsmsg_t *sub, int flags)
 {
   htsmsg_field_t *f;
 
-  f = htsmsg_field_add(msg, name, sub->hm_islist ? HMF_LIST : HMF_MAP,
-		       HMF_NAME_ALLOCED);
+  f = htsmsg_field_add(msg, name, sub->hm_islist ? HMF_LIST : HMF_MAP, flags);
 
   assert(sub->hm_free_opaque == NULL);
-  f->hmf_msg.hm_islist = sub->hm_islist;
-  TAILQ_MOVE(&f->hmf_msg.hm_fields, &sub->hm_fields, hmf_link);
+
+  f->hmf_msg.hm_arena = msg->hm_arena;
+
+  if(sub->hm_arena == msg->hm_arena || sub->hm_arena == NULL) {
+    htsmsg_move_fields(&f->hmf_msg, sub);
+  } else {
+    TAILQ_INIT(&f->hmf_msg.hm_fields);
+    f->hmf_msg.hm_islist = sub->hm_islist;
+    f->hmf_msg.hm_index = NULL;
+    f->hmf_msg.hm_unindexed = 0;
+    htsmsg_copy_i(sub, &f->hmf_msg);
+    htsmsg_clear(sub);
+  }
+  htsmsg_arena_release(sub->hm_arena);
   free(sub);
 }
 
 
-
 /*
  *
  */
 void
-htsmsg_add_msg_extname(htsmsg_t *msg, const char *name, htsmsg_t *sub)
+htsmsg_add_msg(htsmsg_t *msg, const char *name, htsmsg_t *sub)
 {
-  htsmsg_field_t *f;
+  htsmsg_add_msg0(msg, name, sub, HMF_NAME_ALLOCED);
+}
 
-  f = htsmsg_field_add(msg, name, sub->hm_islist ? HMF_LIST : HMF_MAP, 0);
 
-  assert(sub->hm_free_opaque == NULL);
-  TAILQ_MOVE(&f->hmf_msg.hm_fields, &sub->hm_fields, hmf_link);
-  free(sub);
+
+/*
+ *
+ */
+void
+htsmsg_add_msg_extname(htsmsg_t *msg, const char *name, htsmsg_t *sub)
+{
+  htsmsg_add_msg0(msg, name, sub, 0);
 }
 
 
@@ -544,7 +1018,10 @@ htsmsg_detach_submsg(htsmsg_field_t *f)
 {
   htsmsg_t *r = htsmsg_create_map();
 
-  TAILQ_MOVE(&r->hm_fields, &f->hmf_msg.hm_fields, hmf_link);
+  if(f->hmf_msg.hm_arena != NULL)
+    r->hm_arena = htsmsg_arena_retain(f->hmf_msg.hm_arena);
+
+  htsmsg_move_fields(r, &f->hmf_msg);
   r->hm_islist = f->hmf_type == HMF_LIST;
   return r;
 }
@@ -626,8 +1103,13 @@ htsmsg_copy_i(htsmsg_t *src, htsmsg_t *dst)
 
     case HMF_MAP:
     case HMF_LIST:
-      sub = f->hmf_type == HMF_LIST ? 
-	htsmsg_create_list() : htsmsg_create_map();
+      if(dst->hm_arena != NULL)
+	sub = f->hmf_type == HMF_LIST ?
+	  htsmsg_create_list_arena(dst->hm_arena) :
+	  htsmsg_create_map_arena(dst->hm_arena);
+      else
+	sub = f->hmf_type == HMF_LIST ?
+	  htsmsg_create_list() : htsmsg_create_map();
       htsmsg_copy_i(&f->hmf_msg, sub);
       htsmsg_add_msg(dst, f->hmf_name, sub);
       break;
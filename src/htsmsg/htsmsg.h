@@ -32,6 +32,20 @@
 
 TAILQ_HEAD(htsmsg_field_queue, htsmsg_field);
 
+/**
+ * Arena used to allocate fields, names and strings for messages that
+ * are built in one go (typically by parsers) and destroyed as a whole.
+ * Field names are interned so repeated keys share the same storage.
+ *
+ * Messages sharing an arena must not be modified concurrently.
+ *
+ * Arena memory is only reclaimed when the last message holding the
+ * arena is destroyed. Removing or replacing fields does not give any
+ * memory back, so a message that is mutated over a long time should be
+ * moved out of the arena with htsmsg_copy().
+ */
+typedef struct htsmsg_arena htsmsg_arena_t;
+
 typedef struct htsmsg {
   /**
    * fields 
@@ -48,6 +62,17 @@ typedef struct htsmsg {
    */
   void (*hm_free_opaque)(void *);
   void *hm_opaque;
+
+  /**
+   * Arena for fields, NULL if fields are malloced
+   */
+  htsmsg_arena_t *hm_arena;
+
+  /**
+   * Hash index over field names, built once a map grows large
+   */
+  struct htsmsg_index *hm_index;
+  unsigned int hm_unindexed;  // Named fields while hm_index is NULL
 } htsmsg_t;
 
 
@@ -66,6 +91,7 @@ typedef struct htsmsg_field {
 
 #define HMF_ALLOCED 0x1
 #define HMF_NAME_ALLOCED 0x2
+#define HMF_IN_ARENA 0x4
 
   union {
     int64_t  s64;
@@ -103,6 +129,27 @@ htsmsg_t *htsmsg_create_map(void);
  */
 htsmsg_t *htsmsg_create_list(void);
 
+/**
+ * Create a new arena, returned with one reference held by the caller
+ */
+htsmsg_arena_t *htsmsg_arena_create(void);
+
+/**
+ * Drop a reference to an arena. Each message created in the arena
+ * holds a reference of its own
+ */
+void htsmsg_arena_release(htsmsg_arena_t *ha);
+
+/**
+ * Create a new map allocating fields from the given arena
+ */
+htsmsg_t *htsmsg_create_map_arena(htsmsg_arena_t *ha);
+
+/**
+ * Create a new list allocating fields from the given arena
+ */
+htsmsg_t *htsmsg_create_list_arena(htsmsg_arena_t *ha);
+
 /**
  * Remove a given field from a msg
  */
@@ -298,6 +345,12 @@ void htsmsg_print(htsmsg_t *msg);
 htsmsg_field_t *htsmsg_field_add(htsmsg_t *msg, const char *name,
 				 int type, int flags);
 
+/**
+ * Append an already constructed field. Primarily intended for htsmsg
+ * internal functions.
+ */
+void htsmsg_field_link(htsmsg_t *msg, htsmsg_field_t *f);
+
 /**
  * Get a field, return NULL if it does not exist
  */
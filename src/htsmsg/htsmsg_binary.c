@@ -100,6 +100,10 @@ htsmsg_binary_des0(htsmsg_t *msg, const uint8_t *buf, size_t len)
       sub = &f->hmf_msg;
       TAILQ_INIT(&sub->hm_fields);
       sub->hm_free_opaque = NULL;
+      sub->hm_islist = type == HMF_LIST;
+      sub->hm_arena = NULL;
+      sub->hm_index = NULL;
+      sub->hm_unindexed = 0;
       if(htsmsg_binary_des0(sub, buf, datalen) < 0)
 	return -1;
       break;
@@ -110,7 +114,7 @@ htsmsg_binary_des0(htsmsg_t *msg, const uint8_t *buf, size_t len)
       return -1;
     }
 
-    TAILQ_INSERT_TAIL(&msg->hm_fields, f, hmf_link);
+    htsmsg_field_link(msg, f);
     buf += datalen;
     len -= datalen;
   }
@@ -148,13 +148,13 @@ htsmsg_json_serialize_to_rstr(htsmsg_t *msg, const char *prefix)
 static void *
 create_map(void *opaque)
 {
-  return htsmsg_create_map();
+  return htsmsg_create_map_arena(opaque);
 }
 
 static void *
 create_list(void *opaque)
 {
-  return htsmsg_create_list();
+  return htsmsg_create_list_arena(opaque);
 }
 
 static void
@@ -221,7 +221,7 @@ static const json_deserializer_t json_to_htsmsg = {
 htsmsg_t *
 htsmsg_json_deserialize(const char *src)
 {
-  return json_deserialize(src, &json_to_htsmsg, NULL, NULL, 0);
+  return htsmsg_json_deserialize2(src, NULL, 0);
 }
 
 /**
@@ -230,5 +230,8 @@ htsmsg_json_deserialize(const char *src)
 htsmsg_t *
 htsmsg_json_deserialize2(const char *src, char *errbuf, size_t errlen)
 {
-  return json_deserialize(src, &json_to_htsmsg, NULL, errbuf, errlen);
+  htsmsg_arena_t *ha = htsmsg_arena_create();
+  htsmsg_t *m = json_deserialize(src, &json_to_htsmsg, ha, errbuf, errlen);
+  htsmsg_arena_release(ha);
+  return m;
 }
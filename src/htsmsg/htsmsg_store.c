@@ -19,6 +19,29 @@
  *  For more information, contact andreas@lonelycoder.com
  */
 
+/**
+ * All settings records are kept in memory and persisted in two files
+ * in the settings directory:
+ *
+ *  store.snapshot  -- Every record at the time of last compaction
+ *  store.journal   -- Records saved or removed since then, append only
+ *
+ * Both files use the same framing:
+ *
+ *  S <len> <path>\n<json of len bytes>\n     Set record
+ *  R 0 <path>\n\n                            Remove record
+ *
+ * Saves are coalesced in memory and appended to the journal with a
+ * single write() and fsync() when the store is flushed. Once the journal
+ * grows larger than the snapshot (or STORE_COMPACT_MIN) a new snapshot
+ * is written to a temporary file and renamed in place, after which the
+ * journal is truncated. A torn record at the end of the journal (crash
+ * during append) is discarded when loading.
+ *
+ * If no store files exist at startup, the old one-file-per-record tree
+ * is imported
+ */
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <limits.h>
@@ -39,31 +62,108 @@
 #include "arch/arch.h"
 #define SETTINGS_STORE_DELAY 2 // seconds
 
-LIST_HEAD(pending_store_list, pending_store);
+#define STORE_HASH_SIZE   256
+#define STORE_COMPACT_MIN (256 * 1024)
+
+#define STORE_SNAPSHOT "store.snapshot"
+#define STORE_JOURNAL  "store.journal"
 
+LIST_HEAD(store_record_list, store_record);
 
-typedef struct pending_store {
-  LIST_ENTRY(pending_store) ps_link;
-  htsmsg_t *ps_msg;
-  char *ps_path;
-} pending_store_t;
+
+/**
+ * A record with sr_msg == NULL has been removed but the removal
+ * is not yet written to the journal
+ */
+typedef struct store_record {
+  LIST_ENTRY(store_record) sr_hash_link;
+  LIST_ENTRY(store_record) sr_dirty_link;
+  char *sr_path;        // Relative to settings directory
+  htsmsg_t *sr_msg;
+  int sr_dirty;         // 0 if clean, changes each time record is modified
+} store_record_t;
 
 
 static int rename_cant_overwrite;
-static struct pending_store_list pending_stores;
+static struct store_record_list store_hash[STORE_HASH_SIZE];
+static struct store_record_list store_dirty;
+static int store_dirty_gen;
+static int store_num_records;
 static callout_t pending_store_callout;
-static hts_mutex_t pending_store_mutex;
+static hts_mutex_t pending_store_mutex;  // Protects all records
+static hts_mutex_t store_io_mutex;       // Serializes journal and snapshot IO
+static int store_journal_fd = -1;
+static int64_t store_journal_size;
+static int64_t store_snapshot_size;
 static char *showtime_settings_path;
 
+
+/**
+ *
+ */
+static store_record_t *
+store_record_find(const char *path, int create)
+{
+  const unsigned int h = mystrhash(path) % STORE_HASH_SIZE;
+  store_record_t *sr;
+
+  LIST_FOREACH(sr, &store_hash[h], sr_hash_link)
+    if(!strcmp(sr->sr_path, path))
+      return sr;
+
+  if(!create)
+    return NULL;
+
+  sr = calloc(1, sizeof(store_record_t));
+  sr->sr_path = strdup(path);
+  LIST_INSERT_HEAD(&store_hash[h], sr, sr_hash_link);
+  store_num_records++;
+  return sr;
+}
+
+
 /**
  *
  */
 static void
-pending_store_destroy(pending_store_t *ps)
+store_record_destroy(store_record_t *sr)
+{
+  LIST_REMOVE(sr, sr_hash_link);
+  if(sr->sr_dirty)
+    LIST_REMOVE(sr, sr_dirty_link);
+  if(sr->sr_msg != NULL)
+    htsmsg_destroy(sr->sr_msg);
+  free(sr->sr_path);
+  free(sr);
+  store_num_records--;
+}
+
+
+/**
+ * Set (or remove if 'm' is NULL) a record. Takes ownership of 'm'.
+ * If 'dirty' is set the change will be written to journal on next flush
+ */
+static void
+store_record_set(const char *path, htsmsg_t *m, int dirty)
 {
-  htsmsg_destroy(ps->ps_msg);
-  free(ps->ps_path);
-  free(ps);
+  store_record_t *sr = store_record_find(path, m != NULL);
+
+  if(sr == NULL)
+    return;
+
+  if(sr->sr_msg != NULL)
+    htsmsg_destroy(sr->sr_msg);
+  sr->sr_msg = m;
+
+  if(dirty) {
+    if(!sr->sr_dirty)
+      LIST_INSERT_HEAD(&store_dirty, sr, sr_dirty_link);
+    if(++store_dirty_gen == 0)
+      store_dirty_gen = 1;
+    sr->sr_dirty = store_dirty_gen;
+  } else if(m == NULL && !sr->sr_dirty) {
+    store_record_destroy(sr);
+  }
 }
 
 
@@ -71,95 +171,230 @@ pending_store_destroy(pending_store_t *ps)
  *
  */
 static void
-pending_store_write(pending_store_t *ps)
+store_record_serialize(htsbuf_queue_t *hq, const char *path, htsmsg_t *m)
 {
-  char fullpath[PATH_MAX];
-  char fullpath2[PATH_MAX];
-  int x, l, fd;
-  struct stat st;
-  htsbuf_queue_t hq;
-  htsbuf_data_t *hd;
-  int ok;
+  htsbuf_queue_t body;
 
- retry:
+  if(m == NULL) {
+    htsbuf_qprintf(hq, "R 0 %s\n\n", path);
+    return;
+  }
 
-  snprintf(fullpath, sizeof(fullpath), "%s/%s%s",
-	   showtime_settings_path, ps->ps_path,
-	   rename_cant_overwrite ? "" : ".tmp");
+  htsbuf_queue_init(&body, 0);
+  htsmsg_json_serialize(m, &body, 0);
+  htsbuf_qprintf(hq, "S %d %s\n", body.hq_size, path);
+  htsbuf_appendq(hq, &body);
+  htsbuf_append(hq, "\n", 1);
+}
 
-  l = strlen(fullpath);
-  for(x = 1; x < l; x++) {
-    if(fullpath[x] == '/') {
-      /* It's a directory here */
 
-      fullpath[x] = 0;
+/**
+ * Apply all complete records in 'buf'. Returns number of bytes
+ * consumed, anything after that is a torn or corrupt tail
+ */
+static size_t
+store_replay(char *buf, size_t size)
+{
+  size_t off = 0;
 
-      if(stat(fullpath, &st)) {
-        TRACE(TRACE_DEBUG, "Settings", "Dir %s does not exist", fullpath);
+  while(off < size) {
+    char *hdr = buf + off;
+    char *nl = memchr(hdr, '\n', size - off);
+    char *path, *body;
+    long len;
 
-        if(mkdir(fullpath, 0700)) {
-          TRACE(TRACE_ERROR, "Settings", "Unable to create dir \"%s\": %s",
-                fullpath, strerror(errno));
-          return;
-        } else {
-          TRACE(TRACE_DEBUG, "Settings", "Created dir %s", fullpath);
-        }
-      }
-      fullpath[x] = '/';
+    if(nl == NULL)
+      break;
+    *nl = 0;
+
+    if((hdr[0] != 'S' && hdr[0] != 'R') || hdr[1] != ' ')
+      break;
+
+    len = strtol(hdr + 2, &path, 10);
+    if(len < 0 || *path != ' ' || path[1] == 0)
+      break;
+    path++;
+
+    body = nl + 1;
+    if(len >= buf + size - body || body[len] != '\n')
+      break;
+    body[len] = 0;
+
+    if(hdr[0] == 'S') {
+      htsmsg_t *m = htsmsg_json_deserialize(body);
+      if(m == NULL)
+        break;
+      store_record_set(path, m, 0);
+    } else {
+      store_record_set(path, NULL, 0);
     }
+    off = body + len + 1 - buf;
   }
+  return off;
+}
 
 
-  if((fd = open(fullpath, O_CREAT | O_TRUNC | O_WRONLY, 0700)) < 0) {
-    TRACE(TRACE_ERROR, "Settings", "Unable to create \"%s\" - %s",
-	    fullpath, strerror(errno));
-    return;
+/**
+ *
+ */
+static char *
+store_read_file(const char *filename, size_t *sizep)
+{
+  struct stat st;
+  int fd;
+  char *mem;
+  ssize_t n;
+
+  if((fd = open(filename, O_RDONLY, 0)) < 0)
+    return NULL;
+
+  if(fstat(fd, &st) < 0) {
+    close(fd);
+    return NULL;
   }
 
-  ok = 1;
+  mem = malloc(st.st_size + 1);
+  n = read(fd, mem, st.st_size);
+  close(fd);
 
-  htsbuf_queue_init(&hq, 0);
-  htsmsg_json_serialize(ps->ps_msg, &hq, 1);
+  if(n != st.st_size) {
+    TRACE(TRACE_ERROR, "Settings",
+          "Unable to read %s -- %s", filename, strerror(errno));
+    free(mem);
+    return NULL;
+  }
 
-  int bytes = 0;
+  mem[st.st_size] = 0;
+  if(sizep != NULL)
+    *sizep = st.st_size;
+  return mem;
+}
 
-  TAILQ_FOREACH(hd, &hq.hq_q, hd_link) {
-    if(write(fd, hd->hd_data + hd->hd_data_off, hd->hd_data_len) !=
-       hd->hd_data_len) {
-      TRACE(TRACE_ERROR, "Settings", "Failed to write file \"%s\" - %s",
-	      fullpath, strerror(errno));
-      ok = 0;
-      break;
+
+/**
+ * Write entire queue with a single write()
+ */
+static int
+store_write_queue(int fd, htsbuf_queue_t *hq)
+{
+  const size_t len = hq->hq_size;
+  char *buf = malloc(len);
+  int r;
+
+  htsbuf_read(hq, buf, len);
+  r = write(fd, buf, len) == len ? 0 : -1;
+  free(buf);
+  return r;
+}
+
+
+/**
+ * Write all live records to a new snapshot and empty the journal
+ *
+ * Must be called with store_io_mutex held
+ */
+static void
+store_compact(void)
+{
+  char tmppath[PATH_MAX + 4];
+  char path[PATH_MAX];
+  htsbuf_queue_t hq;
+  store_record_t *sr;
+  int i, fd, records = 0;
+  size_t size;
+
+  htsbuf_queue_init(&hq, 0);
+
+  // Dirty records are included too, they will just be journaled again
+  hts_mutex_lock(&pending_store_mutex);
+  for(i = 0; i < STORE_HASH_SIZE; i++) {
+    LIST_FOREACH(sr, &store_hash[i], sr_hash_link) {
+      if(sr->sr_msg == NULL)
+        continue;
+      store_record_serialize(&hq, sr->sr_path, sr->sr_msg);
+      records++;
     }
-    bytes += hd->hd_data_len;
   }
-  htsbuf_queue_flush(&hq);
-  fsync(fd);
-  close(fd);
+  hts_mutex_unlock(&pending_store_mutex);
 
-  if(!ok) {
-    unlink(fullpath);
+  size = hq.hq_size;
+
+  snprintf(path, sizeof(path), "%s/" STORE_SNAPSHOT, showtime_settings_path);
+  snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+
+  if((fd = open(tmppath, O_CREAT | O_TRUNC | O_WRONLY, 0600)) < 0) {
+    TRACE(TRACE_ERROR, "Settings", "Unable to create \"%s\" - %s",
+          tmppath, strerror(errno));
+    htsbuf_queue_flush(&hq);
     return;
   }
 
-  snprintf(fullpath2, sizeof(fullpath2), "%s/%s", showtime_settings_path,
-           ps->ps_path);
+  if(store_write_queue(fd, &hq) || fsync(fd)) {
+    TRACE(TRACE_ERROR, "Settings", "Failed to write file \"%s\" - %s",
+          tmppath, strerror(errno));
+    close(fd);
+    unlink(tmppath);
+    return;
+  }
+  close(fd);
 
-  if(!rename_cant_overwrite && rename(fullpath, fullpath2)) {
+  if(rename_cant_overwrite || rename(tmppath, path)) {
 
-    if(errno == EEXIST) {
-      TRACE(TRACE_DEBUG, "Settings", 
-	    "Seems like rename() can not overwrite, retrying");
+    if(!rename_cant_overwrite && errno == EEXIST) {
+      TRACE(TRACE_DEBUG, "Settings",
+            "Seems like rename() can not overwrite, retrying");
       rename_cant_overwrite = 1;
-      goto retry;
     }
 
-    TRACE(TRACE_ERROR, "Settings", "Failed to rename \"%s\" -> \"%s\" - %s",
-	  fullpath, fullpath2, strerror(errno));
-  } else {
-    TRACE(TRACE_DEBUG, "Settings", "Wrote %d bytes to \"%s\"",
-	  bytes, fullpath2);
+    if(!rename_cant_overwrite ||
+       (unlink(path), rename(tmppath, path))) {
+      TRACE(TRACE_ERROR, "Settings", "Failed to rename \"%s\" -> \"%s\" - %s",
+            tmppath, path, strerror(errno));
+      return;
+    }
   }
+
+  // Snapshot is safe on disk, journal content is now redundant
+  if(ftruncate(store_journal_fd, 0) || fsync(store_journal_fd))
+    TRACE(TRACE_ERROR, "Settings", "Unable to truncate journal - %s",
+          strerror(errno));
+
+  store_journal_size = 0;
+  store_snapshot_size = size;
+
+  TRACE(TRACE_DEBUG, "Settings", "Wrote snapshot with %d records, %d bytes",
+        records, (int)size);
+}
+
+
+/**
+ * Returns 0 if records are safe in the journal
+ */
+static int
+store_journal_append(htsbuf_queue_t *hq, int records)
+{
+  const size_t len = hq->hq_size;
+
+  // Not durable unless fsync() succeeds, so treat that as a failed write
+  if(store_journal_fd == -1 || store_write_queue(store_journal_fd, hq) ||
+     fsync(store_journal_fd)) {
+    TRACE(TRACE_ERROR, "Settings",
+          "Failed to journal %d records - %s", records, strerror(errno));
+    htsbuf_queue_flush(hq);
+
+    // Don't leave a partial record that would hide later appends
+    if(store_journal_fd != -1 &&
+       ftruncate(store_journal_fd, store_journal_size))
+      TRACE(TRACE_ERROR, "Settings", "Unable to truncate journal - %s",
+            strerror(errno));
+    return -1;
+  }
+
+  store_journal_size += len;
+
+  TRACE(TRACE_DEBUG, "Settings", "Journaled %d records, %d bytes",
+        records, (int)len);
+  return 0;
 }
 
 
@@ -169,19 +404,62 @@ pending_store_write(pending_store_t *ps)
 void
 htsmsg_store_flush(void)
 {
-  pending_store_t *ps;
+  store_record_t *sr, **srs = NULL;
+  htsbuf_queue_t hq;
+  int records = 0, i;
+  int *gens = NULL;
+
+  if(showtime_settings_path == NULL)
+    return;
+
+  htsbuf_queue_init(&hq, 0);
+
+  hts_mutex_lock(&store_io_mutex);
+
+  // Records stay dirty until they are in the journal so if writing it
+  // fails they are retried on next flush. Dirty records are never
+  // destroyed by anyone else so the pointers stay valid
   hts_mutex_lock(&pending_store_mutex);
-  while((ps = LIST_FIRST(&pending_stores)) != NULL) {
-    LIST_REMOVE(ps, ps_link);
-    hts_mutex_unlock(&pending_store_mutex);
-    pending_store_write(ps);
-    pending_store_destroy(ps);
-    hts_mutex_lock(&pending_store_mutex);
+  LIST_FOREACH(sr, &store_dirty, sr_dirty_link)
+    records++;
+  if(records) {
+    srs = malloc(sizeof(store_record_t *) * records);
+    gens = malloc(sizeof(int) * records);
+    i = 0;
+    LIST_FOREACH(sr, &store_dirty, sr_dirty_link) {
+      store_record_serialize(&hq, sr->sr_path, sr->sr_msg);
+      srs[i] = sr;
+      gens[i++] = sr->sr_dirty;
+    }
   }
   hts_mutex_unlock(&pending_store_mutex);
 
+  if(records && !store_journal_append(&hq, records)) {
+
+    hts_mutex_lock(&pending_store_mutex);
+    for(i = 0; i < records; i++) {
+      sr = srs[i];
+      if(sr->sr_dirty != gens[i])
+        continue; // Modified since we serialized it, journal again
+
+      LIST_REMOVE(sr, sr_dirty_link);
+      sr->sr_dirty = 0;
+      if(sr->sr_msg == NULL)
+        store_record_destroy(sr);
+    }
+    hts_mutex_unlock(&pending_store_mutex);
+
+    if(store_journal_size > MAX(STORE_COMPACT_MIN, store_snapshot_size))
+      store_compact();
+  }
+  free(srs);
+  free(gens);
+
+  hts_mutex_unlock(&store_io_mutex);
+
 #ifdef STOS
-  arch_sync_path(showtime_settings_path);
+  if(records)
+    arch_sync_path(showtime_settings_path);
 #endif
 }
 
@@ -196,6 +474,128 @@ pending_store_fire(struct callout *c, void *opaque)
 }
 
 
+/**
+ * Import records from the old one-file-per-record layout
+ */
+static void
+store_import_legacy(const char *dirpath, const char *prefix)
+{
+  char fullpath[PATH_MAX];
+  char relpath[PATH_MAX];
+  struct dirent *d;
+  struct stat st;
+  htsmsg_t *m;
+  char *mem;
+  DIR *dir;
+  int l;
+
+  if((dir = opendir(dirpath)) == NULL)
+    return;
+
+  while((d = readdir(dir)) != NULL) {
+    if(d->d_name[0] == '.')
+      continue;
+
+    if(*prefix == 0 && !strncmp(d->d_name, "store.", 6))
+      continue;
+
+    l = strlen(d->d_name);
+    if(l > 4 && !strcmp(d->d_name + l - 4, ".tmp"))
+      continue;
+
+    snprintf(fullpath, sizeof(fullpath), "%s/%s", dirpath, d->d_name);
+
+    if(stat(fullpath, &st))
+      continue;
+
+    if(S_ISDIR(st.st_mode)) {
+      snprintf(relpath, sizeof(relpath), "%s%s/", prefix, d->d_name);
+      store_import_legacy(fullpath, relpath);
+      continue;
+    }
+
+    if((mem = store_read_file(fullpath, NULL)) == NULL)
+      continue;
+
+    snprintf(relpath, sizeof(relpath), "%s%s", prefix, d->d_name);
+
+    if((m = htsmsg_json_deserialize(mem)) != NULL)
+      store_record_set(relpath, m, 0);
+    else
+      TRACE(TRACE_ERROR, "Settings", "Unable to import %s -- corrupted",
+            fullpath);
+    free(mem);
+  }
+  closedir(dir);
+}
+
+
+/**
+ *
+ */
+static void
+store_open(void)
+{
+  char path[PATH_MAX];
+  size_t size, used;
+  char *mem;
+  int found = 0;
+
+  hts_mutex_lock(&store_io_mutex);
+
+  snprintf(path, sizeof(path), "%s/" STORE_SNAPSHOT, showtime_settings_path);
+  if((mem = store_read_file(path, &size)) == NULL) {
+    // If rename() can't overwrite we may have crashed after removing
+    // the old snapshot but before renaming the new one
+    snprintf(path, sizeof(path), "%s/" STORE_SNAPSHOT ".tmp",
+             showtime_settings_path);
+    mem = store_read_file(path, &size);
+  }
+
+  if(mem != NULL) {
+    used = store_replay(mem, size);
+    if(used != size)
+      TRACE(TRACE_ERROR, "Settings", "%s corrupted after %d bytes",
+            path, (int)used);
+    store_snapshot_size = size;
+    free(mem);
+    found = 1;
+  }
+
+  snprintf(path, sizeof(path), "%s/" STORE_JOURNAL, showtime_settings_path);
+  if((mem = store_read_file(path, &size)) != NULL) {
+    used = store_replay(mem, size);
+    if(used != size) {
+      TRACE(TRACE_INFO, "Settings",
+            "Discarding %d bytes of incomplete journal", (int)(size - used));
+      if(truncate(path, used))
+        TRACE(TRACE_ERROR, "Settings", "Unable to truncate journal - %s",
+              strerror(errno));
+    }
+    store_journal_size = used;
+    free(mem);
+    found = 1;
+  }
+
+  store_journal_fd = open(path, O_CREAT | O_WRONLY | O_APPEND, 0600);
+  if(store_journal_fd == -1)
+    TRACE(TRACE_ERROR, "Settings", "Unable to open \"%s\" - %s",
+          path, strerror(errno));
+
+  if(!found) {
+    store_import_legacy(showtime_settings_path, "");
+    if(store_num_records)
+      store_compact();
+  }
+
+  hts_mutex_unlock(&store_io_mutex);
+
+  TRACE(TRACE_DEBUG, "Settings",
+        "Loaded %d records (snapshot %d bytes, journal %d bytes)",
+        store_num_records, (int)store_snapshot_size, (int)store_journal_size);
+}
+
+
 /**
  *
  */
@@ -205,6 +605,7 @@ htsmsg_store_init(void)
   char p1[PATH_MAX], p2[PATH_MAX];
 
   hts_mutex_init(&pending_store_mutex);
+  hts_mutex_init(&store_io_mutex);
 
   if(gconf.persistent_path == NULL)
     return;
@@ -237,28 +638,24 @@ htsmsg_store_init(void)
       }
     }
   }
+
+  store_open();
 }
 
 
 /**
- *
+ * Build path relative to settings directory
  */
-void
-htsmsg_store_save(htsmsg_t *record, const char *pathfmt, ...)
+static int
+htsmsg_store_buildpath(char *dst, size_t dstsize, const char *fmt, va_list ap)
 {
-  char path[PATH_MAX];
-  va_list ap;
-  char *n;
-  pending_store_t *ps;
+  char *n = dst;
+  int l;
 
   if(showtime_settings_path == NULL)
-    return;
-
-  va_start(ap, pathfmt);
-  vsnprintf(path, sizeof(path), pathfmt, ap);
-  va_end(ap);
+     return -1;
 
-  n = path;
+  vsnprintf(dst, dstsize, fmt, ap);
 
   while(*n) {
     if(*n == ':' || *n == '?' || *n == '*' || *n > 127 || *n < 32)
@@ -266,146 +663,103 @@ htsmsg_store_save(htsmsg_t *record, const char *pathfmt, ...)
     n++;
   }
 
-  hts_mutex_lock(&pending_store_mutex);
+  l = strlen(dst);
+  while(l > 0 && dst[l - 1] == '/')
+    dst[--l] = 0;
 
-
-
-  LIST_FOREACH(ps, &pending_stores, ps_link)
-    if(!strcmp(ps->ps_path, path))
-      break;
-  
-  if(!callout_isarmed(&pending_store_callout))
-    callout_arm(&pending_store_callout, pending_store_fire, NULL,
-		SETTINGS_STORE_DELAY);
-
-  if(ps == NULL) {
-    ps = malloc(sizeof(pending_store_t));
-    ps->ps_path = strdup(path);
-    LIST_INSERT_HEAD(&pending_stores, ps, ps_link);
-  } else {
-    htsmsg_destroy(ps->ps_msg);
-  }
-
-  ps->ps_msg = htsmsg_copy(record);
-
-  hts_mutex_unlock(&pending_store_mutex);
+  return l > 0 ? 0 : -1;
 }
 
 
 /**
  *
  */
-static htsmsg_t *
-htsmsg_store_load_one(const char *filename)
+void
+htsmsg_store_save(htsmsg_t *record, const char *pathfmt, ...)
 {
-  struct stat st;
-  int fd;
-  char *mem;
-  htsmsg_t *r;
-  int n;
-  pending_store_t *ps;
-
-  LIST_FOREACH(ps, &pending_stores, ps_link)
-    if(!strcmp(ps->ps_path, filename))
-      return htsmsg_copy(ps->ps_msg);
-
-  if(stat(filename, &st) < 0) {
-    TRACE(TRACE_DEBUG, "Settings", 
-	  "Trying to load %s -- %s", filename, strerror(errno));
-    return NULL;
-  }
-  if((fd = open(filename, O_RDONLY, 0)) < 0) {
-    TRACE(TRACE_ERROR, "Settings", 
-	  "Unable to open %s -- %s", filename, strerror(errno));
-    return NULL;
-  }
+  char path[PATH_MAX];
+  va_list ap;
+  int r;
 
-  mem = malloc(st.st_size + 1);
-  mem[st.st_size] = 0;
+  va_start(ap, pathfmt);
+  r = htsmsg_store_buildpath(path, sizeof(path), pathfmt, ap);
+  va_end(ap);
 
-  n = read(fd, mem, st.st_size);
+  if(r)
+    return;
 
-  close(fd);
-  if(n == st.st_size)
-    r = htsmsg_json_deserialize(mem);
-  else
-    r = NULL;
+  hts_mutex_lock(&pending_store_mutex);
 
-  TRACE(TRACE_DEBUG, "Settings", 
-	"Read %s -- %d bytes. File %s", filename, n, r ? "OK" : "corrupted");
+  store_record_set(path, htsmsg_copy(record), 1);
 
-  free(mem);
+  if(!callout_isarmed(&pending_store_callout))
+    callout_arm_worker(&pending_store_callout, pending_store_fire, NULL,
+		       SETTINGS_STORE_DELAY);
 
-  return r;
+  hts_mutex_unlock(&pending_store_mutex);
 }
 
+
 /**
+ * Collect direct children of 'dir' into a map, same as what loading
+ * a directory returned with the old one-file-per-record layout
  *
+ * Must be called with pending_store_mutex held
  */
-static int
-htsmsg_store_buildpath(char *dst, size_t dstsize, const char *fmt, va_list ap)
+static htsmsg_t *
+store_load_dir(const char *dir)
 {
-  char *n = dst;
-
-  if(showtime_settings_path == NULL)
-     return -1;
-
-  snprintf(dst, dstsize, "%s/", showtime_settings_path);
-
-  vsnprintf(dst + strlen(dst), dstsize - strlen(dst), fmt, ap);
-
-  while(*n) {
-    if(*n == ':' || *n == '?' || *n == '*' || *n > 127 || *n < 32)
-      *n = '_';
-    n++;
+  const size_t len = strlen(dir);
+  htsmsg_t *r = NULL;
+  store_record_t *sr;
+  const char *name;
+  int i;
+
+  for(i = 0; i < STORE_HASH_SIZE; i++) {
+    LIST_FOREACH(sr, &store_hash[i], sr_hash_link) {
+      if(sr->sr_msg == NULL || strncmp(sr->sr_path, dir, len) ||
+         sr->sr_path[len] != '/')
+        continue;
+
+      name = sr->sr_path + len + 1;
+      if(strchr(name, '/') != NULL)
+        continue;
+
+      if(r == NULL)
+        r = htsmsg_create_map();
+      htsmsg_add_msg(r, name, htsmsg_copy(sr->sr_msg));
+    }
   }
-  return 0;
+  return r;
 }
 
+
 /**
  *
  */
 htsmsg_t *
 htsmsg_store_load(const char *pathfmt, ...)
 {
-  char fullpath[PATH_MAX];
-  char child[PATH_MAX];
+  char path[PATH_MAX];
+  store_record_t *sr;
   va_list ap;
-  struct stat st;
-  struct dirent *d;
-  htsmsg_t *r, *c;
-  DIR *dir;
+  htsmsg_t *r;
+  int v;
 
   va_start(ap, pathfmt);
-  if(htsmsg_store_buildpath(fullpath, sizeof(fullpath), pathfmt, ap) < 0)
+  v = htsmsg_store_buildpath(path, sizeof(path), pathfmt, ap);
+  va_end(ap);
+
+  if(v)
     return NULL;
 
   hts_mutex_lock(&pending_store_mutex);
 
-  if(stat(fullpath, &st) == 0 && S_ISDIR(st.st_mode)) {
-
-    if((dir = opendir(fullpath)) == NULL) {
-      hts_mutex_unlock(&pending_store_mutex);
-      return NULL;
-    }
-
-    r = htsmsg_create_map();
-
-    while((d = readdir(dir)) != NULL) {
-      if(d->d_name[0] == '.')
-	continue;
-      
-      snprintf(child, sizeof(child), "%s/%s", fullpath, d->d_name);
-      c = htsmsg_store_load_one(child);
-      if(c != NULL)
-	htsmsg_add_msg(r, d->d_name, c);
-
-    }
-    closedir(dir);
-
-  } else {
-    r = htsmsg_store_load_one(fullpath);
-  }
+  sr = store_record_find(path, 0);
+  if(sr != NULL && sr->sr_msg != NULL)
+    r = htsmsg_copy(sr->sr_msg);
+  else
+    r = store_load_dir(path);
 
   hts_mutex_unlock(&pending_store_mutex);
 
@@ -418,27 +772,28 @@ htsmsg_store_load(const char *pathfmt, ...)
 void
 htsmsg_store_remove(const char *pathfmt, ...)
 {
-  char fullpath[PATH_MAX];
+  char path[PATH_MAX];
+  store_record_t *sr;
   va_list ap;
+  int r;
 
   va_start(ap, pathfmt);
-  if(!htsmsg_store_buildpath(fullpath, sizeof(fullpath), pathfmt, ap)) {
+  r = htsmsg_store_buildpath(path, sizeof(path), pathfmt, ap);
+  va_end(ap);
 
-    pending_store_t *ps;
+  if(r)
+    return;
 
-    hts_mutex_lock(&pending_store_mutex);
+  hts_mutex_lock(&pending_store_mutex);
 
-    LIST_FOREACH(ps, &pending_stores, ps_link)
-      if(!strcmp(ps->ps_path, fullpath))
-	break;
-    
-    if(ps != NULL) {
-      LIST_REMOVE(ps, ps_link);
-      pending_store_destroy(ps);
-    }
+  sr = store_record_find(path, 0);
+  if(sr != NULL && sr->sr_msg != NULL) {
+    store_record_set(path, NULL, 1);
 
-    unlink(fullpath);
-    hts_mutex_unlock(&pending_store_mutex);
+    if(!callout_isarmed(&pending_store_callout))
+      callout_arm_worker(&pending_store_callout, pending_store_fire, NULL,
+                         SETTINGS_STORE_DELAY);
   }
-  va_end(ap);
+
+  hts_mutex_unlock(&pending_store_mutex);
 }
@@ -85,6 +85,8 @@ typedef struct xmlparser {
 
   struct xmlns_list xp_namespaces;
 
+  htsmsg_arena_t *xp_arena;
+
 } xmlparser_t;
 
 #define xmlerr(xp, fmt...) \
@@ -337,7 +339,7 @@ htsmsg_xml_parse_tag(xmlparser_t *xp, htsmsg_t *parent, char *src)
     return NULL;
   }
 
-  attrs = htsmsg_create_map();
+  attrs = htsmsg_create_map_arena(xp->xp_arena);
 
   while(1) {
 
@@ -367,7 +369,7 @@ htsmsg_xml_parse_tag(xmlparser_t *xp, htsmsg_t *parent, char *src)
     }
   }
 
-  m = htsmsg_create_map();
+  m = htsmsg_create_map_arena(xp->xp_arena);
 
   if(TAILQ_FIRST(&attrs->hm_fields) != NULL) {
     htsmsg_add_msg_extname(m, "attrib", attrs);
@@ -445,7 +447,7 @@ htsmsg_xml_parse_pi(xmlparser_t *xp, htsmsg_t *parent, char *src)
   memcpy(piname, s, l);
   piname[l] = 0;
 
-  attrs = htsmsg_create_map();
+  attrs = htsmsg_create_map_arena(xp->xp_arena);
 
   while(1) {
 
@@ -662,7 +664,7 @@ htsmsg_xml_parse_cd(xmlparser_t *xp, htsmsg_t *parent, char *src)
   int c = 0, l, y = 0;
   char *body;
   char *x;
-  htsmsg_t *tags = htsmsg_create_map();
+  htsmsg_t *tags = htsmsg_create_map_arena(xp->xp_arena);
   
   TAILQ_INIT(&ccq);
   src = htsmsg_xml_parse_cd0(xp, &ccq, tags, NULL, src, 0);
@@ -759,7 +761,7 @@ htsmsg_xml_parse_cd(xmlparser_t *xp, htsmsg_t *parent, char *src)
 static char *
 htsmsg_parse_prolog(xmlparser_t *xp, char *src)
 {
-  htsmsg_t *pis = htsmsg_create_map();
+  htsmsg_t *pis = htsmsg_create_map_arena(xp->xp_arena);
   htsmsg_t *xmlpi;
   const char *encoding;
 
@@ -827,11 +829,12 @@ htsmsg_xml_deserialize(char *src, char *errbuf, size_t errbufsize)
   xp.xp_errmsg[0] = 0;
   xp.xp_encoding = XML_ENCODING_UTF8;
   LIST_INIT(&xp.xp_namespaces);
+  xp.xp_arena = htsmsg_arena_create();
 
   if((src = htsmsg_parse_prolog(&xp, src)) == NULL)
     goto err;
 
-  m = htsmsg_create_map();
+  m = htsmsg_create_map_arena(xp.xp_arena);
 
   if(htsmsg_xml_parse_cd(&xp, m, src) == NULL) {
     htsmsg_destroy(m);
@@ -845,9 +848,11 @@ htsmsg_xml_deserialize(char *src, char *errbuf, size_t errbufsize)
     free(src0);
   }
 
+  htsmsg_arena_release(xp.xp_arena);
   return m;
 
  err:
+  htsmsg_arena_release(xp.xp_arena);
   free(src);
   snprintf(errbuf, errbufsize, "%s", xp.xp_errmsg);
   
@@ -881,12 +886,13 @@ htsmsg_xml_deserialize_buf2(buf_t *buf, char *errbuf, size_t errbufsize)
   xp.xp_errmsg[0] = 0;
   xp.xp_encoding = XML_ENCODING_UTF8;
   LIST_INIT(&xp.xp_namespaces);
+  xp.xp_arena = htsmsg_arena_create();
   src = buf->b_ptr;
 
   if((src = htsmsg_parse_prolog(&xp, src)) == NULL)
     goto err;
 
-  m = htsmsg_create_map();
+  m = htsmsg_create_map_arena(xp.xp_arena);
 
   if(htsmsg_xml_parse_cd(&xp, m, src) == NULL) {
     htsmsg_destroy(m);
@@ -899,9 +905,11 @@ htsmsg_xml_deserialize_buf2(buf_t *buf, char *errbuf, size_t errbufsize)
   } else {
     buf_release(buf);
   }
+  htsmsg_arena_release(xp.xp_arena);
   return m;
 
  err:
+  htsmsg_arena_release(xp.xp_arena);
   snprintf(errbuf, errbufsize, "%s", xp.xp_errmsg);
   
   /* Remove any odd chars inside of errmsg */
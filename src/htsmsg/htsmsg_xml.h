@@ -33,4 +33,48 @@ htsmsg_t *htsmsg_xml_deserialize(char *src, char *errbuf, size_t errsize);
 htsmsg_t *htsmsg_xml_deserialize_buf2(buf_t *b, char *errbuf, size_t errsize);
 
 
+/**
+ * Incremental XML parser (htsmsg_xml_stream.c)
+ *
+ * Paths are '/' separated lists of tag names without namespace prefix
+ * starting at the document root. '*' matches any tag.
+ */
+typedef struct htsmsg_xml_stream htsmsg_xml_stream_t;
+
+/**
+ * Invoked for each complete element matching a path. 'element' has the
+ * same layout as a tag parsed by htsmsg_xml_deserialize() and is
+ * destroyed when the callback returns. Return non-zero to abort parsing
+ */
+typedef int (htsmsg_xml_stream_element_cb_t)(void *opaque, const char *name,
+                                             htsmsg_t *element);
+
+/**
+ * Invoked with decoded (UTF-8) character data of elements matching a
+ * path as it arrives. Called with data == NULL when the element ends.
+ * Return non-zero to abort parsing
+ */
+typedef int (htsmsg_xml_stream_cdata_cb_t)(void *opaque, const char *data,
+                                           size_t len);
+
+htsmsg_xml_stream_t *htsmsg_xml_stream_create(void);
+
+void htsmsg_xml_stream_destroy(htsmsg_xml_stream_t *xs);
+
+void htsmsg_xml_stream_on_element(htsmsg_xml_stream_t *xs, const char *path,
+                                  htsmsg_xml_stream_element_cb_t *cb,
+                                  void *opaque);
+
+void htsmsg_xml_stream_on_cdata(htsmsg_xml_stream_t *xs, const char *path,
+                                htsmsg_xml_stream_cdata_cb_t *cb,
+                                void *opaque);
+
+int htsmsg_xml_stream_feed(htsmsg_xml_stream_t *xs, const void *data,
+                           size_t len);
+
+int htsmsg_xml_stream_finish(htsmsg_xml_stream_t *xs);
+
+const char *htsmsg_xml_stream_error(const htsmsg_xml_stream_t *xs);
+
+
 #endif /* HTSMSG_XML_H_ */
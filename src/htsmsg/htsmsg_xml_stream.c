@@ -0,0 +1,906 @@
+/*
+ *  Showtime Mediacenter
+ *  Copyright (C) 2007-2013 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+
+/**
+ * Incremental (push) XML parser
+ *
+ * Data is fed in arbitrary sized chunks as it arrives. Only elements
+ * matching one of the registered paths are materialized as htsmsg's,
+ * in the same form as htsmsg_xml_deserialize() would produce for the
+ * element. Everything else is just tokenized and dropped, so memory
+ * usage is bounded by the largest selected element rather than the
+ * size of the document.
+ *
+ * Same level of XML support as the DOM parser in htsmsg_xml.c
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "htsmsg_xml.h"
+#include "misc/str.h"
+#include "misc/queue.h"
+
+#define XS_MAX_ENTITY_LEN 32
+
+LIST_HEAD(xs_handler_list, xs_handler);
+LIST_HEAD(xs_ns_list, xs_ns);
+
+/**
+ *
+ */
+typedef struct xs_handler {
+  LIST_ENTRY(xs_handler) xh_link;
+  char **xh_path;
+  int xh_depth;
+  htsmsg_xml_stream_element_cb_t *xh_element_cb;
+  htsmsg_xml_stream_cdata_cb_t *xh_cdata_cb;
+  void *xh_opaque;
+} xs_handler_t;
+
+
+/**
+ * Namespace declaration in scope
+ */
+typedef struct xs_ns {
+  LIST_ENTRY(xs_ns) xn_link;
+  int xn_depth;
+  char *xn_prefix;
+  char *xn_norm;
+} xs_ns_t;
+
+
+/**
+ * Open element
+ */
+typedef struct xs_frame {
+  char *xf_name;
+  const char *xf_local;    // Name without namespace prefix
+
+  htsmsg_t *xf_msg;        // Element being collected, NULL if not
+  htsmsg_t *xf_tags;
+  htsbuf_queue_t xf_cdata;
+
+  xs_handler_t *xf_handler; // Set on the element that matched a handler
+} xs_frame_t;
+
+
+/**
+ *
+ */
+struct htsmsg_xml_stream {
+  struct xs_handler_list xs_handlers;
+  struct xs_ns_list xs_namespaces;
+
+  xs_frame_t *xs_stack;
+  int xs_depth;
+  int xs_stack_size;
+
+  char *xs_buf;
+  size_t xs_len;
+  size_t xs_size;
+
+  int xs_latin1;
+  int xs_failed;
+
+  htsmsg_arena_t *xs_arena;  // Arena for element currently collected
+
+  char xs_errmsg[128];
+};
+
+#define xserr(xs, fmt...) do {                                    \
+    snprintf((xs)->xs_errmsg, sizeof((xs)->xs_errmsg), fmt);      \
+    (xs)->xs_failed = 1;                                          \
+  } while(0)
+
+
+/**
+ *
+ */
+htsmsg_xml_stream_t *
+htsmsg_xml_stream_create(void)
+{
+  htsmsg_xml_stream_t *xs = calloc(1, sizeof(htsmsg_xml_stream_t));
+  LIST_INIT(&xs->xs_handlers);
+  LIST_INIT(&xs->xs_namespaces);
+  return xs;
+}
+
+
+/**
+ *
+ */
+static void
+xs_frame_clear(xs_frame_t *xf)
+{
+  free(xf->xf_name);
+  htsmsg_destroy(xf->xf_msg);
+  htsmsg_destroy(xf->xf_tags);
+  htsbuf_queue_flush(&xf->xf_cdata);
+}
+
+
+/**
+ *
+ */
+static void
+xs_ns_destroy(xs_ns_t *xn)
+{
+  LIST_REMOVE(xn, xn_link);
+  free(xn->xn_prefix);
+  free(xn->xn_norm);
+  free(xn);
+}
+
+
+/**
+ *
+ */
+void
+htsmsg_xml_stream_destroy(htsmsg_xml_stream_t *xs)
+{
+  xs_handler_t *xh;
+  xs_ns_t *xn;
+
+  while(xs->xs_depth > 0)
+    xs_frame_clear(&xs->xs_stack[--xs->xs_depth]);
+
+  while((xh = LIST_FIRST(&xs->xs_handlers)) != NULL) {
+    LIST_REMOVE(xh, xh_link);
+    strvec_free(xh->xh_path);
+    free(xh);
+  }
+
+  while((xn = LIST_FIRST(&xs->xs_namespaces)) != NULL)
+    xs_ns_destroy(xn);
+
+  if(xs->xs_arena != NULL)
+    htsmsg_arena_release(xs->xs_arena);
+  free(xs->xs_stack);
+  free(xs->xs_buf);
+  free(xs);
+}
+
+
+/**
+ *
+ */
+static xs_handler_t *
+xs_handler_add(htsmsg_xml_stream_t *xs, const char *path, void *opaque)
+{
+  xs_handler_t *xh = calloc(1, sizeof(xs_handler_t));
+  xh->xh_path = strvec_split(path, '/');
+  while(xh->xh_path[xh->xh_depth] != NULL)
+    xh->xh_depth++;
+  xh->xh_opaque = opaque;
+  LIST_INSERT_HEAD(&xs->xs_handlers, xh, xh_link);
+  return xh;
+}
+
+
+/**
+ *
+ */
+void
+htsmsg_xml_stream_on_element(htsmsg_xml_stream_t *xs, const char *path,
+                             htsmsg_xml_stream_element_cb_t *cb,
+                             void *opaque)
+{
+  xs_handler_add(xs, path, opaque)->xh_element_cb = cb;
+}
+
+
+/**
+ *
+ */
+void
+htsmsg_xml_stream_on_cdata(htsmsg_xml_stream_t *xs, const char *path,
+                           htsmsg_xml_stream_cdata_cb_t *cb,
+                           void *opaque)
+{
+  xs_handler_add(xs, path, opaque)->xh_cdata_cb = cb;
+}
+
+
+/**
+ *
+ */
+const char *
+htsmsg_xml_stream_error(const htsmsg_xml_stream_t *xs)
+{
+  return xs->xs_errmsg;
+}
+
+
+/**
+ *
+ */
+static inline int
+is_xmlws(char c)
+{
+  return c > 0 && c <= 32;
+}
+
+
+/**
+ * Find a handler matching the current element stack
+ */
+static xs_handler_t *
+xs_match(htsmsg_xml_stream_t *xs)
+{
+  xs_handler_t *xh;
+  int i;
+
+  LIST_FOREACH(xh, &xs->xs_handlers, xh_link) {
+    if(xh->xh_depth != xs->xs_depth)
+      continue;
+
+    for(i = 0; i < xh->xh_depth; i++) {
+      const char *c = xh->xh_path[i];
+      if(strcmp(c, "*") && strcmp(c, xs->xs_stack[i].xf_local))
+        break;
+    }
+    if(i == xh->xh_depth)
+      return xh;
+  }
+  return NULL;
+}
+
+
+/**
+ * Expand namespace prefix the same way as the DOM parser does
+ */
+static char *
+xs_expand_name(htsmsg_xml_stream_t *xs, const char *name)
+{
+  const char *colon = strchr(name, ':');
+  xs_ns_t *xn;
+  char *r;
+
+  if(colon != NULL) {
+    int plen = colon - name;
+    LIST_FOREACH(xn, &xs->xs_namespaces, xn_link) {
+      if(strlen(xn->xn_prefix) == plen && !memcmp(xn->xn_prefix, name, plen)) {
+        int nlen = strlen(xn->xn_norm);
+        int llen = strlen(colon + 1);
+        r = malloc(nlen + llen + 1);
+        memcpy(r, xn->xn_norm, nlen);
+        memcpy(r + nlen, colon + 1, llen + 1);
+        return r;
+      }
+    }
+  }
+  return strdup(name);
+}
+
+
+/**
+ * Deliver character data to whoever is interested in the current element
+ */
+static int
+xs_emit(htsmsg_xml_stream_t *xs, const char *data, size_t len)
+{
+  xs_frame_t *xf;
+
+  if(xs->xs_depth == 0 || len == 0)
+    return 0;
+
+  xf = &xs->xs_stack[xs->xs_depth - 1];
+
+  if(xf->xf_handler != NULL && xf->xf_handler->xh_cdata_cb != NULL) {
+    if(xf->xf_handler->xh_cdata_cb(xf->xf_handler->xh_opaque, data, len)) {
+      xserr(xs, "Aborted by callback");
+      return -1;
+    }
+    return 0;
+  }
+
+  if(xf->xf_msg != NULL)
+    htsbuf_append(&xf->xf_cdata, data, len);
+  return 0;
+}
+
+
+/**
+ * Emit raw text, converting from ISO-8859-1 if needed
+ */
+static int
+xs_emit_raw(htsmsg_xml_stream_t *xs, const char *data, size_t len)
+{
+  char tmp[512];
+  size_t i, o = 0;
+
+  if(!xs->xs_latin1)
+    return xs_emit(xs, data, len);
+
+  for(i = 0; i < len; i++) {
+    o += utf8_put(tmp + o, (uint8_t)data[i]);
+    if(o > sizeof(tmp) - 4) {
+      if(xs_emit(xs, tmp, o))
+        return -1;
+      o = 0;
+    }
+  }
+  return xs_emit(xs, tmp, o);
+}
+
+
+/**
+ * Decode a character or label reference. 'src' points after the '&'
+ * and 'len' is the number of bytes up to and excluding the ';'
+ *
+ * Returns unicode codepoint or -1 on error
+ */
+static int
+xs_decode_entity(const char *src, int len)
+{
+  char label[XS_MAX_ENTITY_LEN + 1];
+  int v = 0, i;
+
+  if(len < 1 || len > XS_MAX_ENTITY_LEN)
+    return -1;
+
+  if(src[0] == '#') {
+    if(len > 1 && src[1] == 'x') {
+      for(i = 2; i < len; i++) {
+        char c = src[i];
+        switch(c) {
+        case '0' ... '9': v = v * 0x10 + c - '0';      break;
+        case 'a' ... 'f': v = v * 0x10 + c - 'a' + 10; break;
+        case 'A' ... 'F': v = v * 0x10 + c - 'A' + 10; break;
+        default:
+          return -1;
+        }
+      }
+    } else {
+      for(i = 1; i < len; i++) {
+        if(src[i] < '0' || src[i] > '9')
+          return -1;
+        v = v * 10 + src[i] - '0';
+      }
+    }
+    return v ?: -1;
+  }
+
+  memcpy(label, src, len);
+  label[len] = 0;
+  return html_entity_lookup(label);
+}
+
+
+/**
+ * Process text between tags. If 'more' is set we might get more data
+ * later, so a reference cut in half is kept for next time.
+ *
+ * Returns number of bytes consumed, or -1 on error
+ */
+static int
+xs_text(htsmsg_xml_stream_t *xs, const char *src, int len, int more)
+{
+  const char *start = src, *s = src, *end = src + len;
+  char u[8];
+
+  while(src < end) {
+    if(*src != '&') {
+      src++;
+      continue;
+    }
+
+    if(xs_emit_raw(xs, s, src - s))
+      return -1;
+
+    const char *semi = memchr(src, ';', end - src);
+    if(semi == NULL) {
+      if(more && end - src <= XS_MAX_ENTITY_LEN + 1)
+        return src - start;
+      xserr(xs, "Unterminated reference");
+      return -1;
+    }
+
+    int c = xs_decode_entity(src + 1, semi - src - 1);
+    if(c == -1) {
+      xserr(xs, "Unknown reference: \"%.*s\"", (int)(semi - src + 1), src);
+      return -1;
+    }
+
+    if(xs_emit(xs, u, utf8_put(u, c)))
+      return -1;
+
+    src = s = semi + 1;
+  }
+
+  if(xs_emit_raw(xs, s, src - s))
+    return -1;
+  return len;
+}
+
+
+/**
+ * Decode an attribute value into a malloced UTF-8 string
+ */
+static char *
+xs_decode_attrib(htsmsg_xml_stream_t *xs, const char *src, int len)
+{
+  char *r = malloc(len * 2 + 1);
+  const char *end = src + len;
+  int o = 0;
+
+  while(src < end) {
+    if(*src == '&') {
+      const char *semi = memchr(src, ';', end - src);
+      int c;
+      if(semi != NULL && (c = xs_decode_entity(src + 1, semi - src - 1)) > 0) {
+        o += utf8_put(r + o, c);
+        src = semi + 1;
+        continue;
+      }
+    }
+
+    if(xs->xs_latin1)
+      o += utf8_put(r + o, (uint8_t)*src);
+    else
+      r[o++] = *src;
+    src++;
+  }
+  r[o] = 0;
+  return r;
+}
+
+
+/**
+ * Parse attributes in a start tag (which has been NUL terminated)
+ *
+ * If 'attrs' is NULL the attributes are only scanned for namespace
+ * declarations
+ */
+static int
+xs_parse_attribs(htsmsg_xml_stream_t *xs, char *src, htsmsg_t *attrs)
+{
+  while(1) {
+    while(is_xmlws(*src))
+      src++;
+
+    if(*src == 0)
+      return 0;
+
+    char *name = src;
+    while(*src && !is_xmlws(*src) && *src != '=')
+      src++;
+    char *nameend = src;
+
+    while(is_xmlws(*src))
+      src++;
+
+    if(*src != '=') {
+      xserr(xs, "Expected '=' in attribute parsing");
+      return -1;
+    }
+    src++;
+
+    while(is_xmlws(*src))
+      src++;
+
+    char quote = *src++;
+    if(quote != '"' && quote != '\'') {
+      xserr(xs, "Expected ' or \" before attribute value");
+      return -1;
+    }
+
+    char *payload = src;
+    while(*src != quote) {
+      if(*src == 0) {
+        xserr(xs, "Unexpected end of tag during attribute value parsing");
+        return -1;
+      }
+      src++;
+    }
+    *nameend = 0;
+    *src++ = 0;
+
+    if(nameend == name) {
+      xserr(xs, "Invalid attribute name");
+      return -1;
+    }
+
+    if(!strncmp(name, "xmlns:", 6)) {
+      if(attrs == NULL) {
+        xs_ns_t *xn = malloc(sizeof(xs_ns_t));
+        xn->xn_depth = xs->xs_depth;
+        xn->xn_prefix = strdup(name + 6);
+        xn->xn_norm = xs_decode_attrib(xs, payload, strlen(payload));
+        LIST_INSERT_HEAD(&xs->xs_namespaces, xn, xn_link);
+      }
+      continue;
+    }
+
+    if(attrs != NULL) {
+      char *v = xs_decode_attrib(xs, payload, strlen(payload));
+      htsmsg_add_str(attrs, name, v);
+      free(v);
+    }
+  }
+}
+
+
+/**
+ *
+ */
+static int
+xs_close_element(htsmsg_xml_stream_t *xs)
+{
+  xs_frame_t *xf = &xs->xs_stack[xs->xs_depth - 1];
+  xs_handler_t *xh = xf->xf_handler;
+  xs_ns_t *xn, *next;
+  int r = 0;
+
+  if(xh != NULL && xh->xh_cdata_cb != NULL)
+    r = xh->xh_cdata_cb(xh->xh_opaque, NULL, 0);
+
+  if(xf->xf_msg != NULL) {
+    htsmsg_t *m = xf->xf_msg;
+    xf->xf_msg = NULL;
+
+    if(xf->xf_cdata.hq_size > 0) {
+      char *s = htsbuf_to_string(&xf->xf_cdata);
+      const char *x = s;
+      while(is_xmlws(*x))
+        x++;
+      // Skip indentation between child elements
+      if(*x || xf->xf_tags == NULL)
+        htsmsg_add_str(m, "cdata", s);
+      free(s);
+    }
+
+    if(xf->xf_tags != NULL) {
+      htsmsg_add_msg(m, "tags", xf->xf_tags);
+      xf->xf_tags = NULL;
+    }
+
+    char *name = xs_expand_name(xs, xf->xf_name);
+
+    if(xh != NULL) {
+      r = xh->xh_element_cb(xh->xh_opaque, xf->xf_local, m);
+      htsmsg_destroy(m);
+      htsmsg_arena_release(xs->xs_arena);
+      xs->xs_arena = NULL;
+    } else {
+      xs_frame_t *parent = &xs->xs_stack[xs->xs_depth - 2];
+      if(parent->xf_tags == NULL)
+        parent->xf_tags = htsmsg_create_map_arena(xs->xs_arena);
+      htsmsg_add_msg(parent->xf_tags, name, m);
+    }
+    free(name);
+  }
+
+  for(xn = LIST_FIRST(&xs->xs_namespaces); xn != NULL; xn = next) {
+    next = LIST_NEXT(xn, xn_link);
+    if(xn->xn_depth == xs->xs_depth)
+      xs_ns_destroy(xn);
+  }
+
+  xs_frame_clear(xf);
+  xs->xs_depth--;
+
+  if(r)
+    xserr(xs, "Aborted by callback");
+  return r;
+}
+
+
+/**
+ * Start tag, 'src' is NUL terminated and points after the '<'
+ */
+static int
+xs_open_element(htsmsg_xml_stream_t *xs, char *src, int empty)
+{
+  xs_frame_t *xf, *parent;
+  char *name = src;
+
+  while(*src && !is_xmlws(*src))
+    src++;
+  if(*src)
+    *src++ = 0;
+
+  if(*name == 0) {
+    xserr(xs, "Invalid tag name");
+    return -1;
+  }
+
+  if(xs->xs_depth == xs->xs_stack_size) {
+    xs->xs_stack_size = xs->xs_stack_size * 2 ?: 16;
+    xs->xs_stack = realloc(xs->xs_stack,
+                           xs->xs_stack_size * sizeof(xs_frame_t));
+  }
+
+  parent = xs->xs_depth ? &xs->xs_stack[xs->xs_depth - 1] : NULL;
+  xf = &xs->xs_stack[xs->xs_depth++];
+  memset(xf, 0, sizeof(xs_frame_t));
+  htsbuf_queue_init(&xf->xf_cdata, 0);
+  xf->xf_name = strdup(name);
+  xf->xf_local = strchr(xf->xf_name, ':');
+  xf->xf_local = xf->xf_local ? xf->xf_local + 1 : xf->xf_name;
+
+  // Attributes are parsed twice; first for namespaces, then for values
+  char *attribs = alloca(strlen(src) + 1);
+  strcpy(attribs, src);
+  if(xs_parse_attribs(xs, attribs, NULL))
+    return -1;
+
+  if(parent == NULL || parent->xf_msg == NULL) {
+    xf->xf_handler = xs_match(xs);
+    if(xf->xf_handler != NULL && xf->xf_handler->xh_element_cb != NULL) {
+      xs->xs_arena = htsmsg_arena_create();
+      xf->xf_msg = htsmsg_create_map_arena(xs->xs_arena);
+    }
+  } else {
+    xf->xf_msg = htsmsg_create_map_arena(xs->xs_arena);
+  }
+
+  if(xf->xf_msg != NULL) {
+    htsmsg_t *attrs = htsmsg_create_map_arena(xs->xs_arena);
+    if(xs_parse_attribs(xs, src, attrs)) {
+      htsmsg_destroy(attrs);
+      return -1;
+    }
+    if(TAILQ_FIRST(&attrs->hm_fields) != NULL)
+      htsmsg_add_msg(xf->xf_msg, "attrib", attrs);
+    else
+      htsmsg_destroy(attrs);
+  }
+
+  return empty ? xs_close_element(xs) : 0;
+}
+
+
+/**
+ * End tag, 'src' is NUL terminated and points after the '</'
+ */
+static int
+xs_end_tag(htsmsg_xml_stream_t *xs, char *src)
+{
+  int l = strlen(src);
+  while(l > 0 && is_xmlws(src[l - 1]))
+    src[--l] = 0;
+
+  if(xs->xs_depth == 0) {
+    xserr(xs, "Unexpected close tag </%s>", src);
+    return -1;
+  }
+
+  if(strcmp(xs->xs_stack[xs->xs_depth - 1].xf_name, src)) {
+    xserr(xs, "Mismatched close tag </%s>, expected </%s>",
+          src, xs->xs_stack[xs->xs_depth - 1].xf_name);
+    return -1;
+  }
+  return xs_close_element(xs);
+}
+
+
+/**
+ * Processing instruction, only used to figure out encoding
+ */
+static void
+xs_pi(htsmsg_xml_stream_t *xs, char *src)
+{
+  if(strncmp(src, "xml", 3) || !is_xmlws(src[3]))
+    return;
+
+  const char *enc = strstr(src, "encoding");
+  if(enc == NULL)
+    return;
+  enc += strlen("encoding");
+  while(*enc == '=' || *enc == '"' || *enc == '\'' || is_xmlws(*enc))
+    enc++;
+
+  if(!strncasecmp(enc, "iso-8859-1", 10) ||
+     !strncasecmp(enc, "iso-8859_1", 10) ||
+     !strncasecmp(enc, "iso_8859-1", 10) ||
+     !strncasecmp(enc, "iso_8859_1", 10))
+    xs->xs_latin1 = 1;
+}
+
+
+/**
+ * Find end of a start/end tag, skipping over quoted attribute values
+ */
+static char *
+xs_find_tag_end(char *src, char *end)
+{
+  char quote = 0;
+  for(; src < end; src++) {
+    if(quote) {
+      if(*src == quote)
+        quote = 0;
+    } else if(*src == '"' || *src == '\'') {
+      quote = *src;
+    } else if(*src == '>') {
+      return src;
+    }
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static char *
+xs_memmem(char *src, char *end, const char *needle)
+{
+  size_t nlen = strlen(needle);
+  for(; src + nlen <= end; src++)
+    if(!memcmp(src, needle, nlen))
+      return src;
+  return NULL;
+}
+
+
+/**
+ * The buffer is not NUL terminated, so check for room first
+ */
+static int
+xs_prefix(const char *src, const char *end, const char *prefix)
+{
+  size_t plen = strlen(prefix);
+  return end - src >= plen && !memcmp(src, prefix, plen);
+}
+
+
+/**
+ * Parse as much as possible of the buffered data
+ *
+ * Returns number of bytes consumed or -1 on error
+ */
+static int
+xs_parse(htsmsg_xml_stream_t *xs, int more)
+{
+  char *buf = xs->xs_buf;
+  char *src = buf;
+  char *end = buf + xs->xs_len;
+  char *e;
+  int r;
+
+  while(src < end) {
+
+    if(*src != '<') {
+      e = memchr(src, '<', end - src) ?: end;
+      if(xs->xs_depth == 0) {
+        // Outside of root element, only whitespace allowed (and ignored)
+        src = e;
+        continue;
+      }
+
+      r = xs_text(xs, src, e - src, more && e == end);
+      if(r < 0)
+        return -1;
+      src += r;
+      if(src < e)
+        break; // Partial reference, wait for more data
+      continue;
+    }
+
+    if(end - src < 9 && src + 1 < end && src[1] == '!' && more)
+      break; // Can't tell comment / CDATA / DOCTYPE apart yet
+
+    if(xs_prefix(src, end, "<!--")) {
+      if((e = xs_memmem(src + 4, end, "-->")) == NULL)
+        break;
+      src = e + 3;
+      continue;
+    }
+
+    if(xs_prefix(src, end, "<![CDATA[")) {
+      if((e = xs_memmem(src + 9, end, "]]>")) == NULL)
+        break;
+      if(xs_emit_raw(xs, src + 9, e - src - 9))
+        return -1;
+      src = e + 3;
+      continue;
+    }
+
+    if(xs_prefix(src, end, "<?")) {
+      if((e = xs_memmem(src + 2, end, "?>")) == NULL)
+        break;
+      *e = 0;
+      xs_pi(xs, src + 2);
+      src = e + 2;
+      continue;
+    }
+
+    if((e = xs_find_tag_end(src + 1, end)) == NULL)
+      break;
+
+    *e = 0;
+
+    if(src[1] == '!') {
+      // DOCTYPE and friends, ignored
+
+    } else if(src[1] == '/') {
+      if(xs_end_tag(xs, src + 2))
+        return -1;
+
+    } else {
+      int empty = e > src + 1 && e[-1] == '/';
+      if(empty)
+        e[-1] = 0;
+      if(xs_open_element(xs, src + 1, empty))
+        return -1;
+    }
+    src = e + 1;
+  }
+  return src - buf;
+}
+
+
+/**
+ *
+ */
+int
+htsmsg_xml_stream_feed(htsmsg_xml_stream_t *xs, const void *data, size_t len)
+{
+  int r;
+
+  if(xs->xs_failed)
+    return -1;
+
+  if(xs->xs_len + len > xs->xs_size) {
+    xs->xs_size = xs->xs_len + len + 4096;
+    xs->xs_buf = realloc(xs->xs_buf, xs->xs_size);
+  }
+  memcpy(xs->xs_buf + xs->xs_len, data, len);
+  xs->xs_len += len;
+
+  if((r = xs_parse(xs, 1)) < 0) {
+    xs->xs_failed = 1;
+    return -1;
+  }
+
+  memmove(xs->xs_buf, xs->xs_buf + r, xs->xs_len - r);
+  xs->xs_len -= r;
+  return 0;
+}
+
+
+/**
+ *
+ */
+int
+htsmsg_xml_stream_finish(htsmsg_xml_stream_t *xs)
+{
+  int r;
+
+  if(xs->xs_failed)
+    return -1;
+
+  if((r = xs_parse(xs, 0)) < 0) {
+    xs->xs_failed = 1;
+    return -1;
+  }
+
+  xs->xs_len -= r;
+  if(xs->xs_len > 0 || xs->xs_depth > 0) {
+    xserr(xs, "Unexpected end of file");
+    return -1;
+  }
+  return 0;
+}
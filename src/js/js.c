@@ -39,6 +39,8 @@
 #include "api/xmlrpc.h"
 #include "i18n.h"
 #include "plugins.h"
+#include "blobcache.h"
+#include "ext/spidermonkey/jsxdrapi.h"
 
 prop_courier_t *js_global_pc;
 JSContext *js_global_cx;
@@ -1248,6 +1250,7 @@ static JSFunctionSpec plugin_functions[] = {
     JS_FS("copyFile",         js_copyfile, 2, 0, 0),
     JS_FS("selectView",       js_selectView, 1, 0, 0),
     JS_FS("openDb",           js_db_open, 1, 0, 0),
+    JS_FS("httpReqAsync",     js_httpReqAsync, 3, 0, 0),
     JS_FS_END
 };
 
@@ -1281,6 +1284,79 @@ js_plugin_unload(const char *id)
 }
 
 
+/**
+ * Compiled plugins are stored in the blobcache as XDR encoded bytecode.
+ * The etag is derived from the engine bytecode version and a hash of
+ * the source so stale entries are never decoded
+ */
+static void
+js_script_fingerprint(char *out, size_t outlen, const buf_t *src)
+{
+  uint8_t d[20];
+  char hex[41];
+
+  sha1_decl(ctx);
+  sha1_init(ctx);
+  sha1_update(ctx, buf_c8(src), buf_len(src));
+  sha1_final(ctx, d);
+
+  bin2hex(hex, sizeof(hex), d, sizeof(d));
+  snprintf(out, outlen, "%08x-%s", JSXDR_BYTECODE_VERSION, hex);
+}
+
+
+/**
+ *
+ */
+static JSScript *
+js_script_from_cache(JSContext *cx, const char *url, const char *fingerprint)
+{
+  JSScript *s = NULL;
+  char *etag = NULL;
+  buf_t *b;
+
+  b = blobcache_get(url, "jsbytecode", 0, NULL, &etag, NULL);
+  if(b == NULL)
+    return NULL;
+
+  if(etag != NULL && !strcmp(etag, fingerprint)) {
+    JSXDRState *xdr = JS_XDRNewMem(cx, JSXDR_DECODE);
+    JS_XDRMemSetData(xdr, b->b_ptr, buf_len(b));
+    if(!JS_XDRScript(xdr, &s))
+      s = NULL;
+    // Buffer is not owned by the XDR state
+    JS_XDRMemSetData(xdr, NULL, 0);
+    JS_XDRDestroy(xdr);
+  }
+  free(etag);
+  buf_release(b);
+  return s;
+}
+
+
+/**
+ *
+ */
+static void
+js_script_to_cache(JSContext *cx, JSScript *s, const char *url,
+		   const char *fingerprint)
+{
+  JSXDRState *xdr = JS_XDRNewMem(cx, JSXDR_ENCODE);
+  uint32 len;
+  void *data;
+
+  if(JS_XDRScript(xdr, &s) &&
+     (data = JS_XDRMemGetData(xdr, &len)) != NULL) {
+    buf_t *b = buf_create_and_copy(len, data);
+    blobcache_put(url, "jsbytecode", b, INT32_MAX, fingerprint, 0, 0);
+    buf_release(b);
+  } else {
+    TRACE(TRACE_DEBUG, "JS", "Unable to serialize bytecode for %s", url);
+  }
+  JS_XDRDestroy(xdr);
+}
+
+
 /**
  *
  */
@@ -1293,9 +1369,14 @@ js_plugin_load(const char *id, const char *url, char *errbuf, size_t errlen)
   JSObject *pobj, *gobj;
   JSScript *s;
   char path[PATH_MAX];
+  char fingerprint[64];
   jsval val;
   fa_handle_t *ref;
+  int64_t ts0, ts1, ts2, ts3;
+  int cached = 0;
   
+  ts0 = showtime_get_ts();
+
   ref = fa_reference(url);
 
   if((buf = fa_load(url, FA_LOAD_ERRBUF(errbuf, errlen), NULL)) == NULL) {
@@ -1303,6 +1384,8 @@ js_plugin_load(const char *id, const char *url, char *errbuf, size_t errlen)
     return -1;
   }
 
+  ts1 = showtime_get_ts();
+
   cx = js_newctx(err_reporter);
   JS_BeginRequest(cx);
 
@@ -1364,9 +1447,19 @@ js_plugin_load(const char *id, const char *url, char *errbuf, size_t errlen)
 
   jsp->jsp_protect_object = 1;
 
-  s = JS_CompileScript(cx, pobj, buf_cstr(buf), buf->b_size, url, 1);
+  js_script_fingerprint(fingerprint, sizeof(fingerprint), buf);
+
+  if((s = js_script_from_cache(cx, url, fingerprint)) != NULL) {
+    cached = 1;
+  } else {
+    s = JS_CompileScript(cx, pobj, buf_cstr(buf), buf->b_size, url, 1);
+    if(s != NULL)
+      js_script_to_cache(cx, s, url, fingerprint);
+  }
   buf_release(buf);
 
+  ts2 = showtime_get_ts();
+
   if(s != NULL) {
     JSObject *sobj = JS_NewScriptObject(cx, s);
     jsval result;
@@ -1376,6 +1469,14 @@ js_plugin_load(const char *id, const char *url, char *errbuf, size_t errlen)
     JS_RemoveRoot(cx, &sobj);
   }
 
+  ts3 = showtime_get_ts();
+
+  TRACE(TRACE_DEBUG, "JS",
+	"Plugin %s loaded in %d ms (fetch: %d ms, %s: %d ms, init: %d ms)",
+	id, (int)((ts3 - ts0) / 1000), (int)((ts1 - ts0) / 1000),
+	cached ? "cached bytecode" : "compile", (int)((ts2 - ts1) / 1000),
+	(int)((ts3 - ts2) / 1000));
+
   JS_RemoveRoot(cx, &pobj);
   JS_EndRequest(cx);
   JS_GC(cx);
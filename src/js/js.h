@@ -70,6 +70,8 @@ typedef struct js_plugin {
 
   struct fa_handle *jsp_ref;
 
+  struct js_http_limiter *jsp_http_limiter;
+
   int jsp_protect_object;
 
 } js_plugin_t;
@@ -85,6 +87,14 @@ typedef struct js_context_private {
 
   struct cancellable *jcp_c;
 
+  /**
+   * Courier to deliver asynchronous completions on. If NULL they are
+   * delivered on the global JS courier. jcp_pending counts outstanding
+   * completions and is only accessed from the context's own thread
+   */
+  prop_courier_t *jcp_pc;
+  int jcp_pending;
+
 } js_context_private_t;
 
 void js_load(const char *url);
@@ -110,6 +120,11 @@ JSBool js_httpPost(JSContext *cx, JSObject *obj, uintN argc,
 JSBool js_httpReq(JSContext *cx, JSObject *obj, uintN argc,
 		  jsval *argv, jsval *rval);
 
+JSBool js_httpReqAsync(JSContext *cx, JSObject *obj, uintN argc,
+		       jsval *argv, jsval *rval);
+
+void js_http_async_cancel(js_context_private_t *jcp, js_plugin_t *jsp);
+
 JSBool js_readFile(JSContext *cx, JSObject *obj, uintN argc,
 		   jsval *argv, jsval *rval);
 
@@ -20,6 +20,7 @@
  */
 
 #include <string.h>
+#include <assert.h>
 #include "js.h"
 
 #include "ext/spidermonkey/jsprvtd.h"
@@ -30,6 +31,7 @@
 #include "misc/str.h"
 #include "misc/regex.h"
 #include "backend/backend.h"
+#include "misc/cancellable.h"
 
 typedef struct js_http_response {
   buf_t *buf;
@@ -242,49 +244,90 @@ disable_cache_on_http_headers(struct http_header_list *list)
 }
 
 
+/**
+ * A HTTP request as parsed from JS arguments. Does not reference any
+ * JS objects so it can be performed on any thread
+ */
+typedef struct js_http_req {
+  char *url;
+  char **httpargs;
+  char *method;
+  htsbuf_queue_t postdata;
+  int has_postdata;
+  const char *postcontenttype;
+  struct http_header_list request_headers;
+  int flags;
+  int headreq;
+  int cache;
+  int min_expire;
+  struct cancellable *c;
+
+  /**
+   * Result
+   */
+  buf_t *result;
+  char *contenttype;
+  struct http_header_list response_headers;
+  char errbuf[256];
+} js_http_req_t;
+
+
 /**
  *
  */
-static JSBool 
-js_http_request(JSContext *cx, jsval *rval,
-		const char *url, JSObject *argobj, jsval *postval,
-		JSObject *headerobj, JSObject *ctrlobj, const char *method)
+static void
+js_http_req_cleanup(js_http_req_t *req)
+{
+  free(req->url);
+  free(req->method);
+  free(req->contenttype);
+  if(req->httpargs != NULL)
+    strvec_free(req->httpargs);
+  if(req->has_postdata)
+    htsbuf_queue_flush(&req->postdata);
+  http_headers_free(&req->request_headers);
+  http_headers_free(&req->response_headers);
+  buf_release(req->result);
+}
+
+
+/**
+ *
+ */
+static JSBool
+js_http_req_init(JSContext *cx, js_http_req_t *req,
+		 const char *url, JSObject *argobj, jsval *postval,
+		 JSObject *headerobj, JSObject *ctrlobj, const char *method)
 {
-  char **httpargs = NULL;
   int i;
-  char errbuf[256];
-  htsbuf_queue_t *postdata = NULL;
-  const char *postcontenttype = NULL;
-  struct http_header_list request_headers;
-  int flags = 0;
-  int headreq = 0;
-  int cache = 0;
-  int min_expire = 0;
 
-  LIST_INIT(&request_headers);
+  memset(req, 0, sizeof(js_http_req_t));
+  LIST_INIT(&req->request_headers);
+  LIST_INIT(&req->response_headers);
+  req->url = strdup(url);
 
   if(ctrlobj) {
     if(js_is_prop_true(cx, ctrlobj, "debug"))
-      flags |= FA_DEBUG;
+      req->flags |= FA_DEBUG;
     if(js_is_prop_true(cx, ctrlobj, "noFollow"))
-      flags |= FA_NOFOLLOW;
+      req->flags |= FA_NOFOLLOW;
     if(js_is_prop_true(cx, ctrlobj, "headRequest"))
-      headreq = 1;
+      req->headreq = 1;
     if(js_is_prop_true(cx, ctrlobj, "caching"))
-      cache = 1;
+      req->cache = 1;
     if(js_is_prop_true(cx, ctrlobj, "compression"))
-      flags |= FA_COMPRESSION;
-    min_expire = js_prop_int_or_default(cx, ctrlobj, "cacheTime", 0);
+      req->flags |= FA_COMPRESSION;
+    req->min_expire = js_prop_int_or_default(cx, ctrlobj, "cacheTime", 0);
 
-    if(min_expire)
-      cache = 1;
+    if(req->min_expire)
+      req->cache = 1;
   }
 
   if(argobj != NULL)
-    js_http_add_args(&httpargs, cx, argobj);
+    js_http_add_args(&req->httpargs, cx, argobj);
 
   if(postval != NULL) {
-    htsbuf_queue_t hq;
+    htsbuf_queue_t *hq = &req->postdata;
     JSIdArray *ida;
     const char *str;
     const char *prefix = NULL;
@@ -295,7 +338,7 @@ js_http_request(JSContext *cx, jsval *rval,
       if((ida = JS_Enumerate(cx, postobj)) == NULL)
 	return JS_FALSE;
 
-      htsbuf_queue_init(&hq, 0);
+      htsbuf_queue_init(hq, 0);
 
       for(i = 0; i < ida->length; i++) {
 	jsval name, value;
@@ -309,26 +352,26 @@ js_http_request(JSContext *cx, jsval *rval,
 
 	str = JS_GetStringBytes(JSVAL_TO_STRING(name));
 	if(prefix)
-	  htsbuf_append(&hq, prefix, strlen(prefix));
-	htsbuf_append_and_escape_url(&hq, str);
+	  htsbuf_append(hq, prefix, strlen(prefix));
+	htsbuf_append_and_escape_url(hq, str);
 
 	str = JS_GetStringBytes(JS_ValueToString(cx, value));
-	htsbuf_append(&hq, "=", 1);
-	htsbuf_append_and_escape_url(&hq, str);
+	htsbuf_append(hq, "=", 1);
+	htsbuf_append_and_escape_url(hq, str);
       
 	prefix = "&";
       }
     
       JS_DestroyIdArray(cx, ida);
-      postdata = &hq;
-      postcontenttype =  "application/x-www-form-urlencoded";
+      req->has_postdata = 1;
+      req->postcontenttype =  "application/x-www-form-urlencoded";
     } else if(JSVAL_IS_STRING(*postval)) {
 
       str = JS_GetStringBytes(JSVAL_TO_STRING(*postval));
-      htsbuf_queue_init(&hq, 0);
-      htsbuf_append(&hq, str, strlen(str));
-      postdata = &hq;
-      postcontenttype =  "text/ascii";
+      htsbuf_queue_init(hq, 0);
+      htsbuf_append(hq, str, strlen(str));
+      req->has_postdata = 1;
+      req->postcontenttype =  "text/ascii";
     }
   }
 
@@ -348,7 +391,7 @@ js_http_request(JSContext *cx, jsval *rval,
 			 &value) || JSVAL_IS_VOID(value))
 	continue;
 
-      http_header_add(&request_headers,
+      http_header_add(&req->request_headers,
 		      JS_GetStringBytes(JSVAL_TO_STRING(name)),
 		      JS_GetStringBytes(JS_ValueToString(cx, value)), 0);
     }
@@ -356,100 +399,96 @@ js_http_request(JSContext *cx, jsval *rval,
     JS_DestroyIdArray(cx, ida);
   }
 
-  struct cancellable *c = NULL;
   const js_context_private_t *jcp = JS_GetContextPrivate(cx);
   if(jcp != NULL) {
     if(jcp->jcp_flags & JCP_DISABLE_AUTH)
-      flags |= FA_DISABLE_AUTH;
-    c = jcp->jcp_c;
+      req->flags |= FA_DISABLE_AUTH;
+    req->c = jcp->jcp_c;
   }
 
   if(method != NULL && !strcmp(method, "HEAD")) {
     method = NULL;
-    headreq = 1;
+    req->headreq = 1;
   }
-
-  struct http_header_list response_headers;
-  js_http_response_t *jhr;
-  jsrefcount s = JS_SuspendRequest(cx);
-
-  LIST_INIT(&response_headers);
+  req->method = method ? strdup(method) : NULL;
 
   /**
    * If user add specific HTTP headers we will disable caching
    * A few header types are OK to send though since I don't
    * think it will affect result that much
    */
-  if(cache)
-    cache = !disable_cache_on_http_headers(&request_headers);
+  if(req->cache)
+    req->cache = !disable_cache_on_http_headers(&req->request_headers);
+  return JS_TRUE;
+}
 
-  if(cache && method == NULL && !headreq && !postdata) {
+
+/**
+ * Run the request, does not touch any JS state
+ */
+static int
+js_http_req_perform(js_http_req_t *req)
+{
+  if(req->cache && req->method == NULL && !req->headreq && 
+     !req->has_postdata) {
 
     /**
      * If it's a GET request and cache is enabled, run it thru
      * fa_load() to get caching
      */
 
-    buf_t *b = fa_load(url,
-                       FA_LOAD_ERRBUF(errbuf, sizeof(errbuf)),
-                       FA_LOAD_QUERY_ARGVEC(httpargs),
-                       FA_LOAD_FLAGS(flags),
-                       FA_LOAD_CANCELLABLE(c),
-                       FA_LOAD_MIN_EXPIRE(min_expire),
-                       FA_LOAD_REQUEST_HEADERS(&request_headers),
-                       FA_LOAD_RESPONSE_HEADERS(&response_headers),
+    buf_t *b = fa_load(req->url,
+                       FA_LOAD_ERRBUF(req->errbuf, sizeof(req->errbuf)),
+                       FA_LOAD_QUERY_ARGVEC(req->httpargs),
+                       FA_LOAD_FLAGS(req->flags),
+                       FA_LOAD_CANCELLABLE(req->c),
+                       FA_LOAD_MIN_EXPIRE(req->min_expire),
+                       FA_LOAD_REQUEST_HEADERS(&req->request_headers),
+                       FA_LOAD_RESPONSE_HEADERS(&req->response_headers),
                        NULL);
-    JS_ResumeRequest(cx, s);
+    if(b == NULL)
+      return -1;
 
-    if(b == NULL) {
-      JS_ReportError(cx, errbuf);
-      http_headers_free(&request_headers);
-      return JS_FALSE;
-    }
-
-    jhr = calloc(1, sizeof(js_http_response_t));
-    jhr->buf = b;
-    mystrset(&jhr->contenttype, rstr_get(b->b_content_type));
-
-  } else {
-
-    buf_t *result = NULL;
-
-    int n = http_req(url,
-                     HTTP_ARGLIST(httpargs),
-                     HTTP_RESULT_PTR(headreq ? NULL : &result),
-                     HTTP_ERRBUF(errbuf, sizeof(errbuf)),
-                     HTTP_POSTDATA(postdata, postcontenttype),
-                     HTTP_FLAGS(flags),
-                     HTTP_RESPONSE_HEADERS(&response_headers),
-                     HTTP_REQUEST_HEADERS(&request_headers),
-                     HTTP_METHOD(method),
-                     HTTP_CANCELLABLE(c),
-                     NULL);
-
-    JS_ResumeRequest(cx, s);
-
-    if(httpargs != NULL)
-      strvec_free(httpargs);
+    req->result = b;
+    mystrset(&req->contenttype, rstr_get(b->b_content_type));
+    return 0;
+  }
 
-    if(postdata != NULL)
-      htsbuf_queue_flush(postdata);
+  int n = http_req(req->url,
+                   HTTP_ARGLIST(req->httpargs),
+                   HTTP_RESULT_PTR(req->headreq ? NULL : &req->result),
+                   HTTP_ERRBUF(req->errbuf, sizeof(req->errbuf)),
+                   HTTP_POSTDATA(req->has_postdata ? &req->postdata : NULL,
+                                 req->postcontenttype),
+                   HTTP_FLAGS(req->flags),
+                   HTTP_RESPONSE_HEADERS(&req->response_headers),
+                   HTTP_REQUEST_HEADERS(&req->request_headers),
+                   HTTP_METHOD(req->method),
+                   HTTP_CANCELLABLE(req->c),
+                   NULL);
+  if(n)
+    return -1;
+
+  mystrset(&req->contenttype,
+           http_header_get(&req->response_headers, "content-type"));
+  return 0;
+}
 
-    if(n) {
-      JS_ReportError(cx, errbuf);
-      http_headers_free(&request_headers);
-      return JS_FALSE;
-    }
 
-    jhr = calloc(1, sizeof(js_http_response_t));
-  
-    jhr->buf = result;
-    mystrset(&jhr->contenttype,
-	     http_header_get(&response_headers, "content-type"));
-  }
-  jhr->url = strdup(url);
+/**
+ * Create the JS response object. Ownership of the result is
+ * transfered to the object
+ */
+static JSBool
+js_http_response_create(JSContext *cx, js_http_req_t *req, jsval *rval)
+{
+  js_http_response_t *jhr = calloc(1, sizeof(js_http_response_t));
 
-  http_headers_free(&request_headers);
+  jhr->buf = req->result;
+  req->result = NULL;
+  jhr->contenttype = req->contenttype;
+  req->contenttype = NULL;
+  jhr->url = strdup(req->url);
 
   JSObject *robj = JS_NewObjectWithGivenProto(cx, &http_response_class,
 					      NULL, NULL);
@@ -466,7 +505,7 @@ js_http_request(JSContext *cx, jsval *rval,
   JSObject *hdrs = JS_NewObject(cx, NULL, NULL, NULL);
   http_header_t *hh;
 
-  LIST_FOREACH(hh, &response_headers, hh_link) {
+  LIST_FOREACH(hh, &req->response_headers, hh_link) {
     jsval val = STRING_TO_JSVAL(JS_NewStringCopyZ(cx, hh->hh_value));
     JS_SetProperty(cx, hdrs, hh->hh_key, &val);
   }
@@ -477,7 +516,7 @@ js_http_request(JSContext *cx, jsval *rval,
 
   JSObject *multiheaders = JS_NewObject(cx, NULL, NULL, NULL);
 
-  LIST_FOREACH(hh, &response_headers, hh_link) {
+  LIST_FOREACH(hh, &req->response_headers, hh_link) {
 
     jsval key;
     JSObject *array;
@@ -504,12 +543,43 @@ js_http_request(JSContext *cx, jsval *rval,
   js_set_prop_str(cx, robj, "contenttype", jhr->contenttype);
 
   JS_LeaveLocalRootScope(cx);
-
-  http_headers_free(&response_headers);
   return JS_TRUE;
 }
 
 
+/**
+ *
+ */
+static JSBool 
+js_http_request(JSContext *cx, jsval *rval,
+		const char *url, JSObject *argobj, jsval *postval,
+		JSObject *headerobj, JSObject *ctrlobj, const char *method)
+{
+  js_http_req_t req;
+  JSBool r;
+  int n;
+
+  if(!js_http_req_init(cx, &req, url, argobj, postval, headerobj,
+                       ctrlobj, method)) {
+    js_http_req_cleanup(&req);
+    return JS_FALSE;
+  }
+
+  jsrefcount s = JS_SuspendRequest(cx);
+  n = js_http_req_perform(&req);
+  JS_ResumeRequest(cx, s);
+
+  if(n) {
+    JS_ReportError(cx, req.errbuf);
+    r = JS_FALSE;
+  } else {
+    r = js_http_response_create(cx, &req, rval);
+  }
+  js_http_req_cleanup(&req);
+  return r;
+}
+
+
 /**
  *
  */
@@ -552,22 +622,17 @@ js_httpPost(JSContext *cx, JSObject *obj, uintN argc,
 
 
 /**
- *
+ * Parse the control object taken by httpReq() and httpReqAsync()
  */
-JSBool 
-js_httpReq(JSContext *cx, JSObject *obj, uintN argc,
-	   jsval *argv, jsval *rval)
+static JSBool
+js_http_req_from_ctrl(JSContext *cx, js_http_req_t *req, const char *url,
+		      JSObject *ctrlobj)
 {
-  const char *url;
   jsval postval, *pv = NULL;
-  JSObject *ctrlobj = NULL;
   JSObject *argobj = NULL;
   JSObject *hdrobj = NULL;
   rstr_t *method = NULL;
 
-  if(!JS_ConvertArguments(cx, argc, argv, "s/o", &url, &ctrlobj))
-    return JS_FALSE;
-
   if(ctrlobj != NULL) {
     
     argobj = js_prop_obj(cx, ctrlobj, "args");
@@ -577,12 +642,327 @@ js_httpReq(JSContext *cx, JSObject *obj, uintN argc,
       pv = &postval;
   }
 
-  JSBool v = js_http_request(cx, rval, url, argobj, pv, hdrobj, ctrlobj,
-			     rstr_get(method));
+  JSBool v = js_http_req_init(cx, req, url, argobj, pv, hdrobj, ctrlobj,
+			      rstr_get(method));
   rstr_release(method);
   return v;
 }
 
+
+/**
+ *
+ */
+JSBool 
+js_httpReq(JSContext *cx, JSObject *obj, uintN argc,
+	   jsval *argv, jsval *rval)
+{
+  const char *url;
+  JSObject *ctrlobj = NULL;
+  js_http_req_t req;
+  JSBool r;
+  int n;
+
+  if(!JS_ConvertArguments(cx, argc, argv, "s/o", &url, &ctrlobj))
+    return JS_FALSE;
+
+  if(!js_http_req_from_ctrl(cx, &req, url, ctrlobj)) {
+    js_http_req_cleanup(&req);
+    return JS_FALSE;
+  }
+
+  jsrefcount s = JS_SuspendRequest(cx);
+  n = js_http_req_perform(&req);
+  JS_ResumeRequest(cx, s);
+
+  if(n) {
+    JS_ReportError(cx, req.errbuf);
+    r = JS_FALSE;
+  } else {
+    r = js_http_response_create(cx, &req, rval);
+  }
+  js_http_req_cleanup(&req);
+  return r;
+}
+
+
+/**
+ * Asynchronous HTTP requests
+ *
+ * Requests are performed on worker threads, at most
+ * JS_HTTP_ASYNC_MAX_PER_PLUGIN at a time for each plugin. Completion
+ * is signalled through a private prop subscribed on the courier of the
+ * issuing context so the callback runs on the plugin's own context
+ * (the page's model thread or the global JS courier)
+ */
+#define JS_HTTP_ASYNC_MAX_PER_PLUGIN 4
+
+static HTS_MUTEX_DECL(js_http_async_mutex);
+
+TAILQ_HEAD(js_async_req_queue, js_async_req);
+LIST_HEAD(js_async_req_list, js_async_req);
+
+static struct js_async_req_list js_async_reqs; // All outstanding requests
+
+typedef struct js_http_limiter {
+  int jhl_refcount;
+  int jhl_running;
+  struct js_async_req_queue jhl_queue;
+} js_http_limiter_t;
+
+
+typedef struct js_async_req {
+  TAILQ_ENTRY(js_async_req) jar_link;   // In jhl_queue while jar_queued
+  LIST_ENTRY(js_async_req) jar_global_link;
+  js_http_req_t jar_req;
+  int jar_error;
+
+  cancellable_t jar_cancellable;
+  js_plugin_t *jar_plugin;
+  js_context_private_t *jar_jcp;  // NULL if issued from a global context
+  js_http_limiter_t *jar_limiter;
+  int jar_queued;
+  int jar_orphaned;  // Owner is gone, don't invoke callback
+
+  prop_t *jar_trigger;
+  prop_sub_t *jar_sub;
+
+  JSContext *jar_cx;
+  jsval jar_callback;
+  int *jar_pending;
+} js_async_req_t;
+
+
+/**
+ * Must be called with js_http_async_mutex held
+ */
+static void
+jhl_release0(js_http_limiter_t *jhl)
+{
+  jhl->jhl_refcount--;
+  if(jhl->jhl_refcount > 0)
+    return;
+  assert(TAILQ_FIRST(&jhl->jhl_queue) == NULL);
+  free(jhl);
+}
+
+
+/**
+ *
+ */
+static void *
+js_http_async_thread(void *aux)
+{
+  js_http_limiter_t *jhl = aux;
+  js_async_req_t *jar;
+
+  hts_mutex_lock(&js_http_async_mutex);
+  while((jar = TAILQ_FIRST(&jhl->jhl_queue)) != NULL) {
+    TAILQ_REMOVE(&jhl->jhl_queue, jar, jar_link);
+    jar->jar_queued = 0;
+    hts_mutex_unlock(&js_http_async_mutex);
+
+    jar->jar_error = js_http_req_perform(&jar->jar_req);
+    // jar is owned by the completion callback from here on
+    prop_set_int(jar->jar_trigger, 1);
+
+    hts_mutex_lock(&js_http_async_mutex);
+  }
+  jhl->jhl_running--;
+  jhl_release0(jhl);
+  hts_mutex_unlock(&js_http_async_mutex);
+  return NULL;
+}
+
+
+/**
+ * Invoked on the issuing context's courier
+ */
+static void
+js_async_req_complete(void *opaque, prop_event_t event, ...)
+{
+  js_async_req_t *jar = opaque;
+  JSContext *cx = jar->jar_cx;
+  jsval err = JSVAL_NULL, res = JSVAL_NULL, *argv, result;
+  void *mark;
+  va_list ap;
+
+  if(event != PROP_SET_INT)
+    return;
+
+  va_start(ap, event);
+  int done = va_arg(ap, int);
+  va_end(ap);
+
+  if(!done)
+    return;
+
+  hts_mutex_lock(&js_http_async_mutex);
+  LIST_REMOVE(jar, jar_global_link);
+  const int orphaned = jar->jar_orphaned;
+  hts_mutex_unlock(&js_http_async_mutex);
+
+  if(orphaned)
+    goto cleanup;
+
+  JS_EnterLocalRootScope(cx);
+
+  if(jar->jar_error)
+    err = STRING_TO_JSVAL(JS_NewStringCopyZ(cx, jar->jar_req.errbuf));
+  else if(!js_http_response_create(cx, &jar->jar_req, &res))
+    res = JSVAL_NULL;
+
+  argv = JS_PushArguments(cx, &mark, "vv", err, res);
+  if(argv != NULL) {
+    JS_CallFunctionValue(cx, NULL, jar->jar_callback, 2, argv, &result);
+    JS_PopArguments(cx, mark);
+  }
+
+  JS_LeaveLocalRootScope(cx);
+
+ cleanup:
+  JS_RemoveRoot(cx, &jar->jar_callback);
+  if(jar->jar_pending != NULL)
+    (*jar->jar_pending)--;
+
+  prop_unsubscribe(jar->jar_sub);
+  prop_destroy(jar->jar_trigger);
+  js_http_req_cleanup(&jar->jar_req);
+  free(jar);
+}
+
+
+/**
+ * Cancel outstanding requests issued from 'jcp' (if not NULL) or by
+ * 'jsp' (if not NULL). Their callbacks will not be invoked, but the
+ * completion is still delivered on the issuing context's courier to
+ * release resources and jcp_pending
+ */
+void
+js_http_async_cancel(js_context_private_t *jcp, js_plugin_t *jsp)
+{
+  struct js_async_req_queue q;
+  js_async_req_t *jar;
+
+  TAILQ_INIT(&q);
+
+  hts_mutex_lock(&js_http_async_mutex);
+
+  LIST_FOREACH(jar, &js_async_reqs, jar_global_link) {
+    if(jar->jar_orphaned)
+      continue;
+    if(!(jcp != NULL && jar->jar_jcp == jcp) &&
+       !(jsp != NULL && jar->jar_plugin == jsp))
+      continue;
+
+    jar->jar_orphaned = 1;
+    jar->jar_plugin = NULL;
+
+    if(jar->jar_queued) {
+      // Not started yet, complete right away
+      TAILQ_REMOVE(&jar->jar_limiter->jhl_queue, jar, jar_link);
+      jar->jar_queued = 0;
+      TAILQ_INSERT_TAIL(&q, jar, jar_link);
+    } else {
+      cancellable_cancel(&jar->jar_cancellable);
+    }
+  }
+  hts_mutex_unlock(&js_http_async_mutex);
+
+  while((jar = TAILQ_FIRST(&q)) != NULL) {
+    TAILQ_REMOVE(&q, jar, jar_link);
+    prop_set_int(jar->jar_trigger, 1);
+  }
+}
+
+
+/**
+ * plugin.httpReqAsync(url, ctrl, callback)
+ *
+ * 'ctrl' takes the same options as showtime.httpReq(). 'callback' is
+ * invoked as callback(error, response) once the request completes
+ */
+JSBool 
+js_httpReqAsync(JSContext *cx, JSObject *obj, uintN argc,
+		jsval *argv, jsval *rval)
+{
+  js_plugin_t *jsp = JS_GetPrivate(cx, obj);
+  js_context_private_t *jcp = JS_GetContextPrivate(cx);
+  const char *url;
+  JSObject *ctrlobj = NULL;
+  JSObject *func;
+  js_http_limiter_t *jhl;
+  prop_courier_t *pc;
+
+  if(!JS_ConvertArguments(cx, argc, argv, "soo", &url, &ctrlobj, &func))
+    return JS_FALSE;
+
+  if(func == NULL || !JS_ObjectIsFunction(cx, func)) {
+    JS_ReportError(cx, "Callback is not a function");
+    return JS_FALSE;
+  }
+
+  js_async_req_t *jar = calloc(1, sizeof(js_async_req_t));
+
+  if(!js_http_req_from_ctrl(cx, &jar->jar_req, url, ctrlobj)) {
+    js_http_req_cleanup(&jar->jar_req);
+    free(jar);
+    return JS_FALSE;
+  }
+
+  /*
+   * The context's cancellable can only be bound to one request at a
+   * time, so each async request gets its own. See js_http_async_cancel()
+   */
+  jar->jar_req.c = &jar->jar_cancellable;
+  jar->jar_plugin = jsp;
+
+  if(jcp != NULL && jcp->jcp_pc != NULL) {
+    pc = jcp->jcp_pc;
+    jar->jar_cx = cx;
+    jar->jar_jcp = jcp;
+    jar->jar_pending = &jcp->jcp_pending;
+    jcp->jcp_pending++;
+  } else {
+    pc = js_global_pc;
+    jar->jar_cx = js_global_cx;
+  }
+
+  jar->jar_callback = OBJECT_TO_JSVAL(func);
+  JS_AddNamedRoot(cx, &jar->jar_callback, "asynchttp");
+
+  jar->jar_trigger = prop_create_root(NULL);
+  jar->jar_sub = prop_subscribe(0,
+				PROP_TAG_CALLBACK, js_async_req_complete, jar,
+				PROP_TAG_ROOT, jar->jar_trigger,
+				PROP_TAG_COURIER, pc,
+				NULL);
+
+  hts_mutex_lock(&js_http_async_mutex);
+
+  if((jhl = jsp->jsp_http_limiter) == NULL) {
+    jhl = jsp->jsp_http_limiter = calloc(1, sizeof(js_http_limiter_t));
+    jhl->jhl_refcount = 1;
+    TAILQ_INIT(&jhl->jhl_queue);
+  }
+
+  TAILQ_INSERT_TAIL(&jhl->jhl_queue, jar, jar_link);
+  jar->jar_limiter = jhl;
+  jar->jar_queued = 1;
+  LIST_INSERT_HEAD(&js_async_reqs, jar, jar_global_link);
+
+  if(jhl->jhl_running < JS_HTTP_ASYNC_MAX_PER_PLUGIN) {
+    jhl->jhl_running++;
+    jhl->jhl_refcount++;
+    hts_thread_create_detached("jshttp", js_http_async_thread, jhl,
+			       THREAD_PRIO_MODEL);
+  }
+
+  hts_mutex_unlock(&js_http_async_mutex);
+
+  *rval = JSVAL_VOID;
+  return JS_TRUE;
+}
+
 /**
  *
  */
@@ -801,6 +1181,19 @@ js_io_flush_from_plugin(JSContext *cx, js_plugin_t *jsp)
 
   while((jha = LIST_FIRST(&jsp->jsp_http_auths)) != NULL)
     js_http_auth_delete(cx, jha);
+
+  /*
+   * Requests already running are aborted and completed by the worker
+   * threads, they hold their own reference to the limiter
+   */
+  js_http_async_cancel(NULL, jsp);
+
+  hts_mutex_lock(&js_http_async_mutex);
+  if(jsp->jsp_http_limiter != NULL) {
+    jhl_release0(jsp->jsp_http_limiter);
+    jsp->jsp_http_limiter = NULL;
+  }
+  hts_mutex_unlock(&js_http_async_mutex);
 }
 
 
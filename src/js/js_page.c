@@ -646,28 +646,26 @@ static JSFunctionSpec item_proto_functions[] = {
 
 
 /**
- *
- */
-static JSBool 
-js_appendItem0(JSContext *cx, js_model_t *model, prop_t *parent,
-	       const char *url, const char *type, JSObject *metaobj,
-	       jsval *data, jsval *rval, int enabled,
-	       const char *metabind)
+ * Build the prop tree for an item. It is not attached anywhere so
+ * nobody is subscribing to it yet.
+ * Returns NULL if the item should not be added
+ */
+static prop_t *
+js_item_build(JSContext *cx, const char *url, const char *type,
+	      JSObject *metaobj, jsval *data, int enabled,
+	      const char *metabind)
 {
-  install_nodesub(model);
-
   prop_t *item = prop_create_root(NULL);
 
-  rstr_t *rurl = url ? rstr_alloc(url) : NULL;
-
-  if(url != NULL)
+  if(url != NULL) {
+    rstr_t *rurl = rstr_alloc(url);
     prop_set(item, "url", PROP_SET_RSTRING, rurl);
+    rstr_release(rurl);
+  }
 
   if(data != NULL)
     js_prop_set_from_jsval(cx, prop_create(item, "data"), *data);
 
-  *rval = JSVAL_VOID;
-
   if(metabind != NULL)
     playinfo_bind_url_to_prop(metabind, item);
 
@@ -681,12 +679,67 @@ js_appendItem0(JSContext *cx, js_model_t *model, prop_t *parent,
 
     if(backend_resolve_item(url, item)) {
       prop_destroy(item);
-      rstr_release(rurl);
-      return JS_TRUE;
+      return NULL;
     }
   }
 
   prop_set_int(prop_create(item, "enabled"), enabled);
+  return item;
+}
+
+
+/**
+ * Create the JS object representing an item attached to the model.
+ * Takes ownership of the reference to 'item'
+ */
+static jsval
+js_item_attach(JSContext *cx, js_model_t *model, prop_t *item,
+	       const char *url)
+{
+  JSObject *robj =
+    JS_NewObjectWithGivenProto(cx, &item_class,
+			       JSVAL_TO_OBJECT(model->jm_item_proto), NULL);
+
+  js_item_t *ji = calloc(1, sizeof(js_item_t));
+  atomic_add(&model->jm_refcount, 1);
+  ji->ji_url = url ? rstr_alloc(url) : NULL;
+  ji->ji_model = model;
+  ji->ji_root = item;
+  TAILQ_INSERT_TAIL(&model->jm_items, ji, ji_link);
+  JS_SetPrivate(cx, robj, ji);
+  ji->ji_enable_set_property = 1; 
+
+  ji->ji_eventsub = 
+    prop_subscribe(PROP_SUB_TRACK_DESTROY,
+		   PROP_TAG_CALLBACK, js_item_eventsub, ji,
+		   PROP_TAG_ROOT, ji->ji_root,
+		   PROP_TAG_COURIER, model->jm_pc,
+		   NULL);
+  model->jm_subs++;
+  ji->ji_this = OBJECT_TO_JSVAL(robj);
+  JS_AddNamedRoot(cx, &ji->ji_this, "item_this");
+  prop_tag_set(ji->ji_root, model, ji);
+  return ji->ji_this;
+}
+
+
+/**
+ *
+ */
+static JSBool 
+js_appendItem0(JSContext *cx, js_model_t *model, prop_t *parent,
+	       const char *url, const char *type, JSObject *metaobj,
+	       jsval *data, jsval *rval, int enabled,
+	       const char *metabind)
+{
+  install_nodesub(model);
+
+  *rval = JSVAL_VOID;
+
+  prop_t *item = js_item_build(cx, url, type, metaobj, data, enabled,
+			       metabind);
+  if(item == NULL)
+    return JS_TRUE;
 
   prop_t *p = prop_ref_inc(item);
 
@@ -694,36 +747,48 @@ js_appendItem0(JSContext *cx, js_model_t *model, prop_t *parent,
     prop_destroy(item);
     prop_ref_dec(p);
   } else {
-    JSObject *robj =
-      JS_NewObjectWithGivenProto(cx, &item_class,
-				 JSVAL_TO_OBJECT(model->jm_item_proto), NULL);
-
-    *rval =  OBJECT_TO_JSVAL(robj);
-    js_item_t *ji = calloc(1, sizeof(js_item_t));
-    atomic_add(&model->jm_refcount, 1);
-    ji->ji_url = rstr_dup(rurl);
-    ji->ji_model = model;
-    ji->ji_root =  p;
-    TAILQ_INSERT_TAIL(&model->jm_items, ji, ji_link);
-    JS_SetPrivate(cx, robj, ji);
-    ji->ji_enable_set_property = 1; 
-
-    ji->ji_eventsub = 
-      prop_subscribe(PROP_SUB_TRACK_DESTROY,
-		     PROP_TAG_CALLBACK, js_item_eventsub, ji,
-		     PROP_TAG_ROOT, ji->ji_root,
-		     PROP_TAG_COURIER, model->jm_pc,
-		     NULL);
-    model->jm_subs++;
-    ji->ji_this = OBJECT_TO_JSVAL(robj);
-    JS_AddNamedRoot(cx, &ji->ji_this, "item_this");
-    prop_tag_set(ji->ji_root, model, ji);
+    *rval = js_item_attach(cx, model, p, url);
   }
-  rstr_release(rurl);
   return JS_TRUE;
 }
 
 
+/**
+ * Figure out which URL to bind playinfo to. The returned string may
+ * point into '*mp' which must be destroyed by the caller
+ */
+static const char *
+js_item_canonical_url(const char *url, htsmsg_t **mp)
+{
+  const char *canonical_url = NULL;
+  htsmsg_t *m;
+
+  *mp = NULL;
+
+  if(strncmp(url, "videoparams:", strlen("videoparams:")))
+    return url;
+
+  m = *mp = htsmsg_json_deserialize(url + strlen("videoparams:"));
+  if(m != NULL) {
+    canonical_url = htsmsg_get_str(m, "canonicalUrl");
+
+    if(canonical_url == NULL) {
+      htsmsg_t *sources;
+      if((sources = htsmsg_get_list(m, "sources")) == NULL) {
+	htsmsg_field_t *f;
+	HTSMSG_FOREACH(f, sources) {
+	  htsmsg_t *src = &f->hmf_msg;
+	  canonical_url = htsmsg_get_str(src, "url");
+	  if(canonical_url != NULL)
+	    break;
+	}
+      }
+    }
+  }
+  return canonical_url;
+}
+
+
 /**
  *
  */
@@ -735,34 +800,14 @@ js_appendItem(JSContext *cx, JSObject *obj, uintN argc,
   const char *type = NULL;
   JSObject *metaobj = NULL;
   js_model_t *model = JS_GetPrivate(cx, obj);
-  const char *canonical_url = NULL;
-  htsmsg_t *m = NULL;
+  const char *canonical_url;
+  htsmsg_t *m;
   JSBool r;
 
   if(!JS_ConvertArguments(cx, argc, argv, "s/so", &url, &type, &metaobj))
     return JS_FALSE;
 
-  if(!strncmp(url, "videoparams:", strlen("videoparams:"))) {
-    m = htsmsg_json_deserialize(url + strlen("videoparams:"));
-    if(m != NULL) {
-      canonical_url = htsmsg_get_str(m, "canonicalUrl");
-
-      if(canonical_url == NULL) {
-	htsmsg_t *sources;
-	if((sources = htsmsg_get_list(m, "sources")) == NULL) {
-	  htsmsg_field_t *f;
-	  HTSMSG_FOREACH(f, sources) {
-	    htsmsg_t *src = &f->hmf_msg;
-	    canonical_url = htsmsg_get_str(src, "url");
-	    if(canonical_url != NULL)
-	      break;
-	  }
-	}
-      }
-    }
-  } else {
-    canonical_url = url;
-  }
+  canonical_url = js_item_canonical_url(url, &m);
   r = js_appendItem0(cx, model, model->jm_nodes, url, type, metaobj, NULL,
 		     rval, 1, canonical_url);
   htsmsg_destroy(m);
@@ -770,6 +815,98 @@ js_appendItem(JSContext *cx, JSObject *obj, uintN argc,
 }
 
 
+/**
+ * appendItems([{url: ..., type: ..., metadata: {...}}, ...])
+ *
+ * Same as calling appendItem() for each entry but all items are
+ * attached to the model in one go. Returns an array with the
+ * created item objects (null for entries that were not added)
+ */
+static JSBool 
+js_appendItems(JSContext *cx, JSObject *obj, uintN argc,
+	       jsval *argv, jsval *rval)
+{
+  js_model_t *model = JS_GetPrivate(cx, obj);
+  JSObject *arr, *robj;
+  jsuint len, i;
+  int n = 0;
+
+  if(!JS_ConvertArguments(cx, argc, argv, "o", &arr))
+    return JS_FALSE;
+
+  if(arr == NULL || !JS_IsArrayObject(cx, arr) ||
+     !JS_GetArrayLength(cx, arr, &len)) {
+    JS_ReportError(cx, "Argument is not an array");
+    return JS_FALSE;
+  }
+
+  install_nodesub(model);
+
+  robj = JS_NewArrayObject(cx, 0, NULL);
+  *rval = OBJECT_TO_JSVAL(robj);
+
+  if(len == 0)
+    return JS_TRUE;
+
+  prop_vec_t *pv = prop_vec_create(len);
+  rstr_t **urls = calloc(len, sizeof(rstr_t *));
+  int *index = malloc(len * sizeof(int));
+
+  for(i = 0; i < len; i++) {
+    jsval v = JSVAL_NULL;
+    JS_SetElement(cx, robj, i, &v);
+
+    if(!JS_GetElement(cx, arr, i, &v) || !JSVAL_IS_OBJECT(v) ||
+       JSVAL_IS_NULL(v))
+      continue;
+
+    JSObject *o = JSVAL_TO_OBJECT(v);
+    rstr_t *url  = js_prop_rstr(cx, o, "url");
+    rstr_t *type = js_prop_rstr(cx, o, "type");
+    JSObject *metaobj = js_prop_obj(cx, o, "metadata");
+    const char *canonical_url = NULL;
+    htsmsg_t *m = NULL;
+
+    if(url == NULL) {
+      rstr_release(type);
+      continue;
+    }
+
+    canonical_url = js_item_canonical_url(rstr_get(url), &m);
+
+    prop_t *item = js_item_build(cx, rstr_get(url), rstr_get(type), metaobj,
+				 NULL, 1, canonical_url);
+    htsmsg_destroy(m);
+    rstr_release(type);
+
+    if(item == NULL) {
+      rstr_release(url);
+      continue;
+    }
+
+    pv = prop_vec_append(pv, item);
+    urls[n] = url;
+    index[n] = i;
+    n++;
+  }
+
+  if(n > 0 && !prop_set_parent_vector(pv, model->jm_nodes, NULL, NULL)) {
+    for(i = 0; i < n; i++) {
+      jsval v = js_item_attach(cx, model, prop_ref_inc(prop_vec_get(pv, i)),
+			       rstr_get(urls[i]));
+      JS_SetElement(cx, robj, index[i], &v);
+    }
+  }
+
+  for(i = 0; i < n; i++)
+    rstr_release(urls[i]);
+  free(urls);
+  free(index);
+  prop_vec_release(pv);
+  return JS_TRUE;
+}
+
+
 /**
  *
  */
@@ -1085,6 +1222,7 @@ js_page_wfv(JSContext *cx, JSObject *obj, uintN argc,
  */
 static JSFunctionSpec model_functions[] = {
     JS_FS("appendItem",         js_appendItem,        1, 0, 0),
+    JS_FS("appendItems",        js_appendItems,       1, 0, 0),
     JS_FS("appendPassiveItem",  js_appendPassiveItem, 1, 0, 0),
     JS_FS("appendAction",       js_appendAction,      3, 0, 0),
     JS_FS("appendModel",        js_appendModel,       2, 0, 1),
@@ -1454,8 +1592,16 @@ js_open(js_model_t *jm)
 
   jm->jm_cx = cx;
 
-  while(jm->jm_subs) {
+  int cancelled = 0;
+  while(jm->jm_subs || jm->jm_ctxpriv.jcp_pending) {
     struct prop_notify_queue q;
+
+    if(!jm->jm_subs && !cancelled) {
+      // Page is gone, don't wait for outstanding requests to finish
+      js_http_async_cancel(&jm->jm_ctxpriv, NULL);
+      cancelled = 1;
+    }
+
     jsrefcount s = JS_SuspendRequest(cx);
     prop_courier_wait(jm->jm_pc, &q, 0);
     JS_ResumeRequest(cx, s);
@@ -1497,6 +1643,7 @@ static void
 model_launch(js_model_t *jm)
 {
   jm->jm_pc = prop_courier_create_waitable();
+  jm->jm_ctxpriv.jcp_pc = jm->jm_pc;
   prop_set_int(jm->jm_loading, 1);
   hts_thread_create_detached("jsmodel", js_open_trampoline, jm,
 			     THREAD_PRIO_MODEL);
@@ -27,6 +27,7 @@
 #include "libav.h"
 #include "fileaccess/fa_libav.h"
 #include "video/video_decoder.h"
+#include "misc/profiler.h"
 
 static void
 libav_decode_video(struct media_codec *mc, struct video_decoder *vd,
@@ -53,7 +54,9 @@ libav_decode_video(struct media_codec *mc, struct video_decoder *vd,
   avpkt.data = mb->mb_data;
   avpkt.size = mb->mb_size;
 
+  int64_t ts = prof_begin();
   avcodec_decode_video2(ctx, frame, &got_pic, &avpkt);
+  prof_end(ts, "decode", "video");
 
   t = avgtime_stop(&vd->vd_decode_time, mq->mq_prop_decode_avg,
 		   mq->mq_prop_decode_peak);
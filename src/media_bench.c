@@ -0,0 +1,406 @@
+/*
+ *  Showtime Mediacenter
+ *  Copyright (C) 2007-2013 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "showtime.h"
+#include "media.h"
+#include "media_bench.h"
+#include "event.h"
+#include "backend/backend.h"
+#include "video/video_decoder.h"
+#include "htsmsg/htsmsg_json.h"
+
+#define BENCH_SAMPLE_INTERVAL 100  // ms between queue occupancy samples
+#define BENCH_HIST_BUCKETS    32
+
+/**
+ * Simple accumulator with a log2 histogram for percentiles
+ */
+typedef struct bench_stat {
+  int64_t bs_count;
+  int64_t bs_sum;
+  int64_t bs_min;
+  int64_t bs_max;
+  uint32_t bs_hist[BENCH_HIST_BUCKETS];
+} bench_stat_t;
+
+
+/**
+ *
+ */
+typedef struct media_bench {
+  media_pipe_t *bn_mp;
+  video_decoder_t *bn_vd;
+  int bn_flags;
+
+  hts_mutex_t bn_mutex;
+  hts_cond_t bn_cond;
+  int bn_run;
+  int bn_duration;
+
+  int64_t bn_start;
+  int64_t bn_first_frame;
+
+  int64_t bn_frames;
+  int64_t bn_dropped;
+
+  // Fallback pacing when there is no audio clock to sync to
+  int64_t bn_base_pts;
+  int64_t bn_base_time;
+  int bn_base_epoch;
+
+  bench_stat_t bn_decode_time;
+  bench_stat_t bn_lateness;
+  bench_stat_t bn_avdiff;
+
+  bench_stat_t bn_vq_packets;
+  bench_stat_t bn_aq_packets;
+  bench_stat_t bn_vq_delay;
+  bench_stat_t bn_aq_delay;
+  bench_stat_t bn_buffer_bytes;
+
+} media_bench_t;
+
+
+/**
+ *
+ */
+static void
+bench_stat_add(bench_stat_t *bs, int64_t v)
+{
+  int64_t a = v < 0 ? -v : v;
+  int b = 0;
+
+  if(bs->bs_count == 0 || v < bs->bs_min)
+    bs->bs_min = v;
+  if(bs->bs_count == 0 || v > bs->bs_max)
+    bs->bs_max = v;
+
+  bs->bs_count++;
+  bs->bs_sum += v;
+
+  while(a > 1 && b < BENCH_HIST_BUCKETS - 1) {
+    a >>= 1;
+    b++;
+  }
+  bs->bs_hist[b]++;
+}
+
+
+/**
+ * Returns upper bound of the histogram bucket where the given
+ * percentile of (absolute) samples are found
+ */
+static int64_t
+bench_stat_percentile(const bench_stat_t *bs, int pct)
+{
+  int64_t target = (bs->bs_count * pct + 99) / 100;
+  int64_t acc = 0;
+  int i;
+
+  for(i = 0; i < BENCH_HIST_BUCKETS; i++) {
+    acc += bs->bs_hist[i];
+    if(acc >= target)
+      return 1LL << i;
+  }
+  return bs->bs_max;
+}
+
+
+/**
+ *
+ */
+static htsmsg_t *
+bench_stat_to_msg(const bench_stat_t *bs)
+{
+  htsmsg_t *m = htsmsg_create_map();
+
+  htsmsg_add_s64(m, "count", bs->bs_count);
+  if(bs->bs_count == 0)
+    return m;
+
+  htsmsg_add_s64(m, "min", bs->bs_min);
+  htsmsg_add_s64(m, "max", bs->bs_max);
+  htsmsg_add_dbl(m, "avg", (double)bs->bs_sum / bs->bs_count);
+  htsmsg_add_s64(m, "p50", bench_stat_percentile(bs, 50));
+  htsmsg_add_s64(m, "p95", bench_stat_percentile(bs, 95));
+  htsmsg_add_s64(m, "p99", bench_stat_percentile(bs, 99));
+  return m;
+}
+
+
+/**
+ * Null video output. Called on the video decoder thread
+ */
+static void
+bench_video_deliver(const frame_info_t *fi, void *opaque)
+{
+  media_bench_t *bn = opaque;
+  media_pipe_t *mp = bn->bn_mp;
+  video_decoder_t *vd = bn->bn_vd;
+  int64_t now, aclock = PTS_UNSET, delay = 0;
+  int drop = 0;
+
+  if(fi == NULL) {
+    // Flush
+    hts_mutex_lock(&bn->bn_mutex);
+    bn->bn_base_pts = PTS_UNSET;
+    hts_mutex_unlock(&bn->bn_mutex);
+    return;
+  }
+
+  now = showtime_get_avtime();
+
+  hts_mutex_lock(&mp->mp_clock_mutex);
+  if(mp->mp_audio_clock_avtime && mp->mp_audio_clock_epoch == fi->fi_epoch) {
+    aclock = mp->mp_audio_clock + mp->mp_avdelta;
+    if(bn->bn_flags & MEDIA_BENCH_REALTIME)
+      aclock += now - mp->mp_audio_clock_avtime;
+  }
+  hts_mutex_unlock(&mp->mp_clock_mutex);
+
+  hts_mutex_lock(&bn->bn_mutex);
+
+  if(bn->bn_first_frame == 0)
+    bn->bn_first_frame = showtime_get_ts();
+
+  // Most recent sample is from the frame we are delivering right now
+  bench_stat_add(&bn->bn_decode_time,
+                 vd->vd_decode_time.samples[vd->vd_decode_time.ptr]);
+
+  if(fi->fi_pts != PTS_UNSET) {
+
+    if(aclock != PTS_UNSET) {
+      bench_stat_add(&bn->bn_avdiff, aclock - fi->fi_pts);
+      delay = fi->fi_pts - aclock;
+
+    } else {
+
+      if(bn->bn_base_pts == PTS_UNSET || bn->bn_base_epoch != fi->fi_epoch) {
+        bn->bn_base_pts   = fi->fi_pts;
+        bn->bn_base_time  = now;
+        bn->bn_base_epoch = fi->fi_epoch;
+      }
+      delay = bn->bn_base_time + fi->fi_pts - bn->bn_base_pts - now;
+    }
+
+    if(bn->bn_flags & MEDIA_BENCH_REALTIME) {
+      bench_stat_add(&bn->bn_lateness, -delay);
+      if(-delay > fi->fi_duration)
+        drop = 1;
+    }
+  }
+
+  if(drop)
+    bn->bn_dropped++;
+  else
+    bn->bn_frames++;
+
+  hts_mutex_unlock(&bn->bn_mutex);
+
+  if(bn->bn_flags & MEDIA_BENCH_REALTIME && delay > 0)
+    usleep(MIN(delay, 1000000));
+}
+
+
+/**
+ * Periodically samples queue occupancy and enforces the time limit
+ */
+static void *
+bench_sampler_thread(void *aux)
+{
+  media_bench_t *bn = aux;
+  media_pipe_t *mp = bn->bn_mp;
+
+  hts_mutex_lock(&bn->bn_mutex);
+
+  while(bn->bn_run) {
+
+    hts_cond_wait_timeout(&bn->bn_cond, &bn->bn_mutex, BENCH_SAMPLE_INTERVAL);
+    if(!bn->bn_run)
+      break;
+
+    hts_mutex_unlock(&bn->bn_mutex);
+
+    hts_mutex_lock(&mp->mp_mutex);
+    int vpkts = mp->mp_video.mq_packets_current;
+    int apkts = mp->mp_audio.mq_packets_current;
+    int bytes = mp->mp_buffer_current;
+    hts_mutex_unlock(&mp->mp_mutex);
+
+    int64_t vdelay = mq_realtime_delay(&mp->mp_video);
+    int64_t adelay = mq_realtime_delay(&mp->mp_audio);
+
+    hts_mutex_lock(&bn->bn_mutex);
+
+    bench_stat_add(&bn->bn_vq_packets, vpkts);
+    bench_stat_add(&bn->bn_aq_packets, apkts);
+    bench_stat_add(&bn->bn_buffer_bytes, bytes);
+    bench_stat_add(&bn->bn_vq_delay, vdelay);
+    bench_stat_add(&bn->bn_aq_delay, adelay);
+
+    if(bn->bn_duration &&
+       showtime_get_ts() - bn->bn_start > bn->bn_duration * 1000000LL) {
+      event_t *e = event_create_action(ACTION_STOP);
+      mp_enqueue_event(mp, e);
+      event_release(e);
+      bn->bn_duration = 0;
+    }
+  }
+
+  hts_mutex_unlock(&bn->bn_mutex);
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static htsmsg_t *
+bench_report(media_bench_t *bn, const char *url, const char *result)
+{
+  int64_t elapsed = showtime_get_ts() - bn->bn_start;
+  htsmsg_t *m = htsmsg_create_map();
+  htsmsg_t *v = htsmsg_create_map();
+  htsmsg_t *q = htsmsg_create_map();
+  int64_t decoded = bn->bn_frames + bn->bn_dropped;
+
+  htsmsg_add_str(m, "url", url);
+  htsmsg_add_str(m, "mode", bn->bn_flags & MEDIA_BENCH_REALTIME ?
+                 "realtime" : "unpaced");
+  htsmsg_add_str(m, "result", result);
+  htsmsg_add_s64(m, "elapsed_us", elapsed);
+
+  htsmsg_add_s64(v, "frames", decoded);
+  htsmsg_add_s64(v, "dropped", bn->bn_dropped);
+  if(elapsed > 0)
+    htsmsg_add_dbl(v, "fps", decoded * 1000000.0 / elapsed);
+  if(bn->bn_first_frame)
+    htsmsg_add_s64(v, "first_frame_us", bn->bn_first_frame - bn->bn_start);
+  htsmsg_add_msg(v, "decode_us", bench_stat_to_msg(&bn->bn_decode_time));
+  if(bn->bn_flags & MEDIA_BENCH_REALTIME)
+    htsmsg_add_msg(v, "lateness_us", bench_stat_to_msg(&bn->bn_lateness));
+  htsmsg_add_msg(m, "video", v);
+
+  htsmsg_add_msg(m, "avdiff_us", bench_stat_to_msg(&bn->bn_avdiff));
+
+  htsmsg_add_msg(q, "video_packets", bench_stat_to_msg(&bn->bn_vq_packets));
+  htsmsg_add_msg(q, "audio_packets", bench_stat_to_msg(&bn->bn_aq_packets));
+  htsmsg_add_msg(q, "video_delay_us", bench_stat_to_msg(&bn->bn_vq_delay));
+  htsmsg_add_msg(q, "audio_delay_us", bench_stat_to_msg(&bn->bn_aq_delay));
+  htsmsg_add_msg(q, "buffer_bytes", bench_stat_to_msg(&bn->bn_buffer_bytes));
+  htsmsg_add_msg(m, "queues", q);
+  return m;
+}
+
+
+/**
+ *
+ */
+int
+media_bench_run(const char *url, int flags, int duration, const char *output)
+{
+  media_bench_t *bn = calloc(1, sizeof(media_bench_t));
+  hts_thread_t sampler;
+  video_args_t va;
+  char errbuf[256];
+  const char *result;
+  int rval = -1;
+
+  bn->bn_flags = flags;
+  bn->bn_duration = duration;
+  bn->bn_base_pts = PTS_UNSET;
+  bn->bn_run = 1;
+  hts_mutex_init(&bn->bn_mutex);
+  hts_cond_init(&bn->bn_cond, &bn->bn_mutex);
+
+  media_pipe_t *mp = mp_create("Benchmark", MP_VIDEO | MP_PRIMABLE);
+  bn->bn_mp = mp;
+
+  mp->mp_video_frame_deliver = bench_video_deliver;
+  mp->mp_video_frame_opaque = bn;
+  bn->bn_vd = video_decoder_create(mp);
+
+  memset(&va, 0, sizeof(va));
+  va.episode = -1;
+  va.season = -1;
+  va.canonical_url = url;
+  va.flags = BACKEND_VIDEO_PRIMARY | BACKEND_VIDEO_START_FROM_BEGINNING |
+    BACKEND_VIDEO_NO_FS_SCAN;
+
+  TRACE(TRACE_INFO, "bench", "Playing %s (%s)", url,
+        flags & MEDIA_BENCH_REALTIME ? "realtime" : "unpaced");
+
+  bn->bn_start = showtime_get_ts();
+  hts_thread_create_joinable("bench sampler", &sampler,
+                             bench_sampler_thread, bn, THREAD_PRIO_BGTASK);
+
+  mp_set_url(mp, url, NULL, NULL);
+  event_t *e = backend_play_video(url, mp, errbuf, sizeof(errbuf),
+                                  NULL, NULL, &va);
+
+  hts_mutex_lock(&bn->bn_mutex);
+  bn->bn_run = 0;
+  hts_cond_signal(&bn->bn_cond);
+  hts_mutex_unlock(&bn->bn_mutex);
+  hts_thread_join(&sampler);
+
+  if(e == NULL) {
+    result = errbuf;
+  } else {
+    result = event_is_type(e, EVENT_EOF) ? "eof" : "stopped";
+    rval = 0;
+    event_release(e);
+  }
+
+  video_decoder_stop(bn->bn_vd);
+
+  htsmsg_t *m = bench_report(bn, url, result);
+  char *json = htsmsg_json_serialize_to_str(m, 1);
+  htsmsg_destroy(m);
+
+  FILE *fp = output != NULL ? fopen(output, "w") : stdout;
+  if(fp == NULL) {
+    TRACE(TRACE_ERROR, "bench", "Unable to open %s -- %s",
+          output, strerror(errno));
+    rval = -1;
+  } else {
+    fputs(json, fp);
+    if(fp != stdout)
+      fclose(fp);
+    else
+      fflush(fp);
+  }
+  free(json);
+
+  video_decoder_destroy(bn->bn_vd);
+  mp_ref_dec(mp);
+
+  hts_cond_destroy(&bn->bn_cond);
+  hts_mutex_destroy(&bn->bn_mutex);
+  free(bn);
+  return rval;
+}
@@ -0,0 +1,35 @@
+/*
+ *  Showtime Mediacenter
+ *  Copyright (C) 2007-2013 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#pragma once
+
+#define MEDIA_BENCH_REALTIME 0x1  // Pace output as a real sink would
+
+/**
+ * Play 'url' through the regular demux / decode / queue stack into
+ * null video and audio sinks and write a JSON report to 'output'
+ * (or stdout if NULL).
+ *
+ * 'duration' limits the run to that many seconds (0 = until EOF)
+ *
+ * Returns 0 if playback reached EOF (or the time limit), -1 otherwise
+ */
+int media_bench_run(const char *url, int flags, int duration,
+                    const char *output);
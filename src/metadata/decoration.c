@@ -41,13 +41,38 @@ LIST_HEAD(deco_browse_list, deco_browse);
 TAILQ_HEAD(deco_item_queue, deco_item);
 LIST_HEAD(deco_item_list, deco_item);
 LIST_HEAD(deco_stem_list, deco_stem);
+LIST_HEAD(deco_count_list, deco_count);
 
 static prop_courier_t *deco_courier;
 static hts_mutex_t deco_mutex;
 static struct deco_browse_list deco_browses;
 static int deco_pendings;
+static int64_t deco_pending_since;
 
 #define STEM_HASH_SIZE 503
+#define COUNT_HASH_SIZE 31
+
+#define DECO_QUIET_TIME 50   // ms without node changes before analysis
+#define DECO_MAX_DELAY  500  // ms, analysis runs even if changes keep coming
+
+#define DECO_LONG_VIDEO 300  // seconds
+
+/**
+ * Number of items sharing a value (album, artist, series, season).
+ * Kept up to date as items change so the analysis passes don't
+ * need to look at every item
+ */
+typedef struct deco_count {
+  LIST_ENTRY(deco_count) dc_link;
+  rstr_t *dc_str;
+  int dc_int;
+  int dc_count;
+} deco_count_t;
+
+typedef struct deco_counter {
+  struct deco_count_list dct_hash[COUNT_HASH_SIZE];
+  int dct_distinct;
+} deco_counter_t;
 
 /**
  *
@@ -69,6 +94,19 @@ struct deco_browse {
 
   struct deco_stem_list db_stems[STEM_HASH_SIZE];
 
+  deco_counter_t db_albums;
+  deco_counter_t db_artists;
+  deco_counter_t db_series;
+  deco_counter_t db_seasons;
+
+  int db_audio_without_album;
+  int db_video_without_series;
+  int db_video_without_season;
+  int db_long_videos;
+
+  struct deco_item_list db_lonely_pending;
+  int db_lonely_applied;
+
   rstr_t *db_imdb_id;
 
   int db_pending_flags;
@@ -158,12 +196,156 @@ typedef struct deco_item {
 
   metadata_lazy_video_t *di_mlv;
 
+  LIST_ENTRY(deco_item) di_lonely_link;
+  int di_lonely_pending;
+
 } deco_item_t;
 
 
 static void load_nfo(deco_item_t *di);
 
 
+/**
+ *
+ */
+static void
+deco_set_pending(deco_browse_t *db, int flags)
+{
+  db->db_pending_flags |= flags;
+  if(!deco_pendings) {
+    deco_pendings = 1;
+    deco_pending_since = showtime_get_ts();
+  }
+}
+
+
+/**
+ *
+ */
+static deco_count_t *
+deco_count_find(deco_counter_t *dct, rstr_t *str, int i, int create)
+{
+  const unsigned int hash =
+    ((str ? mystrhash(rstr_get(str)) : 0) + i) % COUNT_HASH_SIZE;
+  deco_count_t *dc;
+
+  LIST_FOREACH(dc, &dct->dct_hash[hash], dc_link)
+    if(dc->dc_int == i &&
+       (dc->dc_str == str || !strcmp(rstr_get(dc->dc_str), rstr_get(str))))
+      return dc;
+
+  if(!create)
+    return NULL;
+
+  dc = calloc(1, sizeof(deco_count_t));
+  dc->dc_str = rstr_dup(str);
+  dc->dc_int = i;
+  LIST_INSERT_HEAD(&dct->dct_hash[hash], dc, dc_link);
+  dct->dct_distinct++;
+  return dc;
+}
+
+
+/**
+ *
+ */
+static void
+deco_count_add(deco_counter_t *dct, rstr_t *str, int i, int delta)
+{
+  deco_count_t *dc = deco_count_find(dct, str, i, delta > 0);
+
+  if(dc == NULL)
+    return;
+
+  dc->dc_count += delta;
+  if(dc->dc_count > 0)
+    return;
+
+  LIST_REMOVE(dc, dc_link);
+  rstr_release(dc->dc_str);
+  free(dc);
+  dct->dct_distinct--;
+}
+
+
+/**
+ * Return the value shared by most items
+ */
+static deco_count_t *
+deco_count_max(deco_counter_t *dct)
+{
+  deco_count_t *dc, *best = NULL;
+  int i;
+
+  for(i = 0; i < COUNT_HASH_SIZE; i++)
+    LIST_FOREACH(dc, &dct->dct_hash[i], dc_link)
+      if(best == NULL || dc->dc_count > best->dc_count)
+        best = dc;
+  return best;
+}
+
+
+/**
+ * Add (delta = 1) or remove (delta = -1) the item's contribution to
+ * the aggregates in the browse
+ */
+static void
+di_account(deco_item_t *di, int delta)
+{
+  deco_browse_t *db = di->di_db;
+
+  switch(di->di_type) {
+  case CONTENT_AUDIO:
+    if(di->di_album == NULL)
+      db->db_audio_without_album += delta;
+    else
+      deco_count_add(&db->db_albums, di->di_album, 0, delta);
+
+    if(di->di_artist != NULL)
+      deco_count_add(&db->db_artists, di->di_artist, 0, delta);
+
+    deco_set_pending(db, DB_PENDING_DEFERRED_ALBUM_ANALYSIS);
+    break;
+
+  case CONTENT_VIDEO:
+    if(di->di_duration > DECO_LONG_VIDEO)
+      db->db_long_videos += delta;
+
+    if(di->di_series == NULL)
+      db->db_video_without_series += delta;
+    else
+      deco_count_add(&db->db_series, di->di_series, 0, delta);
+
+    if(di->di_season == 0)
+      db->db_video_without_season += delta;
+    else
+      deco_count_add(&db->db_seasons, NULL, di->di_season, delta);
+
+    deco_set_pending(db, DB_PENDING_DEFERRED_VIDEO_ANALYSIS);
+    break;
+
+  default:
+    break;
+  }
+}
+
+
+/**
+ * Item needs its 'lonely' state updated by next video analysis
+ */
+static void
+di_lonely_pending(deco_item_t *di)
+{
+  deco_browse_t *db = di->di_db;
+
+  if(!di->di_lonely_pending) {
+    LIST_INSERT_HEAD(&db->db_lonely_pending, di, di_lonely_link);
+    di->di_lonely_pending = 1;
+  }
+  deco_set_pending(db, DB_PENDING_DEFERRED_VIDEO_ANALYSIS);
+}
+
+
 /**
  *
  */
@@ -195,6 +377,7 @@ analyze_video(deco_item_t *di)
 					db->db_lonely_video_item, 0,
 					-1, -1, -1, manual);
   rstr_release(fname);
+  di_lonely_pending(di);
 }
 
 
@@ -328,44 +511,14 @@ type_analysis(deco_browse_t *db)
 }
 
 
-/**
- *
- */
-typedef struct deco_artist {
-  LIST_ENTRY(deco_artist) da_link;
-  rstr_t *da_artist;
-  int da_count;
-} deco_artist_t;
-
-
-/**
- *
- */
-static int 
-artist_compar(const void *A, const void *B)
-{
-  const deco_artist_t *a = *(const deco_artist_t **)A;
-  const deco_artist_t *b = *(const deco_artist_t **)B;
-  return b->da_count - a->da_count;
-}
-
-
 /**
  *
  */
 static void
 album_analysis(deco_browse_t *db)
 {
-  deco_item_t *di;
-  rstr_t *v = NULL;
-
-  LIST_HEAD(, deco_artist) artists;
-  deco_artist_t *da;
-  int artist_count = 0;
-  int item_count = 0;
+  deco_count_t *album, *artist;
 
-
-  LIST_INIT(&artists);
   db->db_contents_mask &= ~DB_CONTENTS_ALBUM;
 
   if(!(db->db_types[CONTENT_AUDIO] > 1 && 
@@ -375,73 +528,30 @@ album_analysis(deco_browse_t *db)
        db->db_types[CONTENT_ALBUM] == 0 &&
        db->db_types[CONTENT_PLUGIN] == 0))
     return;
-  
-  LIST_FOREACH(di, &db->db_items_per_ct[CONTENT_AUDIO], di_type_link) {
-    if(di->di_album == NULL)
-      goto cleanup;
 
+  // All tracks must be from the same album
+  if(db->db_audio_without_album || db->db_albums.dct_distinct != 1)
+    return;
 
-    item_count++;
-
-    if(v == NULL)
-      v = di->di_album;
-    else if(strcmp(rstr_get(v), rstr_get(di->di_album)))
-      goto cleanup;
-    
-    if(di->di_artist == NULL)
-      continue;
-
-    LIST_FOREACH(da, &artists, da_link) {
-      if(!strcmp(rstr_get(da->da_artist), rstr_get(di->di_artist)))
-	break;
-    }
-    
-    if(da == NULL) {
-      da = malloc(sizeof(deco_artist_t));
-      da->da_count = 1;
-      da->da_artist = di->di_artist;
-      artist_count++;
-    } else {
-      da->da_count++;
-      LIST_REMOVE(da, da_link);
-    }
-    LIST_INSERT_HEAD(&artists, da, da_link);
-  }
+  album = deco_count_max(&db->db_albums);
 
   db->db_contents_mask |= DB_CONTENTS_ALBUM;
 
   prop_t *m = prop_create_r(db->db_prop_model, "metadata");
 
-  prop_set(m, "album_name", PROP_SET_RSTRING, v);
+  prop_set(m, "album_name", PROP_SET_RSTRING, album->dc_str);
 
-  if(artist_count > 0) {
-    deco_artist_t **vec = malloc(artist_count * sizeof(deco_artist_t *));
-    int i;
-    da = LIST_FIRST(&artists);
-    for(i = 0; i < artist_count; i++) {
-      vec[i] = da;
-      da = LIST_NEXT(da, da_link);
-    }
-    qsort(vec, artist_count, sizeof(deco_artist_t *), artist_compar);
-    da = vec[0];
-    free(vec);
+  artist = deco_count_max(&db->db_artists);
 
-    if(da->da_count * 2 >= item_count) {
-      prop_set(m, "album_name", PROP_SET_RSTRING, da->da_artist);
+  if(artist != NULL && artist->dc_count * 2 >= db->db_types[CONTENT_AUDIO]) {
+    prop_set(m, "album_name", PROP_SET_RSTRING, artist->dc_str);
       
-      prop_t *p = prop_create_r(m, "album_art");
-      metadata_bind_albumart(p, da->da_artist, v);
-      prop_ref_dec(p);
-    }
+    prop_t *p = prop_create_r(m, "album_art");
+    metadata_bind_albumart(p, artist->dc_str, album->dc_str);
+    prop_ref_dec(p);
   }
 
   prop_ref_dec(m);
-
- cleanup:
-  while((da = LIST_FIRST(&artists)) != NULL) {
-    LIST_REMOVE(da, da_link);
-    free(da);
-  }
 }
 
 
@@ -452,62 +562,43 @@ static void
 video_analysis(deco_browse_t *db)
 {
   deco_item_t *di;
-  int reasonable_video_items = 0;
-  int i;
-
-  for(i = 0; i < 2; i++) {
-    LIST_FOREACH(di, &db->db_items_per_ct[CONTENT_VIDEO], di_type_link) {
+  const int lonely = db->db_long_videos < 2;
 
-      if(di->di_duration > 300) {
-	if(i == 0)
-	  reasonable_video_items++;
-	else if(i == 1 && di->di_mlv)
-	  mlv_set_lonely(di->di_mlv, reasonable_video_items < 2);
-      }
-    }
+  if(lonely != db->db_lonely_applied) {
+    // Changes for every long video
+    LIST_FOREACH(di, &db->db_items_per_ct[CONTENT_VIDEO], di_type_link)
+      if(di->di_duration > DECO_LONG_VIDEO && di->di_mlv)
+        mlv_set_lonely(di->di_mlv, lonely);
+    db->db_lonely_applied = lonely;
+  } else {
+    LIST_FOREACH(di, &db->db_lonely_pending, di_lonely_link)
+      if(di->di_duration > DECO_LONG_VIDEO && di->di_mlv)
+        mlv_set_lonely(di->di_mlv, lonely);
   }
-  db->db_lonely_video_item = reasonable_video_items < 1;
-
-  
-  const char *series = NULL;
-  int season = -1;
-
-  LIST_FOREACH(di, &db->db_items_per_ct[CONTENT_VIDEO], di_type_link) {
-    if(di->di_series == NULL) {
-      series = NULL;
-      break;
-    }
 
-    if(series == NULL)
-      series = rstr_get(di->di_series);
-    else if(strcmp(series, rstr_get(di->di_series))) {
-      series = NULL;
-      break;
-    }
+  while((di = LIST_FIRST(&db->db_lonely_pending)) != NULL) {
+    LIST_REMOVE(di, di_lonely_link);
+    di->di_lonely_pending = 0;
   }
 
+  db->db_lonely_video_item = db->db_long_videos < 1;
 
-  if(series != NULL) {
+  // All videos must be from the same series (and season)
+  const deco_count_t *series = NULL;
+  const deco_count_t *season = NULL;
 
-    LIST_FOREACH(di, &db->db_items_per_ct[CONTENT_VIDEO], di_type_link) {
-      if(di->di_season == 0) {
-	season = -1;
-	break;
-      }
+  if(db->db_types[CONTENT_VIDEO] > 0 && !db->db_video_without_series &&
+     db->db_series.dct_distinct == 1)
+    series = deco_count_max(&db->db_series);
 
-      if(season == -1)
-	season = di->di_season;
-      else if(season != di->di_season) {
-	season = -1;
-	break;
-      }
-    }
-  }
+  if(series != NULL && !db->db_video_without_season &&
+     db->db_seasons.dct_distinct == 1)
+    season = deco_count_max(&db->db_seasons);
   
   di = LIST_FIRST(&db->db_items_per_ct[CONTENT_VIDEO]);
 
   prop_t *x = prop_create_r(db->db_prop_model, "season");
-  if(season != -1 && series) {
+  if(season != NULL) {
     assert(di != NULL);
     db->db_contents_mask |= DB_CONTENTS_TV_SEASON;
     prop_t *y = prop_create_r(di->di_metadata, "season");
@@ -521,7 +612,7 @@ video_analysis(deco_browse_t *db)
 
 
   x = prop_create_r(db->db_prop_model, "series");
-  if(series) {
+  if(series != NULL) {
     assert(di != NULL);
     db->db_contents_mask |= DB_CONTENTS_TV_SERIES;
     prop_t *y = prop_create_r(di->di_metadata, "series");
@@ -616,8 +707,8 @@ di_set_url(deco_item_t *di, rstr_t *str)
     if(!strcasecmp(di->di_postfix, "nfo")) {
       load_nfo(di);
 
-      TAILQ_FOREACH(di, &db->db_items, di_link) {
-	if(di->di_type == CONTENT_VIDEO && di->di_mlv != NULL)
+      LIST_FOREACH(di, &db->db_items_per_ct[CONTENT_VIDEO], di_type_link) {
+	if(di->di_mlv != NULL)
 	  mlv_set_imdb_id(di->di_mlv, di->di_ds->ds_imdb_id ?: db->db_imdb_id);
       }
       return;
@@ -634,9 +725,9 @@ di_set_url(deco_item_t *di, rstr_t *str)
 static void
 di_set_album(deco_item_t *di, rstr_t *str)
 {
+  di_account(di, -1);
   rstr_set(&di->di_album, str);
-  di->di_db->db_pending_flags |= DB_PENDING_DEFERRED_ALBUM_ANALYSIS;
-  deco_pendings = 1;
+  di_account(di, 1);
 }
 
 
@@ -646,9 +737,9 @@ di_set_album(deco_item_t *di, rstr_t *str)
 static void
 di_set_artist(deco_item_t *di, rstr_t *str)
 {
+  di_account(di, -1);
   rstr_set(&di->di_artist, str);
-  di->di_db->db_pending_flags |= DB_PENDING_DEFERRED_ALBUM_ANALYSIS;
-  deco_pendings = 1;
+  di_account(di, 1);
 }
 
 
@@ -669,15 +760,17 @@ di_set_filename(deco_item_t *di, rstr_t *str)
 static void
 di_set_duration(deco_item_t *di, int duration)
 {
+  di_account(di, -1);
   di->di_duration = duration;
+  di_account(di, 1);
+
   if(di->di_type == CONTENT_VIDEO) {
     if(di->di_mlv == NULL)
       analyze_video(di);
     else
       mlv_set_duration(di->di_mlv, di->di_duration);
 
-    di->di_db->db_pending_flags |= DB_PENDING_DEFERRED_VIDEO_ANALYSIS;
-    deco_pendings = 1;
+    di_lonely_pending(di);
   }
 }
 
@@ -689,9 +782,9 @@ di_set_duration(deco_item_t *di, int duration)
 static void
 di_set_series(deco_item_t *di, rstr_t *str)
 {
+  di_account(di, -1);
   rstr_set(&di->di_series, str);
-  di->di_db->db_pending_flags |= DB_PENDING_DEFERRED_VIDEO_ANALYSIS;
-  deco_pendings = 1;
+  di_account(di, 1);
 }
 
 
@@ -702,9 +795,9 @@ di_set_series(deco_item_t *di, rstr_t *str)
 static void
 di_set_season(deco_item_t *di, int v)
 {
+  di_account(di, -1);
   di->di_season = v;
-  di->di_db->db_pending_flags |= DB_PENDING_DEFERRED_VIDEO_ANALYSIS;
-  deco_pendings = 1;
+  di_account(di, 1);
 }
 
 
@@ -716,6 +809,8 @@ di_set_type(deco_item_t *di, const char *str)
 {
   deco_browse_t *db = di->di_db;
 
+  di_account(di, -1);
+
   if(di->di_sub_album != NULL) {
     prop_unsubscribe(di->di_sub_album);
     rstr_set(&di->di_album, NULL);
@@ -753,6 +848,7 @@ di_set_type(deco_item_t *di, const char *str)
   db->db_types[di->di_type]++;
   LIST_INSERT_HEAD(&db->db_items_per_ct[di->di_type], di, di_type_link);
 
+  di_account(di, 1);
 
   switch(di->di_type) {
 
@@ -798,9 +894,6 @@ di_set_type(deco_item_t *di, const char *str)
 		     PROP_TAG_NAMED_ROOT, di->di_root, "node",
 		     PROP_TAG_COURIER, deco_courier,
 		     NULL);
-
-    di->di_db->db_pending_flags |= DB_PENDING_DEFERRED_VIDEO_ANALYSIS;
-    deco_pendings = 1;
     break;
 
   default:
@@ -887,6 +980,11 @@ deco_browse_add_nodes(deco_browse_t *db, prop_vec_t *pv, deco_item_t *before)
 static void
 deco_item_destroy(deco_browse_t *db, deco_item_t *di)
 {
+  di_account(di, -1);
+
+  if(di->di_lonely_pending)
+    LIST_REMOVE(di, di_lonely_link);
+
   if(di->di_ds != NULL) {
     LIST_REMOVE(di, di_stem_link);
     stem_release(di->di_ds);
@@ -911,6 +1009,7 @@ deco_item_destroy(deco_browse_t *db, deco_item_t *di)
   free(di->di_postfix);
   rstr_release(di->di_album);
   rstr_release(di->di_artist);
+  rstr_release(di->di_series);
   rstr_release(di->di_url);
   rstr_release(di->di_filename);
 
@@ -925,9 +1024,8 @@ deco_item_destroy(deco_browse_t *db, deco_item_t *di)
 static void
 deco_browse_del_node(deco_browse_t *db, deco_item_t *di)
 {
-  db->db_pending_flags |= DB_PENDING_DEFERRED_FULL_ANALYSIS;
   deco_item_destroy(db, di);
-  deco_pendings = 1;
+  type_analysis(db);
 }
 
 
@@ -1109,8 +1207,8 @@ set_mode(void *opaque, const char *str)
   switch(v) {
 
   case DECO_MODE_AUTO:
-    deco_pendings = 1;
-    db->db_pending_flags |= DB_PENDING_DEFERRED_FULL_ANALYSIS;
+    db->db_lonely_applied = -1;
+    deco_set_pending(db, DB_PENDING_DEFERRED_FULL_ANALYSIS);
     // FALLTHRU
   case DECO_MODE_MANUAL:
     LIST_FOREACH(di, &db->db_items_per_ct[CONTENT_VIDEO], di_type_link)
@@ -1135,6 +1233,7 @@ decorated_browse_create(prop_t *model, struct prop_nf *pnf, prop_t *items,
   deco_browse_t *db = calloc(1, sizeof(deco_browse_t));
   db->db_url = strdup(url);
   TAILQ_INIT(&db->db_items);
+  db->db_lonely_applied = -1;
 
   hts_mutex_lock(&deco_mutex);
 
@@ -1201,8 +1300,10 @@ deco_thread(void *aux)
     struct prop_notify_queue q;
 
     int do_timo = 0;
-    if(deco_pendings)
-      do_timo = 50;
+    if(deco_pendings) {
+      int waited = (showtime_get_ts() - deco_pending_since) / 1000;
+      do_timo = MAX(1, MIN(DECO_QUIET_TIME, DECO_MAX_DELAY - waited));
+    }
 
     hts_mutex_unlock(&deco_mutex);
     r = prop_courier_wait(deco_courier, &q, do_timo);
@@ -1210,7 +1311,10 @@ deco_thread(void *aux)
 
     prop_notify_dispatch(&q, 0);
 
-    if(r && deco_pendings) {
+    // Run analysis when nodes have been quiet for a while, but don't
+    // let a steady stream of changes (scanner, etc) postpone it forever
+    if(deco_pendings &&
+       (r || showtime_get_ts() - deco_pending_since >= DECO_MAX_DELAY * 1000)) {
       deco_pendings = 0;
       deco_browse_t *db;
 
@@ -416,6 +416,12 @@ int metadb_videoitem_set_preferred(void *db, const char *url, int64_t vid);
 
 int metadb_videoitem_delete_from_ds(void *db, const char *url, int ds);
 
+struct buf *metadb_get_subtitles(void *db, const char *url, time_t mtime,
+                                 uint32_t stamp);
+
+void metadb_put_subtitles(void *db, const char *url, time_t mtime,
+                          uint32_t stamp, const void *data, size_t len);
+
 void decoration_init(void);
 
 #define DECO_FLAGS_NO_AUTO_DESTROY  0x1
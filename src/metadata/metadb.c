@@ -112,7 +112,7 @@ metadb_init(void)
 
   //  unlink(buf);
 
-  metadb_pool = db_pool_create(buf, 2);
+  metadb_pool = db_pool_create(buf, 4, 2048, DB_MMAP_SIZE_KB);
   db = metadb_get();
   if(db == NULL)
     return;
@@ -173,8 +173,8 @@ db_item_get(sqlite3 *db, const char *url, time_t *mtimep)
   int64_t rval = METADATA_PERMANENT_ERROR;
   sqlite3_stmt *stmt;
 
-  rc = db_prepare(db, &stmt,
-		  "SELECT id,mtime from item where url=?1 ");
+  rc = db_prepare_cached(db, &stmt,
+                         "SELECT id,mtime from item where url=?1 ");
   if(rc)
     return METADATA_PERMANENT_ERROR;
   sqlite3_bind_text(stmt, 1, url, -1, SQLITE_STATIC);
@@ -188,7 +188,7 @@ db_item_get(sqlite3 *db, const char *url, time_t *mtimep)
   } else if(rc == SQLITE_LOCKED)
     rval = METADATA_DEADLOCK;
 
-  sqlite3_finalize(stmt);
+  db_stmt_release(stmt);
   return rval;
 }
 
@@ -760,17 +760,17 @@ metadb_get_video_genre(sqlite3 *db, int64_t videoitem_id)
   int rc;
   sqlite3_stmt *sel;
 
-  rc = db_prepare(db, &sel,
-		  "SELECT title "
-		  "FROM videogenre "
-		  "WHERE videoitem_id = ?1");
+  rc = db_prepare_cached(db, &sel,
+                         "SELECT title "
+                         "FROM videogenre "
+                         "WHERE videoitem_id = ?1");
 
   if(rc != SQLITE_OK)
     return NULL;
 
   sqlite3_bind_int64(sel, 1, videoitem_id);
   rstr_t *r = metadb_construct_list(sel, 0);
-  sqlite3_finalize(sel);
+  db_stmt_release(sel);
   return r;
 }
 
@@ -784,11 +784,11 @@ metadb_get_video_cast(sqlite3 *db, int64_t videoitem_id, metadata_t *md)
   int rc;
   sqlite3_stmt *sel;
 
-  rc = db_prepare(db, &sel,
-		  "SELECT name,character,department,job,image "
-		  "FROM videocast "
-		  "WHERE videoitem_id = ?1 "
-		  "ORDER BY \"order\"");
+  rc = db_prepare_cached(db, &sel,
+                         "SELECT name,character,department,job,image "
+                         "FROM videocast "
+                         "WHERE videoitem_id = ?1 "
+                         "ORDER BY \"order\"");
 
   if(rc != SQLITE_OK)
     return METADATA_PERMANENT_ERROR;
@@ -808,7 +808,7 @@ metadb_get_video_cast(sqlite3 *db, int64_t videoitem_id, metadata_t *md)
     else
       TAILQ_INSERT_TAIL(&md->md_crew, mp, mp_link);
   }
-  sqlite3_finalize(sel);
+  db_stmt_release(sel);
   return 0;
 }
 
@@ -1338,11 +1338,11 @@ metadb_metadata_get_artist(sqlite3 *db, get_cache_t *gc, int64_t id)
   int rc;
   sqlite3_stmt *sel;
 
-  rc = db_prepare(db, &sel,
-		  "SELECT title "
-		  "FROM artist "
-		  "WHERE id = ?1 AND ds_id=1"
-		  );
+  rc = db_prepare_cached(db, &sel,
+                         "SELECT title "
+                         "FROM artist "
+                         "WHERE id = ?1 AND ds_id=1"
+                         );
 
   if(rc != SQLITE_OK)
     return METADATA_PERMANENT_ERROR;
@@ -1352,7 +1352,7 @@ metadb_metadata_get_artist(sqlite3 *db, get_cache_t *gc, int64_t id)
   rc = db_step(sel);
 
   if(rc != SQLITE_ROW) {
-    sqlite3_finalize(sel);
+    db_stmt_release(sel);
     return METADATA_PERMANENT_ERROR;
   }
 
@@ -1360,7 +1360,7 @@ metadb_metadata_get_artist(sqlite3 *db, get_cache_t *gc, int64_t id)
 
   rstr_release(gc->gc_artist_title);
   gc->gc_artist_title = rstr_alloc((void *)sqlite3_column_text(sel, 0));
-  sqlite3_finalize(sel);
+  db_stmt_release(sel);
   return 0;
 }
 
@@ -1380,10 +1380,10 @@ metadb_metadata_get_album(sqlite3 *db, get_cache_t *gc, int64_t id)
   int rc;
   sqlite3_stmt *sel;
 
-  rc = db_prepare(db, &sel,
-		  "SELECT title "
-		  "FROM album "
-		  "WHERE id = ?1 AND ds_id=1");
+  rc = db_prepare_cached(db, &sel,
+                         "SELECT title "
+                         "FROM album "
+                         "WHERE id = ?1 AND ds_id=1");
 
   if(rc != SQLITE_OK)
     return METADATA_PERMANENT_ERROR;
@@ -1393,14 +1393,14 @@ metadb_metadata_get_album(sqlite3 *db, get_cache_t *gc, int64_t id)
   rc = db_step(sel);
 
   if(rc != SQLITE_ROW) {
-    sqlite3_finalize(sel);
+    db_stmt_release(sel);
     return METADATA_PERMANENT_ERROR;
   }
 
   gc->gc_album_id = id;
   rstr_release(gc->gc_album_title);
   gc->gc_album_title = rstr_alloc((void *)sqlite3_column_text(sel, 0));
-  sqlite3_finalize(sel);
+  db_stmt_release(sel);
   return 0;
 }
 
@@ -1415,11 +1415,11 @@ metadb_metadata_get_audio(sqlite3 *db, metadata_t *md, int64_t item_id,
   int rc;
   sqlite3_stmt *sel;
 
-  rc = db_prepare(db, &sel,
-		  "SELECT title, album_id, artist_id, duration, track "
-		  "FROM audioitem "
-		  "WHERE item_id = ?1 AND ds_id = 1"
-		  );
+  rc = db_prepare_cached(db, &sel,
+                         "SELECT title, album_id, artist_id, duration, track "
+                         "FROM audioitem "
+                         "WHERE item_id = ?1 AND ds_id = 1"
+                         );
 
   if(rc != SQLITE_OK)
     return METADATA_PERMANENT_ERROR;
@@ -1429,7 +1429,7 @@ metadb_metadata_get_audio(sqlite3 *db, metadata_t *md, int64_t item_id,
   rc = db_step(sel);
 
   if(rc != SQLITE_ROW) {
-    sqlite3_finalize(sel);
+    db_stmt_release(sel);
     return METADATA_PERMANENT_ERROR;
   }
 
@@ -1444,7 +1444,7 @@ metadb_metadata_get_audio(sqlite3 *db, metadata_t *md, int64_t item_id,
   md->md_duration = sqlite3_column_int(sel, 3) / 1000.0f;
   md->md_track = sqlite3_column_int(sel, 4);
 
-  sqlite3_finalize(sel);
+  db_stmt_release(sel);
   return 0;
 }
 
@@ -1459,12 +1459,12 @@ metadb_metadata_get_video(sqlite3 *db, metadata_t *md, int64_t item_id,
   int rc;
   sqlite3_stmt *sel;
 
-  rc = db_prepare(db, &sel,
-		  "SELECT id, title, duration, format, year "
-		  "FROM videoitem "
-		  "WHERE item_id = ?1 "
-		  "AND ds_id = ?2"
-		  );
+  rc = db_prepare_cached(db, &sel,
+                         "SELECT id, title, duration, format, year "
+                         "FROM videoitem "
+                         "WHERE item_id = ?1 "
+                         "AND ds_id = ?2"
+                         );
 
   if(rc != SQLITE_OK)
     return METADATA_PERMANENT_ERROR;
@@ -1475,7 +1475,7 @@ metadb_metadata_get_video(sqlite3 *db, metadata_t *md, int64_t item_id,
   rc = db_step(sel);
 
   if(rc != SQLITE_ROW) {
-    sqlite3_finalize(sel);
+    db_stmt_release(sel);
     return METADATA_PERMANENT_ERROR;
   }
 
@@ -1486,7 +1486,7 @@ metadb_metadata_get_video(sqlite3 *db, metadata_t *md, int64_t item_id,
   md->md_format = rstr_alloc((void *)sqlite3_column_text(sel, 3));
   md->md_year = sqlite3_column_int(sel, 4);
 
-  sqlite3_finalize(sel);
+  db_stmt_release(sel);
   return id;
 }
 
@@ -1689,11 +1689,11 @@ metadb_item_get_preferred_ds(const char *url)
   if((db = metadb_get()) == NULL)
     return METADATA_PERMANENT_ERROR;
 
-  rc = db_prepare(db, &stmt,
-		  "SELECT ds_id "
-		  "FROM item "
-		  "WHERE url=?1"
-		  );
+  rc = db_prepare_cached(db, &stmt,
+                         "SELECT ds_id "
+                         "FROM item "
+                         "WHERE url=?1"
+                         );
 
   if(rc != SQLITE_OK) {
     metadb_close(db);
@@ -1705,7 +1705,7 @@ metadb_item_get_preferred_ds(const char *url)
   rc = db_step(stmt);
   if(rc == SQLITE_ROW)
     id = sqlite3_column_int(stmt, 0);
-  sqlite3_finalize(stmt);
+  db_stmt_release(stmt);
   metadb_close(db);
   return id;
 }
@@ -1725,11 +1725,11 @@ metadb_item_get_user_title(const char *url)
   if((db = metadb_get()) == NULL)
     return NULL;
 
-  rc = db_prepare(db, &stmt, 
-		  "SELECT usertitle "
-		  "FROM item "
-		  "WHERE url=?1"
-		  );
+  rc = db_prepare_cached(db, &stmt, 
+                         "SELECT usertitle "
+                         "FROM item "
+                         "WHERE url=?1"
+                         );
 
   if(rc != SQLITE_OK) {
     metadb_close(db);
@@ -1742,7 +1742,7 @@ metadb_item_get_user_title(const char *url)
   if(rc == SQLITE_ROW)
     ret = db_rstr(stmt, 0);
 
-  sqlite3_finalize(stmt);
+  db_stmt_release(stmt);
   metadb_close(db);
   return ret;
 }
@@ -2040,13 +2040,13 @@ metadb_metadata_get_streams(sqlite3 *db, metadata_t *md, int64_t videoitem_id)
   int strack = 0;
   int vtrack = 0;
 
-  rc = db_prepare(db, &sel,
-		  "SELECT streamindex, info, isolang, codec, "
-		  "mediatype, disposition, title "
-		  "FROM videostream "
-		  "WHERE videoitem_id = ?1 "
-		  "ORDER BY streamindex"
-		  );
+  rc = db_prepare_cached(db, &sel,
+                         "SELECT streamindex, info, isolang, codec, "
+                         "mediatype, disposition, title "
+                         "FROM videostream "
+                         "WHERE videoitem_id = ?1 "
+                         "ORDER BY streamindex"
+                         );
 
   if(rc != SQLITE_OK)
     return METADATA_PERMANENT_ERROR;
@@ -2079,7 +2079,7 @@ metadb_metadata_get_streams(sqlite3 *db, metadata_t *md, int64_t videoitem_id)
 			sqlite3_column_int(sel, 5),
 			tn);
   }
-  sqlite3_finalize(sel);
+  db_stmt_release(sel);
   return 0;
 }
 
@@ -2093,11 +2093,11 @@ metadb_metadata_get_image(sqlite3 *db, metadata_t *md, int64_t item_id)
   int rc;
   sqlite3_stmt *sel;
 
-  rc = db_prepare(db, &sel,
-		  "SELECT original_time, manufacturer, equipment "
-		  "FROM imageitem "
-		  "WHERE item_id = ?1"
-		  );
+  rc = db_prepare_cached(db, &sel,
+                         "SELECT original_time, manufacturer, equipment "
+                         "FROM imageitem "
+                         "WHERE item_id = ?1"
+                         );
 
   if(rc != SQLITE_OK)
     return METADATA_PERMANENT_ERROR;
@@ -2107,14 +2107,14 @@ metadb_metadata_get_image(sqlite3 *db, metadata_t *md, int64_t item_id)
   rc = db_step(sel);
 
   if(rc != SQLITE_ROW) {
-    sqlite3_finalize(sel);
+    db_stmt_release(sel);
     return METADATA_PERMANENT_ERROR;
   }
 
   md->md_time = sqlite3_column_int(sel, 0);
   md->md_manufacturer = rstr_alloc((void *)sqlite3_column_text(sel, 1));
   md->md_equipment = rstr_alloc((void *)sqlite3_column_text(sel, 2));
-  sqlite3_finalize(sel);
+  db_stmt_release(sel);
   return 0;
 }
 
@@ -2178,10 +2178,10 @@ metadb_metadata_get(void *db, const char *url, time_t mtime)
   if(db_begin(db))
     return NULL;
 
-  rc = db_prepare(db, &sel,
-		  "SELECT id,contenttype,parent from item "
-		  "where url=?1 AND "
-		  "mtime=?2");
+  rc = db_prepare_cached(db, &sel,
+                         "SELECT id,contenttype,parent from item "
+                         "where url=?1 AND "
+                         "mtime=?2");
 
   if(rc != SQLITE_OK) {
     db_rollback(db);
@@ -2194,7 +2194,7 @@ metadb_metadata_get(void *db, const char *url, time_t mtime)
   rc = db_step(sel);
 
   if(rc != SQLITE_ROW) {
-    sqlite3_finalize(sel);
+    db_stmt_release(sel);
     db_rollback(db);
     return NULL;
   }
@@ -2213,7 +2213,7 @@ metadb_metadata_get(void *db, const char *url, time_t mtime)
       METADATA_CACHE_STATUS_FULL :
       METADATA_CACHE_STATUS_UNPARENTED;
 
-  sqlite3_finalize(sel);
+  db_stmt_release(sel);
   db_rollback(db);
   return md;
 }
@@ -2378,3 +2378,97 @@ metadb_parent_item(void *db, const char *url, const char *parent_url)
 
 
 
+
+/**
+ * Number of parsed subtitle files we keep around
+ */
+#define SUBTITLE_CACHE_ENTRIES 250
+
+/**
+ * Return parsed subtitles for 'url' if we have them for the
+ * given mtime and stamp
+ */
+buf_t *
+metadb_get_subtitles(void *db, const char *url, time_t mtime, uint32_t stamp)
+{
+  int rc;
+  buf_t *b = NULL;
+  sqlite3_stmt *sel;
+
+  rc = db_prepare_cached(db, &sel,
+                         "SELECT data "
+                         "FROM subtitlecache "
+                         "WHERE url = ?1 AND mtime = ?2 AND stamp = ?3");
+
+  if(rc != SQLITE_OK)
+    return NULL;
+
+  sqlite3_bind_text(sel, 1, url, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(sel, 2, mtime);
+  sqlite3_bind_int64(sel, 3, stamp);
+
+  if(db_step(sel) == SQLITE_ROW) {
+    const void *data = sqlite3_column_blob(sel, 0);
+    int len = sqlite3_column_bytes(sel, 0);
+    if(data != NULL && len > 0)
+      b = buf_create_and_copy(len, data);
+  }
+  db_stmt_release(sel);
+  return b;
+}
+
+
+/**
+ *
+ */
+void
+metadb_put_subtitles(void *db, const char *url, time_t mtime, uint32_t stamp,
+                     const void *data, size_t len)
+{
+  int rc;
+  sqlite3_stmt *stmt;
+
+ again:
+  if(db_begin(db))
+    return;
+
+  rc = db_prepare_cached(db, &stmt,
+                         "INSERT OR REPLACE INTO subtitlecache "
+                         "(url, mtime, stamp, created, data) "
+                         "VALUES (?1, ?2, ?3, ?4, ?5)");
+
+  if(rc != SQLITE_OK) {
+    db_rollback(db);
+    return;
+  }
+
+  sqlite3_bind_text(stmt, 1, url, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 2, mtime);
+  sqlite3_bind_int64(stmt, 3, stamp);
+  sqlite3_bind_int64(stmt, 4, time(NULL));
+  sqlite3_bind_blob(stmt, 5, data, len, SQLITE_STATIC);
+  rc = db_step(stmt);
+  db_stmt_release(stmt);
+
+  if(rc == SQLITE_LOCKED) {
+    db_rollback_deadlock(db);
+    goto again;
+  }
+
+  rc = db_prepare_cached(db, &stmt,
+                         "DELETE FROM subtitlecache WHERE url NOT IN "
+                         "(SELECT url FROM subtitlecache "
+                         "ORDER BY created DESC LIMIT ?1)");
+
+  if(rc == SQLITE_OK) {
+    sqlite3_bind_int(stmt, 1, SUBTITLE_CACHE_ENTRIES);
+    rc = db_step(stmt);
+    db_stmt_release(stmt);
+    if(rc == SQLITE_LOCKED) {
+      db_rollback_deadlock(db);
+      goto again;
+    }
+  }
+
+  db_commit(db);
+}
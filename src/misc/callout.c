@@ -24,23 +24,155 @@
 #include "prop/prop.h"
 #include "callout.h"
 #include "arch/arch.h"
+#include "htsmsg/htsbuf.h"
 
-static LIST_HEAD(, callout) callouts;
+#define CALLOUT_WORKERS 2
+
+/**
+ * Pending callouts are kept in a binary min-heap ordered on deadline.
+ * Index 0 is unused so children of i are at 2i and 2i+1
+ */
+static callout_t **callout_heap;
+static int callout_heap_size;
+static int callout_heap_capacity;
+
+static TAILQ_HEAD(, callout) callout_workq;
 
 static hts_mutex_t callout_mutex;
 static hts_cond_t callout_cond;
+static hts_cond_t callout_work_cond;
 
 /**
- *htsmsg_t *props
+ * Callouts currently executing on a worker. Only compared, never
+ * dereferenced, as the callback may have freed the callout
  */
-static int
-calloutcmp(callout_t *a, callout_t *b)
+static callout_t *callout_running[CALLOUT_WORKERS];
+
+
+/**
+ * Lateness and runtime histograms, per place where callouts are armed
+ *
+ * Bucket n covers [4^(n-1), 4^n) ms, with first bucket being < 1ms
+ */
+#define CALLOUT_HIST_BUCKETS 8
+#define CALLOUT_SITE_HASH 64
+
+typedef struct callout_site {
+  LIST_ENTRY(callout_site) cs_link;
+  const char *cs_file;
+  int cs_line;
+  int cs_worker;
+  unsigned int cs_count;
+  int64_t cs_max_late;
+  int64_t cs_max_runtime;
+  unsigned int cs_late[CALLOUT_HIST_BUCKETS];
+  unsigned int cs_runtime[CALLOUT_HIST_BUCKETS];
+} callout_site_t;
+
+static LIST_HEAD(, callout_site) callout_sites[CALLOUT_SITE_HASH];
+
+
+/**
+ *
+ */
+static void
+callout_heap_set(int i, callout_t *c)
+{
+  callout_heap[i] = c;
+  c->c_heap_idx = i;
+}
+
+
+/**
+ *
+ */
+static void
+callout_heap_up(int i)
 {
-  if(a->c_deadline < b->c_deadline)
-    return -1;
-  else if(a->c_deadline > b->c_deadline)
-    return 1;
- return 0;
+  callout_t *c = callout_heap[i];
+
+  while(i > 1 && callout_heap[i / 2]->c_deadline > c->c_deadline) {
+    callout_heap_set(i, callout_heap[i / 2]);
+    i = i / 2;
+  }
+  callout_heap_set(i, c);
+}
+
+
+/**
+ *
+ */
+static void
+callout_heap_down(int i)
+{
+  callout_t *c = callout_heap[i];
+
+  while(1) {
+    int child = i * 2;
+    if(child > callout_heap_size)
+      break;
+    if(child < callout_heap_size &&
+       callout_heap[child + 1]->c_deadline < callout_heap[child]->c_deadline)
+      child++;
+    if(callout_heap[child]->c_deadline >= c->c_deadline)
+      break;
+    callout_heap_set(i, callout_heap[child]);
+    i = child;
+  }
+  callout_heap_set(i, c);
+}
+
+
+/**
+ *
+ */
+static void
+callout_heap_insert(callout_t *c)
+{
+  if(callout_heap_size + 1 >= callout_heap_capacity) {
+    callout_heap_capacity = MAX(64, callout_heap_capacity * 2);
+    callout_heap = realloc(callout_heap,
+                           callout_heap_capacity * sizeof(callout_t *));
+  }
+  callout_heap_size++;
+  callout_heap_set(callout_heap_size, c);
+  callout_heap_up(callout_heap_size);
+}
+
+
+/**
+ *
+ */
+static void
+callout_heap_remove(callout_t *c)
+{
+  const int i = c->c_heap_idx;
+  callout_t *last = callout_heap[callout_heap_size--];
+
+  c->c_heap_idx = 0;
+
+  if(last == c)
+    return;
+
+  callout_heap_set(i, last);
+  if(i > 1 && callout_heap[i / 2]->c_deadline > last->c_deadline)
+    callout_heap_up(i);
+  else
+    callout_heap_down(i);
+}
+
+
+/**
+ * Remove from whatever queue the callout is in
+ */
+static void
+callout_unlink(callout_t *c)
+{
+  if(c->c_heap_idx)
+    callout_heap_remove(c);
+  else if(c->c_flags & CALLOUT_QUEUED)
+    TAILQ_REMOVE(&callout_workq, c, c_work_link);
+  c->c_flags &= ~CALLOUT_QUEUED;
 }
 
 
@@ -49,23 +181,27 @@ calloutcmp(callout_t *a, callout_t *b)
  */
 static void
 callout_arm_abs(callout_t *d, callout_callback_t *callback, void *opaque,
-		uint64_t deadline, const char *file, int line)
+		uint64_t deadline, int flags, const char *file, int line)
 {
   hts_mutex_lock(&callout_mutex);
 
   if(d == NULL)
-    d = malloc(sizeof(callout_t));
+    d = calloc(1, sizeof(callout_t));
   else if(d->c_callback != NULL)
-    LIST_REMOVE(d, c_link);
-    
+    callout_unlink(d);
+
   d->c_callback = callback;
   d->c_opaque = opaque;
   d->c_deadline = deadline;
+  d->c_flags = flags;
   d->c_armed_by_file = file;
   d->c_armed_by_line = line;
 
-  LIST_INSERT_SORTED(&callouts, d, c_link, calloutcmp);
-  hts_cond_signal(&callout_cond);
+  callout_heap_insert(d);
+
+  // Only need to wake up the callout thread if the next deadline changed
+  if(d->c_heap_idx == 1)
+    hts_cond_signal(&callout_cond);
   hts_mutex_unlock(&callout_mutex);
 }
 
@@ -78,7 +214,7 @@ callout_arm_x(callout_t *d, callout_callback_t *callback,
               const char *file, int line)
 {
   uint64_t deadline = showtime_get_ts() + delta * 1000000LL;
-  callout_arm_abs(d, callback, opaque, deadline, file, line);
+  callout_arm_abs(d, callback, opaque, deadline, 0, file, line);
 }
 
 /**
@@ -90,7 +226,19 @@ callout_arm_hires_x(callout_t *d, callout_callback_t *callback,
                     const char *file, int line)
 {
   uint64_t deadline = showtime_get_ts() + delta;
-  callout_arm_abs(d, callback, opaque, deadline, file, line);
+  callout_arm_abs(d, callback, opaque, deadline, 0, file, line);
+}
+
+/**
+ *
+ */
+void
+callout_arm_worker_x(callout_t *d, callout_callback_t *callback,
+                     void *opaque, int delta,
+                     const char *file, int line)
+{
+  uint64_t deadline = showtime_get_ts() + delta * 1000000LL;
+  callout_arm_abs(d, callback, opaque, deadline, CALLOUT_WORKER, file, line);
 }
 
 /**
@@ -101,13 +249,89 @@ callout_disarm(callout_t *d)
 {
   hts_mutex_lock(&callout_mutex);
   if(d->c_callback) {
-    LIST_REMOVE(d, c_link);
+    callout_unlink(d);
     d->c_callback = NULL;
   }
   hts_mutex_unlock(&callout_mutex);
 }
 
 
+/**
+ *
+ */
+static int
+callout_hist_bucket(int64_t us)
+{
+  int b = 0;
+  int64_t lim = 1000;
+
+  while(b < CALLOUT_HIST_BUCKETS - 1 && us >= lim) {
+    lim *= 4;
+    b++;
+  }
+  return b;
+}
+
+
+/**
+ * Must be called with callout_mutex locked
+ */
+static void
+callout_account(const char *file, int line, int worker,
+                int64_t late, int64_t runtime)
+{
+  const unsigned int h =
+    ((uintptr_t)file / sizeof(void *) + line) % CALLOUT_SITE_HASH;
+  callout_site_t *cs;
+
+  LIST_FOREACH(cs, &callout_sites[h], cs_link)
+    if(cs->cs_file == file && cs->cs_line == line)
+      break;
+
+  if(cs == NULL) {
+    cs = calloc(1, sizeof(callout_site_t));
+    cs->cs_file = file;
+    cs->cs_line = line;
+    LIST_INSERT_HEAD(&callout_sites[h], cs, cs_link);
+  }
+
+  if(late < 0)
+    late = 0;
+
+  cs->cs_worker = worker;
+  cs->cs_count++;
+  cs->cs_late[callout_hist_bucket(late)]++;
+  cs->cs_runtime[callout_hist_bucket(runtime)]++;
+  cs->cs_max_late    = MAX(cs->cs_max_late, late);
+  cs->cs_max_runtime = MAX(cs->cs_max_runtime, runtime);
+}
+
+
+/**
+ * Run an expired callout. Called with callout_mutex locked, the callout
+ * already removed from the queues. Returns with callout_mutex locked
+ */
+static void
+callout_run(callout_t *c, int worker)
+{
+  callout_callback_t *cc = c->c_callback;
+  void *opaque     = c->c_opaque;
+  const char *file = c->c_armed_by_file;
+  int line         = c->c_armed_by_line;
+  int64_t deadline = c->c_deadline;
+
+  c->c_callback = NULL;
+  hts_mutex_unlock(&callout_mutex);
+
+  int64_t start = showtime_get_ts();
+  cc(c, opaque);
+  int64_t ts = showtime_get_ts();
+
+  hts_mutex_lock(&callout_mutex);
+  callout_account(file, line, worker, start - deadline, ts - start);
+}
+
+
 /**
  *
  */
@@ -116,7 +340,6 @@ callout_loop(void *aux)
 {
   uint64_t now;
   callout_t *c;
-  callout_callback_t *cc;
 
   hts_mutex_lock(&callout_mutex);
 
@@ -124,24 +347,23 @@ callout_loop(void *aux)
 
     now = showtime_get_ts();
 
-    while((c = LIST_FIRST(&callouts)) != NULL && c->c_deadline <= now) {
-      cc = c->c_callback;
-      LIST_REMOVE(c, c_link);
-      c->c_callback = NULL;
-      const char *file = c->c_armed_by_file;
-      int line         = c->c_armed_by_line;
-      hts_mutex_unlock(&callout_mutex);
-      cc(c, c->c_opaque);
-      hts_mutex_lock(&callout_mutex);
-      int64_t ts = showtime_get_ts();
-      if(ts - now > 1000000)
-        TRACE(TRACE_DEBUG, "Callout", "%s:%d executed for %dus",
-              file, line, (int)(ts - now));
-      now = ts;
-    }
+    while(callout_heap_size > 0 &&
+          (c = callout_heap[1])->c_deadline <= now) {
+      callout_heap_remove(c);
 
-    if((c = LIST_FIRST(&callouts)) != NULL) {
+      if(c->c_flags & CALLOUT_WORKER) {
+        c->c_flags |= CALLOUT_QUEUED;
+        TAILQ_INSERT_TAIL(&callout_workq, c, c_work_link);
+        hts_cond_signal(&callout_work_cond);
+        continue;
+      }
 
+      callout_run(c, 0);
+      now = showtime_get_ts();
+    }
+
+    if(callout_heap_size > 0) {
+      c = callout_heap[1];
       int timeout = (c->c_deadline - now + 999) / 1000;
       hts_cond_wait_timeout(&callout_cond, &callout_mutex, timeout);
     } else {
@@ -153,6 +375,112 @@ callout_loop(void *aux)
 }
 
 
+/**
+ * Pick first queued callout that is not already executing on another
+ * worker. A callout may be rearmed from within its own callback and we
+ * must not run two instances concurrently
+ */
+static callout_t *
+callout_work_next(void)
+{
+  callout_t *c;
+  int i;
+
+  TAILQ_FOREACH(c, &callout_workq, c_work_link) {
+    for(i = 0; i < CALLOUT_WORKERS; i++)
+      if(callout_running[i] == c)
+        break;
+    if(i == CALLOUT_WORKERS)
+      return c;
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static void *
+callout_worker(void *aux)
+{
+  const int id = (intptr_t)aux;
+  callout_t *c;
+
+  hts_mutex_lock(&callout_mutex);
+
+  while(1) {
+
+    if((c = callout_work_next()) == NULL) {
+      hts_cond_wait(&callout_work_cond, &callout_mutex);
+      continue;
+    }
+
+    TAILQ_REMOVE(&callout_workq, c, c_work_link);
+    c->c_flags &= ~CALLOUT_QUEUED;
+
+    callout_running[id] = c;
+    callout_run(c, 1);
+    callout_running[id] = NULL;
+
+    // Someone might have been skipped because we were running it
+    if(TAILQ_FIRST(&callout_workq) != NULL)
+      hts_cond_signal(&callout_work_cond);
+  }
+
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static void
+callout_dump_hist(struct htsbuf_queue *hq, const unsigned int *hist)
+{
+  int i;
+  for(i = 0; i < CALLOUT_HIST_BUCKETS; i++)
+    htsbuf_qprintf(hq, " %7u", hist[i]);
+}
+
+
+/**
+ *
+ */
+void
+callout_dump_stats(struct htsbuf_queue *hq)
+{
+  static const char *hdr =
+    "      <1ms    <4ms   <16ms   <64ms  <256ms     <1s     <4s    >=4s";
+  callout_site_t *cs;
+  callout_t *c;
+  int i, queued = 0;
+
+  hts_mutex_lock(&callout_mutex);
+
+  TAILQ_FOREACH(c, &callout_workq, c_work_link)
+    queued++;
+
+  htsbuf_qprintf(hq, "%d callouts armed, %d waiting for worker\n\n",
+                 callout_heap_size, queued);
+
+  for(i = 0; i < CALLOUT_SITE_HASH; i++) {
+    LIST_FOREACH(cs, &callout_sites[i], cs_link) {
+      htsbuf_qprintf(hq, "%s:%d%s  %u runs  max late %dus  max runtime %dus\n",
+                     cs->cs_file, cs->cs_line,
+                     cs->cs_worker ? " (worker)" : "",
+                     cs->cs_count,
+                     (int)cs->cs_max_late, (int)cs->cs_max_runtime);
+      htsbuf_qprintf(hq, "        %s\n  late    ", hdr);
+      callout_dump_hist(hq, cs->cs_late);
+      htsbuf_qprintf(hq, "\n  runtime ");
+      callout_dump_hist(hq, cs->cs_runtime);
+      htsbuf_qprintf(hq, "\n\n");
+    }
+  }
+  hts_mutex_unlock(&callout_mutex);
+}
+
+
 static callout_t callout_clock;
 
 static prop_t *prop_hour;
@@ -189,13 +517,20 @@ void
 callout_init(void)
 {
   prop_t *clock;
+  int i;
 
   hts_mutex_init(&callout_mutex);
   hts_cond_init(&callout_cond, &callout_mutex);
+  hts_cond_init(&callout_work_cond, &callout_mutex);
+  TAILQ_INIT(&callout_workq);
 
   hts_thread_create_detached("callout", callout_loop, NULL,
 			     THREAD_PRIO_BGTASK);
 
+  for(i = 0; i < CALLOUT_WORKERS; i++)
+    hts_thread_create_detached("calloutworker", callout_worker,
+                               (void *)(intptr_t)i, THREAD_PRIO_BGTASK);
+
   clock = prop_create(prop_get_global(), "clock");
   prop_hour     = prop_create(clock, "hour");
   prop_minute   = prop_create(clock, "minute");
@@ -29,7 +29,11 @@ struct callout;
 typedef void (callout_callback_t)(struct callout *c, void *opaque);
 
 typedef struct callout {
-  LIST_ENTRY(callout) c_link;
+  int c_heap_idx;          // 1-based position in timer heap, 0 if not in it
+  int c_flags;
+#define CALLOUT_WORKER 0x1 // Run on worker pool instead of callout thread
+#define CALLOUT_QUEUED 0x2 // Expired, waiting for a worker
+  TAILQ_ENTRY(callout) c_work_link;
   callout_callback_t *c_callback;
   void *c_opaque;
   uint64_t c_deadline;
@@ -49,12 +53,26 @@ void callout_arm_hires_x(callout_t *d, callout_callback_t *callback,
 #define callout_arm_hires(a,b,c,d) \
  callout_arm_hires_x(a,b,c,d,__FILE__,__LINE__);
 
+/**
+ * Same as callout_arm() but the callback is executed on a worker pool.
+ * Use this for callbacks that may block (disk I/O, etc) so they don't
+ * delay other callouts
+ */
+void callout_arm_worker_x(callout_t *c, callout_callback_t *callback,
+                          void *opaque, int delta, const char *file, int line);
+
+#define callout_arm_worker(a,b,c,d) \
+ callout_arm_worker_x(a,b,c,d,__FILE__,__LINE__);
 
 
 void callout_disarm(callout_t *c);
 
 void callout_init(void);
 
+struct htsbuf_queue;
+
+void callout_dump_stats(struct htsbuf_queue *hq);
+
 #define callout_isarmed(c) ((c)->c_callback != NULL)
 
 #endif /* CALLOUT_H__ */
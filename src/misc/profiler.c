@@ -0,0 +1,272 @@
+/*
+ *  Showtime Mediacenter
+ *  Copyright (C) 2007-2013 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "showtime.h"
+#include "arch/threads.h"
+#include "htsmsg/htsbuf.h"
+#include "profiler.h"
+
+/**
+ * Each thread records into its own buffer so recording needs no locks.
+ * Buffers are rings, when full the oldest events are overwritten
+ */
+#define PROF_EVENTS 8192  // Must be power of 2
+#define PROF_NAME_CACHE 32 // Must be power of 2
+
+typedef struct prof_event {
+  const char *pe_cat;
+  const char *pe_name;
+  int64_t pe_start;
+  int pe_dur;
+} prof_event_t;
+
+typedef struct prof_thread {
+  LIST_ENTRY(prof_thread) pt_link;
+  int pt_tid;
+  int pt_gen;      // Session the recorded events belong to
+  int pt_exited;
+  unsigned int pt_count;
+  const char *pt_names[PROF_NAME_CACHE]; // Interned names recently used
+  prof_event_t pt_events[PROF_EVENTS];
+} prof_thread_t;
+
+/**
+ * Copies of names that are not guaranteed to outlive the recorded
+ * events. Never freed, there are only a handful of them
+ */
+typedef struct prof_name {
+  struct prof_name *pn_next;
+  char pn_str[0];
+} prof_name_t;
+
+int profiler_enabled;
+
+static int profiler_gen;
+static int64_t profiler_epoch;
+static int profiler_tid_tally;
+
+static hts_mutex_t profiler_mutex;
+static hts_key_t profiler_key;
+static LIST_HEAD(, prof_thread) profiler_threads;
+static prof_name_t *profiler_names;
+
+
+/**
+ * Thread is exiting. Buffer is kept until next session so its events
+ * can still be exported
+ */
+static void
+profiler_thread_exit(void *aux)
+{
+  prof_thread_t *pt = aux;
+  hts_mutex_lock(&profiler_mutex);
+  pt->pt_exited = 1;
+  hts_mutex_unlock(&profiler_mutex);
+}
+
+
+/**
+ *
+ */
+static prof_thread_t *
+profiler_thread_get(void)
+{
+  prof_thread_t *pt = hts_thread_get_specific(profiler_key);
+
+  if(pt == NULL) {
+    pt = calloc(1, sizeof(prof_thread_t));
+    pt->pt_exited = 0;
+    pt->pt_count = 0;
+    pt->pt_gen = profiler_gen;
+
+    hts_mutex_lock(&profiler_mutex);
+    pt->pt_tid = ++profiler_tid_tally;
+    LIST_INSERT_HEAD(&profiler_threads, pt, pt_link);
+    hts_mutex_unlock(&profiler_mutex);
+
+    hts_thread_set_specific(profiler_key, pt);
+  }
+
+  if(pt->pt_gen != profiler_gen) {
+    // Left over from previous session
+    pt->pt_gen = profiler_gen;
+    pt->pt_count = 0;
+  }
+  return pt;
+}
+
+
+/**
+ * Return a copy of 'name' that lives forever. The per thread cache keeps
+ * the lock out of the common case
+ */
+static const char *
+profiler_name_intern(prof_thread_t *pt, const char *name)
+{
+  unsigned int h = 0;
+  const char *s;
+  prof_name_t *pn;
+
+  for(s = name; *s; s++)
+    h = h * 33 + (uint8_t)*s;
+  h &= PROF_NAME_CACHE - 1;
+
+  if(pt->pt_names[h] != NULL && !strcmp(pt->pt_names[h], name))
+    return pt->pt_names[h];
+
+  hts_mutex_lock(&profiler_mutex);
+  for(pn = profiler_names; pn != NULL; pn = pn->pn_next)
+    if(!strcmp(pn->pn_str, name))
+      break;
+
+  if(pn == NULL) {
+    pn = malloc(sizeof(prof_name_t) + strlen(name) + 1);
+    strcpy(pn->pn_str, name);
+    pn->pn_next = profiler_names;
+    profiler_names = pn;
+  }
+  hts_mutex_unlock(&profiler_mutex);
+
+  pt->pt_names[h] = pn->pn_str;
+  return pn->pn_str;
+}
+
+
+/**
+ *
+ */
+void
+prof_record(const char *cat, const char *name, int64_t start, int copy_name)
+{
+  int64_t now = showtime_get_ts();
+
+  if(!profiler_enabled)
+    return;
+
+  prof_thread_t *pt = profiler_thread_get();
+  prof_event_t *pe = &pt->pt_events[pt->pt_count & (PROF_EVENTS - 1)];
+
+  if(copy_name)
+    name = profiler_name_intern(pt, name);
+
+  pe->pe_cat   = cat;
+  pe->pe_name  = name;
+  pe->pe_start = start;
+  pe->pe_dur   = now - start;
+  pt->pt_count++;
+}
+
+
+/**
+ *
+ */
+void
+profiler_start(void)
+{
+  prof_thread_t *pt, *next;
+
+  hts_mutex_lock(&profiler_mutex);
+
+  for(pt = LIST_FIRST(&profiler_threads); pt != NULL; pt = next) {
+    next = LIST_NEXT(pt, pt_link);
+    if(pt->pt_exited) {
+      LIST_REMOVE(pt, pt_link);
+      free(pt);
+    }
+  }
+
+  profiler_gen++;
+  profiler_epoch = showtime_get_ts();
+  profiler_enabled = 1;
+  hts_mutex_unlock(&profiler_mutex);
+  TRACE(TRACE_INFO, "profiler", "Profiling started");
+}
+
+
+/**
+ *
+ */
+void
+profiler_stop(void)
+{
+  if(!profiler_enabled)
+    return;
+  profiler_enabled = 0;
+  TRACE(TRACE_INFO, "profiler", "Profiling stopped");
+}
+
+
+/**
+ * Export recorded events in Chrome's trace event format
+ * (load in chrome://tracing)
+ */
+void
+profiler_export(struct htsbuf_queue *hq)
+{
+  prof_thread_t *pt;
+  const char *sep = "";
+  unsigned int i;
+
+  htsbuf_qprintf(hq, "{\"traceEvents\":[");
+
+  hts_mutex_lock(&profiler_mutex);
+
+  LIST_FOREACH(pt, &profiler_threads, pt_link) {
+    if(pt->pt_gen != profiler_gen)
+      continue;
+
+    i = pt->pt_count > PROF_EVENTS ? pt->pt_count - PROF_EVENTS : 0;
+
+    for(; i < pt->pt_count; i++) {
+      const prof_event_t *pe = &pt->pt_events[i & (PROF_EVENTS - 1)];
+      if(pe->pe_start < profiler_epoch)
+        continue;
+
+      htsbuf_qprintf(hq, "%s\n{\"cat\":", sep);
+      htsbuf_append_and_escape_jsonstr(hq, pe->pe_cat);
+      htsbuf_qprintf(hq, ",\"name\":");
+      htsbuf_append_and_escape_jsonstr(hq, pe->pe_name);
+      htsbuf_qprintf(hq, ",\"ph\":\"X\","
+                     "\"pid\":1,\"tid\":%d,\"ts\":%"PRId64",\"dur\":%d}",
+                     pt->pt_tid, pe->pe_start - profiler_epoch, pe->pe_dur);
+      sep = ",";
+    }
+  }
+  hts_mutex_unlock(&profiler_mutex);
+
+  htsbuf_qprintf(hq, "\n],\"displayTimeUnit\":\"ms\"}\n");
+}
+
+
+/**
+ *
+ */
+static void
+profiler_init(void)
+{
+  hts_mutex_init(&profiler_mutex);
+  hts_thread_key_create((void *)&profiler_key, profiler_thread_exit);
+}
+
+INITME(INIT_GROUP_API, profiler_init);
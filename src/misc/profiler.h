@@ -0,0 +1,71 @@
+/*
+ *  Showtime Mediacenter
+ *  Copyright (C) 2007-2013 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#ifndef PROFILER_H__
+#define PROFILER_H__
+
+#include "showtime.h"
+
+/**
+ * Lightweight scoped timers
+ *
+ *   int64_t t = prof_begin();
+ *   ... do stuff ...
+ *   prof_end(t, "glw", "render");
+ *
+ * Nothing is recorded unless profiling has been started (from
+ * /showtime/profile/start on the HTTP server). Category and name must
+ * be strings that live forever (constants). Names that may be freed
+ * (such as those of plugin provided protocols) must be passed to
+ * prof_end_dyn() which records a copy
+ */
+
+extern int profiler_enabled;
+
+void prof_record(const char *cat, const char *name, int64_t start,
+                 int copy_name);
+
+static inline int64_t prof_begin(void)
+{
+  return profiler_enabled ? showtime_get_ts() : 0;
+}
+
+static inline void prof_end(int64_t start, const char *cat, const char *name)
+{
+  if(start)
+    prof_record(cat, name, start, 0);
+}
+
+static inline void prof_end_dyn(int64_t start, const char *cat,
+                                const char *name)
+{
+  if(start)
+    prof_record(cat, name, start, 1);
+}
+
+void profiler_start(void);
+
+void profiler_stop(void);
+
+struct htsbuf_queue;
+
+void profiler_export(struct htsbuf_queue *hq);
+
+#endif /* PROFILER_H__ */
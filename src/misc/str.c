@@ -865,7 +865,7 @@ static int casefoldtablelen;
 /**
  *
  */
-static int
+int
 unicode_casefold(unsigned int i)
 {
   int r;
@@ -61,6 +61,8 @@ char *utf8_cleanup(const char *str);
 
 const char *mystrstr(const char *haystack, const char *needle);
 
+int unicode_casefold(unsigned int i);
+
 void strvec_addp(char ***str, const char *v);
 
 void strvec_addpn(char ***str, const char *v, size_t len);
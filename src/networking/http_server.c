@@ -23,10 +23,17 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 
+#ifdef linux
+#include <sys/sendfile.h>
+#endif
+
 #include <libavutil/base64.h>
 
 #define hsprintf(fmt...) // printf(fmt)
@@ -43,6 +50,7 @@
 #include "asyncio.h"
 
 #include "upnp/upnp.h"
+#include "fileaccess/fileaccess.h"
 
 static LIST_HEAD(, http_path) http_paths;
 LIST_HEAD(http_connection_list, http_connection); 
@@ -112,9 +120,27 @@ struct http_connection {
   void *hc_opaque;
 
   char hc_my_addr[128]; // hc_local_addr as text
+
+  /**
+   * File backed response, sent after hc_output is drained.
+   * Further requests are not processed until it's done
+   */
+  int hc_file_fd;         // -1 if none
+  int64_t hc_file_offset;
+  int64_t hc_file_left;
 };
 
 
+#define HTTP_IOV_MAX         16
+#define HTTP_FILE_CHUNK      (1024 * 1024)
+
+static prop_t *http_stats_bps;
+static prop_t *http_stats_syscalls;
+static int64_t http_stats_ts;
+static int64_t http_stats_bytes;
+static int http_stats_calls;
+
+
 /**
  *
  */
@@ -287,7 +313,7 @@ http_rc2str(int code)
  */
 static void
 http_send_header(http_connection_t *hc, int rc, const char *content, 
-		 int contentlen, const char *encoding, const char *location, 
+		 int64_t contentlen, const char *encoding, const char *location,
 		 int maxage, const char *range)
 {
   htsbuf_queue_t hdrs;
@@ -335,7 +361,7 @@ http_send_header(http_connection_t *hc, int rc, const char *content,
   if(content != NULL)
     htsbuf_qprintf(&hdrs, "Content-Type: %s\r\n", content);
 
-  htsbuf_qprintf(&hdrs, "Content-Length: %d\r\n", contentlen);
+  htsbuf_qprintf(&hdrs, "Content-Length: %"PRId64"\r\n", contentlen);
 
   LIST_FOREACH(hh, &hc->hc_response_headers, hh_link)
     htsbuf_qprintf(&hdrs, "%s: %s\r\n", hh->hh_key, hh->hh_value);
@@ -407,6 +433,125 @@ http_send_reply(http_connection_t *hc, int rc, const char *content,
 }
 
 
+/**
+ * Parse Range header (only a single range is supported)
+ *
+ * Returns HTTP status code to reply with. [*startp, *endp) is set
+ * to the part of the file to send
+ */
+static int
+http_parse_range(http_connection_t *hc, int64_t size,
+		 int64_t *startp, int64_t *endp)
+{
+  const char *r = http_header_get(&hc->hc_request_headers, "Range");
+  char *e;
+  int64_t s, l;
+
+  *startp = 0;
+  *endp = size;
+
+  if(r == NULL || strncasecmp(r, "bytes=", 6) || strchr(r, ','))
+    return HTTP_STATUS_OK;
+
+  r += 6;
+
+  if(*r == '-') {
+    // Last n bytes
+    l = strtoll(r + 1, &e, 10);
+    if(e == r + 1)
+      return HTTP_STATUS_OK;
+    if(l == 0)
+      return 416;
+    *startp = size > l ? size - l : 0;
+    return 206;
+  }
+
+  s = strtoll(r, &e, 10);
+  if(e == r || *e != '-')
+    return HTTP_STATUS_OK;
+
+  if(s >= size)
+    return 416;
+
+  *startp = s;
+
+  if(e[1]) {
+    l = strtoll(e + 1, NULL, 10);
+    if(l < s)
+      return HTTP_STATUS_OK;
+    *endp = MIN(l + 1, size);
+  }
+  return 206;
+}
+
+
+/**
+ * Send a file, with support for Range requests.
+ *
+ * Local files are sent directly from the file descriptor without
+ * passing through the output queue. Other URLs are loaded via fa_load()
+ */
+int
+http_send_file(http_connection_t *hc, const char *url, const char *content,
+	       int maxage)
+{
+  char *path = fa_get_native_path(url);
+  char range[128];
+  struct stat st;
+  int64_t size, start, end;
+  buf_t *b = NULL;
+  int fd = -1, rc;
+
+  if(path != NULL) {
+    fd = open(path, O_RDONLY);
+    free(path);
+    if(fd != -1 && (fstat(fd, &st) || !S_ISREG(st.st_mode))) {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  if(fd != -1) {
+    size = st.st_size;
+  } else {
+    if((b = fa_load(url, NULL)) == NULL)
+      return HTTP_STATUS_NOT_FOUND;
+    size = b->b_size;
+  }
+
+  http_set_response_hdr(hc, "Accept-Ranges", "bytes");
+
+  rc = http_parse_range(hc, size, &start, &end);
+
+  if(rc == 416) {
+    snprintf(range, sizeof(range), "bytes */%"PRId64, size);
+    http_set_response_hdr(hc, "Content-Range", range);
+    start = end = 0;
+  } else if(rc == 206) {
+    snprintf(range, sizeof(range), "bytes %"PRId64"-%"PRId64"/%"PRId64,
+	     start, end - 1, size);
+    http_set_response_hdr(hc, "Content-Range", range);
+  }
+
+  http_send_header(hc, rc, content, end - start, NULL, NULL, maxage, NULL);
+
+  if(hc->hc_no_output || start == end) {
+    if(fd != -1)
+      close(fd);
+  } else if(fd != -1) {
+    hc->hc_file_fd = fd;
+    hc->hc_file_offset = start;
+    hc->hc_file_left = end - start;
+  } else {
+    htsbuf_append(&hc->hc_output, b->b_ptr + start, end - start);
+  }
+
+  if(b != NULL)
+    buf_release(b);
+  return 0;
+}
+
+
 /**
  * Send HTTP error back
  */
@@ -1095,6 +1240,9 @@ http_handle_input(http_connection_t *hc)
 	if(http_handle_request(hc))
 	  return 1;
 
+	if(hc->hc_file_fd != -1)
+	  return 0; // Rest of input is processed once file has been sent
+
 	if(TAILQ_FIRST(&hc->hc_output.hq_q) == NULL && !hc->hc_keep_alive)
 	  return 1;
 
@@ -1123,42 +1271,133 @@ http_handle_input(http_connection_t *hc)
 }
 
 
+/**
+ * Account for a write syscall
+ */
+static void
+http_stats_update(int bytes)
+{
+  int64_t now = showtime_get_ts();
+
+  http_stats_calls++;
+  if(bytes > 0)
+    http_stats_bytes += bytes;
+
+  if(now - http_stats_ts < 1000000)
+    return;
+
+  if(http_stats_ts)
+    prop_set_int(http_stats_bps,
+		 http_stats_bytes * 1000000 / (now - http_stats_ts));
+  prop_set_int(http_stats_syscalls, http_stats_calls);
+  http_stats_ts = now;
+  http_stats_bytes = 0;
+  http_stats_calls = 0;
+}
+
+
+/**
+ * Send next part of file
+ */
+static int
+http_write_file(http_connection_t *hc)
+{
+  size_t len = MIN(hc->hc_file_left, HTTP_FILE_CHUNK);
+  int r;
+
+#ifdef linux
+  off_t off = hc->hc_file_offset;
+  r = sendfile(hc->hc_fd, hc->hc_file_fd, &off, len);
+#else
+  char buf[65536];
+
+  len = MIN(len, sizeof(buf));
+  r = pread(hc->hc_file_fd, buf, len, hc->hc_file_offset);
+  if(r > 0)
+    r = write(hc->hc_fd, buf, r);
+#endif
+  return r;
+}
+
+
 /**
  *
  */
 static int
 http_write(http_connection_t *hc)
 {
+  struct iovec iov[HTTP_IOV_MAX];
   htsbuf_data_t *hd;
-  int l, r = 0;
+  int i, l, r, len;
 
   htsbuf_queue_t *q = &hc->hc_output;
-  
+
   while((hd = TAILQ_FIRST(&q->hq_q)) != NULL) {
 
-    l = hd->hd_data_len - hd->hd_data_off;
-    r = write(hc->hc_fd, hd->hd_data + hd->hd_data_off, l);
+    len = 0;
+    for(i = 0; hd != NULL && i < HTTP_IOV_MAX;
+	hd = TAILQ_NEXT(hd, hd_link), i++) {
+      iov[i].iov_base = hd->hd_data + hd->hd_data_off;
+      iov[i].iov_len  = hd->hd_data_len - hd->hd_data_off;
+      len += iov[i].iov_len;
+    }
+
+    r = writev(hc->hc_fd, iov, i);
 
     if(r == -1 && (errno == EWOULDBLOCK || errno == EAGAIN))
       r = 0;
 
+    http_stats_update(r);
+
     if(r == -1)
       return -1;
 
     q->hq_size -= r;
+    len -= r;
 
-    if(r != l) {
+    for(; r > 0; r -= l) {
+      hd = TAILQ_FIRST(&q->hq_q);
+      l = hd->hd_data_len - hd->hd_data_off;
+      if(r < l) {
+	hd->hd_data_off += r;
+	break;
+      }
+      TAILQ_REMOVE(&q->hq_q, hd, hd_link);
+      free(hd->hd_data);
+      free(hd);
+    }
+
+    if(len > 0) {
       // Failed to write it all
-      hd->hd_data_off += r;
+      asyncio_add_events(hc->hc_afd, ASYNCIO_WRITE);
+      return 0;
+    }
+  }
+
+  while(hc->hc_file_fd != -1) {
 
+    r = http_write_file(hc);
+
+    if(r == -1 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+      http_stats_update(0);
       asyncio_add_events(hc->hc_afd, ASYNCIO_WRITE);
       return 0;
     }
 
-    TAILQ_REMOVE(&q->hq_q, hd, hd_link);
-    free(hd->hd_data);
-    free(hd);
+    http_stats_update(r);
+
+    if(r <= 0)
+      return -1; // Error or file truncated
+
+    hc->hc_file_offset += r;
+    hc->hc_file_left -= r;
+
+    if(hc->hc_file_left == 0) {
+      close(hc->hc_file_fd);
+      hc->hc_file_fd = -1;
+    }
   }
+
   asyncio_rem_events(hc->hc_afd, ASYNCIO_WRITE);
   return 0;
 }
@@ -1181,15 +1420,27 @@ http_io(http_connection_t *hc, int events)
     r = read(hc->hc_fd, mem, rlen);
     if(r > 0) {
       htsbuf_append_prealloc(&hc->hc_input, mem, r);
-      if(http_handle_input(hc))
+      if(hc->hc_file_fd == -1 && http_handle_input(hc))
 	return 1;
     } else {
       free(mem);
       return 1;
     }
   }
-  r = http_write(hc);
-  return r;
+
+  if(hc->hc_file_fd == -1)
+    return http_write(hc);
+
+  if(http_write(hc))
+    return 1;
+
+  if(hc->hc_file_fd != -1)
+    return 0;
+
+  // File sent, continue with requests that arrived meanwhile
+  if(http_handle_input(hc))
+    return 1;
+  return http_write(hc);
 }
 
 
@@ -1202,6 +1453,8 @@ http_close(http_connection_t *hc)
   hsprintf("%p: ----------------- CLOSED CONNECTION\n", hc);
   htsbuf_queue_flush(&hc->hc_input);
   htsbuf_queue_flush(&hc->hc_output);
+  if(hc->hc_file_fd != -1)
+    close(hc->hc_file_fd);
   http_headers_free(&hc->hc_req_args);
   http_headers_free(&hc->hc_request_headers);
   http_headers_free(&hc->hc_response_headers);
@@ -1265,6 +1518,7 @@ http_accept(void *opaque, int fd, const net_addr_t *local_addr,
                               http_io_callback, hc, "HTTP connection");
   htsbuf_queue_init(&hc->hc_input, 0);
   htsbuf_queue_init(&hc->hc_output, 0);
+  hc->hc_file_fd = -1;
 
   hc->hc_local_addr  = *local_addr;
 }
@@ -1281,6 +1535,11 @@ http_server_init(void)
                                   http_accept,
                                   NULL, 1);
 
+  prop_t *p = prop_create(prop_create(prop_get_global(), "system"),
+			  "httpserver");
+  http_stats_bps      = prop_create(p, "bytesPerSecond");
+  http_stats_syscalls = prop_create(p, "syscallsPerSecond");
+
   if(http_server_fd != NULL) {
     http_server_port = asyncio_get_port(http_server_fd);
     if(!gconf.disable_upnp)
@@ -340,8 +340,8 @@ int prop_set_parent_ex(prop_t *p, prop_t *parent, prop_t *before,
      
 #define prop_set_parent(p, parent) prop_set_parent_ex(p, parent, NULL, NULL)
 
-void prop_set_parent_vector(prop_vec_t *pv, prop_t *parent,
-			    prop_t *before, prop_sub_t *skipme);
+int prop_set_parent_vector(prop_vec_t *pv, prop_t *parent,
+			   prop_t *before, prop_sub_t *skipme);
 
 void prop_unparent_ex(prop_t *p, prop_sub_t *skipme);
 
@@ -0,0 +1,917 @@
+/*
+ *  Showtime Mediacenter
+ *  Copyright (C) 2007-2013 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <assert.h>
+
+#include "prop_i.h"
+#include "prop_colstore.h"
+#include "misc/str.h"
+
+#define CS_ROW_DIRTY   0x1  // Value changed after row was published
+#define CS_ROW_KEEP    0x2  // Temporary mark used by cs_materialize()
+#define CS_ROW_DELETED 0x4
+
+/**
+ *
+ */
+typedef struct cs_column {
+  char **csc_path;     // NULL if column is not materialized
+  prop_colstore_type_t csc_type;
+  int csc_flags;
+  union {
+    rstr_t **csc_str;
+    int *csc_int;
+  };
+} cs_column_t;
+
+
+/**
+ *
+ */
+struct prop_colstore {
+  prop_t *cs_dst;
+  prop_sub_t *cs_dstsub;
+  prop_sub_t *cs_filtersub;
+
+  cs_column_t *cs_columns;
+  int cs_ncolumns;
+
+  /**
+   * Rows [0, cs_published) have been filtered and sorted into the view.
+   * Rows after that are still being filled in by the producer
+   */
+  int cs_rows;
+  int cs_capacity;
+  int cs_published;
+  int cs_ndirty;
+
+  uint8_t *cs_rowflags;
+  prop_t **cs_props;   // Materialized prop per row (NULL if not bound)
+
+  /**
+   * Visible rows in output order
+   */
+  int *cs_view;
+  int cs_viewlen;
+
+  /**
+   * Rows currently materialized below cs_dst, in order.
+   * Normally the first cs_nbound entries of the view, but is allowed
+   * to lag behind until cs_materialize() is called
+   */
+  int *cs_bound;
+  int cs_nbound;
+
+  int cs_window;
+  int cs_limit;
+  int cs_have_more;
+
+  int cs_sortcol;
+  int cs_sortdesc;
+  int cs_groupcol;
+
+  char *cs_filter;
+
+  /**
+   * Rows bound since last call to cs_unlock(), 'bind' is called for
+   * these once prop_mutex has been released
+   */
+  prop_colstore_bind_t *cs_bind;
+  void *cs_opaque;
+  prop_vec_t *cs_bindq;
+  int *cs_bindrows;
+};
+
+
+/**
+ * qsort() has no opaque argument so the comparator picks up the store
+ * from here. Only touched with prop_mutex held
+ */
+static const prop_colstore_t *cs_sorting;
+
+
+/**
+ *
+ */
+static int
+cs_cmp(const prop_colstore_t *cs, int a, int b)
+{
+  int r = 0;
+
+  if(cs->cs_groupcol >= 0) {
+    const int *v = cs->cs_columns[cs->cs_groupcol].csc_int;
+    if(v[a] != v[b])
+      return v[a] < v[b] ? -1 : 1;
+  }
+
+  if(cs->cs_sortcol >= 0) {
+    const cs_column_t *csc = &cs->cs_columns[cs->cs_sortcol];
+
+    switch(csc->csc_type) {
+    case PROP_COLSTORE_STR:
+      r = dictcmp(rstr_get(csc->csc_str[a]) ?: "",
+                  rstr_get(csc->csc_str[b]) ?: "");
+      break;
+    case PROP_COLSTORE_INT:
+      r = csc->csc_int[a] < csc->csc_int[b] ? -1 :
+        csc->csc_int[a] > csc->csc_int[b];
+      break;
+    }
+    if(cs->cs_sortdesc)
+      r = -r;
+  }
+  return r ?: a - b;
+}
+
+
+/**
+ *
+ */
+static int
+cs_qsort_cmp(const void *A, const void *B)
+{
+  return cs_cmp(cs_sorting, *(const int *)A, *(const int *)B);
+}
+
+
+/**
+ *
+ */
+static void
+cs_sort_range(prop_colstore_t *cs, int *v, int len)
+{
+  cs_sorting = cs;
+  qsort(v, len, sizeof(int), cs_qsort_cmp);
+  cs_sorting = NULL;
+}
+
+
+/**
+ *
+ */
+static int
+cs_row_match(const prop_colstore_t *cs, int row)
+{
+  int i;
+
+  if(cs->cs_rowflags[row] & CS_ROW_DELETED)
+    return 0;
+
+  for(i = 0; i < cs->cs_ncolumns; i++) {
+    const cs_column_t *csc = &cs->cs_columns[i];
+    if(csc->csc_flags & PROP_COLSTORE_EXCLUDE && csc->csc_int[row])
+      return 0;
+  }
+
+  if(cs->cs_filter == NULL)
+    return 1;
+
+  for(i = 0; i < cs->cs_ncolumns; i++) {
+    const cs_column_t *csc = &cs->cs_columns[i];
+    if(csc->csc_type != PROP_COLSTORE_STR ||
+       !(csc->csc_flags & PROP_COLSTORE_SEARCHABLE) ||
+       csc->csc_str[row] == NULL)
+      continue;
+    if(mystrstr(rstr_get(csc->csc_str[row]), cs->cs_filter))
+      return 1;
+  }
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+cs_set_cell(prop_colstore_t *cs, prop_t *p, int col, int row)
+{
+  const cs_column_t *csc = &cs->cs_columns[col];
+  char **path;
+
+  if(csc->csc_path == NULL)
+    return;
+
+  for(path = csc->csc_path; *path != NULL; path++)
+    p = prop_create0(p, *path, cs->cs_dstsub, 0);
+
+  switch(csc->csc_type) {
+  case PROP_COLSTORE_STR:
+    if(csc->csc_str[row] == NULL)
+      prop_set_void_exl(p, cs->cs_dstsub);
+    else
+      prop_set_rstring_exl(p, cs->cs_dstsub, csc->csc_str[row]);
+    break;
+  case PROP_COLSTORE_INT:
+    prop_set_int_exl(p, cs->cs_dstsub, csc->csc_int[row]);
+    break;
+  }
+}
+
+
+/**
+ * Create the prop subtree for a row. It's not parented here
+ */
+static prop_t *
+cs_bind(prop_colstore_t *cs, int row)
+{
+  prop_t *p = prop_make(NULL, 0, NULL);
+  int i;
+
+  for(i = 0; i < cs->cs_ncolumns; i++)
+    cs_set_cell(cs, p, i, row);
+  cs->cs_props[row] = p;
+
+  if(cs->cs_bind != NULL) {
+    if(cs->cs_bindq == NULL)
+      cs->cs_bindq = prop_vec_create(16);
+    cs->cs_bindq = prop_vec_append(cs->cs_bindq, p);
+    cs->cs_bindrows = realloc(cs->cs_bindrows,
+                              sizeof(int) * cs->cs_bindq->pv_length);
+    cs->cs_bindrows[cs->cs_bindq->pv_length - 1] = row;
+  }
+  return p;
+}
+
+
+/**
+ * Release prop_mutex and tell the producer about newly bound rows
+ */
+static void
+cs_unlock(prop_colstore_t *cs)
+{
+  prop_vec_t *pv = cs->cs_bindq;
+  int *rows = cs->cs_bindrows;
+  int i;
+
+  cs->cs_bindq = NULL;
+  cs->cs_bindrows = NULL;
+  hts_mutex_unlock(&prop_mutex);
+
+  if(pv == NULL)
+    return;
+
+  for(i = 0; i < pv->pv_length; i++)
+    cs->cs_bind(cs->cs_opaque, rows[i], pv->pv_vec[i]);
+  prop_vec_release(pv);
+  free(rows);
+}
+
+
+/**
+ * Make the props below cs_dst reflect the first cs_limit rows of
+ * the view. Props for rows that stay are moved rather than recreated
+ * so subscribers (and focus in the UI) survive sorting and filtering
+ */
+static void
+cs_materialize(prop_colstore_t *cs)
+{
+  int n = MIN(cs->cs_viewlen, cs->cs_limit);
+  prop_vec_t *pv = NULL;
+  prop_t *cur, *p;
+  int i, r;
+
+  for(i = 0; i < n; i++)
+    cs->cs_rowflags[cs->cs_view[i]] |= CS_ROW_KEEP;
+
+  for(i = 0; i < cs->cs_nbound; i++) {
+    r = cs->cs_bound[i];
+    if(cs->cs_rowflags[r] & CS_ROW_KEEP)
+      continue;
+    prop_destroy0(cs->cs_props[r]);
+    cs->cs_props[r] = NULL;
+  }
+
+  cur = cs->cs_dst->hp_type == PROP_DIR ?
+    TAILQ_FIRST(&cs->cs_dst->hp_childs) : NULL;
+
+  if(n > cs->cs_nbound)
+    cs->cs_bound = realloc(cs->cs_bound, sizeof(int) * n);
+
+  for(i = 0; i < n; i++) {
+    r = cs->cs_view[i];
+    cs->cs_rowflags[r] &= ~CS_ROW_KEEP;
+    cs->cs_bound[i] = r;
+
+    p = cs->cs_props[r];
+    if(p != NULL) {
+      if(p == cur)
+        cur = TAILQ_NEXT(cur, hp_parent_link);
+      else
+        prop_move0(p, cur, cs->cs_dstsub);
+      continue;
+    }
+
+    p = cs_bind(cs, r);
+    if(cur != NULL) {
+      prop_set_parent0(p, cs->cs_dst, cur, cs->cs_dstsub);
+    } else {
+      // Appending at the end, batch them up into a single notification
+      if(pv == NULL)
+        pv = prop_vec_create(n - i);
+      pv = prop_vec_append(pv, p);
+    }
+  }
+  cs->cs_nbound = n;
+
+  if(pv != NULL) {
+    prop_set_parent_vector0(pv, cs->cs_dst, NULL, cs->cs_dstsub);
+    prop_vec_release(pv);
+  }
+
+  int have_more = n < cs->cs_viewlen;
+  if(have_more != cs->cs_have_more) {
+    cs->cs_have_more = have_more;
+    prop_have_more_childs0(cs->cs_dst, have_more);
+  }
+}
+
+
+/**
+ * Rebuild the view from scratch
+ */
+static void
+cs_rebuild_view(prop_colstore_t *cs)
+{
+  int i;
+
+  cs->cs_viewlen = 0;
+  for(i = 0; i < cs->cs_published; i++)
+    if(cs_row_match(cs, i))
+      cs->cs_view[cs->cs_viewlen++] = i;
+
+  cs_sort_range(cs, cs->cs_view, cs->cs_viewlen);
+}
+
+
+/**
+ * Rows in view[0, split) and view[split, viewlen) are both sorted,
+ * merge them
+ */
+static void
+cs_merge_view(prop_colstore_t *cs, int split)
+{
+  int *v = cs->cs_view;
+  int n = cs->cs_viewlen;
+  int *tmp;
+  int a = 0, b = split, o = 0;
+
+  if(split == 0 || split == n || cs_cmp(cs, v[split - 1], v[split]) < 0)
+    return;
+
+  tmp = malloc(sizeof(int) * n);
+  while(a < split && b < n)
+    tmp[o++] = cs_cmp(cs, v[a], v[b]) < 0 ? v[a++] : v[b++];
+  while(a < split)
+    tmp[o++] = v[a++];
+  while(b < n)
+    tmp[o++] = v[b++];
+
+  memcpy(v, tmp, sizeof(int) * n);
+  free(tmp);
+}
+
+
+/**
+ * Publish appended rows and re-evaluate rows that changed.
+ * Returns 0 if there was nothing to do
+ */
+static int
+cs_publish(prop_colstore_t *cs)
+{
+  int i, o, split;
+
+  if(cs->cs_published == cs->cs_rows && cs->cs_ndirty == 0)
+    return 0;
+
+  if(cs->cs_ndirty) {
+    // Pull out changed rows, they are re-added below
+    for(i = 0, o = 0; i < cs->cs_viewlen; i++) {
+      int r = cs->cs_view[i];
+      if(!(cs->cs_rowflags[r] & CS_ROW_DIRTY))
+        cs->cs_view[o++] = r;
+    }
+    cs->cs_viewlen = o;
+  }
+
+  split = cs->cs_viewlen;
+
+  if(cs->cs_ndirty) {
+    for(i = 0; i < cs->cs_published; i++) {
+      if(!(cs->cs_rowflags[i] & CS_ROW_DIRTY))
+        continue;
+      cs->cs_rowflags[i] &= ~CS_ROW_DIRTY;
+      if(cs_row_match(cs, i))
+        cs->cs_view[cs->cs_viewlen++] = i;
+    }
+    cs->cs_ndirty = 0;
+  }
+
+  for(i = cs->cs_published; i < cs->cs_rows; i++)
+    if(cs_row_match(cs, i))
+      cs->cs_view[cs->cs_viewlen++] = i;
+  cs->cs_published = cs->cs_rows;
+
+  cs_sort_range(cs, cs->cs_view + split, cs->cs_viewlen - split);
+  cs_merge_view(cs, split);
+  return 1;
+}
+
+
+/**
+ *
+ */
+static void
+cs_set_filter(void *opaque, const char *str)
+{
+  prop_colstore_t *cs = opaque;
+  int i, o, narrow = 0;
+
+  if(str != NULL && str[0] == 0)
+    str = NULL;
+
+  hts_mutex_lock(&prop_mutex);
+
+  if(cs->cs_filter != NULL && str != NULL) {
+    if(!strcmp(cs->cs_filter, str))
+      goto out;
+    narrow = !!mystrstr(str, cs->cs_filter);
+  } else if(cs->cs_filter == NULL && str == NULL) {
+    goto out;
+  } else {
+    narrow = cs->cs_filter == NULL;
+  }
+
+  mystrset(&cs->cs_filter, str);
+
+  // Changes not yet published would make the view inconsistent
+  cs_publish(cs);
+
+  if(narrow) {
+    // Rows not in the view can't match a longer filter, and order is kept
+    for(i = 0, o = 0; i < cs->cs_viewlen; i++)
+      if(cs_row_match(cs, cs->cs_view[i]))
+        cs->cs_view[o++] = cs->cs_view[i];
+    cs->cs_viewlen = o;
+  } else {
+    cs_rebuild_view(cs);
+  }
+  cs->cs_limit = cs->cs_window;
+  cs_materialize(cs);
+ out:
+  cs_unlock(cs);
+}
+
+
+/**
+ *
+ */
+static void
+cs_dst_cb(void *opaque, prop_event_t event, ...)
+{
+  prop_colstore_t *cs = opaque;
+
+  switch(event) {
+  case PROP_WANT_MORE_CHILDS:
+    hts_mutex_lock(&prop_mutex);
+    if(cs->cs_nbound < cs->cs_viewlen) {
+      cs->cs_limit = cs->cs_nbound + cs->cs_window;
+      cs_materialize(cs);
+    }
+    cs_unlock(cs);
+    break;
+
+  default:
+    break;
+  }
+}
+
+
+/**
+ *
+ */
+prop_colstore_t *
+prop_colstore_create(prop_t *dst, prop_t *filter, int window, int flags,
+                     prop_courier_t *pc, prop_colstore_bind_t *bind,
+                     void *opaque)
+{
+  prop_colstore_t *cs = calloc(1, sizeof(prop_colstore_t));
+
+  cs->cs_window = window > 0 ? window : 100;
+  cs->cs_limit = cs->cs_window;
+  cs->cs_sortcol = -1;
+  cs->cs_groupcol = -1;
+  cs->cs_bind = bind;
+  cs->cs_opaque = opaque;
+  cs->cs_dst = flags & PROP_COLSTORE_TAKE_DST_OWNERSHIP ? dst :
+    prop_xref_addref(dst);
+
+  hts_mutex_lock(&prop_mutex);
+
+  if(filter != NULL)
+    cs->cs_filtersub = prop_subscribe(PROP_SUB_DONTLOCK,
+                                      PROP_TAG_CALLBACK_STRING,
+                                      cs_set_filter, cs,
+                                      PROP_TAG_ROOT, filter,
+                                      PROP_TAG_COURIER, pc,
+                                      NULL);
+
+  cs->cs_dstsub = prop_subscribe(PROP_SUB_DONTLOCK,
+                                 PROP_TAG_CALLBACK, cs_dst_cb, cs,
+                                 PROP_TAG_ROOT, cs->cs_dst,
+                                 PROP_TAG_COURIER, pc,
+                                 NULL);
+
+  hts_mutex_unlock(&prop_mutex);
+  return cs;
+}
+
+
+/**
+ *
+ */
+static void
+cs_clear0(prop_colstore_t *cs)
+{
+  int i, j;
+
+  for(i = 0; i < cs->cs_nbound; i++) {
+    prop_destroy0(cs->cs_props[cs->cs_bound[i]]);
+    cs->cs_props[cs->cs_bound[i]] = NULL;
+  }
+  cs->cs_nbound = 0;
+
+  for(i = 0; i < cs->cs_ncolumns; i++) {
+    cs_column_t *csc = &cs->cs_columns[i];
+    if(csc->csc_type != PROP_COLSTORE_STR)
+      continue;
+    for(j = 0; j < cs->cs_rows; j++)
+      rstr_release(csc->csc_str[j]);
+  }
+
+  cs->cs_rows = 0;
+  cs->cs_published = 0;
+  cs->cs_ndirty = 0;
+  cs->cs_viewlen = 0;
+  cs->cs_limit = cs->cs_window;
+}
+
+
+/**
+ *
+ */
+void
+prop_colstore_destroy(prop_colstore_t *cs)
+{
+  int i;
+
+  hts_mutex_lock(&prop_mutex);
+
+  if(cs->cs_filtersub != NULL)
+    prop_unsubscribe0(cs->cs_filtersub);
+  prop_unsubscribe0(cs->cs_dstsub);
+
+  cs_clear0(cs);
+  prop_destroy0(cs->cs_dst);
+
+  hts_mutex_unlock(&prop_mutex);
+
+  if(cs->cs_bindq != NULL)
+    prop_vec_release(cs->cs_bindq);
+  free(cs->cs_bindrows);
+
+  for(i = 0; i < cs->cs_ncolumns; i++) {
+    cs_column_t *csc = &cs->cs_columns[i];
+    strvec_free(csc->csc_path);
+    if(csc->csc_type == PROP_COLSTORE_STR)
+      free(csc->csc_str);
+    else
+      free(csc->csc_int);
+  }
+  free(cs->cs_columns);
+  free(cs->cs_rowflags);
+  free(cs->cs_props);
+  free(cs->cs_view);
+  free(cs->cs_bound);
+  free(cs->cs_filter);
+  free(cs);
+}
+
+
+/**
+ *
+ */
+void
+prop_colstore_clear(prop_colstore_t *cs)
+{
+  hts_mutex_lock(&prop_mutex);
+  cs_clear0(cs);
+  cs_materialize(cs);
+  cs_unlock(cs);
+}
+
+
+/**
+ * Columns can only be added while the store is empty. Columns without
+ * a path are never materialized, they can still be used for sorting,
+ * grouping and exclusion.
+ * Returns column index
+ */
+int
+prop_colstore_add_column(prop_colstore_t *cs, const char *path,
+                         prop_colstore_type_t type, int flags)
+{
+  cs_column_t *csc;
+  int col;
+
+  assert(!(flags & PROP_COLSTORE_EXCLUDE) || type == PROP_COLSTORE_INT);
+
+  hts_mutex_lock(&prop_mutex);
+  assert(cs->cs_rows == 0);
+
+  col = cs->cs_ncolumns++;
+  cs->cs_columns = realloc(cs->cs_columns,
+                           sizeof(cs_column_t) * cs->cs_ncolumns);
+  csc = &cs->cs_columns[col];
+  csc->csc_path = path != NULL ? strvec_split(path, '.') : NULL;
+  csc->csc_type = type;
+  csc->csc_flags = flags;
+
+  if(type == PROP_COLSTORE_STR)
+    csc->csc_str = calloc(cs->cs_capacity, sizeof(rstr_t *));
+  else
+    csc->csc_int = calloc(cs->cs_capacity, sizeof(int));
+
+  hts_mutex_unlock(&prop_mutex);
+  return col;
+}
+
+
+/**
+ * Add a new row. It will not be visible until prop_colstore_flush()
+ * Returns row index
+ */
+int
+prop_colstore_append(prop_colstore_t *cs)
+{
+  int i, row;
+
+  hts_mutex_lock(&prop_mutex);
+
+  if(cs->cs_rows == cs->cs_capacity) {
+    int n = cs->cs_capacity = MAX(cs->cs_capacity * 2, 64);
+
+    for(i = 0; i < cs->cs_ncolumns; i++) {
+      cs_column_t *csc = &cs->cs_columns[i];
+      if(csc->csc_type == PROP_COLSTORE_STR)
+        csc->csc_str = realloc(csc->csc_str, sizeof(rstr_t *) * n);
+      else
+        csc->csc_int = realloc(csc->csc_int, sizeof(int) * n);
+    }
+    cs->cs_rowflags = realloc(cs->cs_rowflags, n);
+    cs->cs_props    = realloc(cs->cs_props, sizeof(prop_t *) * n);
+    cs->cs_view     = realloc(cs->cs_view, sizeof(int) * n);
+  }
+
+  row = cs->cs_rows++;
+
+  for(i = 0; i < cs->cs_ncolumns; i++) {
+    cs_column_t *csc = &cs->cs_columns[i];
+    if(csc->csc_type == PROP_COLSTORE_STR)
+      csc->csc_str[row] = NULL;
+    else
+      csc->csc_int[row] = 0;
+  }
+  cs->cs_rowflags[row] = 0;
+  cs->cs_props[row] = NULL;
+
+  hts_mutex_unlock(&prop_mutex);
+  return row;
+}
+
+
+/**
+ *
+ */
+static void
+cs_row_changed(prop_colstore_t *cs, int row)
+{
+  if(row < cs->cs_published && !(cs->cs_rowflags[row] & CS_ROW_DIRTY)) {
+    cs->cs_rowflags[row] |= CS_ROW_DIRTY;
+    cs->cs_ndirty++;
+  }
+}
+
+
+/**
+ * Remove a row, it disappears from the view on next flush. The row
+ * index is not reused
+ */
+void
+prop_colstore_remove(prop_colstore_t *cs, int row)
+{
+  int i;
+
+  hts_mutex_lock(&prop_mutex);
+  assert(row < cs->cs_rows);
+
+  cs->cs_rowflags[row] |= CS_ROW_DELETED;
+  for(i = 0; i < cs->cs_ncolumns; i++) {
+    cs_column_t *csc = &cs->cs_columns[i];
+    if(csc->csc_type == PROP_COLSTORE_STR)
+      rstr_set(&csc->csc_str[row], NULL);
+  }
+  cs_row_changed(cs, row);
+  hts_mutex_unlock(&prop_mutex);
+}
+
+
+/**
+ *
+ */
+static void
+cs_cell_changed(prop_colstore_t *cs, int row, int col)
+{
+  const cs_column_t *csc = &cs->cs_columns[col];
+
+  if(row >= cs->cs_published)
+    return;
+
+  if(cs->cs_props[row] != NULL)
+    cs_set_cell(cs, cs->cs_props[row], col, row);
+
+  if(col == cs->cs_sortcol || col == cs->cs_groupcol ||
+     csc->csc_flags & PROP_COLSTORE_EXCLUDE ||
+     (cs->cs_filter != NULL && csc->csc_flags & PROP_COLSTORE_SEARCHABLE))
+    cs_row_changed(cs, row);
+}
+
+
+/**
+ *
+ */
+void
+prop_colstore_set_rstr(prop_colstore_t *cs, int row, int col, rstr_t *str)
+{
+  hts_mutex_lock(&prop_mutex);
+  cs_column_t *csc = &cs->cs_columns[col];
+  assert(csc->csc_type == PROP_COLSTORE_STR);
+  assert(row < cs->cs_rows);
+  if(!(cs->cs_rowflags[row] & CS_ROW_DELETED)) {
+    rstr_set(&csc->csc_str[row], str);
+    cs_cell_changed(cs, row, col);
+  }
+  hts_mutex_unlock(&prop_mutex);
+}
+
+
+/**
+ *
+ */
+void
+prop_colstore_set_str(prop_colstore_t *cs, int row, int col, const char *str)
+{
+  rstr_t *r = rstr_alloc(str);
+  prop_colstore_set_rstr(cs, row, col, r);
+  rstr_release(r);
+}
+
+
+/**
+ *
+ */
+void
+prop_colstore_set_int(prop_colstore_t *cs, int row, int col, int v)
+{
+  hts_mutex_lock(&prop_mutex);
+  cs_column_t *csc = &cs->cs_columns[col];
+  assert(csc->csc_type == PROP_COLSTORE_INT);
+  assert(row < cs->cs_rows);
+  if(csc->csc_int[row] != v) {
+    csc->csc_int[row] = v;
+    cs_cell_changed(cs, row, col);
+  }
+  hts_mutex_unlock(&prop_mutex);
+}
+
+
+/**
+ * Make appended rows visible and reposition rows that changed
+ */
+void
+prop_colstore_flush(prop_colstore_t *cs)
+{
+  hts_mutex_lock(&prop_mutex);
+  if(cs_publish(cs))
+    cs_materialize(cs);
+  cs_unlock(cs);
+}
+
+
+/**
+ *
+ */
+static void
+cs_resort(prop_colstore_t *cs)
+{
+  cs_publish(cs);
+  cs_sort_range(cs, cs->cs_view, cs->cs_viewlen);
+  cs_materialize(cs);
+}
+
+
+/**
+ * Sort on column 'col', or in insertion order if 'col' is -1
+ */
+void
+prop_colstore_sort(prop_colstore_t *cs, int col, int desc)
+{
+  hts_mutex_lock(&prop_mutex);
+
+  assert(col < cs->cs_ncolumns);
+
+  if(col < 0)
+    desc = 0;
+
+  if(cs->cs_sortcol != col || cs->cs_sortdesc != desc) {
+    cs->cs_sortcol = col;
+    cs->cs_sortdesc = desc;
+    cs_resort(cs);
+  }
+  cs_unlock(cs);
+}
+
+
+/**
+ * Order rows on the (int) column 'col' before the sort column, for
+ * example to keep directories first. -1 disables
+ */
+void
+prop_colstore_group(prop_colstore_t *cs, int col)
+{
+  hts_mutex_lock(&prop_mutex);
+
+  assert(col < 0 || cs->cs_columns[col].csc_type == PROP_COLSTORE_INT);
+
+  if(cs->cs_groupcol != col) {
+    cs->cs_groupcol = col;
+    cs_resort(cs);
+  }
+  cs_unlock(cs);
+}
+
+
+/**
+ * Returns a reference to the prop of 'row' if it's materialized
+ */
+prop_t *
+prop_colstore_get_prop(prop_colstore_t *cs, int row)
+{
+  prop_t *p;
+  hts_mutex_lock(&prop_mutex);
+  p = row < cs->cs_rows ? prop_ref_inc(cs->cs_props[row]) : NULL;
+  hts_mutex_unlock(&prop_mutex);
+  return p;
+}
+
+
+/**
+ * Returns the row 'p' (or what it originates from) was materialized
+ * for, -1 if none
+ */
+int
+prop_colstore_find(prop_colstore_t *cs, prop_t *p)
+{
+  int i, row = -1;
+
+  hts_mutex_lock(&prop_mutex);
+  while(p->hp_originator != NULL)
+    p = p->hp_originator;
+
+  for(i = 0; i < cs->cs_nbound; i++) {
+    if(cs->cs_props[cs->cs_bound[i]] == p) {
+      row = cs->cs_bound[i];
+      break;
+    }
+  }
+  hts_mutex_unlock(&prop_mutex);
+  return row;
+}
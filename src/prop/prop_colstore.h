@@ -0,0 +1,96 @@
+/*
+ *  Showtime Mediacenter
+ *  Copyright (C) 2007-2013 Lonelycoder AB
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  This program is also available under a commercial proprietary license.
+ *  For more information, contact andreas@lonelycoder.com
+ */
+#pragma once
+
+#include "prop.h"
+
+/**
+ * Column oriented item store
+ *
+ * Keeps large listings (tens of thousands of entries) as typed arrays,
+ * one per field, instead of a full prop subtree per entry. Filtering
+ * and sorting are done directly on the columns and only the first rows
+ * of the resulting view are materialized as props below 'dst'. More
+ * rows are materialized when the UI asks for more children
+ * (PROP_WANT_MORE_CHILDS) so the cost of a listing is proportional to
+ * what is actually being displayed.
+ *
+ * Filter changes and requests for more rows are delivered via 'pc'.
+ * 'bind' is called for every row that gets a prop, after it has been
+ * added below 'dst' and without prop_mutex held, so it may use the
+ * regular prop API to decorate the row further. It is called from the
+ * courier or from within the functions below, so the producer should
+ * serialize its calls into the store with the courier (for example by
+ * giving the courier an entry mutex)
+ *
+ * Rows below 'dst' are owned by the store and should not be modified
+ * by anyone else except from 'bind'
+ */
+
+typedef struct prop_colstore prop_colstore_t;
+
+typedef enum {
+  PROP_COLSTORE_STR,
+  PROP_COLSTORE_INT,
+} prop_colstore_type_t;
+
+typedef void (prop_colstore_bind_t)(void *opaque, int row, prop_t *p);
+
+#define PROP_COLSTORE_TAKE_DST_OWNERSHIP 0x1
+
+// Column flags
+#define PROP_COLSTORE_SEARCHABLE 0x1  // Filter matches on this
+#define PROP_COLSTORE_EXCLUDE    0x2  // Row is hidden if (int) value != 0
+
+prop_colstore_t *prop_colstore_create(prop_t *dst, prop_t *filter,
+                                      int window, int flags,
+                                      prop_courier_t *pc,
+                                      prop_colstore_bind_t *bind,
+                                      void *opaque);
+
+void prop_colstore_destroy(prop_colstore_t *cs);
+
+int prop_colstore_add_column(prop_colstore_t *cs, const char *path,
+                             prop_colstore_type_t type, int flags);
+
+int prop_colstore_append(prop_colstore_t *cs);
+
+void prop_colstore_remove(prop_colstore_t *cs, int row);
+
+void prop_colstore_set_rstr(prop_colstore_t *cs, int row, int col,
+                            rstr_t *str);
+
+void prop_colstore_set_str(prop_colstore_t *cs, int row, int col,
+                           const char *str);
+
+void prop_colstore_set_int(prop_colstore_t *cs, int row, int col, int v);
+
+void prop_colstore_flush(prop_colstore_t *cs);
+
+void prop_colstore_sort(prop_colstore_t *cs, int col, int desc);
+
+void prop_colstore_group(prop_colstore_t *cs, int col);
+
+void prop_colstore_clear(prop_colstore_t *cs);
+
+prop_t *prop_colstore_get_prop(prop_colstore_t *cs, int row);
+
+int prop_colstore_find(prop_colstore_t *cs, prop_t *p);
@@ -33,6 +33,7 @@
 #include "prop_i.h"
 #include "misc/str.h"
 #include "event.h"
+#include "misc/profiler.h"
 #ifdef PROP_DEBUG
 int prop_trace;
 #endif
@@ -810,6 +811,7 @@ void
 prop_notify_dispatch(struct prop_notify_queue *q, const char *trace_name)
 {
   prop_notify_t *n, *next;
+  int64_t t = prof_begin();
 
   if(trace_name) {
     TAILQ_FOREACH(n, q, hpn_link) {
@@ -835,6 +837,8 @@ prop_notify_dispatch(struct prop_notify_queue *q, const char *trace_name)
       prop_dispatch_one(n);
   }
 
+  prof_end(t, "prop", "dispatch");
+
   hts_mutex_lock(&prop_mutex);
 
   for(n = TAILQ_FIRST(q); n != NULL; n = next) {
@@ -1712,19 +1716,18 @@ prop_set_parent_ex(prop_t *p, prop_t *parent, prop_t *before,
 /**
  *
  */
-void
-prop_set_parent_vector(prop_vec_t *pv, prop_t *parent, prop_t *before,
-		       prop_sub_t *skipme)
+int
+prop_set_parent_vector0(prop_vec_t *pv, prop_t *parent, prop_t *before,
+                        prop_sub_t *skipme)
 {
   int i;
 
-  hts_mutex_lock(&prop_mutex);
-
   if(parent == NULL || parent->hp_type == PROP_ZOMBIE) {
 
-  for(i = 0; i < pv->pv_length; i++)
-    prop_destroy0(pv->pv_vec[i]);
-
+    for(i = 0; i < pv->pv_length; i++) {
+      prop_destroy0(pv->pv_vec[i]);
+    }
+    return -1;
   } else {
 
     prop_t *p;
@@ -1746,7 +1749,23 @@ prop_set_parent_vector(prop_vec_t *pv, prop_t *parent, prop_t *before,
     prop_notify_childv(pv, parent, before ? PROP_ADD_CHILD_VECTOR_BEFORE : 
 		       PROP_ADD_CHILD_VECTOR, skipme, before);
   }
+  return 0;
+}
+
+
+/**
+ * Returns -1 if parent is gone, the props in the vector are
+ * destroyed in that case
+ */
+int
+prop_set_parent_vector(prop_vec_t *pv, prop_t *parent, prop_t *before,
+		       prop_sub_t *skipme)
+{
+  int r;
+  hts_mutex_lock(&prop_mutex);
+  r = prop_set_parent_vector0(pv, parent, before, skipme);
   hts_mutex_unlock(&prop_mutex);
+  return r;
 }
 
 
@@ -2973,7 +2992,7 @@ prop_set_string_ex(prop_t *p, prop_sub_t *skipme, const char *str,
 /**
  *
  */
-static void
+void
 prop_set_rstring_exl(prop_t *p, prop_sub_t *skipme, rstr_t *rstr)
 {
   if(p->hp_type == PROP_ZOMBIE)
@@ -3297,7 +3316,7 @@ prop_set_float_clipping_range(prop_t *p, float min, float max)
 /**
  *
  */
-static void
+void
 prop_set_int_exl(prop_t *p, prop_sub_t *skipme, int v)
 {
   if(p->hp_type == PROP_ZOMBIE)
@@ -3480,7 +3499,7 @@ prop_set_int_clipping_range(prop_t *p, int min, int max)
 /**
  *
  */
-static void
+void
 prop_set_void_exl(prop_t *p, prop_sub_t *skipme)
 {
   if(p->hp_type == PROP_ZOMBIE)
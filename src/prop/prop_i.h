@@ -430,6 +430,9 @@ void prop_link0(prop_t *src, prop_t *dst, prop_sub_t *skipme, int hard,
 int prop_set_parent0(prop_t *p, prop_t *parent, prop_t *before, 
 		     prop_sub_t *skipme);
 
+int prop_set_parent_vector0(prop_vec_t *pv, prop_t *parent, prop_t *before,
+                            prop_sub_t *skipme);
+
 void prop_unparent0(prop_t *p, prop_sub_t *skipme);
 
 int prop_destroy0(prop_t *p);
@@ -452,6 +455,12 @@ void prop_want_more_childs0(prop_sub_t *s);
 void prop_set_string_exl(prop_t *p, prop_sub_t *skipme, const char *str,
 			 prop_str_type_t type);
 
+void prop_set_rstring_exl(prop_t *p, prop_sub_t *skipme, rstr_t *rstr);
+
+void prop_set_int_exl(prop_t *p, prop_sub_t *skipme, int v);
+
+void prop_set_void_exl(prop_t *p, prop_sub_t *skipme);
+
 void prop_sub_ref_dec_locked(prop_sub_t *s);
 
 void prop_dispatch_one(prop_notify_t *n);
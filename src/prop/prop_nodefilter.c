@@ -35,9 +35,25 @@
 #include "misc/pixmap.h"
 #include "misc/str.h"
 #include "misc/redblack.h"
+#include "htsmsg/htsbuf.h"
 
 #define MAX_SORT_KEYS 4
 
+/**
+ * Each node caches the casefolded bigrams of its searchable strings in
+ * a small bitmap. A node can only match a filter if all bits of the
+ * filter's bitmap are set in the node's bitmap, which lets us reject
+ * most nodes without looking at the text at all.
+ */
+#define NF_GRAM_WORDS 4
+#define NF_GRAM_BITS  (NF_GRAM_WORDS * 64)
+
+/**
+ * Separator between strings in the cached node text. Can never be part
+ * of a filter so a match never spans two fields
+ */
+#define NF_TEXT_SEPARATOR '\x1f'
+
 TAILQ_HEAD(nfnode_queue, nfnode);
 LIST_HEAD(nfn_pred_list, nfn_pred);
 LIST_HEAD(prop_nf_pred_list, prop_nf_pred);
@@ -82,7 +98,12 @@ typedef struct nfnode {
   struct nfn_pred_list preds;
 
   struct prop_nf *nf;
+
+  rstr_t *text;   // All searchable strings in the node, NULL if no filter
+  uint64_t grams[NF_GRAM_WORDS];
+
   char inserted:1;
+  char match:1;   // Result of filter check on 'text'
   char sortkey_type[MAX_SORT_KEYS];
 
 #define SORTKEY_NONE  0
@@ -148,6 +169,7 @@ typedef struct prop_nf {
   struct nfnode_tree out_tree;
 
   char *filter;
+  uint64_t filter_grams[NF_GRAM_WORDS];
 
   char *sortkey[MAX_SORT_KEYS];
   sortmap_t *sortmap[MAX_SORT_KEYS];
@@ -240,21 +262,33 @@ eval_preds(nfnode_t *nfn)
 
 
 /**
- *
+ * Add all bigrams in 'str' to the bitmap
  */
-static int
-filterstr(const char *s, const char *q)
+static void
+nf_grams_add(uint64_t *grams, const char *str)
 {
-  return !!mystrstr(s, q);
+  int prev = unicode_casefold(utf8_get(&str));
+  int c;
+
+  if(prev == 0)
+    return;
+
+  while((c = unicode_casefold(utf8_get(&str))) != 0) {
+    unsigned int bit = (prev * 31 + c) % NF_GRAM_BITS;
+    grams[bit / 64] |= 1ULL << (bit & 63);
+    prev = c;
+  }
 }
 
 
 /**
- *
+ * Collect all strings in a node into one buffer, this is what the
+ * filter matches against
  */
-static int
-nf_filtercheck(prop_t *p, const char *q)
+static void
+nf_collect_text(prop_t *p, htsbuf_queue_t *hq)
 {
+  const char *str;
   prop_t *c;
 
   while(p->hp_originator != NULL)
@@ -262,23 +296,86 @@ nf_filtercheck(prop_t *p, const char *q)
 
   switch(p->hp_type) {
   case PROP_RSTRING:
-    return filterstr(rstr_get(p->hp_rstring), q);
+    str = rstr_get(p->hp_rstring);
+    break;
 
   case PROP_CSTRING:
-    return filterstr(p->hp_cstring, q);
+    str = p->hp_cstring;
+    break;
 
   case PROP_LINK:
-    return filterstr(rstr_get(p->hp_link_rtitle), q);
+    str = rstr_get(p->hp_link_rtitle);
+    break;
 
   case PROP_DIR:
     TAILQ_FOREACH(c, &p->hp_childs, hp_parent_link)
-      if(nf_filtercheck(c, q))
-	return 1;
-    break;
+      nf_collect_text(c, hq);
+    return;
+
   default:
-    break;
+    return;
   }
-  return 0;
+
+  if(str == NULL || *str == 0)
+    return;
+
+  htsbuf_append(hq, str, strlen(str));
+  htsbuf_append(hq, (const char []){NF_TEXT_SEPARATOR}, 1);
+}
+
+
+/**
+ *
+ */
+static void
+nf_clear_text(nfnode_t *nfn)
+{
+  rstr_release(nfn->text);
+  nfn->text = NULL;
+  memset(nfn->grams, 0, sizeof(nfn->grams));
+}
+
+
+/**
+ * Rebuild the cached text and bigram bitmap for a node.
+ * Only done when the node itself changes, not when the filter does
+ */
+static void
+nf_update_text(nfnode_t *nfn)
+{
+  htsbuf_queue_t hq;
+
+  nf_clear_text(nfn);
+
+  htsbuf_queue_init(&hq, 0);
+  nf_collect_text(nfn->in, &hq);
+  if(hq.hq_size == 0)
+    return;
+
+  nfn->text = htsbuf_to_rstr(&hq, NULL);
+  nf_grams_add(nfn->grams, rstr_get(nfn->text));
+}
+
+
+/**
+ * Check the cached node text against the current filter
+ */
+static int
+nf_filtercheck(const prop_nf_t *nf, const nfnode_t *nfn)
+{
+  int i;
+
+  if(nf->filter == NULL)
+    return 1;
+
+  if(nfn->text == NULL)
+    return 0;
+
+  for(i = 0; i < NF_GRAM_WORDS; i++)
+    if(nf->filter_grams[i] & ~nfn->grams[i])
+      return 0;
+
+  return !!mystrstr(rstr_get(nfn->text), nf->filter);
 }
 
 
@@ -403,7 +500,7 @@ nf_update_egress(prop_nf_t *nf, nfnode_t *nfn)
       en = 0;
 
   // Check filtering
-  if(en && nf->filter != NULL && !nf_filtercheck(nfn->in, nf->filter))
+  if(en && nf->filter != NULL && !nfn->match)
     en = 0;
 
   if(eval_preds(nfn))
@@ -445,6 +542,10 @@ nf_multi_filter(void *opaque, prop_event_t event, ...)
   nfnode_t *nfn = opaque;
   prop_nf_t *nf = nfn->nf;
 
+  if(nf->filter != NULL) {
+    nf_update_text(nfn);
+    nfn->match = nf_filtercheck(nf, nfn);
+  }
   nf_update_egress(nf, nfn);
 }
 
@@ -470,6 +571,7 @@ nf_update_multisub(prop_nf_t *nf, nfnode_t *nfn)
 
     prop_unsubscribe0(nfn->multisub);
     nfn->multisub = NULL;
+    nf_clear_text(nfn);
   }
 }
 
@@ -810,7 +912,9 @@ nf_del_node(prop_nf_t *nf, nfnode_t *nfn)
 
   while((nfnp = LIST_FIRST(&nfn->preds)) != NULL)
     nfnp_destroy(nfnp);
-  
+
+  rstr_release(nfn->text);
+
   for(i = 0; i < MAX_SORT_KEYS; i++)
     if(nfn->sortkey_type[i] == SORTKEY_RSTR)
       rstr_release(nfn->sk[i].rstr);
@@ -1110,12 +1214,30 @@ nf_set_filter(void *opaque, const char *str)
 {
   prop_nf_t *nf = opaque;
   nfnode_t *nfn;
+  int narrow = 0, widen = 0;
 
   if(str != NULL && str[0] == 0)
     str = NULL;
 
+  if(nf->filter != NULL && str != NULL) {
+    if(!strcmp(nf->filter, str))
+      return;
+
+    /*
+     * If the new filter contains the old one, nodes not matching now
+     * can't match after the change either (typing more characters).
+     * The reverse holds when characters are erased.
+     */
+    narrow = !!mystrstr(str, nf->filter);
+    widen = !narrow && mystrstr(nf->filter, str);
+  }
+
   mystrset(&nf->filter, str);
 
+  memset(nf->filter_grams, 0, sizeof(nf->filter_grams));
+  if(nf->filter != NULL)
+    nf_grams_add(nf->filter_grams, nf->filter);
+
   if(nf->filter == NULL && nf->pending_have_more) {
     prop_have_more_childs0(nf->dst,
                            nf->pending_have_more == PROP_HAVE_MORE_CHILDS_YES);
@@ -1124,7 +1246,18 @@ nf_set_filter(void *opaque, const char *str)
 
 
   TAILQ_FOREACH(nfn, &nf->in, in_link) {
+    if(nfn->multisub == NULL) {
+      // Filter enabled, subscribing will build text and evaluate node
+      nf_update_multisub(nf, nfn);
+      continue;
+    }
+
     nf_update_multisub(nf, nfn);
+
+    if((narrow && !nfn->match) || (widen && nfn->match))
+      continue;
+
+    nfn->match = nf_filtercheck(nf, nfn);
     nf_update_egress(nf, nfn);
   }
 }
@@ -233,6 +233,8 @@ typedef struct gconf {
   int disable_upnp;
   int disable_sd;
 
+  int audio_null;  // AUDIO_NULL_* from audio_ext.h, 0 = Use real output
+
 
   int enable_bin_replace;
   int enable_omnigrade;
@@ -278,6 +280,7 @@ typedef struct gconf {
 
   int fa_allow_delete;
   int fa_kvstore_as_xattr;
+  int fa_cache_size;  // Persistent network cache size in MB, 0 = off
   int show_filename_extensions;
   int ignore_the_prefix;
 
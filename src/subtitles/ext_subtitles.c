@@ -37,6 +37,9 @@
 #include "vobsub.h"
 #include "text/text.h"
 #include "subtitles.h"
+#include "metadata/metadata.h"
+
+extern char font_subs[];
 
 /**
  *
@@ -667,10 +670,338 @@ es_sort(ext_subtitles_t *es, int trim_stop)
       vec[i]->vo_stop = MIN(vec[i]->vo_stop, vec[i + 1]->vo_start);
   }
 
+  es->es_max_duration = 0;
   TAILQ_INIT(&es->es_entries);
-  for(i = 0; i < cnt; i++)
+  for(i = 0; i < cnt; i++) {
     TAILQ_INSERT_TAIL(&es->es_entries, vec[i], vo_link);
-  free(vec);
+    es->es_max_duration = MAX(es->es_max_duration,
+                              vec[i]->vo_stop - vec[i]->vo_start);
+  }
+
+  // Keep the sorted vector, subtitles_pick() uses it to find its way
+  free(es->es_index);
+  es->es_index = vec;
+  es->es_num = cnt;
+}
+
+
+/**
+ * Find first entry that may still be visible at 'pts'
+ */
+static video_overlay_t *
+es_find(ext_subtitles_t *es, int64_t pts)
+{
+  const int64_t t = pts - es->es_max_duration;
+  int lo = 0, hi = es->es_num;
+
+  if(es->es_index == NULL)
+    return TAILQ_FIRST(&es->es_entries);
+
+  while(lo < hi) {
+    int mid = (lo + hi) / 2;
+    if(es->es_index[mid]->vo_start < t)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < es->es_num ? es->es_index[lo] : NULL;
+}
+
+
+/**
+ * Parsed subtitles are stored in the metadb keyed on URL and mtime
+ * so we don't need to load and parse them again.
+ *
+ * Layout is a es_cache_hdr_t followed by the names of all font families
+ * referred to (each prefixed by its length as an uint16_t) and then one
+ * es_cache_rec_t per entry followed by its text. Font family ids are
+ * only valid within this process so they are stored as index into the
+ * family table
+ */
+#define ES_CACHE_MAGIC   0x53545343
+#define ES_CACHE_VERSION 1
+
+typedef struct es_cache_hdr {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t count;
+  uint32_t families;
+} es_cache_hdr_t;
+
+typedef struct es_cache_rec {
+  int64_t start;
+  int64_t stop;
+  int32_t fadein;
+  int32_t fadeout;
+  int32_t text_length;
+  int16_t x;
+  int16_t y;
+  int16_t padding_left;
+  int16_t padding_top;
+  int16_t padding_right;
+  int16_t padding_bottom;
+  int16_t canvas_width;
+  int16_t canvas_height;
+  uint8_t type;
+  uint8_t stop_estimated;
+  uint8_t alignment;
+  uint8_t layer;
+} es_cache_rec_t;
+
+#define ES_CACHE_MAX_FAMILIES 64
+
+
+/**
+ * Changing any of these changes what we produce when parsing, so cached
+ * entries are only valid for the same settings. The charset is used for
+ * files that are not UTF-8 and the frame rate times frame based formats
+ * (MicroDVD, MPL2)
+ */
+static uint32_t
+es_cache_stamp(const AVRational *fr)
+{
+  const charset_t *cs = i18n_get_default_charset();
+  char tmp[512];
+  snprintf(tmp, sizeof(tmp), "%d:%d:%x:%x:%d:%x:%d:%s:%s:%d/%d",
+           ES_CACHE_VERSION,
+           subtitle_settings.style_override,
+           subtitle_settings.color,
+           subtitle_settings.shadow_color,
+           subtitle_settings.shadow_displacement,
+           subtitle_settings.outline_color,
+           subtitle_settings.outline_size,
+           font_subs,
+           cs != NULL ? cs->id : "auto",
+           fr != NULL ? fr->num : 0,
+           fr != NULL ? fr->den : 0);
+  return mystrhash(tmp);
+}
+
+
+/**
+ *
+ */
+static void
+es_cache_store(ext_subtitles_t *es, const char *url, time_t mtime,
+               uint32_t stamp)
+{
+  int families[ES_CACHE_MAX_FAMILIES];
+  rstr_t *names[ES_CACHE_MAX_FAMILIES];
+  int num_families = 0;
+  video_overlay_t *vo;
+  size_t size = sizeof(es_cache_hdr_t);
+  int count = 0, i, j;
+
+  TAILQ_FOREACH(vo, &es->es_entries, vo_link) {
+    if(vo->vo_pixmap != NULL)
+      goto bad;
+
+    for(i = 0; i < vo->vo_text_length; i++) {
+      const uint32_t c = vo->vo_text[i];
+      if((c & 0xff000000) != TR_CODE_FONT_FAMILY)
+        continue;
+      const int id = c & 0xffffff;
+      for(j = 0; j < num_families; j++)
+        if(families[j] == id)
+          break;
+      if(j < num_families)
+        continue;
+      if(num_families == ES_CACHE_MAX_FAMILIES)
+        goto bad;
+#if ENABLE_LIBFREETYPE
+      names[num_families] = freetype_family_name(id);
+#else
+      names[num_families] = NULL;
+#endif
+      families[num_families++] = id;
+      if(names[num_families - 1] == NULL)
+        goto bad;
+      size += sizeof(uint16_t) + strlen(rstr_get(names[num_families - 1]));
+    }
+    size += sizeof(es_cache_rec_t) + vo->vo_text_length * sizeof(uint32_t);
+    count++;
+  }
+
+  uint8_t *data = malloc(size);
+  uint8_t *ptr = data;
+
+  es_cache_hdr_t hdr;
+  hdr.magic    = ES_CACHE_MAGIC;
+  hdr.version  = ES_CACHE_VERSION;
+  hdr.count    = count;
+  hdr.families = num_families;
+  memcpy(ptr, &hdr, sizeof(hdr));
+  ptr += sizeof(hdr);
+
+  for(i = 0; i < num_families; i++) {
+    const char *name = rstr_get(names[i]);
+    uint16_t len = strlen(name);
+    memcpy(ptr, &len, sizeof(len));
+    ptr += sizeof(len);
+    memcpy(ptr, name, len);
+    ptr += len;
+  }
+
+  TAILQ_FOREACH(vo, &es->es_entries, vo_link) {
+    es_cache_rec_t rec = {0};
+    rec.start          = vo->vo_start;
+    rec.stop           = vo->vo_stop;
+    rec.fadein         = vo->vo_fadein;
+    rec.fadeout        = vo->vo_fadeout;
+    rec.text_length    = vo->vo_text_length;
+    rec.x              = vo->vo_x;
+    rec.y              = vo->vo_y;
+    rec.padding_left   = vo->vo_padding_left;
+    rec.padding_top    = vo->vo_padding_top;
+    rec.padding_right  = vo->vo_padding_right;
+    rec.padding_bottom = vo->vo_padding_bottom;
+    rec.canvas_width   = vo->vo_canvas_width;
+    rec.canvas_height  = vo->vo_canvas_height;
+    rec.type           = vo->vo_type;
+    rec.stop_estimated = vo->vo_stop_estimated;
+    rec.alignment      = vo->vo_alignment;
+    rec.layer          = vo->vo_layer;
+    memcpy(ptr, &rec, sizeof(rec));
+    ptr += sizeof(rec);
+
+    for(i = 0; i < vo->vo_text_length; i++) {
+      uint32_t c = vo->vo_text[i];
+      if((c & 0xff000000) == TR_CODE_FONT_FAMILY) {
+        for(j = 0; j < num_families; j++)
+          if(families[j] == (c & 0xffffff))
+            break;
+        c = TR_CODE_FONT_FAMILY | j;
+      }
+      memcpy(ptr, &c, sizeof(c));
+      ptr += sizeof(c);
+    }
+  }
+
+  assert(ptr == data + size);
+
+  void *db = metadb_get();
+  if(db != NULL) {
+    metadb_put_subtitles(db, url, mtime, stamp, data, size);
+    metadb_close(db);
+  }
+  free(data);
+
+ bad:
+  for(i = 0; i < num_families; i++)
+    rstr_release(names[i]);
+}
+
+
+/**
+ *
+ */
+static ext_subtitles_t *
+es_cache_load(const char *url, time_t mtime, uint32_t stamp)
+{
+  void *db = metadb_get();
+  if(db == NULL)
+    return NULL;
+  buf_t *b = metadb_get_subtitles(db, url, mtime, stamp);
+  metadb_close(db);
+  if(b == NULL)
+    return NULL;
+
+  const uint8_t *ptr = buf_c8(b);
+  const uint8_t *end = ptr + buf_len(b);
+  int families[ES_CACHE_MAX_FAMILIES];
+  es_cache_hdr_t hdr;
+  int i, j;
+
+  if(end - ptr < sizeof(hdr))
+    goto bad;
+  memcpy(&hdr, ptr, sizeof(hdr));
+  ptr += sizeof(hdr);
+
+  if(hdr.magic != ES_CACHE_MAGIC || hdr.version != ES_CACHE_VERSION ||
+     hdr.families > ES_CACHE_MAX_FAMILIES)
+    goto bad;
+
+  for(i = 0; i < hdr.families; i++) {
+    uint16_t len;
+    char name[512];
+    if(end - ptr < sizeof(len))
+      goto bad;
+    memcpy(&len, ptr, sizeof(len));
+    ptr += sizeof(len);
+    if(end - ptr < len || len >= sizeof(name))
+      goto bad;
+    memcpy(name, ptr, len);
+    name[len] = 0;
+    ptr += len;
+#if ENABLE_LIBFREETYPE
+    families[i] = freetype_family_id(name, 0);
+#else
+    families[i] = 0;
+#endif
+  }
+
+  ext_subtitles_t *es = calloc(1, sizeof(ext_subtitles_t));
+  TAILQ_INIT(&es->es_entries);
+
+  for(i = 0; i < hdr.count; i++) {
+    es_cache_rec_t rec;
+    if(end - ptr < sizeof(rec))
+      goto bad_es;
+    memcpy(&rec, ptr, sizeof(rec));
+    ptr += sizeof(rec);
+
+    if(rec.text_length < 0 ||
+       (end - ptr) / sizeof(uint32_t) < rec.text_length)
+      goto bad_es;
+
+    video_overlay_t *vo = calloc(1, sizeof(video_overlay_t));
+    vo->vo_start           = rec.start;
+    vo->vo_stop            = rec.stop;
+    vo->vo_fadein          = rec.fadein;
+    vo->vo_fadeout         = rec.fadeout;
+    vo->vo_x               = rec.x;
+    vo->vo_y               = rec.y;
+    vo->vo_padding_left    = rec.padding_left;
+    vo->vo_padding_top     = rec.padding_top;
+    vo->vo_padding_right   = rec.padding_right;
+    vo->vo_padding_bottom  = rec.padding_bottom;
+    vo->vo_canvas_width    = rec.canvas_width;
+    vo->vo_canvas_height   = rec.canvas_height;
+    vo->vo_type            = rec.type;
+    vo->vo_stop_estimated  = rec.stop_estimated;
+    vo->vo_alignment       = rec.alignment;
+    vo->vo_layer           = rec.layer;
+
+    if(rec.text_length > 0) {
+      vo->vo_text = malloc(rec.text_length * sizeof(uint32_t));
+      vo->vo_text_length = rec.text_length;
+      memcpy(vo->vo_text, ptr, rec.text_length * sizeof(uint32_t));
+      ptr += rec.text_length * sizeof(uint32_t);
+
+      for(j = 0; j < rec.text_length; j++) {
+        const uint32_t c = vo->vo_text[j];
+        if((c & 0xff000000) != TR_CODE_FONT_FAMILY)
+          continue;
+        if((c & 0xffffff) >= hdr.families) {
+          video_overlay_destroy(vo);
+          goto bad_es;
+        }
+        vo->vo_text[j] = TR_CODE_FONT_FAMILY | families[c & 0xffffff];
+      }
+    }
+    TAILQ_INSERT_TAIL(&es->es_entries, vo, vo_link);
+  }
+
+  buf_release(b);
+  es_sort(es, 0);
+  return es;
+
+ bad_es:
+  subtitles_destroy(es);
+ bad:
+  TRACE(TRACE_ERROR, "Subtitles", "Cached copy of %s is corrupt", url);
+  buf_release(b);
+  return NULL;
 }
 
 
@@ -759,59 +1090,54 @@ subtitles_destroy(ext_subtitles_t *es)
   }
   if(es->es_dtor)
     es->es_dtor(es);
+  free(es->es_index);
   free(es);
 }
 
 
 /**
- *
+ * Overlay queue has been flushed (seek, etc)
  */
-static void
-vo_deliver(ext_subtitles_t *es, video_overlay_t *vo, media_pipe_t *mp,
-	   int64_t pts)
+void
+subtitles_flush(ext_subtitles_t *es)
 {
-  int64_t s = vo->vo_start;
-  do {
-    es->es_cur = vo;
-
-    video_overlay_enqueue(mp, video_overlay_dup(vo));
-    vo = TAILQ_NEXT(vo, vo_link);
-  } while(vo != NULL && vo->vo_start == s && vo->vo_stop > pts);
+  es->es_ahead = NULL;
 }
 
 
 /**
- *
+ * Entries are handed to the overlay queue SUBTITLES_LOOKAHEAD before
+ * they are due so the UI can render them in advance. es_ahead is the
+ * last entry handed over
  */
 void
 subtitles_pick(ext_subtitles_t *es, int64_t pts, media_pipe_t *mp)
 {
-  video_overlay_t *vo = es->es_cur;
+  video_overlay_t *vo;
 
   if(es->es_picker)
     return es->es_picker(es, pts);
 
-  if(vo != NULL) {
-    vo = TAILQ_NEXT(vo, vo_link);
-    if(vo != NULL && vo->vo_start <= pts && vo->vo_stop > pts) {
-      vo_deliver(es, vo, mp, pts);
-      return;
-    }
+  if(es->es_ahead != NULL && pts < es->es_last_pts - 1000000) {
+    // Moved backwards (subtitle delay changed), start over
+    hts_mutex_lock(&mp->mp_overlay_mutex);
+    video_overlay_flush_locked(mp, 1);
+    hts_mutex_unlock(&mp->mp_overlay_mutex);
+    es->es_ahead = NULL;
   }
+  es->es_last_pts = pts;
 
-  vo = es->es_cur;
+  if(es->es_ahead != NULL)
+    vo = TAILQ_NEXT(es->es_ahead, vo_link);
+  else
+    vo = es_find(es, pts);
 
-  if(vo != NULL && vo->vo_start <= pts && vo->vo_stop > pts) {
-    return; // Already sent
+  for(; vo != NULL && vo->vo_start < pts + SUBTITLES_LOOKAHEAD;
+      vo = TAILQ_NEXT(vo, vo_link)) {
+    if(vo->vo_stop > pts)
+      video_overlay_enqueue(mp, video_overlay_dup(vo));
+    es->es_ahead = vo;
   }
-
-  TAILQ_FOREACH(vo, &es->es_entries, vo_link) {
-    if(vo->vo_start <= pts && vo->vo_stop > pts) {
-      vo_deliver(es, vo, mp, pts);
-      return;
-    }
-  }
-  es->es_cur = NULL;
 }
 
 
@@ -864,6 +1190,21 @@ subtitles_load(media_pipe_t *mp, const char *url, AVRational *fr)
 
   TRACE(TRACE_DEBUG, "Subtitles", "Trying to load %s", url);
 
+  // Files inside of in-memory archives are cached via the archive itself
+  fa_stat_t st;
+  uint32_t stamp = 0;
+  const int cacheable = strstr(url, "memfile://") == NULL &&
+    !fa_stat(url, &st, errbuf, sizeof(errbuf)) && st.fs_mtime != 0;
+
+  if(cacheable) {
+    stamp = es_cache_stamp(fr);
+    sub = es_cache_load(url, st.fs_mtime, stamp);
+    if(sub != NULL) {
+      TRACE(TRACE_DEBUG, "Subtitles", "Loaded %s from cache", url);
+      return sub;
+    }
+  }
+
   buf_t *b = fa_load(url,
                      FA_LOAD_ERRBUF(errbuf, sizeof(errbuf)),
                      NULL);
@@ -876,7 +1217,10 @@ subtitles_load(media_pipe_t *mp, const char *url, AVRational *fr)
 
   if(b->b_size > 4 && !memcmp(buf_cstr(b), "PK\003\004", 4)) {
     TRACE(TRACE_DEBUG, "Subtitles", "%s is a ZIP archive, scanning...", url);
-    return subtitles_from_zipfile(mp, b, fr);
+    sub = subtitles_from_zipfile(mp, b, fr);
+    if(sub != NULL && cacheable && sub->es_picker == NULL)
+      es_cache_store(sub, url, st.fs_mtime, stamp);
+    return sub;
   }
   
   if(gz_check(b)) {
@@ -901,6 +1245,8 @@ subtitles_load(media_pipe_t *mp, const char *url, AVRational *fr)
     hexdump("Subtitles", header, MIN(b->b_size, 64));
   } else {
     TRACE(TRACE_DEBUG, "Subtitles", "Loaded %s OK", url);
+    if(cacheable)
+      es_cache_store(sub, url, st.fs_mtime, stamp);
   }
   return sub;
 }
@@ -908,25 +1254,36 @@ subtitles_load(media_pipe_t *mp, const char *url, AVRational *fr)
 
 
 /**
- *
+ * All the formats we need to probe for can be identified by their
+ * first line so only read the head of the file
  */
 const char *
 subtitles_probe(const char *url)
 {
   const char *ret;
-  buf_t *b = fa_load(url, NULL);
+  char buf[1024];
+  int len;
 
-  if(is_txt(buf_cstr(b), buf_len(b)))
+  fa_handle_t *fh = fa_open(url, NULL, 0);
+  if(fh == NULL)
+    return NULL;
+
+  len = fa_read(fh, buf, sizeof(buf) - 1);
+  fa_close(fh);
+  if(len <= 0)
+    return NULL;
+  buf[len] = 0;
+
+  if(is_txt(buf, len))
     ret = "TXT";
-  else if(is_mpl(buf_cstr(b), buf_len(b)))
+  else if(is_mpl(buf, len))
     ret = "MPL";
-  else if(is_sub(buf_cstr(b), buf_len(b)))
+  else if(is_sub(buf, len))
     ret = "SUB";
-  else if(is_tmp(buf_cstr(b), buf_len(b)))
+  else if(is_tmp(buf, len))
     ret = "TMP";
   else
     ret = NULL;
 
-  buf_release(b);
   return ret;
 }
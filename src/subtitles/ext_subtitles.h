@@ -27,9 +27,16 @@
 
 struct video_decoder;
 
+#define SUBTITLES_LOOKAHEAD 5000000
+
 typedef struct ext_subtitles {
   struct video_overlay_queue es_entries;
-  video_overlay_t *es_cur;
+  video_overlay_t *es_ahead;  // Last entry handed to overlay queue
+  int64_t es_last_pts;
+
+  video_overlay_t **es_index;  // es_entries sorted on start time
+  int es_num;
+  int64_t es_max_duration;     // Longest entry in es_entries
 
   void (*es_dtor)(struct ext_subtitles *es);
   void (*es_picker)(struct ext_subtitles *es, int64_t pts);
@@ -46,3 +53,5 @@ ext_subtitles_t *subtitles_load(struct media_pipe *mp, const char *url,
 ext_subtitles_t *load_ssa(const char *url, char *buf, size_t len);
 
 void subtitles_pick(ext_subtitles_t *es, int64_t pts, media_pipe_t *mp);
+
+void subtitles_flush(ext_subtitles_t *es);
@@ -37,6 +37,9 @@
 #include "htsmsg/htsmsg_store.h"
 #include "misc/str.h"
 
+// Milliseconds to wait after playback start before scanning for subtitles
+#define SUB_SCANNER_DELAY 3000
+
 TAILQ_HEAD(subtitle_provider_queue, subtitle_provider);
 
 static hts_mutex_t subtitle_provider_mutex;
@@ -407,6 +410,7 @@ sub_scanner_release(sub_scanner_t *ss)
   rstr_release(ss->ss_title);
   rstr_release(ss->ss_imdbid);
   free(ss->ss_url);
+  hts_cond_destroy(&ss->ss_cond);
   hts_mutex_destroy(&ss->ss_mutex);
   free(ss);
 }
@@ -432,6 +436,21 @@ sub_scanner_thread(void *aux)
   sub_scanner_t *ss = aux;
   subtitle_provider_t *sp, **v;
 
+  /*
+   * Let playback get going before we start hitting the same (possibly
+   * remote) filesystem and the subtitle providers
+   */
+  hts_mutex_lock(&ss->ss_mutex);
+  int64_t deadline = showtime_get_ts() + SUB_SCANNER_DELAY * 1000;
+  while(!ss->ss_stop) {
+    int64_t now = showtime_get_ts();
+    if(now >= deadline)
+      break;
+    hts_cond_wait_timeout(&ss->ss_cond, &ss->ss_mutex,
+                          (deadline - now + 999) / 1000);
+  }
+  hts_mutex_unlock(&ss->ss_mutex);
+
   hts_mutex_lock(&subtitle_provider_mutex);
 
   int cnt = 0;
@@ -519,6 +538,7 @@ sub_scanner_create(const char *url, prop_t *proproot,
 
   sub_scanner_t *ss = calloc(1, sizeof(sub_scanner_t));
   hts_mutex_init(&ss->ss_mutex);
+  hts_cond_init(&ss->ss_cond, &ss->ss_mutex);
   ss->ss_refcount = 2; // one for thread, one for caller
   ss->ss_url = url ? strdup(url) : NULL;
   ss->ss_beflags = va->flags;
@@ -548,8 +568,9 @@ sub_scanner_destroy(sub_scanner_t *ss)
 {
   if(ss == NULL)
     return;
-  ss->ss_stop = 1;
   hts_mutex_lock(&ss->ss_mutex);
+  ss->ss_stop = 1;
+  hts_cond_signal(&ss->ss_cond);
   prop_ref_dec(ss->ss_proproot);
   ss->ss_proproot = NULL;
   hts_mutex_unlock(&ss->ss_mutex);
@@ -34,6 +34,7 @@ typedef struct sub_scanner {
   rstr_t *ss_imdbid;
 
   hts_mutex_t ss_mutex;  // Lock around ss_proproot
+  hts_cond_t ss_cond;    // Signalled when ss_stop is set
   struct prop *ss_proproot;   // property where to add subs
 
   char *ss_url;  // can be NULL 
@@ -29,6 +29,9 @@
 #include "arch/arch.h"
 
 #include "fileaccess/fileaccess.h"
+#include "misc/callout.h"
+#include "htsmsg/htsbuf.h"
+#include "blobcache.h"
 
 #define HORIZONTAL_ELLIPSIS_UNICODE 0x2026
 
@@ -41,6 +44,7 @@
 #include FT_OUTLINE_H
 #include FT_SYNTHESIS_H
 #include FT_STROKER_H
+#include FT_TRUETYPE_TABLES_H
 
 #define ver(maj, min, pat) ((maj) * 100000 + (min) * 100 + (pat))
 
@@ -51,10 +55,19 @@ static FT_Stroker text_stroker;
 static hts_mutex_t text_mutex;
 static int font_domain_tally = 10;
 
-#define GLYPH_HASH_SIZE 128
-#define GLYPH_HASH_MASK (GLYPH_HASH_SIZE-1)
+#define GLYPH_HASH_MIN 128
+
+#ifdef PS3
+#define GLYPH_MEM_BUDGET (1024 * 1024)
+#else
+#define GLYPH_MEM_BUDGET (4 * 1024 * 1024)
+#endif
+#define GLYPH_MEM_BUDGET_LOW (256 * 1024)
+
 TAILQ_HEAD(glyph_queue, glyph);
 LIST_HEAD(glyph_list, glyph);
+TAILQ_HEAD(glyph_atlas_queue, glyph_atlas);
+LIST_HEAD(glyph_atlas_list, glyph_atlas);
 TAILQ_HEAD(face_queue, face);
 LIST_HEAD(idmap_list, idmap);
 
@@ -83,7 +96,9 @@ typedef struct face {
   uint8_t style;
   int persistent;
   int font_domain;
+  unsigned int hash;     // Identifies the face across restarts
   struct glyph_list glyphs;
+  struct glyph_atlas_list atlases;
 } face_t;
 
 static struct face_queue faces;
@@ -92,10 +107,16 @@ static face_t *default_font;
 
 //------------------------- Glyph cache -----------------------
 
+/**
+ * Glyphs are kept in a hash that grows with the number of glyphs.
+ * When the memory used by glyphs (mostly bitmaps and outlines) goes
+ * above glyph_mem_budget the least recently used ones are evicted
+ */
 typedef struct glyph {
   int uc;
   int16_t size;
   uint8_t style;
+  uint8_t rendered;     // bmp_* is valid
 
   face_t *face;
   LIST_ENTRY(glyph) face_link;
@@ -104,19 +125,84 @@ typedef struct glyph {
 
   LIST_ENTRY(glyph) hash_link;
   TAILQ_ENTRY(glyph) lru_link;
-  FT_Glyph orig_glyph;
-  FT_Glyph bmp;
+  FT_Glyph orig_glyph;  // Loaded on demand, not needed if bitmap is cached
   FT_Glyph outline;
   int outline_amt;
   int adv_x;
 
   FT_BBox bbox;
 
+  int16_t bmp_left;
+  int16_t bmp_top;
+  uint16_t bmp_width;
+  uint16_t bmp_rows;
+  uint8_t *bmp_pixels;  // bmp_width * bmp_rows, NULL if empty
+
+  int mem;              // What we've accounted in glyph_mem
 } glyph_t;
 
-static struct glyph_list glyph_hash[GLYPH_HASH_SIZE];
+static struct glyph_list *glyph_hash;
+static int glyph_hash_size;
 static struct glyph_queue allglyphs;
 static int num_glyphs;
+static int glyph_mem;
+static int glyph_mem_budget = GLYPH_MEM_BUDGET;
+
+
+//------------------------- Glyph atlases -----------------------
+
+/**
+ * Rasterized glyphs are persisted in the blobcache, one atlas per
+ * (face, size, style). An atlas is a header followed by glyph records
+ * sorted on unicode codepoint, each followed by its pixels
+ */
+typedef struct glyph_rec {
+  int32_t uc;
+  uint32_t gi;
+  int32_t adv_x;
+  int32_t bbox[4];
+  int16_t left;
+  int16_t top;
+  uint16_t width;
+  uint16_t rows;
+} glyph_rec_t;
+
+#define GLYPH_ATLAS_MAGIC      0x53544741
+#define GLYPH_ATLAS_VERSION    1
+#define GLYPH_ATLAS_HDR_SIZE   12
+#define GLYPH_ATLAS_MAX        2048
+#define GLYPH_ATLAS_MAXAGE     (86400 * 90)
+#define GLYPH_ATLAS_SAVE_DELAY 5
+#define GLYPH_ATLAS_STASH      "glyphatlas"
+
+typedef struct glyph_atlas {
+  LIST_ENTRY(glyph_atlas) ga_face_link;
+  TAILQ_ENTRY(glyph_atlas) ga_lru_link;  // In loaded_atlases if ga_buf set
+  face_t *ga_face;     // NULL once the face is gone and only a save remains
+  unsigned int ga_hash;
+  int16_t ga_size;
+  uint8_t ga_style;
+  uint8_t ga_dirty;    // Glyphs have been rasterized since last save
+  uint8_t ga_loaded;   // We've looked for it in the cache
+  buf_t *ga_buf;       // Copy of what's in the cache, NULL if too big
+  int ga_num;
+  int *ga_offsets;     // Offset of each record in ga_buf
+  int ga_stored;       // Number of glyphs in the cache
+  uint8_t *ga_pending; // Records of evicted glyphs not yet saved
+  size_t ga_pending_size;
+  int ga_pending_num;
+} glyph_atlas_t;
+
+static struct glyph_atlas_queue loaded_atlases;
+static struct glyph_atlas_list orphan_atlases; // Of destroyed faces, unsaved
+static callout_t glyph_atlas_save_callout;
+
+static unsigned int glyph_stat_hits;
+static unsigned int glyph_stat_atlas_hits;
+static unsigned int glyph_stat_loads;
+static unsigned int glyph_stat_rasterized;
+static unsigned int glyph_stat_evicted;
+static int64_t glyph_stat_raster_time;
 
 /**
  *
@@ -153,6 +239,69 @@ idmap_find(int id)
 
 
 
+/**
+ *
+ */
+static inline int
+glyph_hash_key(int uc, int size, uint8_t style)
+{
+  return (uc ^ size ^ style) & (glyph_hash_size - 1);
+}
+
+
+/**
+ *
+ */
+static void
+glyph_hash_resize(int size)
+{
+  glyph_t *g;
+
+  free(glyph_hash);
+  glyph_hash_size = size;
+  glyph_hash = calloc(size, sizeof(struct glyph_list));
+
+  TAILQ_FOREACH(g, &allglyphs, lru_link)
+    LIST_INSERT_HEAD(&glyph_hash[glyph_hash_key(g->uc, g->size, g->style)],
+		     g, hash_link);
+}
+
+
+/**
+ * Approximate number of bytes used by a glyph
+ */
+static int
+glyph_cost(const glyph_t *g)
+{
+  int r = sizeof(glyph_t) + g->bmp_width * g->bmp_rows;
+
+  if(g->orig_glyph != NULL &&
+     g->orig_glyph->format == FT_GLYPH_FORMAT_OUTLINE) {
+    const FT_Outline *o = &((FT_OutlineGlyph)g->orig_glyph)->outline;
+    r += o->n_points * (sizeof(FT_Vector) + 1) +
+      o->n_contours * sizeof(short);
+  }
+
+  if(g->outline != NULL) {
+    const FT_Bitmap *b = &((FT_BitmapGlyph)g->outline)->bitmap;
+    r += abs(b->pitch) * b->rows;
+  }
+  return r;
+}
+
+
+/**
+ *
+ */
+static void
+glyph_account(glyph_t *g)
+{
+  int mem = glyph_cost(g);
+  glyph_mem += mem - g->mem;
+  g->mem = mem;
+}
+
+
 /**
  *
  */
@@ -162,23 +311,481 @@ glyph_destroy(glyph_t *g)
   LIST_REMOVE(g, face_link);
   TAILQ_REMOVE(&allglyphs, g, lru_link);
   LIST_REMOVE(g, hash_link);
-  FT_Done_Glyph(g->orig_glyph);
-  if(g->bmp)
-    FT_Done_Glyph(g->bmp);
+  if(g->orig_glyph)
+    FT_Done_Glyph(g->orig_glyph);
   if(g->outline)
     FT_Done_Glyph(g->outline);
+  free(g->bmp_pixels);
+  glyph_mem -= g->mem;
   free(g);
   num_glyphs--;
 }
 
 
+/**
+ *
+ */
+static glyph_atlas_t *
+glyph_atlas_get(face_t *f, int size, uint8_t style)
+{
+  glyph_atlas_t *ga;
+
+  LIST_FOREACH(ga, &f->atlases, ga_face_link)
+    if(ga->ga_size == size && ga->ga_style == style)
+      return ga;
+
+  ga = calloc(1, sizeof(glyph_atlas_t));
+  ga->ga_face = f;
+  ga->ga_hash = f->hash;
+  ga->ga_size = size;
+  ga->ga_style = style;
+  LIST_INSERT_HEAD(&f->atlases, ga, ga_face_link);
+  return ga;
+}
+
+
+/**
+ *
+ */
+static void
+glyph_atlas_key(const glyph_atlas_t *ga, char *buf, size_t len)
+{
+  snprintf(buf, len, "%08x-%d-%d",
+	   ga->ga_hash, ga->ga_size, ga->ga_style);
+}
+
+
+/**
+ *
+ */
+static int
+glyph_atlas_mem(const glyph_atlas_t *ga)
+{
+  return ga->ga_buf->b_size + ga->ga_num * sizeof(int);
+}
+
+
+/**
+ * Make 'b' (with records at 'offsets') the loaded copy of the atlas
+ */
+static void
+glyph_atlas_set(glyph_atlas_t *ga, buf_t *b, int *offsets, int num)
+{
+  ga->ga_loaded = 1;
+  ga->ga_buf = b;
+  ga->ga_offsets = offsets;
+  ga->ga_num = num;
+  TAILQ_INSERT_TAIL(&loaded_atlases, ga, ga_lru_link);
+  glyph_mem += glyph_atlas_mem(ga);
+}
+
+
+/**
+ * Drop our copy of the atlas, it will be reloaded from cache if needed
+ */
+static void
+glyph_atlas_unload(glyph_atlas_t *ga)
+{
+  ga->ga_loaded = 0;
+  if(ga->ga_buf == NULL)
+    return;
+
+  glyph_mem -= glyph_atlas_mem(ga);
+  TAILQ_REMOVE(&loaded_atlases, ga, ga_lru_link);
+  buf_release(ga->ga_buf);
+  free(ga->ga_offsets);
+  ga->ga_buf = NULL;
+  ga->ga_offsets = NULL;
+  ga->ga_num = 0;
+}
+
+
+/**
+ * Read and validate the stored copy of the atlas
+ */
+static buf_t *
+glyph_atlas_read(const glyph_atlas_t *ga, int **offsetsp, int *nump)
+{
+  char key[64];
+  int ignore_expiry, i, num, *offsets = NULL;
+  int32_t prev = -1;
+  uint32_t hdr[3];
+  size_t off;
+  glyph_rec_t gr;
+  buf_t *b;
+
+  glyph_atlas_key(ga, key, sizeof(key));
+  b = blobcache_get(key, GLYPH_ATLAS_STASH, 0, &ignore_expiry, NULL, NULL);
+  if(b == NULL)
+    return NULL;
+
+  if(b->b_size < GLYPH_ATLAS_HDR_SIZE)
+    goto bad;
+
+  memcpy(hdr, b->b_ptr, GLYPH_ATLAS_HDR_SIZE);
+  if(hdr[0] != GLYPH_ATLAS_MAGIC || hdr[1] != GLYPH_ATLAS_VERSION ||
+     hdr[2] > GLYPH_ATLAS_MAX)
+    goto bad;
+
+  num = hdr[2];
+  offsets = malloc(num * sizeof(int));
+  off = GLYPH_ATLAS_HDR_SIZE;
+
+  for(i = 0; i < num; i++) {
+    if(off + sizeof(glyph_rec_t) > b->b_size)
+      goto bad;
+    memcpy(&gr, buf_c8(b) + off, sizeof(glyph_rec_t));
+    if(gr.uc <= prev)
+      goto bad;
+    prev = gr.uc;
+    offsets[i] = off;
+    off += sizeof(glyph_rec_t) + gr.width * gr.rows;
+  }
+
+  if(off > b->b_size)
+    goto bad;
+
+  *offsetsp = offsets;
+  *nump = num;
+  return b;
+
+ bad:
+  TRACE(TRACE_DEBUG, "Freetype", "Ignoring corrupt glyph atlas %s", key);
+  free(offsets);
+  buf_release(b);
+  return NULL;
+}
+
+
+/**
+ * An atlas that would crowd out most of the glyphs is not kept loaded,
+ * it would just be reparsed on every miss and dropped on every trim
+ */
+static int
+glyph_atlas_fits(const buf_t *b, int num)
+{
+  return (int)(b->b_size + num * sizeof(int)) <= glyph_mem_budget / 2;
+}
+
+
+/**
+ * Make the stored copy (if any and not too big) the loaded one
+ */
+static void
+glyph_atlas_install(glyph_atlas_t *ga, buf_t *b, int *offsets, int num)
+{
+  char key[64];
+
+  ga->ga_loaded = 1;
+  ga->ga_stored = num;
+  if(glyph_atlas_fits(b, num)) {
+    glyph_atlas_set(ga, b, offsets, num);
+    return;
+  }
+
+  glyph_atlas_key(ga, key, sizeof(key));
+  TRACE(TRACE_DEBUG, "Freetype",
+	"Glyph atlas %s is %d bytes, too big to keep loaded",
+	key, (int)b->b_size);
+  free(offsets);
+  buf_release(b);
+}
+
+
+/**
+ *
+ */
+static void
+glyph_atlas_load(glyph_atlas_t *ga)
+{
+  int num, *offsets;
+  buf_t *b;
+
+  ga->ga_loaded = 1;
+  ga->ga_stored = 0;
+  if((b = glyph_atlas_read(ga, &offsets, &num)) != NULL)
+    glyph_atlas_install(ga, b, offsets, num);
+}
+
+
+/**
+ * Binary search for 'uc' in atlas. Returns offset of record or -1
+ */
+static int
+glyph_atlas_find(const glyph_atlas_t *ga, int uc, glyph_rec_t *gr)
+{
+  int lo = 0, hi = ga->ga_num;
+
+  while(lo < hi) {
+    int mid = (lo + hi) / 2;
+    memcpy(gr, buf_c8(ga->ga_buf) + ga->ga_offsets[mid], sizeof(glyph_rec_t));
+    if(gr->uc == uc)
+      return ga->ga_offsets[mid];
+    if(gr->uc < uc)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return -1;
+}
+
+
+/**
+ *
+ */
+static void
+glyph_to_rec(const glyph_t *g, glyph_rec_t *gr)
+{
+  gr->uc      = g->uc;
+  gr->gi      = g->gi;
+  gr->adv_x   = g->adv_x;
+  gr->bbox[0] = g->bbox.xMin;
+  gr->bbox[1] = g->bbox.yMin;
+  gr->bbox[2] = g->bbox.xMax;
+  gr->bbox[3] = g->bbox.yMax;
+  gr->left    = g->bmp_left;
+  gr->top     = g->bmp_top;
+  gr->width   = g->bmp_width;
+  gr->rows    = g->bmp_rows;
+}
+
+
+/**
+ * Keep the record of an evicted glyph until its atlas is saved.
+ * Saving from the eviction path would mean a cache read on the render
+ * thread and loading the whole atlas into glyph_mem
+ */
+static void
+glyph_atlas_pend(glyph_atlas_t *ga, const glyph_t *g)
+{
+  size_t len = g->bmp_pixels != NULL ? g->bmp_width * g->bmp_rows : 0;
+  glyph_rec_t gr;
+  uint8_t *p;
+
+  glyph_to_rec(g, &gr);
+  ga->ga_pending = realloc(ga->ga_pending, ga->ga_pending_size +
+			   sizeof(glyph_rec_t) + len);
+  p = ga->ga_pending + ga->ga_pending_size;
+  memcpy(p, &gr, sizeof(glyph_rec_t));
+  if(len > 0)
+    memcpy(p + sizeof(glyph_rec_t), g->bmp_pixels, len);
+  ga->ga_pending_size += sizeof(glyph_rec_t) + len;
+  ga->ga_pending_num++;
+}
+
+
+/**
+ * A glyph record to be written to the atlas. When the same codepoint
+ * comes from more than one source the lowest 'prio' wins
+ */
+typedef struct glyph_src {
+  glyph_rec_t gr;
+  const uint8_t *pixels;
+  int prio;
+} glyph_src_t;
+
+
+/**
+ *
+ */
+static int
+glyph_src_cmp(const void *A, const void *B)
+{
+  const glyph_src_t *a = A;
+  const glyph_src_t *b = B;
+  if(a->gr.uc != b->gr.uc)
+    return a->gr.uc < b->gr.uc ? -1 : 1;
+  return a->prio - b->prio;
+}
+
+
+/**
+ * Collect 'num' consecutive records starting at 'p'
+ */
+static int
+glyph_src_parse(glyph_src_t *v, const uint8_t *p, int num, int prio)
+{
+  int i;
+  for(i = 0; i < num; i++) {
+    memcpy(&v[i].gr, p, sizeof(glyph_rec_t));
+    p += sizeof(glyph_rec_t);
+    v[i].pixels = p;
+    v[i].prio = prio;
+    p += v[i].gr.width * v[i].gr.rows;
+  }
+  return num;
+}
+
+
+/**
+ * Write atlas to cache. It will contain everything rasterized we have
+ * in memory and everything evicted since last save, merged with what
+ * was already stored
+ */
+static void
+glyph_atlas_save(glyph_atlas_t *ga)
+{
+  face_t *f = ga->ga_face;
+  glyph_src_t *v;
+  glyph_t *g;
+  int i, n = 0, num = 0, stored_num = 0, *offsets, *tmp_offsets = NULL;
+  uint32_t hdr[3];
+  size_t size = GLYPH_ATLAS_HDR_SIZE + ga->ga_pending_size, len;
+  uint8_t *base, *p;
+  char key[64];
+  buf_t *b, *stored = ga->ga_buf, *tmp = NULL;
+
+  ga->ga_dirty = 0;
+
+  // If we don't have it loaded, merge from the cache without loading it
+  if(stored != NULL)
+    stored_num = ga->ga_num;
+  else
+    stored = tmp = glyph_atlas_read(ga, &tmp_offsets, &stored_num);
+
+  if(f != NULL) {
+    LIST_FOREACH(g, &f->glyphs, face_link) {
+      if(g->size == ga->ga_size && g->style == ga->ga_style && g->rendered) {
+	n++;
+	size += sizeof(glyph_rec_t) + g->bmp_width * g->bmp_rows;
+      }
+    }
+  }
+
+  if(stored != NULL)
+    size += stored->b_size;
+
+  v = malloc((n + ga->ga_pending_num + stored_num) * sizeof(glyph_src_t));
+  n = 0;
+  if(f != NULL) {
+    LIST_FOREACH(g, &f->glyphs, face_link) {
+      if(g->size == ga->ga_size && g->style == ga->ga_style && g->rendered) {
+	glyph_to_rec(g, &v[n].gr);
+	v[n].pixels = g->bmp_pixels;
+	v[n].prio = 0;
+	n++;
+      }
+    }
+  }
+  n += glyph_src_parse(v + n, ga->ga_pending, ga->ga_pending_num, 1);
+  if(stored != NULL)
+    n += glyph_src_parse(v + n, buf_c8(stored) + GLYPH_ATLAS_HDR_SIZE,
+			 stored_num, 2);
+
+  qsort(v, n, sizeof(glyph_src_t), glyph_src_cmp);
+
+  b = buf_create(size);
+  base = b->b_ptr;
+  p = base + GLYPH_ATLAS_HDR_SIZE;
+  offsets = malloc(MIN(n, GLYPH_ATLAS_MAX) * sizeof(int));
+
+  for(i = 0; i < n && num < GLYPH_ATLAS_MAX; i++) {
+    if(i > 0 && v[i].gr.uc == v[i - 1].gr.uc)
+      continue;  // Older copy of the same glyph
+
+    len = v[i].gr.width * v[i].gr.rows;
+    offsets[num++] = p - base;
+    memcpy(p, &v[i].gr, sizeof(glyph_rec_t));
+    p += sizeof(glyph_rec_t);
+    if(v[i].pixels != NULL)
+      memcpy(p, v[i].pixels, len);
+    p += len;
+  }
+  free(v);
+
+  hdr[0] = GLYPH_ATLAS_MAGIC;
+  hdr[1] = GLYPH_ATLAS_VERSION;
+  hdr[2] = num;
+  memcpy(base, hdr, GLYPH_ATLAS_HDR_SIZE);
+  b->b_size = p - base;
+
+  glyph_atlas_key(ga, key, sizeof(key));
+  blobcache_put(key, GLYPH_ATLAS_STASH, b, GLYPH_ATLAS_MAXAGE, NULL, 0, 0);
+
+  if(tmp != NULL) {
+    buf_release(tmp);
+    free(tmp_offsets);
+  }
+
+  free(ga->ga_pending);
+  ga->ga_pending = NULL;
+  ga->ga_pending_size = 0;
+  ga->ga_pending_num = 0;
+
+  if(f == NULL) {
+    // Orphaned, no one will look it up again
+    free(offsets);
+    buf_release(b);
+    return;
+  }
+
+  // What we just wrote is now the stored copy
+  glyph_atlas_unload(ga);
+  glyph_atlas_install(ga, b, offsets, num);
+}
+
+
+/**
+ *
+ */
+static void
+glyph_atlas_save_all(callout_t *c, void *aux)
+{
+  glyph_atlas_t *ga;
+  face_t *f;
+
+  hts_mutex_lock(&text_mutex);
+  TAILQ_FOREACH(f, &faces, link)
+    LIST_FOREACH(ga, &f->atlases, ga_face_link)
+      if(ga->ga_dirty)
+	glyph_atlas_save(ga);
+
+  while((ga = LIST_FIRST(&orphan_atlases)) != NULL) {
+    glyph_atlas_save(ga);
+    LIST_REMOVE(ga, ga_face_link);
+    free(ga);
+  }
+  hts_mutex_unlock(&text_mutex);
+}
+
+
 /**
  *
  */
 static void
 face_destroy(face_t *f)
 {
+  glyph_atlas_t *ga;
   glyph_t *g;
+
+  /*
+   * This can run on the render thread (via faces_purge()) so unsaved
+   * atlases are handed over to the save callout. Glyphs still in memory
+   * are stashed in the atlas pending records as they go away with the face
+   */
+  LIST_FOREACH(g, &f->glyphs, face_link) {
+    if(!g->rendered)
+      continue;
+    ga = glyph_atlas_get(f, g->size, g->style);
+    if(ga->ga_dirty)
+      glyph_atlas_pend(ga, g);
+  }
+
+  while((ga = LIST_FIRST(&f->atlases)) != NULL) {
+    glyph_atlas_unload(ga);
+    LIST_REMOVE(ga, ga_face_link);
+    if(ga->ga_dirty) {
+      ga->ga_face = NULL;
+      LIST_INSERT_HEAD(&orphan_atlases, ga, ga_face_link);
+      if(!callout_isarmed(&glyph_atlas_save_callout))
+	callout_arm_worker(&glyph_atlas_save_callout, glyph_atlas_save_all,
+			   NULL, GLYPH_ATLAS_SAVE_DELAY);
+    } else {
+      free(ga->ga_pending);
+      free(ga);
+    }
+  }
+
   while((g = LIST_FIRST(&f->glyphs)) != NULL)
     glyph_destroy(g);
 
@@ -236,11 +843,12 @@ face_close(FT_Stream stream)
  *
  */
 static face_t *
-face_create_epilogue(face_t *face, int font_domain)
+face_create_epilogue(face_t *face, int font_domain, const fa_stat_t *fs)
 {
   const char *family = face->face->family_name;
   const char *style = face->face->style_name;
-  char buf[256];
+  const TT_Header *head = FT_Get_Sfnt_Table(face->face, ft_sfnt_head);
+  char buf[1024];
 
   TRACE(TRACE_DEBUG, "Freetype", "Loaded '%s' [%s] domain:%d",
 	family, style, font_domain);
@@ -261,6 +869,20 @@ face_create_epilogue(face_t *face, int font_domain)
   snprintf(buf, sizeof(buf), "%s %s", family, style);
   face->fullname = strdup(buf);
 
+  /*
+   * Glyph atlases are keyed on this so it must change when the font
+   * file does. The 'head' checksum and modification date identify the
+   * data of sfnt fonts even when loaded from memory
+   */
+  snprintf(buf, sizeof(buf), "%s %s %ld %d %d %s %"PRId64" %ld %lx %lx %lx",
+	   family, style,
+	   (long)face->face->num_glyphs, face->face->units_per_EM, ftver,
+	   face->url ?: "", fs->fs_size, (long)fs->fs_mtime,
+	   head ? (unsigned long)head->CheckSum_Adjust : 0,
+	   head ? (unsigned long)head->Modified[0] : 0,
+	   head ? (unsigned long)head->Modified[1] : 0);
+  face->hash = mystrhash(buf);
+
   FT_Select_Charmap(face->face, FT_ENCODING_UNICODE);
 
   TAILQ_INSERT_TAIL(&faces, face, link);
@@ -272,13 +894,14 @@ face_create_epilogue(face_t *face, int font_domain)
  *
  */
 static face_t *
-face_create_from_fh(fa_handle_t *fh, int font_domain, 
+face_create_from_fh(fa_handle_t *fh, const char *url, int font_domain,
 		    char *errbuf, size_t errlen)
 {
   FT_Open_Args oa = {0};
   FT_Error err;
   int64_t s;
   face_t *face;
+  fa_stat_t fs;
 
   s = fa_fsize(fh);
   if(s < 0) {
@@ -287,6 +910,10 @@ face_create_from_fh(fa_handle_t *fh, int font_domain,
     return NULL;
   }
 
+  if(fa_fstat(fh, &fs))
+    fs.fs_mtime = 0;
+  fs.fs_size = s;
+
   face = calloc(1, sizeof(face_t));
 
   FT_Stream srec = calloc(1, sizeof(FT_StreamRec));
@@ -305,7 +932,8 @@ face_create_from_fh(fa_handle_t *fh, int font_domain,
     return NULL;
   }
 
-  return face_create_epilogue(face, font_domain);
+  face->url = url ? strdup(url) : NULL;
+  return face_create_epilogue(face, font_domain, &fs);
 }
 
 
@@ -330,13 +958,12 @@ face_create_from_uri(const char *path, int font_domain, const char **vpaths)
     return NULL;
   }
 
-  face = face_create_from_fh(fh, font_domain, errbuf, sizeof(errbuf));
+  face = face_create_from_fh(fh, path, font_domain, errbuf, sizeof(errbuf));
   if(face == NULL) {
     TRACE(TRACE_ERROR, "Freetype", "Unable to load font: %s -- %s",
 	  path, errbuf);
     return NULL;
   }
-  face->url = strdup(path);
   return face;
 }
 
@@ -502,6 +1129,175 @@ face_set_size(face_t *f, int size)
 }
 
 
+/**
+ * Load glyph outline from face with any synthesized style applied
+ */
+static int
+glyph_load(face_t *f, FT_UInt gi, int size, uint8_t style,
+	   FT_Glyph *glyphp, int *adv_x)
+{
+  FT_GlyphSlot gs;
+
+  face_set_size(f, size);
+
+  if(FT_Load_Glyph(f->face, gi, FT_LOAD_FORCE_AUTOHINT))
+    return -1;
+
+  gs = f->face->glyph;
+
+  if(style & TR_STYLE_ITALIC && !(f->style & TR_STYLE_ITALIC))
+    FT_GlyphSlot_Oblique(gs);
+
+  if(style & TR_STYLE_BOLD && !(f->style & TR_STYLE_BOLD) && 
+     gs->format == FT_GLYPH_FORMAT_OUTLINE) {
+    int v = FT_MulFix(gs->face->units_per_EM,
+		      gs->face->size->metrics.y_scale) / 64;
+    FT_Outline_Embolden(&gs->outline, v);
+  }
+
+  if(adv_x != NULL)
+    *adv_x = gs->advance.x;
+
+  return FT_Get_Glyph(gs, glyphp) ? -1 : 0;
+}
+
+
+/**
+ * Glyphs restored from an atlas don't have the outline loaded
+ */
+static FT_Glyph
+glyph_orig(glyph_t *g)
+{
+  if(g->orig_glyph == NULL) {
+    if(glyph_load(g->face, g->gi, g->size, g->style, &g->orig_glyph, NULL))
+      return NULL;
+    glyph_account(g);
+  }
+  return g->orig_glyph;
+}
+
+
+/**
+ *
+ */
+static void
+glyph_rasterize(glyph_t *g)
+{
+  int64_t ts = showtime_get_ts();
+  glyph_atlas_t *ga;
+  FT_BitmapGlyph bg;
+  FT_Glyph orig, bmp;
+  int y;
+
+  if((orig = bmp = glyph_orig(g)) == NULL)
+    return;
+
+  if(FT_Glyph_To_Bitmap(&bmp, FT_RENDER_MODE_NORMAL, NULL, 0))
+    return;
+
+  bg = (FT_BitmapGlyph)bmp;
+  g->bmp_left  = bg->left;
+  g->bmp_top   = bg->top;
+  g->bmp_width = bg->bitmap.width;
+  g->bmp_rows  = bg->bitmap.rows;
+
+  if(g->bmp_width > 0 && g->bmp_rows > 0) {
+    g->bmp_pixels = malloc(g->bmp_width * g->bmp_rows);
+    for(y = 0; y < g->bmp_rows; y++)
+      memcpy(g->bmp_pixels + y * g->bmp_width,
+	     bg->bitmap.buffer + y * bg->bitmap.pitch, g->bmp_width);
+  }
+
+  // For bitmap glyphs (embedded strikes) FT_Glyph_To_Bitmap() is a no-op
+  if(bmp != orig)
+    FT_Done_Glyph(bmp);
+
+  g->rendered = 1;
+  glyph_account(g);
+
+  glyph_stat_rasterized++;
+  glyph_stat_raster_time += showtime_get_ts() - ts;
+
+  // Once the atlas is full there is no point in rewriting it
+  ga = glyph_atlas_get(g->face, g->size, g->style);
+  if(ga->ga_stored >= GLYPH_ATLAS_MAX)
+    return;
+
+  ga->ga_dirty = 1;
+  if(!callout_isarmed(&glyph_atlas_save_callout))
+    callout_arm_worker(&glyph_atlas_save_callout, glyph_atlas_save_all, NULL,
+		       GLYPH_ATLAS_SAVE_DELAY);
+}
+
+
+/**
+ * Create glyph, from atlas if we have it there, otherwise from the face
+ */
+static glyph_t *
+glyph_create(face_t *f, int uc, int size, uint8_t style)
+{
+  glyph_atlas_t *ga = glyph_atlas_get(f, size, style);
+  glyph_rec_t gr;
+  glyph_t *g;
+  int off;
+
+  if(!ga->ga_loaded)
+    glyph_atlas_load(ga);
+
+  g = calloc(1, sizeof(glyph_t));
+
+  if(ga->ga_buf != NULL &&
+     (off = glyph_atlas_find(ga, uc, &gr)) != -1) {
+
+    TAILQ_REMOVE(&loaded_atlases, ga, ga_lru_link);
+    TAILQ_INSERT_TAIL(&loaded_atlases, ga, ga_lru_link);
+
+    g->gi          = gr.gi;
+    g->adv_x       = gr.adv_x;
+    g->bbox.xMin   = gr.bbox[0];
+    g->bbox.yMin   = gr.bbox[1];
+    g->bbox.xMax   = gr.bbox[2];
+    g->bbox.yMax   = gr.bbox[3];
+    g->bmp_left    = gr.left;
+    g->bmp_top     = gr.top;
+    g->bmp_width   = gr.width;
+    g->bmp_rows    = gr.rows;
+    if(gr.width > 0 && gr.rows > 0) {
+      g->bmp_pixels = malloc(gr.width * gr.rows);
+      memcpy(g->bmp_pixels, buf_c8(ga->ga_buf) + off + sizeof(glyph_rec_t),
+	     gr.width * gr.rows);
+    }
+    g->rendered = 1;
+    glyph_stat_atlas_hits++;
+
+  } else {
+
+    g->gi = FT_Get_Char_Index(f->face, uc);
+    if(glyph_load(f, g->gi, size, style, &g->orig_glyph, &g->adv_x)) {
+      free(g);
+      return NULL;
+    }
+    FT_Glyph_Get_CBox(g->orig_glyph, FT_GLYPH_BBOX_GRIDFIT, &g->bbox);
+    glyph_stat_loads++;
+  }
+
+  if(num_glyphs >= glyph_hash_size * 2)
+    glyph_hash_resize(glyph_hash_size * 2);
+
+  LIST_INSERT_HEAD(&f->glyphs, g, face_link);
+  g->face = f;
+  g->uc = uc;
+  g->style = style;
+  g->size = size;
+
+  LIST_INSERT_HEAD(&glyph_hash[glyph_hash_key(uc, size, style)],
+		   g, hash_link);
+  num_glyphs++;
+  glyph_account(g);
+  return g;
+}
+
+
 /**
  *
  */
@@ -509,9 +1305,9 @@ static glyph_t *
 glyph_get(int uc, int size, uint8_t style, const char *font,
 	  int font_domain, const char **vpaths)
 {
-  int err, hash = (uc ^ size ^ style) & GLYPH_HASH_MASK;
+  int hash = glyph_hash_key(uc, size, style);
+  face_t *f = NULL;
   glyph_t *g;
-  FT_GlyphSlot gs;
 
   LIST_FOREACH(g, &glyph_hash[hash], hash_link) {
     if(g->uc != uc || g->size != size || g->style != style)
@@ -532,9 +1328,6 @@ glyph_get(int uc, int size, uint8_t style, const char *font,
   }
 
   if(g == NULL) {
-    face_t *f;
-    FT_UInt gi = 0;
-
     f = face_find(uc, style, font, font_domain, vpaths);
 
     if(f == NULL) {
@@ -543,45 +1336,17 @@ glyph_get(int uc, int size, uint8_t style, const char *font,
 	return NULL;
     }
 
-    gi = FT_Get_Char_Index(f->face, uc);
-
-    face_set_size(f, size);
-
-    if((err = FT_Load_Glyph(f->face, gi, FT_LOAD_FORCE_AUTOHINT)) != 0)
-      return NULL;
-    
-    gs = f->face->glyph;
-
-    if(style & TR_STYLE_ITALIC && !(f->style & TR_STYLE_ITALIC))
-      FT_GlyphSlot_Oblique(gs);
-
-    if(style & TR_STYLE_BOLD && !(f->style & TR_STYLE_BOLD) && 
-       gs->format == FT_GLYPH_FORMAT_OUTLINE) {
-      int v = FT_MulFix(gs->face->units_per_EM,
-			gs->face->size->metrics.y_scale) / 64;
-      FT_Outline_Embolden(&gs->outline, v);
-    }
-
-    g = calloc(1, sizeof(glyph_t));
+    // Might have resolved to a face we already have the glyph for
+    LIST_FOREACH(g, &glyph_hash[hash], hash_link)
+      if(g->face == f && g->uc == uc && g->size == size && g->style == style)
+	break;
+  }
 
-    if((err = FT_Get_Glyph(gs, &g->orig_glyph)) != 0) {
-      free(g);
+  if(g == NULL) {
+    if((g = glyph_create(f, uc, size, style)) == NULL)
       return NULL;
-    }
-
-    FT_Glyph_Get_CBox(g->orig_glyph, FT_GLYPH_BBOX_GRIDFIT, &g->bbox);
-
-    g->gi = gi;
-    LIST_INSERT_HEAD(&f->glyphs, g, face_link);
-    g->face = f;
-    g->uc = uc;
-    g->style = style;
-    g->size = size;
-	 
-    g->adv_x = gs->advance.x;
-    LIST_INSERT_HEAD(&glyph_hash[hash], g, hash_link);
-    num_glyphs++;
   } else {
+    glyph_stat_hits++;
     TAILQ_REMOVE(&allglyphs, g, lru_link);
   }
   TAILQ_INSERT_TAIL(&allglyphs, g, lru_link);
@@ -597,8 +1362,37 @@ static void
 glyph_flush_one(void)
 {
   glyph_t *g = TAILQ_FIRST(&allglyphs);
+  glyph_atlas_t *ga;
   assert(g != NULL);
+
+  // Make sure the bitmap is stored before we lose it
+  ga = glyph_atlas_get(g->face, g->size, g->style);
+  if(ga->ga_dirty && g->rendered)
+    glyph_atlas_pend(ga, g);
+
   glyph_destroy(g);
+  glyph_stat_evicted++;
+}
+
+
+/**
+ * Evict until we're within budget. Atlases are just a copy of what's
+ * in the cache so they go first
+ */
+static void
+glyph_cache_trim(void)
+{
+  glyph_atlas_t *ga;
+
+  while(glyph_mem > glyph_mem_budget &&
+	(ga = TAILQ_FIRST(&loaded_atlases)) != NULL)
+    glyph_atlas_unload(ga);
+
+  while(glyph_mem > glyph_mem_budget && TAILQ_FIRST(&allglyphs) != NULL)
+    glyph_flush_one();
+
+  if(glyph_hash_size > GLYPH_HASH_MIN && num_glyphs < glyph_hash_size / 4)
+    glyph_hash_resize(glyph_hash_size / 2);
 }
 
 
@@ -606,14 +1400,17 @@ glyph_flush_one(void)
  *
  */
 static void
-draw_glyph(pixmap_t *pm, int left, int top, FT_Bitmap *bmp, int color)
+draw_glyph(pixmap_t *pm, int left, int top, uint8_t *pixels,
+	   int width, int rows, int linesize, int color)
 {
   pixmap_t src;
+  if(pixels == NULL)
+    return;
   src.pm_type = PIXMAP_I;
-  src.pm_pixels = bmp->buffer;
-  src.pm_width = bmp->width;
-  src.pm_height = bmp->rows;
-  src.pm_linesize = bmp->width;
+  src.pm_pixels = pixels;
+  src.pm_width = width;
+  src.pm_height = rows;
+  src.pm_linesize = linesize;
   pixmap_composite(pm, &src, left, top, color);
 }
 
@@ -788,31 +1585,39 @@ draw_glyphs(pixmap_t *pm, struct line_queue *lq, int target_height,
 	if(g->outline)
 	  FT_Done_Glyph(g->outline);
 	
-	g->outline = g->orig_glyph;
+	g->outline = glyph_orig(g);
 	FT_Stroker_Set(text_stroker,
 		       items[i].outline,
 		       FT_STROKER_LINECAP_ROUND,
 		       FT_STROKER_LINEJOIN_ROUND,
 		       0);
 	g->outline_amt = items[i].outline;
-	if(FT_Glyph_StrokeBorder(&g->outline, text_stroker, 0, 0))
-	  g->outline = NULL;
-	else if(FT_Glyph_To_Bitmap(&g->outline, FT_RENDER_MODE_NORMAL, NULL, 1))
-	  g->outline = NULL;
+	if(g->outline != NULL) {
+	  if(FT_Glyph_StrokeBorder(&g->outline, text_stroker, 0, 0))
+	    g->outline = NULL;
+	  else if(FT_Glyph_To_Bitmap(&g->outline, FT_RENDER_MODE_NORMAL,
+				     NULL, 1))
+	    g->outline = NULL;
+	}
+	glyph_account(g);
       }
       
-      if(g->bmp == NULL) {
-	g->bmp = g->orig_glyph;
-	if(FT_Glyph_To_Bitmap(&g->bmp, FT_RENDER_MODE_NORMAL, NULL, 0))
-	  g->bmp = NULL;
-      }
-      if(pass == 0 && items[i].shadow && (g->outline != NULL || g->bmp != NULL)) {
-	FT_BitmapGlyph bmp = (FT_BitmapGlyph)(g->outline ?: g->bmp);
+      if(!g->rendered)
+	glyph_rasterize(g);
+
+      if(pass == 0 && items[i].shadow && g->outline != NULL) {
+	FT_BitmapGlyph bmp = (FT_BitmapGlyph)g->outline;
 	draw_glyph(pm,
 		   bmp->left + items[i].shadow + margin + pen.x,
 		   target_height - bmp->top + items[i].shadow + margin - pen.y,
-		   &bmp->bitmap, 
-		   items[i].shadow_color);
+		   bmp->bitmap.buffer, bmp->bitmap.width, bmp->bitmap.rows,
+		   bmp->bitmap.pitch, items[i].shadow_color);
+      } else if(pass == 0 && items[i].shadow && g->rendered) {
+	draw_glyph(pm,
+		   g->bmp_left + items[i].shadow + margin + pen.x,
+		   target_height - g->bmp_top + items[i].shadow + margin - pen.y,
+		   g->bmp_pixels, g->bmp_width, g->bmp_rows,
+		   g->bmp_width, items[i].shadow_color);
       }
 
       if(pass == 1 && items[i].outline > 0 && g->outline != NULL) {
@@ -820,21 +1625,20 @@ draw_glyphs(pixmap_t *pm, struct line_queue *lq, int target_height,
 	draw_glyph(pm,
 		   bmp->left + margin + pen.x,
 		   target_height - bmp->top + margin - pen.y,
-		   &bmp->bitmap, 
-		   items[i].outline_color);
+		   bmp->bitmap.buffer, bmp->bitmap.width, bmp->bitmap.rows,
+		   bmp->bitmap.pitch, items[i].outline_color);
       }
 
-      if(pass == 2 && g->bmp != NULL) {
-	FT_BitmapGlyph bmp = (FT_BitmapGlyph)g->bmp;
+      if(pass == 2 && g->rendered) {
 	draw_glyph(pm,
-		   bmp->left + margin + pen.x,
-		   target_height - bmp->top + margin - pen.y,
-		   &bmp->bitmap, 
-		   items[i].color);
+		   g->bmp_left + margin + pen.x,
+		   target_height - g->bmp_top + margin - pen.y,
+		   g->bmp_pixels, g->bmp_width, g->bmp_rows,
+		   g->bmp_width, items[i].color);
 
 	if(pm->pm_charpos != NULL) {
-	  pm->pm_charpos[i * 2 + 0] = bmp->left + pen.x;
-	  pm->pm_charpos[i * 2 + 1] = bmp->left + bmp->bitmap.width + pen.x;
+	  pm->pm_charpos[i * 2 + 0] = g->bmp_left + pen.x;
+	  pm->pm_charpos[i * 2 + 1] = g->bmp_left + g->bmp_width + pen.x;
 	}
       }
 
@@ -1381,9 +2185,7 @@ text_render(const uint32_t *uc, const int len, int flags, int default_size,
   pm = text_render0(uc, len, flags, default_size, scale, alignment, 
 		    max_width, max_lines, family, context, min_size,
 		    vpaths);
-  while(num_glyphs > 512)
-    glyph_flush_one();
-
+  glyph_cache_trim();
   faces_purge();
 
   hts_mutex_unlock(&text_mutex);
@@ -1423,6 +2225,57 @@ freetype_set_default_font(const char *url)
 }
 
 
+/**
+ * Called when system is low on memory
+ */
+void
+freetype_set_low_memory(int on)
+{
+  hts_mutex_lock(&text_mutex);
+  glyph_mem_budget = on ? GLYPH_MEM_BUDGET_LOW : GLYPH_MEM_BUDGET;
+  glyph_cache_trim();
+  faces_purge();
+  hts_mutex_unlock(&text_mutex);
+}
+
+
+/**
+ *
+ */
+void
+freetype_dump_stats(struct htsbuf_queue *hq)
+{
+  unsigned int lookups;
+  int atlases = 0;
+  glyph_atlas_t *ga;
+
+  hts_mutex_lock(&text_mutex);
+
+  TAILQ_FOREACH(ga, &loaded_atlases, ga_lru_link)
+    atlases++;
+
+  lookups = glyph_stat_hits + glyph_stat_atlas_hits + glyph_stat_loads;
+
+  htsbuf_qprintf(hq, "%d glyphs in %d buckets, %d/%d kB used, "
+		 "%d atlases loaded\n",
+		 num_glyphs, glyph_hash_size, glyph_mem / 1024,
+		 glyph_mem_budget / 1024, atlases);
+  htsbuf_qprintf(hq, "%u lookups, %u in memory, %u from atlas, "
+		 "%u from font, %d%% hit rate\n",
+		 lookups, glyph_stat_hits, glyph_stat_atlas_hits,
+		 glyph_stat_loads,
+		 lookups ? (int)((uint64_t)(lookups - glyph_stat_loads) * 100 /
+				 lookups) : 0);
+  htsbuf_qprintf(hq, "%u rasterized, avg %dus, %u evicted\n",
+		 glyph_stat_rasterized,
+		 glyph_stat_rasterized ?
+		 (int)(glyph_stat_raster_time / glyph_stat_rasterized) : 0,
+		 glyph_stat_evicted);
+
+  hts_mutex_unlock(&text_mutex);
+}
+
+
 /**
  *
  */
@@ -1440,6 +2293,8 @@ freetype_init(void)
   FT_Stroker_New(text_library, &text_stroker);
   TAILQ_INIT(&faces);
   TAILQ_INIT(&allglyphs);
+  TAILQ_INIT(&loaded_atlases);
+  glyph_hash_resize(GLYPH_HASH_MIN);
   hts_mutex_init(&text_mutex);
   //  arch_preload_fonts();
 
@@ -1481,7 +2336,7 @@ freetype_load_font_from_fh(fa_handle_t *fh, int font_domain,
   face_t *f;
   hts_mutex_lock(&text_mutex);
 
-  f = face_create_from_fh(fh, font_domain, errbuf, errlen);
+  f = face_create_from_fh(fh, NULL, font_domain, errbuf, errlen);
   if(f != NULL)
     f->persistent++;
 
@@ -1517,6 +2372,22 @@ freetype_family_id(const char *str, int font_domain)
 }
 
 
+/**
+ * Reverse of freetype_family_id()
+ */
+rstr_t *
+freetype_family_name(int id)
+{
+  rstr_t *r = NULL;
+  hts_mutex_lock(&text_mutex);
+  idmap_t *im = idmap_find(id);
+  if(im != NULL)
+    r = rstr_alloc(im->name);
+  hts_mutex_unlock(&text_mutex);
+  return r;
+}
+
+
 /**
  *
  */
@@ -105,12 +105,20 @@ void freetype_unload_font(void *ref);
 
 int freetype_family_id(const char *str, int context);
 
+struct rstr *freetype_family_name(int id);
+
 int freetype_get_context(void);   // rename context -> font_domain
 
 struct rstr *freetype_get_family(void *handle);
 
 struct rstr *freetype_get_identifier(void *handle);
 
+void freetype_set_low_memory(int on);
+
+struct htsbuf_queue;
+
+void freetype_dump_stats(struct htsbuf_queue *hq);
+
 #endif
 
 void fontstash_init(void);
@@ -29,24 +29,71 @@
 
 #include "prop/prop.h"
 #include "showtime.h"
+#include "arch/atomic.h"
+#include "misc/queue.h"
 
 static hts_mutex_t trace_mutex;
+static hts_cond_t trace_cond;
 static prop_t *log_root;
 
 static int entries;
 
 #define UI_LOG_LINES 200
 
-TAILQ_HEAD(trace_entry_queue, trace_entry);
-SIMPLEQ_HEAD(tracetmp_queue, tracetmp);
 
+/**
+ * Trace messages are formatted on the calling thread into a slot in a
+ * ring buffer. All I/O (log file, network, console and UI props) is done
+ * by a drain thread so tracing never blocks the caller on a lock or a
+ * syscall.
+ *
+ * Producers reserve slots by atomically incrementing trace_head. Each
+ * slot has a sequence number: 'ticket' when free for the producer that
+ * got that ticket and 'ticket + 1' once the message is published.
+ * The drainer hands the slot back to the next lap by setting it to
+ * 'ticket + TRACE_RING_SIZE'
+ *
+ * trace_mutex is never held by the drainer while it calls code that
+ * might trace itself (such as the prop system)
+ */
+#define TRACE_RING_SIZE 256   // Must be power of 2
+#define TRACE_MSG_SIZE  1024
+
+typedef struct trace_slot {
+  volatile int ts_seq;
+  int ts_flags;
+  int ts_level;
+  int64_t ts_time;
+  char ts_subsys[64];
+  char ts_msg[TRACE_MSG_SIZE];
+} trace_slot_t;
+
+static trace_slot_t trace_ring[TRACE_RING_SIZE];
+static volatile int trace_head;  // Next ticket for producers
+static int trace_tail;           // Next ticket to drain, under trace_mutex
+static volatile int trace_dropped;
+static volatile int trace_drainer_idle;
+static hts_thread_t trace_drainer_tid;
+
+/**
+ * Lines for the UI log, queued under trace_mutex and turned into props
+ * by the drain thread once it has released the lock
+ */
+typedef struct trace_ui_line {
+  TAILQ_ENTRY(trace_ui_line) tul_link;
+  int tul_level;
+  char *tul_message;
+  char tul_prefix[0];
+} trace_ui_line_t;
+
+TAILQ_HEAD(trace_ui_line_queue, trace_ui_line);
+
+static struct trace_ui_line_queue trace_ui_lines;
 
+#define TRACE_LOG_BATCH 16384
 
-typedef struct tracetmp {
-  SIMPLEQ_ENTRY(tracetmp) link;
-  const char *s1;
-  const char *s2;
-} tracetmp_t;
+static char trace_logbuf[TRACE_LOG_BATCH];
+static int trace_logbuf_len;
 
 
 extern int trace_level;
@@ -132,102 +179,313 @@ trace_net(int level, const char *prefix, const char *str)
 /**
  *
  */
-void
-tracev(int flags, int level, const char *subsys, const char *fmt, va_list ap)
+static const char *
+trace_level_txt(int level)
 {
-  static char buf[1024];
-  char buf2[64];
-  char buf3[64];
-  char *s, *p;
-  const char *leveltxt;
-  int l;
-  struct tracetmp_queue q;
-  tracetmp_t *tt;
+  switch(level) {
+  case TRACE_EMERG: return "EMERG";
+  case TRACE_ERROR: return "ERROR";
+  case TRACE_INFO:  return "INFO";
+  case TRACE_DEBUG: return "DEBUG";
+  default:          return "?????";
+  }
+}
 
-  SIMPLEQ_INIT(&q);
 
-  if(!trace_initialized)
+/**
+ * Must be called with trace_mutex locked
+ */
+static void
+trace_log_flush(void)
+{
+  if(log_fd != -1 && trace_logbuf_len > 0 &&
+     write(log_fd, trace_logbuf, trace_logbuf_len) != trace_logbuf_len) {
+    close(log_fd);
+    log_fd = -1;
+  }
+  trace_logbuf_len = 0;
+}
+
+
+/**
+ * Must be called with trace_mutex locked
+ */
+static void
+trace_log_line(int64_t time, const char *prefix, const char *str)
+{
+  int ts = (time - log_start_ts) / 1000LL;
+  int len = strlen(prefix) + strlen(str) + 32;
+
+  if(log_fd == -1)
     return;
 
-  hts_mutex_lock(&trace_mutex);
+  if(trace_logbuf_len + len > TRACE_LOG_BATCH)
+    trace_log_flush();
 
-  switch(level) {
-  case TRACE_EMERG: leveltxt = "EMERG"; break;
-  case TRACE_ERROR: leveltxt = "ERROR"; break;
-  case TRACE_INFO:  leveltxt = "INFO";  break;
-  case TRACE_DEBUG: leveltxt = "DEBUG"; break;
-  default:          leveltxt = "?????"; break;
-  }
+  if(len > TRACE_LOG_BATCH)
+    return;
 
-  vsnprintf(buf, sizeof(buf), fmt, ap);
+  trace_logbuf_len +=
+    snprintf(trace_logbuf + trace_logbuf_len,
+             TRACE_LOG_BATCH - trace_logbuf_len,
+             "%02d:%02d:%02d.%03d: %s%s\n",
+             ts / 3600000,
+             (ts / 60000) % 60,
+             (ts / 1000) % 60,
+             ts % 1000,
+             prefix, str);
+}
 
-  p = buf;
 
-  snprintf(buf2, sizeof(buf2), "%s [%s]:", subsys, leveltxt);
+/**
+ * Must be called with trace_mutex locked
+ */
+static void
+trace_output(const trace_slot_t *ts)
+{
+  const char *leveltxt = trace_level_txt(ts->ts_level);
+  char buf2[96];
+  char *s, *p = (char *)ts->ts_msg;
+  int l;
+
+  snprintf(buf2, sizeof(buf2), "%s [%s]:", ts->ts_subsys, leveltxt);
   l = strlen(buf2);
 
   while((s = strsep(&p, "\n")) != NULL) {
     if(!*s)
       continue; // Avoid empty lines
 
-    trace_net(level, buf2, s);
+    trace_net(ts->ts_level, buf2, s);
 
-    if(level <= gconf.trace_level)
-      trace_arch(level, buf2, s);
-    if(!(flags & TRACE_NO_PROP) && level != TRACE_EMERG) {
-      tt = alloca(sizeof(tracetmp_t));
-      tt->s1 = mystrdupa(buf2);
-      tt->s2 = mystrdupa(s);
-      SIMPLEQ_INSERT_TAIL(&q, tt, link);
-      entries++;
-    }
-    if(log_fd != -1) {
-      int ts = (showtime_get_ts() - log_start_ts) / 1000LL;
-      snprintf(buf3, sizeof(buf3), "%02d:%02d:%02d.%03d: ",
-	       ts / 3600000,
-	       (ts / 60000) % 60,
-	       (ts / 1000) % 60,
-	       ts % 1000);
-
-      if(write(log_fd, buf3, strlen(buf3)) != strlen(buf3) ||
-	 write(log_fd, buf2, strlen(buf2)) != strlen(buf2) ||
-	 write(log_fd, s, strlen(s)) != strlen(s) ||
-	 write(log_fd, "\n", 1) != 1) {
-	close(log_fd);
-	log_fd = -1;
-      }
+    if(ts->ts_level <= gconf.trace_level)
+      trace_arch(ts->ts_level, buf2, s);
+
+    if(!(ts->ts_flags & TRACE_NO_PROP) && ts->ts_level != TRACE_EMERG) {
+      int plen = strlen(buf2) + 1;
+      trace_ui_line_t *tul = malloc(sizeof(trace_ui_line_t) + plen +
+                                    strlen(s) + 1);
+      tul->tul_level = ts->ts_level;
+      memcpy(tul->tul_prefix, buf2, plen);
+      tul->tul_message = tul->tul_prefix + plen;
+      strcpy(tul->tul_message, s);
+      TAILQ_INSERT_TAIL(&trace_ui_lines, tul, tul_link);
     }
+
+    trace_log_line(ts->ts_time, buf2, s);
     memset(buf2, ' ', l);
   }
+}
 
 
-  int zapcnt = 0;
-  if(entries > UI_LOG_LINES) {
-    zapcnt = entries - UI_LOG_LINES;
-    entries = UI_LOG_LINES;
-  }
-
-  hts_mutex_unlock(&trace_mutex);
+/**
+ * Add queued lines to the UI log. Only called from the drain thread
+ * without trace_mutex held
+ */
+static void
+trace_ui_output(struct trace_ui_line_queue *q)
+{
+  trace_ui_line_t *tul;
 
-  rstr_t *rlev = rstr_alloc(leveltxt);
+  while((tul = TAILQ_FIRST(q)) != NULL) {
+    TAILQ_REMOVE(q, tul, tul_link);
 
-  SIMPLEQ_FOREACH(tt, &q, link) {
     prop_t *p = prop_create_root(NULL);
 
-    prop_set_string(prop_create(p, "prefix"), tt->s1);
-    prop_set_string(prop_create(p, "message"), tt->s2);
-    prop_set_rstring(prop_create(p, "severity"), rlev);
-    
+    prop_set_string(prop_create(p, "prefix"), tul->tul_prefix);
+    prop_set_string(prop_create(p, "message"), tul->tul_message);
+    prop_set_string(prop_create(p, "severity"),
+                    trace_level_txt(tul->tul_level));
+
     if(prop_set_parent(p, log_root))
       abort();
+
+    if(++entries > UI_LOG_LINES) {
+      prop_destroy_first(log_root);
+      entries--;
+    }
+    free(tul);
+  }
+}
+
+
+/**
+ * Output all published messages. Returns number of messages processed
+ *
+ * Must be called with trace_mutex locked
+ */
+static int
+trace_drain(void)
+{
+  int cnt = 0;
+
+  while(1) {
+    trace_slot_t *ts = &trace_ring[trace_tail & (TRACE_RING_SIZE - 1)];
+
+    if(ts->ts_seq != trace_tail + 1)
+      break;
+
+    __sync_synchronize();
+    trace_output(ts);
+    __sync_synchronize();
+
+    ts->ts_seq = trace_tail + TRACE_RING_SIZE;
+    __sync_synchronize();
+    trace_tail++;
+    cnt++;
+  }
+
+  int dropped = trace_dropped;
+  if(dropped) {
+    char msg[64];
+    atomic_add(&trace_dropped, -dropped);
+    snprintf(msg, sizeof(msg), "%d log messages dropped", dropped);
+    trace_arch(TRACE_ERROR, "trace [ERROR]:", msg);
+    trace_log_line(showtime_get_ts(), "trace [ERROR]:", msg);
+  }
+
+  trace_log_flush();
+  return cnt;
+}
+
+
+/**
+ *
+ */
+static void *
+trace_drain_thread(void *aux)
+{
+  struct trace_ui_line_queue q;
+
+  trace_drainer_tid = hts_thread_current();
+
+  hts_mutex_lock(&trace_mutex);
+  while(1) {
+    int cnt = trace_drain();
+
+    if(TAILQ_FIRST(&trace_ui_lines) != NULL) {
+      TAILQ_MOVE(&q, &trace_ui_lines, tul_link);
+      hts_mutex_unlock(&trace_mutex);
+      trace_ui_output(&q);
+      hts_mutex_lock(&trace_mutex);
+    }
+
+    if(cnt)
+      continue;
+
+    // Producers only signal when we are idle, wakeups might get lost so
+    // don't sleep for too long
+    trace_drainer_idle = 1;
+    __sync_synchronize();
+    if(!trace_drain())
+      hts_cond_wait_timeout(&trace_cond, &trace_mutex, 100);
+    trace_drainer_idle = 0;
+  }
+  return NULL;
+}
+
+
+/**
+ * We are probably about to die, so output right away without going
+ * through the ring (which might be full)
+ */
+static void
+trace_emerg(int flags, const char *subsys, const char *fmt, va_list ap)
+{
+  trace_slot_t ts;
+
+  ts.ts_flags = flags;
+  ts.ts_level = TRACE_EMERG;
+  ts.ts_time = showtime_get_ts();
+  snprintf(ts.ts_subsys, sizeof(ts.ts_subsys), "%s", subsys);
+  vsnprintf(ts.ts_msg, sizeof(ts.ts_msg), fmt, ap);
+
+  hts_mutex_lock(&trace_mutex);
+  trace_drain();
+  trace_output(&ts);
+  trace_log_flush();
+  hts_mutex_unlock(&trace_mutex);
+}
+
+
+/**
+ * The drain thread can't wait for a slot to free up since it is the
+ * one freeing them. Only reserve a ticket if its slot is free already.
+ * Slots are handed back before trace_tail moves past them, so a stale
+ * trace_tail can only make us drop more than needed
+ */
+static int
+trace_reserve_from_drainer(void)
+{
+  int ticket;
+
+  do {
+    ticket = trace_head;
+    if(ticket - trace_tail >= TRACE_RING_SIZE)
+      return -1;
+  } while(!__sync_bool_compare_and_swap(&trace_head, ticket, ticket + 1));
+  return ticket;
+}
+
+
+/**
+ *
+ */
+void
+tracev(int flags, int level, const char *subsys, const char *fmt, va_list ap)
+{
+  trace_slot_t *ts;
+  int ticket;
+
+  if(!trace_initialized)
+    return;
+
+  if(level == TRACE_EMERG) {
+    trace_emerg(flags, subsys, fmt, ap);
+    return;
   }
 
-  rstr_release(rlev);
+  if(hts_thread_current() == trace_drainer_tid) {
+
+    if((ticket = trace_reserve_from_drainer()) == -1) {
+      atomic_add(&trace_dropped, 1);
+      return;
+    }
+    ts = &trace_ring[ticket & (TRACE_RING_SIZE - 1)];
+
+  } else {
+
+    if(trace_head - trace_tail >= TRACE_RING_SIZE) {
+      atomic_add(&trace_dropped, 1);
+      return;
+    }
 
-  while(zapcnt > 0) {
-    prop_destroy_first(log_root);
-    zapcnt--;
+    ticket = atomic_add(&trace_head, 1);
+    ts = &trace_ring[ticket & (TRACE_RING_SIZE - 1)];
+
+    // Raced with other producers for the last free slot. Drain on our
+    // own as the drainer might be stuck on a lock we are holding
+    while(ts->ts_seq != ticket) {
+      hts_mutex_lock(&trace_mutex);
+      trace_drain();
+      hts_mutex_unlock(&trace_mutex);
+      if(ts->ts_seq != ticket)
+        usleep(1000);
+    }
   }
+
+  __sync_synchronize();
+
+  ts->ts_flags = flags;
+  ts->ts_level = level;
+  ts->ts_time = showtime_get_ts();
+  snprintf(ts->ts_subsys, sizeof(ts->ts_subsys), "%s", subsys);
+  vsnprintf(ts->ts_msg, sizeof(ts->ts_msg), fmt, ap);
+
+  __sync_synchronize();
+  ts->ts_seq = ticket + 1;
+
+  if(trace_drainer_idle)
+    hts_cond_signal(&trace_cond);
 }
 
 
@@ -282,6 +540,7 @@ void
 trace_fini(void)
 {
   hts_mutex_lock(&trace_mutex);
+  trace_drain();
   static const char logmark[] = "--MARK-- END\n";
   if(write(log_fd, logmark, strlen(logmark))) {}
   close(log_fd);
@@ -332,6 +591,14 @@ trace_init(void)
   log_start_ts = showtime_get_ts();
   log_root = prop_create(prop_get_global(), "logbuffer");
   hts_mutex_init(&trace_mutex);
+  hts_cond_init(&trace_cond, &trace_mutex);
+  TAILQ_INIT(&trace_ui_lines);
+
+  for(i = 0; i < TRACE_RING_SIZE; i++)
+    trace_ring[i].ts_seq = i;
+
+  hts_thread_create_detached("trace", trace_drain_thread, NULL,
+                             THREAD_PRIO_BGTASK);
   trace_initialized = 1;
   extern const char *htsversion_full;
 
@@ -28,6 +28,7 @@
 #include "keymapper.h"
 
 #include "arch/threads.h"
+#include "misc/profiler.h"
 #include "text/text.h"
 
 #include "glw.h"
@@ -464,6 +465,7 @@ void
 glw_prepare_frame(glw_root_t *gr, int flags)
 {
   glw_t *w;
+  int64_t t = prof_begin();
 
   glw_update_sizes(gr);
 
@@ -526,6 +528,7 @@ glw_prepare_frame(glw_root_t *gr, int flags)
       glw_focus_leave(gr->gr_current_focus);
     }
   }
+  prof_end(t, "glw", "prepare");
 }
 
 
@@ -41,6 +41,7 @@
 #include "misc/str.h"
 #include "navigator.h"
 #include "arch/arch.h"
+#include "misc/profiler.h"
 
 #include <psl1ght/lv2.h>
 #include <rsx/commands.h>
@@ -512,8 +513,14 @@ drawFrame(glw_ps3_t *gp, int buffer, int with_universe)
   glw_rctx_t rc;
   glw_rctx_init(&rc, gp->gr.gr_width * gp->scale, gp->gr.gr_height, 1);
   rc.rc_alpha = 1 - gp->gp_stop * 0.1;
+
+  int64_t t = prof_begin();
   glw_layout0(gp->gr.gr_universe, &rc);
+  prof_end(t, "glw", "layout");
+
+  t = prof_begin();
   glw_render0(gp->gr.gr_universe, &rc);
+  prof_end(t, "glw", "render");
   glw_unlock(&gp->gr);
 }
 
@@ -29,6 +29,7 @@
 #include "glw_texture.h"
 
 #include "backend/backend.h"
+#include "misc/profiler.h"
 
 
 /**
@@ -253,8 +254,10 @@ loader_thread(void *aux)
       cancellable_reset(&glt->glt_cancellable);
 
       glw_unlock(gr);
+      int64_t t = prof_begin();
       pm = backend_imageloader(url, &im, gr->gr_vpaths, errbuf, sizeof(errbuf),
 			       ccptr, &glt->glt_cancellable);
+      prof_end(t, "tex", "load");
 
       glw_lock(gr);
 
@@ -321,7 +324,9 @@ loader_thread(void *aux)
             glt->glt_xs            = pm->pm_width;
             glt->glt_ys            = pm->pm_height;
 
+	    t = prof_begin();
 	    glt->glt_size          = glw_tex_backend_load(gr, glt, pm);
+	    prof_end(t, "tex", "upload");
 	  }
 	}
 
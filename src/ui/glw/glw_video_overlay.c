@@ -29,6 +29,13 @@
 #include "subtitles/video_overlay.h"
 #include "subtitles/dvdspu.h"
 
+/**
+ * Text overlays are created this far ahead of their start time so the
+ * font render thread has them rasterized by the time they're shown
+ */
+#define GVO_LOOKAHEAD     5000000
+#define GVO_LOOKAHEAD_MAX 8
+
 /**
  *
  */
@@ -75,6 +82,8 @@ typedef struct glw_video_overlay {
 			       video frame */
   int gvo_layer;
 
+  int gvo_pending;  /* Created ahead of gvo_start, not yet visible */
+
 } glw_video_overlay_t;
 
 
@@ -122,7 +131,7 @@ gvo_flush_all(glw_video_t *gv)
 
 
 /**
- * Destroy all overlays without an end time
+ * Destroy all visible overlays without an end time
  */
 static void
 gvo_flush_infinite(glw_video_t *gv)
@@ -132,12 +141,56 @@ gvo_flush_infinite(glw_video_t *gv)
   for(gvo = LIST_FIRST(&gv->gv_overlays); gvo != NULL; gvo = next) {
     next = LIST_NEXT(gvo, gvo_link);
 
+    if(gvo->gvo_pending)
+      continue;
+
     if(gvo->gvo_stop == PTS_UNSET || gvo->gvo_stop_estimated)
       gvo_destroy(gv, gvo);
   }
 }
 
 
+/**
+ *
+ */
+static int
+gvo_num_pending(glw_video_t *gv)
+{
+  glw_video_overlay_t *gvo;
+  int cnt = 0;
+
+  LIST_FOREACH(gvo, &gv->gv_overlays, gvo_link)
+    cnt += gvo->gvo_pending;
+  return cnt;
+}
+
+
+/**
+ * Make pending overlays that are due visible. Same as when they
+ * are dequeued at their start time, they replace overlays without
+ * an end time
+ */
+static void
+gvo_activate(glw_video_t *gv, int64_t pts)
+{
+  glw_video_overlay_t *gvo;
+  int due = 0;
+
+  LIST_FOREACH(gvo, &gv->gv_overlays, gvo_link)
+    if(gvo->gvo_pending && gvo->gvo_start <= pts)
+      due = 1;
+
+  if(!due)
+    return;
+
+  gvo_flush_infinite(gv);
+
+  LIST_FOREACH(gvo, &gv->gv_overlays, gvo_link)
+    if(gvo->gvo_pending && gvo->gvo_start <= pts)
+      gvo->gvo_pending = 0;
+}
+
+
 /**
  *
  */
@@ -147,9 +200,14 @@ gvo_set_pts(glw_video_t *gv, int64_t pts)
   glw_video_overlay_t *gvo, *next;
   float a;
 
+  gvo_activate(gv, pts);
+
   for(gvo = LIST_FIRST(&gv->gv_overlays); gvo != NULL; gvo = next) {
     next = LIST_NEXT(gvo, gvo_link);
 
+    if(gvo->gvo_pending)
+      continue;
+
     if(gvo->gvo_stop != PTS_UNSET && gvo->gvo_stop <= pts) {
       gvo_destroy(gv, gvo);
       continue;
@@ -234,6 +292,14 @@ glw_video_overlay_layout(glw_video_t *gv, glw_rctx_t *frc, glw_rctx_t *vrc)
     f[2] = scaling * gvo->gvo_padding_right;
     f[3] = 0;
 
+    if(gvo->gvo_pending) {
+      /* Lay it out so it gets rendered, but it must not push
+	 visible overlays around */
+      gc->gc_set_padding(w, f);
+      glw_layout0(w, rc);
+      continue;
+    }
+
     switch(gvo->gvo_alignment) {
     case LAYOUT_ALIGN_TOP:
     case LAYOUT_ALIGN_TOP_LEFT:
@@ -280,6 +346,9 @@ glw_video_overlay_render(glw_video_t *gv, const glw_rctx_t *frc,
 
   LIST_FOREACH(gvo, &gv->gv_overlays, gvo_link) {
 
+    if(gvo->gvo_pending)
+      continue;
+
     if(gv->gv_vo_on_video || gvo->gvo_videoframe_align)
       rc0 = *vrc;
     else
@@ -734,7 +803,7 @@ gvo_padding_cmp(const glw_video_overlay_t *a, const glw_video_overlay_t *b)
  *
  */
 static void
-gvo_create_from_vo_text(glw_video_t *gv, video_overlay_t *vo)
+gvo_create_from_vo_text(glw_video_t *gv, video_overlay_t *vo, int64_t pts)
 {
   const glw_class_t *gc = glw_class_find_by_name("label");
   
@@ -743,6 +812,8 @@ gvo_create_from_vo_text(glw_video_t *gv, video_overlay_t *vo)
 
   glw_video_overlay_t *gvo = gvo_create(vo->vo_start, GVO_TEXT);
 
+  gvo->gvo_pending        = vo->vo_start > pts;
+
   gvo->gvo_stop           = vo->vo_stop;
   gvo->gvo_stop_estimated = vo->vo_stop_estimated;
   gvo->gvo_fadein         = vo->vo_fadein;
@@ -818,10 +889,12 @@ glw_video_overlay_sub_set_pts(glw_video_t *gv, int64_t pts)
       continue;
 
     case VO_TEXT:
-      if(vo->vo_start > pts)
+      if(vo->vo_start > pts + GVO_LOOKAHEAD ||
+         (vo->vo_start > pts && gvo_num_pending(gv) >= GVO_LOOKAHEAD_MAX))
         break;
-      gvo_flush_infinite(gv);
-      gvo_create_from_vo_text(gv, vo);
+      if(vo->vo_start <= pts)
+        gvo_flush_infinite(gv);
+      gvo_create_from_vo_text(gv, vo, pts);
       video_overlay_dequeue_destroy(mp, vo);
       continue;
 
@@ -42,6 +42,7 @@
 #include "ui/linux/nvidia.h"
 #include "settings.h"
 #include "navigator.h"
+#include "misc/profiler.h"
 
 #include "glw_settings.h"
 #if ENABLE_VALGRIND
@@ -931,8 +932,13 @@ layout_draw(glw_x11_t *gx11)
   
   glw_rctx_init(&rc, gx11->gr.gr_width, gx11->gr.gr_height, 1);
 
+  int64_t t = prof_begin();
   glw_layout0(gx11->gr.gr_universe, &rc);
+  prof_end(t, "glw", "layout");
+
+  t = prof_begin();
   glw_render0(gx11->gr.gr_universe, &rc);
+  prof_end(t, "glw", "render");
 }
 
 
@@ -1185,7 +1191,9 @@ glw_x11_mainloop(glw_x11_t *gx11)
 
       clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &req, NULL);
     }
+    int64_t t = prof_begin();
     glXSwapBuffers(gx11->display, gx11->win);
+    prof_end(t, "glw", "swap");
 
 #ifdef CONFIG_NVCTRL
     if(gx11->nvidia != NULL)
@@ -33,6 +33,7 @@
 #include "fileaccess/fileaccess.h"
 #include "db/kvstore.h"
 #include "metadata/playinfo.h"
+#include "htsmsg/htsbuf.h"
 
 /**
  * UPNP browse request
@@ -67,6 +68,9 @@ typedef struct upnp_browse {
 
   int ub_loaded_entries;
   int ub_total_entries;
+  int ub_prefetched_entries;   // Pages up to here are in page cache
+  unsigned int ub_update_id;   // Container UpdateID from last response
+  int ub_have_update_id;
 
   prop_sub_t *ub_sortsub;
   const char *ub_sortcriteria;
@@ -295,89 +299,365 @@ add_container(htsmsg_t *item, prop_t *root, const char *baseurl,
     prop_destroy(c);
 }
 
+#define UPNP_BROWSE_PAGE_SIZE    500
+#define UPNP_BROWSE_LOOKAHEAD    1    // Pages fetched ahead of the paginator
+#define UPNP_PAGE_CACHE_SIZE     (4 * 1024 * 1024)
+
+/**
+ * Cached DIDL-Lite page. Only valid as long as the container's
+ * UpdateID is unchanged
+ */
+typedef struct upnp_page {
+  TAILQ_ENTRY(upnp_page) up_link;
+  char *up_key;
+  int up_start;
+  unsigned int up_update_id;
+  int up_total_matches;
+  int up_number_returned;
+  char *up_didl;
+  size_t up_len;
+} upnp_page_t;
+
+TAILQ_HEAD(upnp_page_queue, upnp_page);
+
+static struct upnp_page_queue upnp_pages; // LRU order, most recent first
+static size_t upnp_page_cache_size;
+static hts_mutex_t upnp_page_mutex;
+
+
 /**
  *
  */
 static void
-nodes_from_meta(htsmsg_t *meta, prop_t *root, const char *trackid,
-		prop_t **trackptr, const char *baseurl, prop_sub_t *skip)
+upnp_page_destroy(upnp_page_t *up)
 {
-  htsmsg_t *items;
-  htsmsg_field_t *f;
+  TAILQ_REMOVE(&upnp_pages, up, up_link);
+  upnp_page_cache_size -= up->up_len;
+  free(up->up_key);
+  free(up->up_didl);
+  free(up);
+}
 
-  items = htsmsg_get_map_multi(meta, "tags", "DIDL-Lite", "tags", NULL);
-  if(items == NULL)
-    return;
 
-  HTSMSG_FOREACH(f, items) {
-    if(!strcmp(f->hmf_name, "item")) {
-      htsmsg_t *item = htsmsg_get_map_by_field(f);
-      if(item != NULL)
-	add_item(item, root, trackid, trackptr, skip, baseurl);
-    } else if(baseurl != NULL && !strcmp(f->hmf_name, "container")) {
-      htsmsg_t *container = htsmsg_get_map_by_field(f);
-      if(container != NULL)
-	add_container(container, root, baseurl, skip);
+/**
+ * Key for a page in cache. Same container with other sort order is
+ * a different set of pages
+ */
+static char *
+upnp_page_key(const char *uri, const char *id, const char *sortcriteria)
+{
+  size_t len = strlen(uri) + strlen(id) + strlen(sortcriteria) + 3;
+  char *key = malloc(len);
+  snprintf(key, len, "%s\n%s\n%s", uri, id, sortcriteria);
+  return key;
+}
+
+
+/**
+ * Takes ownership of 'didl'
+ */
+static void
+upnp_page_cache_put(const char *key, int start, unsigned int update_id,
+                    int total_matches, int number_returned,
+                    char *didl, size_t len)
+{
+  upnp_page_t *up;
+
+  hts_mutex_lock(&upnp_page_mutex);
+
+  TAILQ_FOREACH(up, &upnp_pages, up_link)
+    if(up->up_start == start && !strcmp(up->up_key, key))
+      break;
+
+  if(up != NULL)
+    upnp_page_destroy(up);
+
+  up = calloc(1, sizeof(upnp_page_t));
+  up->up_key = strdup(key);
+  up->up_start = start;
+  up->up_update_id = update_id;
+  up->up_total_matches = total_matches;
+  up->up_number_returned = number_returned;
+  up->up_didl = didl;
+  up->up_len = len;
+  TAILQ_INSERT_HEAD(&upnp_pages, up, up_link);
+  upnp_page_cache_size += len;
+
+  while(upnp_page_cache_size > UPNP_PAGE_CACHE_SIZE &&
+        (up = TAILQ_LAST(&upnp_pages, upnp_page_queue)) != NULL)
+    upnp_page_destroy(up);
+
+  hts_mutex_unlock(&upnp_page_mutex);
+}
+
+
+/**
+ * Returns a malloced copy of the DIDL-Lite document for the page or
+ * NULL if not in cache (or stale)
+ */
+static char *
+upnp_page_cache_get(const char *key, int start, unsigned int update_id,
+                    int *total_matches, int *number_returned, size_t *lenp)
+{
+  upnp_page_t *up;
+  char *r = NULL;
+
+  hts_mutex_lock(&upnp_page_mutex);
+
+  TAILQ_FOREACH(up, &upnp_pages, up_link)
+    if(up->up_start == start && !strcmp(up->up_key, key))
+      break;
+
+  if(up != NULL) {
+    if(up->up_update_id != update_id) {
+      upnp_page_destroy(up);
+    } else {
+      TAILQ_REMOVE(&upnp_pages, up, up_link);
+      TAILQ_INSERT_HEAD(&upnp_pages, up, up_link);
+      r = malloc(up->up_len);
+      memcpy(r, up->up_didl, up->up_len);
+      *lenp = up->up_len;
+      *total_matches = up->up_total_matches;
+      *number_returned = up->up_number_returned;
     }
   }
+  hts_mutex_unlock(&upnp_page_mutex);
+  return r;
 }
 
 
 /**
  *
  */
-int
-upnp_browse_children(const char *uri, const char *id, prop_t *nodes,
-		     const char *trackid, prop_t **trackptr)
+static void
+upnp_page_cache_init(void)
+{
+  TAILQ_INIT(&upnp_pages);
+  hts_mutex_init(&upnp_page_mutex);
+}
+
+INITME(INIT_GROUP_API, upnp_page_cache_init);
+
+
+/**
+ * State for a streamed Browse request
+ */
+typedef struct browse_stream {
+  htsmsg_xml_stream_t *bs_didl;  // Parser for the embedded DIDL-Lite doc
+  htsbuf_queue_t *bs_capture;    // If set, raw DIDL-Lite is copied here
+
+  prop_t *bs_root;
+  const char *bs_trackid;
+  prop_t **bs_trackptr;
+  const char *bs_baseurl;
+  prop_sub_t *bs_skip;
+
+  int bs_have_result;
+  int bs_total_matches;    // -1 if not in response
+  int bs_number_returned;  // -1 if not in response
+  int bs_have_update_id;
+  unsigned int bs_update_id;
+} browse_stream_t;
+
+
+/**
+ *
+ */
+static int
+bs_item(void *opaque, const char *name, htsmsg_t *item)
+{
+  browse_stream_t *bs = opaque;
+  add_item(item, bs->bs_root, bs->bs_trackid, bs->bs_trackptr,
+	   bs->bs_skip, bs->bs_baseurl);
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int
+bs_container(void *opaque, const char *name, htsmsg_t *container)
+{
+  browse_stream_t *bs = opaque;
+  if(bs->bs_baseurl != NULL)
+    add_container(container, bs->bs_root, bs->bs_baseurl, bs->bs_skip);
+  return 0;
+}
+
+
+/**
+ * The DIDL-Lite document is XML escaped inside the Result element
+ * so we parse it while the outer response is still being received
+ */
+static int
+bs_result(void *opaque, const char *data, size_t len)
+{
+  browse_stream_t *bs = opaque;
+
+  bs->bs_have_result = 1;
+
+  if(bs->bs_capture != NULL && data != NULL)
+    htsbuf_append(bs->bs_capture, data, len);
+
+  if(bs->bs_root == NULL)
+    return 0; // Only prefetching
+
+  if(data == NULL)
+    return htsmsg_xml_stream_finish(bs->bs_didl);
+  return htsmsg_xml_stream_feed(bs->bs_didl, data, len);
+}
+
+
+/**
+ *
+ */
+static int
+bs_arg(void *opaque, const char *name, htsmsg_t *arg)
+{
+  browse_stream_t *bs = opaque;
+  const char *str = htsmsg_get_str(arg, "cdata");
+
+  if(str == NULL)
+    return 0;
+
+  if(!strcmp(name, "TotalMatches"))
+    bs->bs_total_matches = atoi(str);
+  else if(!strcmp(name, "NumberReturned"))
+    bs->bs_number_returned = atoi(str);
+  else if(!strcmp(name, "UpdateID")) {
+    bs->bs_update_id = strtoul(str, NULL, 10);
+    bs->bs_have_update_id = 1;
+  }
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+browse_stream_init(browse_stream_t *bs)
+{
+  bs->bs_didl = htsmsg_xml_stream_create();
+  bs->bs_have_result = 0;
+  bs->bs_have_update_id = 0;
+  bs->bs_total_matches = -1;
+  bs->bs_number_returned = -1;
+
+  htsmsg_xml_stream_on_element(bs->bs_didl, "DIDL-Lite/item", bs_item, bs);
+  htsmsg_xml_stream_on_element(bs->bs_didl, "DIDL-Lite/container",
+			       bs_container, bs);
+}
+
+
+/**
+ * Add items from a cached DIDL-Lite document
+ */
+static int
+browse_didl(browse_stream_t *bs, const char *didl, size_t len,
+	    char *errbuf, size_t errlen)
 {
   int r;
-  htsmsg_t *in = htsmsg_create_map(), *out;
-  char errbuf[200];
-  const char *result;
-  htsmsg_t *meta;
 
-  if(trackptr != NULL)
-    *trackptr = NULL;
+  browse_stream_init(bs);
+
+  r = htsmsg_xml_stream_feed(bs->bs_didl, didl, len) ||
+    htsmsg_xml_stream_finish(bs->bs_didl);
+
+  if(r)
+    snprintf(errbuf, errlen, "Malformed XML: %s",
+	     htsmsg_xml_stream_error(bs->bs_didl));
+
+  htsmsg_xml_stream_destroy(bs->bs_didl);
+  return r ? -1 : 0;
+}
+
+
+/**
+ * Issue a Browse request for children of 'id'. Items are added to
+ * bs_root as they are received. If bs_root is NULL the result is
+ * only captured into bs_capture
+ */
+static int
+browse_stream(const char *uri, const char *id, int start, int count,
+	      const char *sortcriteria, browse_stream_t *bs,
+	      char *errbuf, size_t errlen)
+{
+  int r;
+  htsmsg_t *in = htsmsg_create_map();
+  htsmsg_xml_stream_t *xs = htsmsg_xml_stream_create();
+
+  browse_stream_init(bs);
+
+  htsmsg_xml_stream_on_cdata(xs, "Envelope/Body/*/Result", bs_result, bs);
+  htsmsg_xml_stream_on_element(xs, "Envelope/Body/*/TotalMatches",
+			       bs_arg, bs);
+  htsmsg_xml_stream_on_element(xs, "Envelope/Body/*/NumberReturned",
+			       bs_arg, bs);
+  htsmsg_xml_stream_on_element(xs, "Envelope/Body/*/UpdateID",
+			       bs_arg, bs);
 
   htsmsg_add_str(in, "ObjectID", id);
   htsmsg_add_str(in, "BrowseFlag", "BrowseDirectChildren");
   htsmsg_add_str(in, "Filter", "*");
-  htsmsg_add_u32(in, "StartingIndex", 0);
-  htsmsg_add_u32(in, "RequestedCount", 0);
-  htsmsg_add_str(in, "SortCriteria", "");
-  r = soap_exec(uri, "ContentDirectory", 1, "Browse", in, &out,
-		errbuf, sizeof(errbuf));
+  htsmsg_add_u32(in, "StartingIndex", start);
+  htsmsg_add_u32(in, "RequestedCount", count);
+  htsmsg_add_str(in, "SortCriteria", sortcriteria);
+
+  r = soap_exec_stream(uri, "ContentDirectory", 1, "Browse", in, xs,
+		       errbuf, errlen);
   htsmsg_destroy(in);
-  if(r) {
-    TRACE(TRACE_ERROR, "UPNP", 
-	  "Browse %s via %s -- %s", id, uri, errbuf);
-    return -1;
-  }
 
-  if(out == NULL) {
-    TRACE(TRACE_ERROR, "UPNP", 
-	  "Browse %s via %s -- No returned varibles", uri, id);
-    return -1;
-  }
-  
-  if((result = htsmsg_get_str(out, "Result")) == NULL) {
-    TRACE(TRACE_ERROR, "UPNP", 
-	  "Browse %s via %s -- No returned result", uri, id);
-    htsmsg_destroy(out);
-    return -1;
-  }
+  if(r && *htsmsg_xml_stream_error(bs->bs_didl))
+    snprintf(errbuf, errlen, "Malformed XML: %s",
+	     htsmsg_xml_stream_error(bs->bs_didl));
 
-  meta = htsmsg_xml_deserialize(strdup(result), errbuf, sizeof(errbuf));
-  if(meta == NULL) {
-    TRACE(TRACE_ERROR, "UPNP", 
-	  "Browse %s via %s -- XML error %s", uri, id, errbuf);
-    htsmsg_destroy(out);
-    return -1;
+  if(!r && !bs->bs_have_result) {
+    snprintf(errbuf, errlen, "No SOAP result");
+    r = -1;
   }
 
-  nodes_from_meta(meta, nodes, trackid, trackptr, NULL, NULL);
-  htsmsg_destroy(meta);
-  htsmsg_destroy(out);
+  htsmsg_xml_stream_destroy(bs->bs_didl);
+  htsmsg_xml_stream_destroy(xs);
+  return r;
+}
+
+
+/**
+ *
+ */
+int
+upnp_browse_children(const char *uri, const char *id, prop_t *nodes,
+		     const char *trackid, prop_t **trackptr)
+{
+  char errbuf[200];
+  browse_stream_t bs = {0};
+  int start = 0;
+
+  if(trackptr != NULL)
+    *trackptr = NULL;
+
+  bs.bs_root = nodes;
+  bs.bs_trackid = trackid;
+  bs.bs_trackptr = trackptr;
+
+  // Fetch in pages to keep the size of each response bounded
+  while(1) {
+    if(browse_stream(uri, id, start, UPNP_BROWSE_PAGE_SIZE, "", &bs,
+		     errbuf, sizeof(errbuf))) {
+      TRACE(TRACE_ERROR, "UPNP",
+	    "Browse %s via %s -- %s", id, uri, errbuf);
+      return -1;
+    }
+
+    if(bs.bs_number_returned <= 0)
+      break;
+    start += bs.bs_number_returned;
+    // TotalMatches of 0 means unknown, keep going until nothing returned
+    if(bs.bs_total_matches > 0 && start >= bs.bs_total_matches)
+      break;
+  }
   return 0;
 }
 
@@ -403,65 +683,130 @@ browse_fail(upnp_browse_t *ub, const char *fmt, ...)
 
 
 /**
- *
+ * Load next page into the items node. From page cache if it was
+ * prefetched and the container is unchanged, otherwise from server
  */
-static void 
+static void
 browse_items(upnp_browse_t *ub)
 {
-  int r;
-  htsmsg_t *in = htsmsg_create_map(), *out;
   char errbuf[200];
-  const char *result, *str;
-  htsmsg_t *meta;
+  browse_stream_t bs = {0};
+  char *key = upnp_page_key(ub->ub_control_url, ub->ub_id,
+                            ub->ub_sortcriteria);
+  char *didl = NULL;
+  size_t len;
+  int r;
 
-  htsmsg_add_str(in, "ObjectID", ub->ub_id);
-  htsmsg_add_str(in, "BrowseFlag", "BrowseDirectChildren");
-  htsmsg_add_str(in, "Filter", "*");
-  htsmsg_add_u32(in, "StartingIndex", ub->ub_loaded_entries);
-  htsmsg_add_u32(in, "RequestedCount", 500);
-  htsmsg_add_str(in, "SortCriteria", ub->ub_sortcriteria);
+  bs.bs_root = ub->ub_items;
+  bs.bs_baseurl = ub->ub_base_url;
+  bs.bs_skip = ub->ub_itemsub;
+
+  if(ub->ub_loaded_entries == 0)
+    ub->ub_prefetched_entries = 0;
+
+  if(ub->ub_have_update_id && ub->ub_loaded_entries > 0)
+    didl = upnp_page_cache_get(key, ub->ub_loaded_entries, ub->ub_update_id,
+                               &bs.bs_total_matches, &bs.bs_number_returned,
+                               &len);
+
+  if(didl != NULL) {
+    int total_matches = bs.bs_total_matches;
+    int number_returned = bs.bs_number_returned;
+    r = browse_didl(&bs, didl, len, errbuf, sizeof(errbuf));
+    bs.bs_total_matches = total_matches;
+    bs.bs_number_returned = number_returned;
+    free(didl);
+  } else {
+    r = browse_stream(ub->ub_control_url, ub->ub_id, ub->ub_loaded_entries,
+                      UPNP_BROWSE_PAGE_SIZE, ub->ub_sortcriteria, &bs,
+                      errbuf, sizeof(errbuf));
 
-  r = soap_exec(ub->ub_control_url, "ContentDirectory", 1, "Browse", in, &out,
-		errbuf, sizeof(errbuf));
-  htsmsg_destroy(in);
+    ub->ub_have_update_id = bs.bs_have_update_id;
+    ub->ub_update_id = bs.bs_update_id;
+  }
+
+  free(key);
 
   if(r)
     return browse_fail(ub, "%s", errbuf);
 
-  if(out == NULL)
-    return browse_fail(ub, "Malformed SOAP response, no returned variabled");
-  
-  str = htsmsg_get_str(out, "TotalMatches");
-  if(str != NULL) {
-    ub->ub_total_entries = atoi(str);
+  if(bs.bs_number_returned >= 0) {
+    ub->ub_loaded_entries += bs.bs_number_returned;
   } else {
     ub->ub_run = 0;
   }
 
-  str = htsmsg_get_str(out, "NumberReturned");
-  if(str != NULL) {
-    ub->ub_loaded_entries = atoi(str) + ub->ub_loaded_entries;
+  if(bs.bs_total_matches > 0) {
+    ub->ub_total_entries = bs.bs_total_matches;
+  } else if(bs.bs_total_matches == 0) {
+    /*
+     * Servers may report 0 if the total is unknown. Assume there is
+     * more as long as we get something back
+     */
+    ub->ub_total_entries = ub->ub_loaded_entries +
+      (bs.bs_number_returned > 0);
   } else {
     ub->ub_run = 0;
   }
 
-  if((result = htsmsg_get_str(out, "Result")) == NULL)
-    return browse_fail(ub, "No SOAP result");
+  TRACE(TRACE_DEBUG, "UPNP", "Browsed %d of %d items%s",
+	ub->ub_loaded_entries, ub->ub_total_entries,
+        didl != NULL ? " (cached)" : "");
 
-  meta = htsmsg_xml_deserialize(strdup(result), errbuf, sizeof(errbuf));
-  if(meta == NULL)
-    return browse_fail(ub, "Malformed XML: %s", errbuf);
+  prop_have_more_childs(ub->ub_items,
+                        ub->ub_loaded_entries < ub->ub_total_entries);
+}
 
-  nodes_from_meta(meta, ub->ub_items, NULL, NULL, 
-		  ub->ub_base_url, ub->ub_itemsub);
 
-  TRACE(TRACE_DEBUG, "UPNP", "Browsed %d of %d items",
-	ub->ub_loaded_entries, ub->ub_total_entries);
+/**
+ * Fetch pages ahead of what has been loaded into the page cache so
+ * the next PROP_WANT_MORE_CHILDS can be served without a round trip.
+ *
+ * Only done if the server reports UpdateID, without it we can't tell
+ * if the cached page is still valid
+ */
+static void
+browse_prefetch(upnp_browse_t *ub)
+{
+  char errbuf[200];
+  int start = MAX(ub->ub_loaded_entries, ub->ub_prefetched_entries);
+  const int end = MIN(ub->ub_total_entries,
+                      ub->ub_loaded_entries +
+                      UPNP_BROWSE_LOOKAHEAD * UPNP_BROWSE_PAGE_SIZE);
 
-  htsmsg_destroy(meta);
-  prop_have_more_childs(ub->ub_items,
-                        ub->ub_loaded_entries < ub->ub_total_entries);
-  htsmsg_destroy(out);
+  if(!ub->ub_have_update_id)
+    return;
+
+  char *key = upnp_page_key(ub->ub_control_url, ub->ub_id,
+                            ub->ub_sortcriteria);
+
+  while(start < end && ub->ub_run) {
+    browse_stream_t bs = {0};
+    htsbuf_queue_t hq;
+
+    htsbuf_queue_init(&hq, 0);
+    bs.bs_capture = &hq;
+
+    if(browse_stream(ub->ub_control_url, ub->ub_id, start,
+                     UPNP_BROWSE_PAGE_SIZE, ub->ub_sortcriteria, &bs,
+                     errbuf, sizeof(errbuf)) ||
+       !bs.bs_have_update_id || bs.bs_update_id != ub->ub_update_id ||
+       bs.bs_number_returned <= 0) {
+      htsbuf_queue_flush(&hq);
+      break;
+    }
+
+    size_t len = hq.hq_size;
+    char *didl = malloc(len);
+    htsbuf_read(&hq, didl, len);
+
+    upnp_page_cache_put(key, start, bs.bs_update_id, bs.bs_total_matches,
+                        bs.bs_number_returned, didl, len);
+
+    start += bs.bs_number_returned;
+    ub->ub_prefetched_entries = start;
+  }
+  free(key);
 }
 
 
@@ -733,12 +1078,27 @@ browse_directory(upnp_browse_t *ub, const char *title)
   prop_set_int(ub->ub_loading, 0);
   while(ub->ub_run) {
 
-    prop_courier_wait_and_dispatch(pc);
-    
+    // Dispatch anything that arrived while we were busy
+    prop_courier_poll(pc);
+
     if(ub->ub_load_more) {
       ub->ub_load_more = 0;
       browse_items(ub);
+      continue;
+    }
+
+    if(ub->ub_run && ub->ub_loaded_entries < ub->ub_total_entries &&
+       ub->ub_prefetched_entries < ub->ub_loaded_entries +
+       UPNP_BROWSE_LOOKAHEAD * UPNP_BROWSE_PAGE_SIZE) {
+      browse_prefetch(ub);
+      if(ub->ub_prefetched_entries < ub->ub_total_entries &&
+         ub->ub_prefetched_entries < ub->ub_loaded_entries +
+         UPNP_BROWSE_LOOKAHEAD * UPNP_BROWSE_PAGE_SIZE)
+        ub->ub_prefetched_entries = ub->ub_total_entries; // Failed, stop
+      continue;
     }
+
+    prop_courier_wait_and_dispatch(pc);
   }
 
   prop_unsubscribe(ub->ub_itemsub);
@@ -400,7 +400,7 @@ upnp_flush(callout_t *c, void *opaque)
   time_t now;
   time(&now);
 
-  callout_arm(&upnp_flush_timer, upnp_flush, NULL, 60);
+  callout_arm_worker(&upnp_flush_timer, upnp_flush, NULL, 60);
 
   hts_mutex_lock(&upnp_lock);
   purge_subscriptions(&upnp_ConnectionManager_2, now);
@@ -417,7 +417,7 @@ void
 upnp_event_init(void)
 {
   sidtally = arch_get_seed();
-  callout_arm(&upnp_flush_timer, upnp_flush, NULL, 60);
+  callout_arm_worker(&upnp_flush_timer, upnp_flush, NULL, 60);
 }
 
 
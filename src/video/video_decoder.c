@@ -38,6 +38,7 @@
 #include "media.h"
 #include "misc/sha.h"
 #include "libav.h"
+#include "misc/profiler.h"
 
 #include "subtitles/ext_subtitles.h"
 #include "subtitles/video_overlay.h"
@@ -326,7 +327,9 @@ vd_thread(void *aux)
       mb = data;
 
     } else {
+      int64_t t = prof_begin();
       hts_cond_wait(&mq->mq_avail, &mp->mp_mutex);
+      prof_end(t, "mq_wait", "video");
       continue;
     }
 
@@ -362,6 +365,9 @@ vd_thread(void *aux)
       dvdspu_flush_locked(mp);
       hts_mutex_unlock(&mp->mp_overlay_mutex);
 
+      if(vd->vd_ext_subtitles != NULL)
+        subtitles_flush(vd->vd_ext_subtitles);
+
       mp->mp_video_frame_deliver(NULL, mp->mp_video_frame_opaque);
 
       if(mc_current != NULL) {
@@ -459,6 +465,8 @@ vd_thread(void *aux)
       hts_mutex_lock(&mp->mp_overlay_mutex);
       video_overlay_flush_locked(mp, 1);
       hts_mutex_unlock(&mp->mp_overlay_mutex);
+      if(vd->vd_ext_subtitles != NULL)
+        subtitles_flush(vd->vd_ext_subtitles);
       break;
 
     case MB_CTRL_EXT_SUBTITLE:
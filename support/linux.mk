@@ -20,6 +20,10 @@ SRCS-$(CONFIG_LIBPULSE)  += src/audio2/pulseaudio.c
 SRCS-$(CONFIG_LIBASOUND) += src/audio2/alsa.c src/audio2/alsa_default.c 
 SRCS-$(CONFIG_WEBPOPUP) += src/arch/linux/linux_webpopup.c
 
+# 'make mediabench' swaps linux_main.c for a headless main()
+MEDIABENCH_MAIN = src/arch/linux/linux_mediabench.c
+MEDIABENCH_OMIT = src/arch/linux/linux_main.c
+
 ${BUILDDIR}/src/arch/linux/%.o : CFLAGS = $(CFLAGS_GTK) ${OPTFLAGS} \
 -Wall -Werror -Wmissing-prototypes -Wno-cast-qual -Wno-deprecated-declarations
 